@@ -1,24 +1,163 @@
 #!/usr/bin/env perl
 
-$bmarks = `cat ALL`;
-@bm = split(/\n/, $bmarks);
-
-$total = 0;
-
-foreach $b (@bm) {
-    if ($b =~ /([a-zA-Z0-9]+)\/([a-zA-Z0-9]+)\s+(.*)/) {
-        #print "Running $1 $2\n";
-        chdir $1;
-        $result = `/usr/bin/time ./$2 $3 2> .times`;
-        $time = `cat .times`; 
-        chdir "..";
-        #print $time;
-        @timeflds = split(/\s+/, $time);
-        $user = $timeflds[3];
-        print "$1 / $2 $user\n";
-        $total += $user;
+# Runs the benchmarks listed in ALL, each several times after some warmup
+# runs, and writes wall and user times and the RTS statistics of every run
+# to a JSON file. Given the results of an earlier run as a baseline, it
+# reports which benchmarks got slower or faster, and exits with status 1 if
+# any regressed.
+#
+#   ./run.pl [--runs N] [--warmup N] [--out FILE] [--baseline FILE]
+#            [--threshold PERCENT] [benchmark ...]
+
+use strict;
+use warnings;
+use Cwd;
+use Getopt::Long;
+use JSON::PP;
+use Time::HiRes qw(gettimeofday tv_interval);
+
+my $runs = 5;
+my $warmup = 1;
+my $out = "results.json";
+my $baseline;
+my $threshold = 5;
+
+GetOptions("runs=i" => \$runs,
+           "warmup=i" => \$warmup,
+           "out=s" => \$out,
+           "baseline=s" => \$baseline,
+           "threshold=f" => \$threshold)
+    or die "Usage: $0 [--runs N] [--warmup N] [--out FILE] [--baseline FILE] [--threshold PERCENT] [benchmark ...]\n";
+die "--runs must be at least 2\n" if $runs < 2;
+
+my %only = map { $_ => 1 } @ARGV;
+my $top = getcwd();
+my $statsfile = "$top/.stats.json";
+
+# RTS statistics which are the same from run to run, and those which vary
+# like the times do
+my @counters = qw(bytes_allocated allocations bytes_copied collections);
+my @timings = qw(wall user gc_ns max_pause_ns);
+
+sub mean {
+    my $sum = 0;
+    $sum += $_ foreach @_;
+    return $sum / @_;
+}
+
+sub stddev {
+    my $m = mean(@_);
+    my $sum = 0;
+    $sum += ($_ - $m) ** 2 foreach @_;
+    return sqrt($sum / (@_ - 1));
+}
+
+sub median {
+    my @s = sort { $a <=> $b } @_;
+    return @s % 2 ? $s[$#s / 2] : ($s[@s / 2 - 1] + $s[@s / 2]) / 2;
+}
+
+sub summary {
+    my @xs = @_;
+    return { median => median(@xs), mean => mean(@xs),
+             stddev => stddev(@xs), min => (sort { $a <=> $b } @xs)[0] };
+}
+
+sub run_once {
+    my ($exe, $args) = @_;
+    unlink $statsfile;
+    my (undef, undef, $cuser0) = times;
+    my $t0 = [gettimeofday];
+    system("./$exe +RTS -S$statsfile -RTS $args > /dev/null") == 0
+        or die "$exe failed: $?\n";
+    my $wall = tv_interval($t0);
+    my (undef, undef, $cuser1) = times;
+
+    open(my $fh, "<", $statsfile) or die "$exe wrote no RTS statistics\n";
+    my $stats = decode_json(join("", <$fh>));
+    close($fh);
+    return { %$stats, wall => $wall, user => $cuser1 - $cuser0 };
+}
+
+my %results;
+my $total = 0;
+
+foreach my $line (split(/\n/, `cat ALL`)) {
+    next unless $line =~ /([a-zA-Z0-9]+)\/([a-zA-Z0-9]+)\s+(.*)/;
+    my ($dir, $exe, $args) = ($1, $2, $3);
+    my $name = "$dir/$exe";
+    next if %only && !$only{$name};
+
+    chdir $dir;
+    run_once($exe, $args) for 1 .. $warmup;
+    my @samples = map { run_once($exe, $args) } 1 .. $runs;
+    chdir $top;
+
+    my %r = (args => $args, runs => \@samples);
+    foreach my $m (@timings, @counters) {
+        next unless defined $samples[0]{$m};
+        $r{$m} = summary(map { $_->{$m} } @samples);
     }
+    $results{$name} = \%r;
+    printf("%-22s %8.3fs wall %8.3fs user\n", $name,
+           $r{wall}{median}, $r{user}{median});
+    $total += $r{user}{median};
+}
+unlink $statsfile;
+printf("\nTOTAL %.3f\n", $total);
+
+open(my $fh, ">", $out) or die "Unable to write $out\n";
+print $fh JSON::PP->new->canonical->pretty->encode(
+    { runs => $runs, warmup => $warmup, benchmarks => \%results });
+close($fh);
+
+exit 0 unless defined $baseline;
+
+# Welch's t test: one-sided 95% critical values of Student's t, by degrees
+# of freedom
+my @tcrit = (undef, 6.314, 2.920, 2.353, 2.132, 2.015, 1.943, 1.895, 1.860,
+             1.833, 1.812, 1.796, 1.782, 1.771, 1.761, 1.753, 1.746, 1.740,
+             1.734, 1.729, 1.725);
+
+sub significant {
+    my ($new, $old) = @_;
+    my $vn = $new->{stddev} ** 2 / $runs;
+    my $vo = $old->{stddev} ** 2 / $old->{n};
+    my $se = sqrt($vn + $vo);
+    return 1 if $se == 0;
+    my $t = abs($new->{mean} - $old->{mean}) / $se;
+    my $df = ($vn + $vo) ** 2 /
+             (($vn ** 2) / ($runs - 1) + ($vo ** 2) / ($old->{n} - 1));
+    $df = int($df);
+    my $crit = $df < 1 ? $tcrit[1] : $df <= 20 ? $tcrit[$df] : 1.645;
+    return $t > $crit;
 }
 
-print "\nTOTAL $total\n";
+open($fh, "<", $baseline) or die "Unable to read $baseline\n";
+my $base = decode_json(join("", <$fh>));
+close($fh);
 
+my $regressions = 0;
+print "\nCompared with $baseline (threshold $threshold%):\n";
+foreach my $name (sort keys %results) {
+    my $old = $base->{benchmarks}{$name};
+    if (!defined $old) {
+        print "$name: not in the baseline\n";
+        next;
+    }
+    foreach my $m (@timings, @counters) {
+        my ($n, $o) = ($results{$name}{$m}, $old->{$m});
+        next unless defined $n && defined $o && $o->{median} > 0;
+        my $change = 100 * ($n->{median} - $o->{median}) / $o->{median};
+        next if abs($change) <= $threshold;
+        # The counters don't vary between runs, so any change is real
+        my $timing = grep { $_ eq $m } @timings;
+        next if $timing &&
+                !significant($n, { %$o, n => scalar @{$old->{runs}} });
+        printf("%-22s %-16s %+7.1f%%%s\n", $name, $m, $change,
+               $change > 0 ? "  REGRESSION" : "");
+        $regressions++ if $change > 0;
+    }
+}
+print $regressions ? "\n$regressions regressions\n" : "\nNo regressions\n";
+exit($regressions ? 1 : 0);
@@ -0,0 +1,607 @@
+#if defined(__linux__)
+// For syscall, and MAP_POPULATE
+#define _GNU_SOURCE
+#endif
+#include "idris_aio.h"
+#include "idris_buffer.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+// -DIDRIS_NO_IO_URING uses the thread pool on Linux too
+#if defined(__has_include) && !defined(IDRIS_NO_IO_URING)
+#if __has_include(<linux/io_uring.h>)
+#define IDRIS_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+#endif
+
+#define AIO_READ  0
+#define AIO_WRITE 1
+#define AIO_FSYNC 2
+
+// Threads in a context's pool, when it doesn't use io_uring
+#define AIO_THREADS 4
+
+typedef struct {
+    int op;
+    int fd;
+    i_int offset;
+    struct iovec iov;   // The request's own block, and its length
+    i_int result;
+    int next;           // The next request in whichever list this is in
+} AioRequest;
+
+typedef struct {
+    int depth;
+    AioRequest* reqs;
+    int free;                  // Unused requests
+    int queued, queued_tail;   // Waiting for the next submit
+    int inflight;              // Started but not collected
+    int* done;                 // Collected by the last wait
+    int ndone;
+    int wake[2];               // Read and write ends, the same for an eventfd
+
+    int uring;
+#ifdef IDRIS_IO_URING
+    int ring_fd;
+    unsigned unsubmitted;      // Entries the kernel hasn't taken yet
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+#endif
+
+    // Completed by the thread pool, but not collected. Without pthreads,
+    // requests are carried out as they're submitted, and go straight here.
+    int finished, finished_tail;
+#ifdef HAS_PTHREAD
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    int pending, pending_tail; // Waiting for a thread
+    int stopping;
+    pthread_t threads[AIO_THREADS];
+    int nthreads;
+#endif
+} AioContext;
+
+// Lists of requests are linked through their next fields
+static void listAppend(AioContext* ctx, int* head, int* tail, int r) {
+    ctx->reqs[r].next = -1;
+    if (*head == -1) {
+        *head = r;
+    } else {
+        ctx->reqs[*tail].next = r;
+    }
+    *tail = r;
+}
+
+static int listTake(AioContext* ctx, int* head) {
+    int r = *head;
+    if (r != -1) {
+        *head = ctx->reqs[r].next;
+    }
+    return r;
+}
+
+static void signalWake(AioContext* ctx) {
+    uint64_t one = 1;
+    ssize_t r;
+    do {
+        r = write(ctx->wake[1], &one, ctx->wake[0] == ctx->wake[1] ? 8 : 1);
+    } while (r == -1 && errno == EINTR);
+}
+
+static void drainWake(AioContext* ctx) {
+    char buf[64];
+    while (read(ctx->wake[0], buf, sizeof(buf)) > 0) {
+    }
+}
+
+static i_int perform(AioRequest* r) {
+    ssize_t n;
+    do {
+        switch (r->op) {
+        case AIO_READ:
+            n = r->offset < 0 ? read(r->fd, r->iov.iov_base, r->iov.iov_len)
+                              : pread(r->fd, r->iov.iov_base, r->iov.iov_len,
+                                      (off_t)r->offset);
+            break;
+        case AIO_WRITE:
+            n = r->offset < 0 ? write(r->fd, r->iov.iov_base, r->iov.iov_len)
+                              : pwrite(r->fd, r->iov.iov_base, r->iov.iov_len,
+                                       (off_t)r->offset);
+            break;
+        default:
+            n = fsync(r->fd);
+            break;
+        }
+    } while (n == -1 && errno == EINTR);
+    return n < 0 ? -(i_int)errno : (i_int)n;
+}
+
+#ifdef IDRIS_IO_URING
+
+static int uringSetup(AioContext* ctx) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, (unsigned)ctx->depth, &p);
+    if (fd < 0) {
+        return -1;
+    }
+
+    ctx->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ctx->cq_ring_size = p.cq_off.cqes +
+                        p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && ctx->cq_ring_size > ctx->sq_ring_size) {
+        ctx->sq_ring_size = ctx->cq_ring_size;
+    }
+    ctx->sq_ring = mmap(NULL, ctx->sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ctx->sq_ring == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    if (single) {
+        ctx->cq_ring = ctx->sq_ring;
+    } else {
+        ctx->cq_ring = mmap(NULL, ctx->cq_ring_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ctx->cq_ring == MAP_FAILED) {
+            munmap(ctx->sq_ring, ctx->sq_ring_size);
+            close(fd);
+            return -1;
+        }
+    }
+    ctx->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ctx->sqes = mmap(NULL, ctx->sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ctx->sqes == MAP_FAILED) {
+        if (!single) {
+            munmap(ctx->cq_ring, ctx->cq_ring_size);
+        }
+        munmap(ctx->sq_ring, ctx->sq_ring_size);
+        close(fd);
+        return -1;
+    }
+
+    char* sq = ctx->sq_ring;
+    char* cq = ctx->cq_ring;
+    ctx->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ctx->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ctx->sq_array = (unsigned*)(sq + p.sq_off.array);
+    ctx->cq_head = (unsigned*)(cq + p.cq_off.head);
+    ctx->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ctx->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ctx->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    ctx->ring_fd = fd;
+    ctx->unsubmitted = 0;
+
+    // The kernel signals the eventfd as it posts each completion
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD,
+                &ctx->wake[0], 1) != 0) {
+        munmap(ctx->sqes, ctx->sqes_size);
+        if (!single) {
+            munmap(ctx->cq_ring, ctx->cq_ring_size);
+        }
+        munmap(ctx->sq_ring, ctx->sq_ring_size);
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void uringClose(AioContext* ctx) {
+    munmap(ctx->sqes, ctx->sqes_size);
+    if (ctx->cq_ring != ctx->sq_ring) {
+        munmap(ctx->cq_ring, ctx->cq_ring_size);
+    }
+    munmap(ctx->sq_ring, ctx->sq_ring_size);
+    close(ctx->ring_fd);
+}
+
+static int uringEnter(AioContext* ctx, unsigned submit, unsigned wait) {
+    int n;
+    do {
+        n = (int)syscall(__NR_io_uring_enter, ctx->ring_fd, submit, wait,
+                         wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (n == -1 && errno == EINTR);
+    return n;
+}
+
+// Readv and writev of one block, rather than read and write, so that
+// kernels from before 5.6 can do them.
+static void uringQueue(AioContext* ctx, int r) {
+    AioRequest* req = &ctx->reqs[r];
+    unsigned tail = *ctx->sq_tail;
+    unsigned idx = tail & *ctx->sq_mask;
+    struct io_uring_sqe* sqe = &ctx->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = req->fd;
+    sqe->user_data = (uint64_t)r;
+    if (req->op == AIO_FSYNC) {
+        sqe->opcode = IORING_OP_FSYNC;
+    } else {
+        sqe->opcode = req->op == AIO_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+        sqe->off = (uint64_t)(int64_t)req->offset;
+        sqe->addr = (uint64_t)(uintptr_t)&req->iov;
+        sqe->len = 1;
+    }
+    ctx->sq_array[idx] = idx;
+    __atomic_store_n(ctx->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ctx->unsubmitted++;
+}
+
+static void uringCollect(AioContext* ctx) {
+    unsigned head = *ctx->cq_head;
+    unsigned tail = __atomic_load_n(ctx->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe* cqe = &ctx->cqes[head & *ctx->cq_mask];
+        int r = (int)cqe->user_data;
+        ctx->reqs[r].result = cqe->res;
+        ctx->done[ctx->ndone++] = r;
+        ctx->inflight--;
+        head++;
+    }
+    __atomic_store_n(ctx->cq_head, head, __ATOMIC_RELEASE);
+}
+
+#endif // IDRIS_IO_URING
+
+#ifdef HAS_PTHREAD
+static void* aioWorker(void* arg) {
+    AioContext* ctx = arg;
+    pthread_mutex_lock(&ctx->lock);
+    for (;;) {
+        while (!ctx->stopping && ctx->pending == -1) {
+            pthread_cond_wait(&ctx->work, &ctx->lock);
+        }
+        int r = listTake(ctx, &ctx->pending);
+        if (r == -1) {
+            break;
+        }
+        pthread_mutex_unlock(&ctx->lock);
+        ctx->reqs[r].result = perform(&ctx->reqs[r]);
+        pthread_mutex_lock(&ctx->lock);
+        listAppend(ctx, &ctx->finished, &ctx->finished_tail, r);
+        signalWake(ctx);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+#endif
+
+static int openWake(AioContext* ctx) {
+#ifdef __linux__
+    int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd == -1) {
+        return -1;
+    }
+    ctx->wake[0] = ctx->wake[1] = fd;
+#else
+    if (pipe(ctx->wake) == -1) {
+        return -1;
+    }
+    for (int i = 0; i < 2; ++i) {
+        fcntl(ctx->wake[i], F_SETFL, fcntl(ctx->wake[i], F_GETFL) | O_NONBLOCK);
+        fcntl(ctx->wake[i], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+    return 0;
+}
+
+static void closeWake(AioContext* ctx) {
+    close(ctx->wake[0]);
+    if (ctx->wake[1] != ctx->wake[0]) {
+        close(ctx->wake[1]);
+    }
+}
+
+void* idris_aio_create(int depth) {
+    if (depth <= 0) {
+        return NULL;
+    }
+    AioContext* ctx = calloc(1, sizeof(AioContext));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->depth = depth;
+    ctx->reqs = calloc(depth, sizeof(AioRequest));
+    ctx->done = calloc(depth, sizeof(int));
+    if (ctx->reqs == NULL || ctx->done == NULL || openWake(ctx) == -1) {
+        free(ctx->reqs);
+        free(ctx->done);
+        free(ctx);
+        return NULL;
+    }
+    for (int r = 0; r < depth; ++r) {
+        ctx->reqs[r].next = r + 1 < depth ? r + 1 : -1;
+    }
+    ctx->free = 0;
+    ctx->queued = ctx->finished = -1;
+
+#ifdef IDRIS_IO_URING
+    ctx->uring = uringSetup(ctx) == 0;
+#endif
+#ifdef HAS_PTHREAD
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->work, NULL);
+    ctx->pending = -1;
+    if (!ctx->uring) {
+        int n = depth < AIO_THREADS ? depth : AIO_THREADS;
+        for (ctx->nthreads = 0; ctx->nthreads < n; ++ctx->nthreads) {
+            if (pthread_create(&ctx->threads[ctx->nthreads], NULL,
+                               aioWorker, ctx) != 0) {
+                break;
+            }
+        }
+        if (ctx->nthreads == 0) {
+            idris_aio_free(ctx);
+            return NULL;
+        }
+    }
+#endif
+    return ctx;
+}
+
+// Give back the requests collected by the last wait
+static void recycleDone(AioContext* ctx) {
+    for (int i = 0; i < ctx->ndone; ++i) {
+        AioRequest* req = &ctx->reqs[ctx->done[i]];
+        free(req->iov.iov_base);
+        req->iov.iov_base = NULL;
+        req->next = ctx->free;
+        ctx->free = ctx->done[i];
+    }
+    ctx->ndone = 0;
+}
+
+static void collect(AioContext* ctx) {
+#ifdef IDRIS_IO_URING
+    if (ctx->uring) {
+        uringCollect(ctx);
+        return;
+    }
+#endif
+#ifdef HAS_PTHREAD
+    pthread_mutex_lock(&ctx->lock);
+#endif
+    int r;
+    while ((r = listTake(ctx, &ctx->finished)) != -1) {
+        ctx->done[ctx->ndone++] = r;
+        ctx->inflight--;
+    }
+#ifdef HAS_PTHREAD
+    pthread_mutex_unlock(&ctx->lock);
+#endif
+}
+
+void idris_aio_free(void* vctx) {
+    AioContext* ctx = vctx;
+    idris_aio_submit(ctx);
+    while (ctx->inflight > 0) {
+        recycleDone(ctx);
+        idris_aio_wait(ctx, -1);
+    }
+    recycleDone(ctx);
+    // Requests which were never submitted
+    int r;
+    while ((r = listTake(ctx, &ctx->queued)) != -1) {
+        free(ctx->reqs[r].iov.iov_base);
+    }
+#ifdef IDRIS_IO_URING
+    if (ctx->uring) {
+        uringClose(ctx);
+    }
+#endif
+#ifdef HAS_PTHREAD
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stopping = 1;
+    pthread_cond_broadcast(&ctx->work);
+    pthread_mutex_unlock(&ctx->lock);
+    for (int i = 0; i < ctx->nthreads; ++i) {
+        pthread_join(ctx->threads[i], NULL);
+    }
+    pthread_cond_destroy(&ctx->work);
+    pthread_mutex_destroy(&ctx->lock);
+#endif
+    closeWake(ctx);
+    free(ctx->reqs);
+    free(ctx->done);
+    free(ctx);
+}
+
+int idris_aio_kernel(void* ctx) {
+    return ((AioContext*)ctx)->uring;
+}
+
+int idris_aio_fd(void* ctx) {
+    return ((AioContext*)ctx)->wake[0];
+}
+
+static int newRequest(AioContext* ctx, int op, int fd, i_int offset,
+                      size_t len) {
+    if (ctx->free == -1) {
+        return -1;
+    }
+    char* data = NULL;
+    if (op != AIO_FSYNC) {
+        // A block even for an empty request, so NULL means failure
+        data = malloc(len > 0 ? len : 1);
+        if (data == NULL) {
+            return -1;
+        }
+    }
+    int r = listTake(ctx, &ctx->free);
+    AioRequest* req = &ctx->reqs[r];
+    req->op = op;
+    req->fd = fd;
+    req->offset = offset < 0 ? -1 : offset;
+    req->iov.iov_base = data;
+    req->iov.iov_len = len;
+    req->result = 0;
+    listAppend(ctx, &ctx->queued, &ctx->queued_tail, r);
+    return r;
+}
+
+int idris_aio_read(void* ctx, int fd, i_int offset, int len) {
+    if (len < 0) {
+        return -1;
+    }
+    return newRequest(ctx, AIO_READ, fd, offset, len);
+}
+
+int idris_aio_write(void* ctx, int fd, i_int offset, void* buffer, int loc,
+                    int len) {
+    if (loc < 0 || len < 0 || loc > idris_getBufferSize(buffer) - len) {
+        return -1;
+    }
+    int r = newRequest(ctx, AIO_WRITE, fd, offset, len);
+    if (r != -1) {
+        memcpy(((AioContext*)ctx)->reqs[r].iov.iov_base,
+               idris_getBufferData(buffer) + loc, len);
+    }
+    return r;
+}
+
+int idris_aio_fsync(void* ctx, int fd) {
+    return newRequest(ctx, AIO_FSYNC, fd, -1, 0);
+}
+
+int idris_aio_submit(void* vctx) {
+    AioContext* ctx = vctx;
+    int n = 0;
+    int r;
+#ifdef IDRIS_IO_URING
+    if (ctx->uring) {
+        while ((r = listTake(ctx, &ctx->queued)) != -1) {
+            uringQueue(ctx, r);
+            ctx->inflight++;
+            n++;
+        }
+        if (ctx->unsubmitted > 0) {
+            // Whatever the kernel doesn't take now is retried next time
+            int taken = uringEnter(ctx, ctx->unsubmitted, 0);
+            if (taken < 0 && errno != EAGAIN && errno != EBUSY) {
+                return -1;
+            }
+            if (taken > 0) {
+                ctx->unsubmitted -= taken;
+            }
+        }
+        return n;
+    }
+#endif
+#ifdef HAS_PTHREAD
+    pthread_mutex_lock(&ctx->lock);
+    while ((r = listTake(ctx, &ctx->queued)) != -1) {
+        listAppend(ctx, &ctx->pending, &ctx->pending_tail, r);
+        ctx->inflight++;
+        n++;
+    }
+    pthread_cond_broadcast(&ctx->work);
+    pthread_mutex_unlock(&ctx->lock);
+#else
+    while ((r = listTake(ctx, &ctx->queued)) != -1) {
+        ctx->reqs[r].result = perform(&ctx->reqs[r]);
+        listAppend(ctx, &ctx->finished, &ctx->finished_tail, r);
+        ctx->inflight++;
+        n++;
+    }
+    if (n > 0) {
+        signalWake(ctx);
+    }
+#endif
+    return n;
+}
+
+int idris_aio_wait(void* vctx, int timeout_ms) {
+    AioContext* ctx = vctx;
+    recycleDone(ctx);
+    if (idris_aio_submit(ctx) < 0) {
+        return -1;
+    }
+    for (;;) {
+        // Drain the wakeup before looking, so that a completion which
+        // arrives after looking wakes the next poll
+        drainWake(ctx);
+        collect(ctx);
+        if (ctx->ndone > 0 || ctx->inflight == 0 || timeout_ms == 0) {
+            return ctx->ndone;
+        }
+        struct pollfd pfd = { .fd = ctx->wake[0], .events = POLLIN };
+        int n = poll(&pfd, 1, timeout_ms);
+        if (n == -1 && errno != EINTR) {
+            return -1;
+        }
+        if (n == 0) {
+            return 0;
+        }
+    }
+}
+
+int idris_aio_completed_id(void* vctx, int i) {
+    AioContext* ctx = vctx;
+    return i >= 0 && i < ctx->ndone ? ctx->done[i] : -1;
+}
+
+i_int idris_aio_completed_result(void* vctx, int i) {
+    AioContext* ctx = vctx;
+    return i >= 0 && i < ctx->ndone ? ctx->reqs[ctx->done[i]].result
+                                     : -(i_int)EINVAL;
+}
+
+int idris_aio_copy_read(void* vctx, int i, void* buffer, int loc) {
+    AioContext* ctx = vctx;
+    if (i < 0 || i >= ctx->ndone) {
+        return 0;
+    }
+    AioRequest* req = &ctx->reqs[ctx->done[i]];
+    int size = idris_getBufferSize(buffer);
+    if (req->op != AIO_READ || req->result <= 0 || loc < 0 || loc >= size) {
+        return 0;
+    }
+    int len = req->result < size - loc ? (int)req->result : size - loc;
+    memcpy(idris_getBufferData(buffer) + loc, req->iov.iov_base, len);
+    return len;
+}
+
+#else // _WIN32
+
+void* idris_aio_create(int depth) {
+    (void)depth;
+    return NULL;
+}
+
+void idris_aio_free(void* ctx) { (void)ctx; }
+int idris_aio_kernel(void* ctx) { (void)ctx; return 0; }
+int idris_aio_fd(void* ctx) { (void)ctx; return -1; }
+int idris_aio_read(void* ctx, int fd, i_int offset, int len) { return -1; }
+int idris_aio_write(void* ctx, int fd, i_int offset, void* buffer, int loc,
+                    int len) { return -1; }
+int idris_aio_fsync(void* ctx, int fd) { return -1; }
+int idris_aio_submit(void* ctx) { return -1; }
+int idris_aio_wait(void* ctx, int timeout_ms) { return -1; }
+int idris_aio_completed_id(void* ctx, int i) { return -1; }
+i_int idris_aio_completed_result(void* ctx, int i) { return -1; }
+int idris_aio_copy_read(void* ctx, int i, void* buffer, int loc) { return 0; }
+
+#endif // _WIN32
@@ -0,0 +1,56 @@
+#ifndef _IDRIS_AIO_H
+#define _IDRIS_AIO_H
+
+#include "idris_rts.h"
+
+/* *** Asynchronous file I/O ***
+ * A context keeps up to 'depth' reads, writes and syncs on file descriptors
+ * in flight at once. It uses io_uring on Linux, where the kernel allows it,
+ * and otherwise a small pool of threads making the ordinary blocking calls.
+ *
+ * Each request has a block of its own in the C heap: a write's data is
+ * copied into it when it's submitted, and a read's data is copied out of
+ * it once it has completed. Buffers in the Idris heap can move, so the
+ * kernel is never given a pointer into one.
+ *
+ * The context has a descriptor which is readable whenever there are
+ * completions to collect, so it can be watched by an idrnet poller along
+ * with sockets and timers, and one loop can wait on all of them.
+ */
+
+// Returns NULL on failure.
+void* idris_aio_create(int depth);
+// Waits for anything still in flight first.
+void idris_aio_free(void* ctx);
+// Returns 1 if the context uses io_uring, 0 if it uses threads
+int idris_aio_kernel(void* ctx);
+// Readable when there are completions to collect
+int idris_aio_fd(void* ctx);
+
+// Start reading up to len bytes from offset, or writing len bytes of a
+// Data.Buffer from loc to offset. An offset of -1 means the descriptor's
+// current position. Return a request id, or -1 if the context is full or
+// the request is out of range. Requests are queued until the next call of
+// idris_aio_submit or idris_aio_wait.
+int idris_aio_read(void* ctx, int fd, i_int offset, int len);
+int idris_aio_write(void* ctx, int fd, i_int offset, void* buffer, int loc,
+                    int len);
+int idris_aio_fsync(void* ctx, int fd);
+
+// Start everything queued. Returns the number of requests started, or -1.
+int idris_aio_submit(void* ctx);
+
+// Start everything queued, and wait for up to timeout_ms milliseconds (or
+// indefinitely, if it's negative) for at least one request to complete.
+// Returns the number of completed requests, which can be read back with
+// the functions below until the next wait, or -1 on failure. They count
+// towards the depth until then.
+int idris_aio_wait(void* ctx, int timeout_ms);
+int idris_aio_completed_id(void* ctx, int i);
+// The number of bytes read or written, or minus the error number
+i_int idris_aio_completed_result(void* ctx, int i);
+// Copy the data a completed read returned into a Data.Buffer at loc, as
+// far as it fits. Returns the number of bytes copied.
+int idris_aio_copy_read(void* ctx, int i, void* buffer, int loc);
+
+#endif // _IDRIS_AIO_H
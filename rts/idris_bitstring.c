@@ -9,13 +9,20 @@ VAL idris_b16const(VM *vm, uint16_t a) {
 }
 
 VAL idris_b32const(VM *vm, uint32_t a) {
+#ifdef IDRIS_UNBOXED_BITS32
+    return MKINT((i_int)a);
+#else
     Bits32 * cl = iallocate(vm, sizeof(*cl), 0);
     SETTY(cl, CT_BITS32);
     cl->bits32 = a;
     return (VAL)cl;
+#endif
 }
 
 VAL idris_b64const(VM *vm, uint64_t a) {
+    if (a <= BITS64_MAXINT) {
+        return MKINT((i_int)a);
+    }
     Bits64 * cl = iallocate(vm, sizeof(*cl), 0);
     SETTY(cl, CT_BITS64);
     cl->bits64 = a;
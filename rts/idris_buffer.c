@@ -1,25 +1,88 @@
 #include "idris_rts.h"
 #include "idris_buffer.h"
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 typedef struct {
     int size;
+    int capacity; // Room allocated for the data, which the size can grow to
     uint8_t data[0];
 } Buffer;
 
+// The buffer is allocated directly as a managed pointer, so its contents
+// are only written once. Buffers of 64K or more go in the large object
+// space, so the collector never copies them.
 VAL idris_newBuffer(VM* vm, int bytes) {
-    size_t size = sizeof(Buffer) + bytes*sizeof(uint8_t);
-
-    Buffer* buf = malloc(size);
-    if (buf == NULL) {
+    if (bytes < 0) {
         return NULL;
     }
+    size_t size = sizeof(Buffer) + bytes*sizeof(uint8_t);
 
+    ManagedPtr* cl = iallocate(vm, sizeof(*cl) + size, 0);
+    SETTY(cl, CT_MANAGEDPTR);
+
+    Buffer* buf = (Buffer*)cl->mptr;
     buf->size = bytes;
+    buf->capacity = bytes;
     memset(buf->data, 0, bytes);
+    return (VAL)cl;
+}
+
+VAL idris_resizeBuffer(VM* vm, VAL buffer, int bytes) {
+    Buffer* b = (Buffer*)GETMPTR(buffer);
+
+    // Resize in place if there's room. Anything exposed by growing again
+    // after shrinking is cleared, as it would be in a new buffer.
+    if (bytes >= 0 && bytes <= b->capacity) {
+        if (bytes > b->size) {
+            memset(b->data + b->size, 0, bytes - b->size);
+        }
+        b->size = bytes;
+        return buffer;
+    }
+
+    RESERVENOALLOC(1);
+    TOP(0) = buffer;
+    ADDTOP(1);
+    VAL newbuf = idris_newBuffer(vm, bytes);
+    buffer = TOP(-1);
+    ADDTOP(-1);
+
+    if (newbuf != NULL) {
+        b = (Buffer*)GETMPTR(buffer);
+        memcpy(((Buffer*)GETMPTR(newbuf))->data, b->data, b->size);
+    }
+    return newbuf;
+}
+
+// Fixed width values are moved in and out with memcpy, which compiles to a
+// single (possibly unaligned) load or store, and are byte swapped only if
+// the order asked for isn't the host's.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOST_BIG_ENDIAN 1
+#else
+#define HOST_BIG_ENDIAN 0
+#endif
+
+static inline uint16_t order16(uint16_t x, int bigEndian) {
+    return bigEndian != HOST_BIG_ENDIAN ? __builtin_bswap16(x) : x;
+}
+
+static inline uint32_t order32(uint32_t x, int bigEndian) {
+    return bigEndian != HOST_BIG_ENDIAN ? __builtin_bswap32(x) : x;
+}
+
+static inline uint64_t order64(uint64_t x, int bigEndian) {
+    return bigEndian != HOST_BIG_ENDIAN ? __builtin_bswap64(x) : x;
+}
 
-    void* retbuf = MKMPTR(vm, buf, size);
-    free(buf);
-    return retbuf;
+static inline int inBounds(Buffer* b, int loc, size_t len) {
+    return loc >= 0 && (size_t)loc + len <= (size_t)b->size;
 }
 
 void idris_copyBuffer(void* from, int start, int len,
@@ -27,15 +90,60 @@ void idris_copyBuffer(void* from, int start, int len,
     Buffer* bfrom = from;
     Buffer* bto = to;
 
-    if (loc >= 0 && loc+len <= bto->size) {
-        memcpy(bto->data + loc, bfrom->data + start, len);
+    // The buffers may be the same, with overlapping ranges
+    if (len >= 0 && inBounds(bfrom, start, len) && inBounds(bto, loc, len)) {
+        memmove(bto->data + loc, bfrom->data + start, len);
+    }
+}
+
+void idris_fillBuffer(void* buffer, int loc, int len, uint8_t byte) {
+    Buffer* b = buffer;
+    if (len >= 0 && inBounds(b, loc, len)) {
+        memset(b->data + loc, byte, len);
+    }
+}
+
+// The parts of each range outside its buffer are ignored, so a range cut
+// short by the end of its buffer compares less than one which isn't.
+int idris_compareBuffer(void* buf1, int loc1, void* buf2, int loc2, int len) {
+    Buffer* b1 = buf1;
+    Buffer* b2 = buf2;
+    int len1 = loc1 < 0 || loc1 > b1->size ? 0 : b1->size - loc1;
+    int len2 = loc2 < 0 || loc2 > b2->size ? 0 : b2->size - loc2;
+    if (len < 0) {
+        len = 0;
     }
+    len1 = len1 < len ? len1 : len;
+    len2 = len2 < len ? len2 : len;
+
+    int cmp = memcmp(b1->data + (len1 ? loc1 : 0), b2->data + (len2 ? loc2 : 0),
+                     len1 < len2 ? len1 : len2);
+    if (cmp != 0) {
+        return cmp < 0 ? -1 : 1;
+    }
+    return (len1 > len2) - (len1 < len2);
+}
+
+int idris_findBufferByte(void* buffer, int loc, int len, uint8_t byte) {
+    Buffer* b = buffer;
+    if (loc < 0 || loc >= b->size) {
+        return -1;
+    }
+    if (len > b->size - loc) {
+        len = b->size - loc;
+    }
+    uint8_t* found = len > 0 ? memchr(b->data + loc, byte, len) : NULL;
+    return found == NULL ? -1 : (int)(found - b->data);
 }
 
 int idris_getBufferSize(void* buffer) {
     return ((Buffer*)buffer)->size;
 }
 
+uint8_t* idris_getBufferData(void* buffer) {
+    return ((Buffer*)buffer)->data;
+}
+
 void idris_setBufferByte(void* buffer, int loc, uint8_t byte) {
     Buffer* b = buffer;
     if (loc >= 0 && loc < b->size) {
@@ -44,27 +152,53 @@ void idris_setBufferByte(void* buffer, int loc, uint8_t byte) {
 }
 
 void idris_setBufferInt(void* buffer, int loc, int val) {
+    idris_setBufferBits32(buffer, loc, (uint32_t)val, 0);
+}
+
+void idris_setBufferDouble(void* buffer, int loc, double val) {
     Buffer* b = buffer;
-    if (loc >= 0 && loc+3 < b->size) {
-        b->data[loc] = val & 0xff;
-        b->data[loc+1] = (val >> 8) & 0xff;
-        b->data[loc+2] = (val >> 16) & 0xff;
-        b->data[loc+3] = (val >> 24) & 0xff;
+    if (inBounds(b, loc, sizeof(double))) {
+        memcpy(b->data + loc, &val, sizeof(double));
     }
 }
 
-void idris_setBufferDouble(void* buffer, int loc, double val) {
+void idris_setBufferBits16(void* buffer, int loc, uint16_t val, int bigEndian) {
     Buffer* b = buffer;
-    // I am not proud of this
-    if (loc >= 0 && loc + sizeof(double) <= b->size) {
-        unsigned char* c = (unsigned char*)(& val);
-        int i;
-        for (i = 0; i < sizeof(double); ++i) {
-            b->data[loc+i] = c[i];
-        }
+    if (inBounds(b, loc, sizeof(val))) {
+        val = order16(val, bigEndian);
+        memcpy(b->data + loc, &val, sizeof(val));
+    }
+}
+
+void idris_setBufferBits32(void* buffer, int loc, uint32_t val, int bigEndian) {
+    Buffer* b = buffer;
+    if (inBounds(b, loc, sizeof(val))) {
+        val = order32(val, bigEndian);
+        memcpy(b->data + loc, &val, sizeof(val));
     }
 }
 
+void idris_setBufferBits64(void* buffer, int loc, uint64_t val, int bigEndian) {
+    Buffer* b = buffer;
+    if (inBounds(b, loc, sizeof(val))) {
+        val = order64(val, bigEndian);
+        memcpy(b->data + loc, &val, sizeof(val));
+    }
+}
+
+void idris_setBufferFloat32(void* buffer, int loc, double val, int bigEndian) {
+    float f = (float)val;
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    idris_setBufferBits32(buffer, loc, bits, bigEndian);
+}
+
+void idris_setBufferFloat64(void* buffer, int loc, double val, int bigEndian) {
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+    idris_setBufferBits64(buffer, loc, bits, bigEndian);
+}
+
 void idris_setBufferString(void* buffer, int loc, char* str) {
     Buffer* b = buffer;
     int len = strlen(str);
@@ -84,32 +218,57 @@ uint8_t idris_getBufferByte(void* buffer, int loc) {
 }
 
 int idris_getBufferInt(void* buffer, int loc) {
+    return (int32_t)idris_getBufferBits32(buffer, loc, 0);
+}
+
+double idris_getBufferDouble(void* buffer, int loc) {
     Buffer* b = buffer;
-    if (loc >= 0 && loc+3 < b->size) {
-        return b->data[loc] +
-               (b->data[loc+1] << 8) +
-               (b->data[loc+2] << 16) +
-               (b->data[loc+3] << 24);
-    } else {
-        return 0;
+    double d = 0;
+    if (inBounds(b, loc, sizeof(double))) {
+        memcpy(&d, b->data + loc, sizeof(double));
     }
+    return d;
 }
 
-double idris_getBufferDouble(void* buffer, int loc) {
+uint16_t idris_getBufferBits16(void* buffer, int loc, int bigEndian) {
     Buffer* b = buffer;
-    double d;
-    // I am even less proud of this
-    unsigned char *c = (unsigned char*)(& d);
-    if (loc >= 0 && loc + sizeof(double) <= b->size) {
-        int i;
-        for (i = 0; i < sizeof(double); ++i) {
-            c[i] = b->data[loc+i];
-        }
-        return d;
+    uint16_t val = 0;
+    if (inBounds(b, loc, sizeof(val))) {
+        memcpy(&val, b->data + loc, sizeof(val));
     }
-    else {
-        return 0;
+    return order16(val, bigEndian);
+}
+
+uint32_t idris_getBufferBits32(void* buffer, int loc, int bigEndian) {
+    Buffer* b = buffer;
+    uint32_t val = 0;
+    if (inBounds(b, loc, sizeof(val))) {
+        memcpy(&val, b->data + loc, sizeof(val));
+    }
+    return order32(val, bigEndian);
+}
+
+uint64_t idris_getBufferBits64(void* buffer, int loc, int bigEndian) {
+    Buffer* b = buffer;
+    uint64_t val = 0;
+    if (inBounds(b, loc, sizeof(val))) {
+        memcpy(&val, b->data + loc, sizeof(val));
     }
+    return order64(val, bigEndian);
+}
+
+double idris_getBufferFloat32(void* buffer, int loc, int bigEndian) {
+    uint32_t bits = idris_getBufferBits32(buffer, loc, bigEndian);
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+double idris_getBufferFloat64(void* buffer, int loc, int bigEndian) {
+    uint64_t bits = idris_getBufferBits64(buffer, loc, bigEndian);
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
 }
 
 VAL idris_getBufferString(void* buffer, int loc, int len) {
@@ -144,3 +303,154 @@ void idris_writeBuffer(FILE* h, void* buffer, int loc, int len) {
         fwrite((b->data)+loc, sizeof(uint8_t), len, h);
     }
 }
+
+/* Mapped files: read only views of whole files, which are paged in by the
+ * OS rather than copied into the Idris heap. The mapping lives in the C
+ * heap, and is unmapped by its finalizer.
+ */
+
+typedef struct {
+    uint8_t* data;
+    size_t size;
+} MappedFile;
+
+static inline MappedFile* mappedFile(CData mapped) {
+    return mapped->data;
+}
+
+static inline int inMapped(MappedFile* m, i_int loc, size_t len) {
+    return loc >= 0 && (size_t)loc <= m->size && len <= m->size - (size_t)loc;
+}
+
+void* idris_mapFile(const char* path) {
+#ifdef _WIN32
+    // Not supported yet
+    return NULL;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    MappedFile* m = malloc(sizeof(MappedFile));
+    if (m == NULL) {
+        close(fd);
+        return NULL;
+    }
+    m->size = st.st_size;
+    m->data = NULL;
+    // A mapping can't be empty, but an empty file has nothing to map anyway
+    if (m->size > 0) {
+        void* data = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            free(m);
+            m = NULL;
+        } else {
+            m->data = data;
+        }
+    }
+    // The mapping keeps its own reference to the file
+    close(fd);
+    return m;
+#endif
+}
+
+static void unmapFile(void* mapped) {
+    MappedFile* m = mapped;
+#ifndef _WIN32
+    if (m->data != NULL) {
+        munmap(m->data, m->size);
+    }
+#endif
+    free(m);
+}
+
+CData idris_manageMappedFile(void* mapped) {
+    // The pages belong to the file rather than the C heap, so only the
+    // descriptor counts towards the C heap's size
+    return cdata_manage(mapped, sizeof(MappedFile), unmapFile);
+}
+
+i_int idris_mappedSize(CData mapped) {
+    return mappedFile(mapped)->size;
+}
+
+void idris_adviseMapped(CData mapped, int advice) {
+#ifndef _WIN32
+    static const int advices[] = {
+        POSIX_MADV_NORMAL, POSIX_MADV_SEQUENTIAL, POSIX_MADV_RANDOM,
+        POSIX_MADV_WILLNEED, POSIX_MADV_DONTNEED
+    };
+    MappedFile* m = mappedFile(mapped);
+    if (m->data != NULL && advice >= 0 && advice < 5) {
+        posix_madvise(m->data, m->size, advices[advice]);
+    }
+#endif
+}
+
+uint8_t idris_getMappedByte(CData mapped, i_int loc) {
+    MappedFile* m = mappedFile(mapped);
+    return inMapped(m, loc, 1) ? m->data[loc] : 0;
+}
+
+uint16_t idris_getMappedBits16(CData mapped, i_int loc, int bigEndian) {
+    MappedFile* m = mappedFile(mapped);
+    uint16_t val = 0;
+    if (inMapped(m, loc, sizeof(val))) {
+        memcpy(&val, m->data + loc, sizeof(val));
+    }
+    return order16(val, bigEndian);
+}
+
+uint32_t idris_getMappedBits32(CData mapped, i_int loc, int bigEndian) {
+    MappedFile* m = mappedFile(mapped);
+    uint32_t val = 0;
+    if (inMapped(m, loc, sizeof(val))) {
+        memcpy(&val, m->data + loc, sizeof(val));
+    }
+    return order32(val, bigEndian);
+}
+
+uint64_t idris_getMappedBits64(CData mapped, i_int loc, int bigEndian) {
+    MappedFile* m = mappedFile(mapped);
+    uint64_t val = 0;
+    if (inMapped(m, loc, sizeof(val))) {
+        memcpy(&val, m->data + loc, sizeof(val));
+    }
+    return order64(val, bigEndian);
+}
+
+i_int idris_findMappedByte(CData mapped, i_int loc, i_int len, uint8_t byte) {
+    MappedFile* m = mappedFile(mapped);
+    if (loc < 0 || (size_t)loc >= m->size || len <= 0) {
+        return -1;
+    }
+    if ((size_t)len > m->size - loc) {
+        len = m->size - loc;
+    }
+    uint8_t* found = memchr(m->data + loc, byte, len);
+    return found == NULL ? -1 : (i_int)(found - m->data);
+}
+
+VAL idris_getMappedString(CData mapped, i_int loc, i_int len) {
+    MappedFile* m = mappedFile(mapped);
+    if (len <= 0 || !inMapped(m, loc, len)) {
+        return MKSTRlen(get_vm(), "", 0);
+    }
+    return MKSTRlen(get_vm(), (char*)m->data + loc, len);
+}
+
+void idris_copyMapped(CData mapped, i_int start, int len,
+                      void* buffer, int loc) {
+    MappedFile* m = mappedFile(mapped);
+    Buffer* b = buffer;
+
+    if (len > 0 && inMapped(m, start, len) && inBounds(b, loc, len)) {
+        memcpy(b->data + loc, m->data + start, len);
+    }
+}
@@ -7,16 +7,33 @@
 #include "idris_rts.h"
 
 VAL idris_newBuffer(VM* vm, int bytes);
+// Returns the same buffer if the new size fits in the room allocated for
+// it, or a new buffer holding a copy of the contents otherwise.
+VAL idris_resizeBuffer(VM* vm, VAL buffer, int bytes);
 
 int idris_getBufferSize(void* buffer);
+// The contents, which move if the buffer does
+uint8_t* idris_getBufferData(void* buffer);
 
 void idris_setBufferByte(void* buffer, int loc, uint8_t byte);
 void idris_setBufferInt(void* buffer, int loc, int val);
 void idris_setBufferDouble(void* buffer, int loc, double val);
 void idris_setBufferString(void* buffer, int loc, char* str);
 
+// Fixed width values, stored little endian unless bigEndian is non-zero
+void idris_setBufferBits16(void* buffer, int loc, uint16_t val, int bigEndian);
+void idris_setBufferBits32(void* buffer, int loc, uint32_t val, int bigEndian);
+void idris_setBufferBits64(void* buffer, int loc, uint64_t val, int bigEndian);
+void idris_setBufferFloat32(void* buffer, int loc, double val, int bigEndian);
+void idris_setBufferFloat64(void* buffer, int loc, double val, int bigEndian);
+
 void idris_copyBuffer(void* from, int start, int len,
                       void* to, int loc);
+void idris_fillBuffer(void* buffer, int loc, int len, uint8_t byte);
+// Returns -1, 0 or 1, comparing the ranges lexicographically
+int idris_compareBuffer(void* buf1, int loc1, void* buf2, int loc2, int len);
+// Returns the location of the first matching byte in range, or -1
+int idris_findBufferByte(void* buffer, int loc, int len, uint8_t byte);
 
 int idris_readBuffer(FILE* h, void* buffer, int loc, int max);
 void idris_writeBuffer(FILE* h, void* buffer, int loc, int len);
@@ -26,4 +43,28 @@ int idris_getBufferInt(void* buffer, int loc);
 double idris_getBufferDouble(void* buffer, int loc);
 VAL idris_getBufferString(void* buffer, int loc, int len);
 
+uint16_t idris_getBufferBits16(void* buffer, int loc, int bigEndian);
+uint32_t idris_getBufferBits32(void* buffer, int loc, int bigEndian);
+uint64_t idris_getBufferBits64(void* buffer, int loc, int bigEndian);
+double idris_getBufferFloat32(void* buffer, int loc, int bigEndian);
+double idris_getBufferFloat64(void* buffer, int loc, int bigEndian);
+
+// Returns NULL if the file can't be mapped. Otherwise the result must be
+// passed to idris_manageMappedFile, which unmaps it when collected.
+void* idris_mapFile(const char* path);
+CData idris_manageMappedFile(void* mapped);
+
+i_int idris_mappedSize(CData mapped);
+// Advice is 0 to 4 for normal, sequential, random, will need and don't need
+void idris_adviseMapped(CData mapped, int advice);
+
+uint8_t idris_getMappedByte(CData mapped, i_int loc);
+uint16_t idris_getMappedBits16(CData mapped, i_int loc, int bigEndian);
+uint32_t idris_getMappedBits32(CData mapped, i_int loc, int bigEndian);
+uint64_t idris_getMappedBits64(CData mapped, i_int loc, int bigEndian);
+i_int idris_findMappedByte(CData mapped, i_int loc, i_int len, uint8_t byte);
+VAL idris_getMappedString(CData mapped, i_int loc, i_int len);
+void idris_copyMapped(CData mapped, i_int start, int len,
+                      void* buffer, int loc);
+
 #endif
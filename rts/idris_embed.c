@@ -0,0 +1,257 @@
+#include "idris_embed.h"
+#include "idris_gc.h"
+#include "idris_gmp.h"
+#include "idris_par.h"
+#include "idris_sched.h"
+
+#include <stdlib.h>
+
+#ifdef HAS_PTHREAD
+#define POOL_LOCK(p) pthread_mutex_lock(&(p)->lock);
+#define POOL_UNLOCK(p) pthread_mutex_unlock(&(p)->lock);
+#else
+#define POOL_LOCK(p)
+#define POOL_UNLOCK(p)
+#endif
+
+// Set up what every VM shares
+static void init_rts(void) {
+    init_threadkeys();
+    init_gmpalloc();
+    init_signals();
+}
+
+VM* idris_newVM(const RTSOpts* opts) {
+#ifdef HAS_PTHREAD
+    static pthread_once_t rts_once = PTHREAD_ONCE_INIT;
+    pthread_once(&rts_once, init_rts);
+#else
+    static int rts_ready = 0;
+    if (!rts_ready) {
+        init_rts();
+        rts_ready = 1;
+    }
+#endif
+
+    VM* vm = init_vm(opts->max_stack_size, opts->init_heap_size,
+                     opts->max_threads);
+    if (opts->compact) {
+        idris_gc_compacting(vm, 1);
+    } else if (opts->gc_pause > 0) {
+        idris_gc_incremental(vm, opts->gc_pause);
+    } else {
+        alloc_nursery(&(vm->nursery), opts->nursery_size);
+    }
+    vm->heap.max_size = opts->max_heap_size;
+    vm->heap.growth_factor = opts->heap_growth_factor;
+    idris_gc_threads(opts->gc_threads);
+    idris_parWorkers(opts->par_workers);
+    idris_processStack(opts->process_stack_size);
+    if (opts->huge_pages) {
+        heap_use_huge_pages(&(vm->heap));
+    }
+    init_threaddata(vm);
+    return vm;
+}
+
+void idris_freeVM(VM* vm) {
+    terminate(vm);
+#ifdef HAS_PTHREAD
+    if (vm->spawned) {
+        return;
+    }
+    if (get_vm() == vm) {
+        init_threaddata(NULL);
+    }
+#endif
+    free(vm);
+}
+
+void idris_resetVM(VM* vm) {
+    vm->valstack_top = vm->valstack;
+    vm->valstack_base = vm->valstack;
+    vm->ret = NULL;
+    vm->reg1 = NULL;
+#ifdef HAS_PTHREAD
+    idris_freeMessages(vm);
+#endif
+    idris_gc(vm);
+}
+
+VM* idris_vm(void) {
+    RTSOpts opts = IDRIS_DEFAULT_OPTS;
+    opts.init_heap_size = 4096000;
+    return idris_newVM(&opts);
+}
+
+void close_vm(VM* vm) {
+    idris_freeVM(vm);
+}
+
+/* *** Pools *** */
+
+// A thread's own VM, which goes back to the pool when the thread exits
+typedef struct ThreadVM {
+    VMPool* pool;
+    VM* vm;
+    struct ThreadVM* next;
+    struct ThreadVM* prev;
+} ThreadVM;
+
+struct VMPool {
+    RTSOpts opts;
+    int max_idle;
+    VM** idle;
+    int idle_count;
+    int idle_size;
+    ThreadVM* threads; // Every thread's VM, so they can be freed with the pool
+#ifdef HAS_PTHREAD
+    pthread_mutex_t lock;
+    pthread_key_t thread_key;
+#endif
+};
+
+#ifdef HAS_PTHREAD
+static void thread_exit(void* data) {
+    ThreadVM* t = data;
+    VMPool* pool = t->pool;
+    POOL_LOCK(pool)
+    if (t->prev != NULL) {
+        t->prev->next = t->next;
+    } else {
+        pool->threads = t->next;
+    }
+    if (t->next != NULL) {
+        t->next->prev = t->prev;
+    }
+    POOL_UNLOCK(pool)
+    idris_giveVM(pool, t->vm);
+    free(t);
+}
+#endif
+
+VMPool* idris_newPool(const RTSOpts* opts, int max_idle) {
+    VMPool* pool = malloc(sizeof(VMPool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->opts = *opts;
+    pool->max_idle = max_idle;
+    pool->idle = NULL;
+    pool->idle_count = 0;
+    pool->idle_size = 0;
+    pool->threads = NULL;
+#ifdef HAS_PTHREAD
+    if (pthread_key_create(&pool->thread_key, thread_exit) != 0) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+#endif
+    return pool;
+}
+
+void idris_freePool(VMPool* pool) {
+    int i;
+#ifdef HAS_PTHREAD
+    // No more VMs go back to the pool when their threads exit
+    pthread_key_delete(pool->thread_key);
+#endif
+    while (pool->threads != NULL) {
+        ThreadVM* t = pool->threads;
+        pool->threads = t->next;
+        idris_freeVM(t->vm);
+        free(t);
+    }
+    for (i = 0; i < pool->idle_count; ++i) {
+        idris_freeVM(pool->idle[i]);
+    }
+    free(pool->idle);
+#ifdef HAS_PTHREAD
+    pthread_mutex_destroy(&pool->lock);
+#endif
+    free(pool);
+}
+
+VM* idris_takeVM(VMPool* pool) {
+    VM* vm = NULL;
+    POOL_LOCK(pool)
+    if (pool->idle_count > 0) {
+        vm = pool->idle[--pool->idle_count];
+    }
+    POOL_UNLOCK(pool)
+    if (vm == NULL) {
+        return idris_newVM(&pool->opts);
+    }
+    init_threaddata(vm);
+    return vm;
+}
+
+void idris_giveVM(VMPool* pool, VM* vm) {
+    // A VM with threads still running would hear from them again
+#ifdef HAS_PTHREAD
+    int busy = vm->processes > 0;
+#else
+    int busy = 0;
+#endif
+    if (!busy) {
+        idris_resetVM(vm);
+        POOL_LOCK(pool)
+        if (pool->max_idle == 0 || pool->idle_count < pool->max_idle) {
+            if (pool->idle_count == pool->idle_size) {
+                int size = pool->idle_size ? pool->idle_size * 2 : 8;
+                VM** idle = realloc(pool->idle, size * sizeof(VM*));
+                if (idle != NULL) {
+                    pool->idle = idle;
+                    pool->idle_size = size;
+                }
+            }
+            if (pool->idle_count < pool->idle_size) {
+                pool->idle[pool->idle_count++] = vm;
+                vm = NULL;
+            }
+        }
+        POOL_UNLOCK(pool)
+    }
+    if (vm != NULL) {
+        idris_freeVM(vm);
+    }
+}
+
+VM* idris_threadVM(VMPool* pool) {
+#ifdef HAS_PTHREAD
+    ThreadVM* t = pthread_getspecific(pool->thread_key);
+    if (t != NULL) {
+        return t->vm;
+    }
+    t = malloc(sizeof(ThreadVM));
+    if (t == NULL) {
+        return NULL;
+    }
+    t->pool = pool;
+    t->vm = idris_takeVM(pool);
+    t->prev = NULL;
+    POOL_LOCK(pool)
+    t->next = pool->threads;
+    if (t->next != NULL) {
+        t->next->prev = t;
+    }
+    pool->threads = t;
+    POOL_UNLOCK(pool)
+    pthread_setspecific(pool->thread_key, t);
+    return t->vm;
+#else
+    // There's only one thread
+    if (pool->threads == NULL) {
+        pool->threads = malloc(sizeof(ThreadVM));
+        if (pool->threads == NULL) {
+            return NULL;
+        }
+        pool->threads->pool = pool;
+        pool->threads->vm = idris_takeVM(pool);
+        pool->threads->next = NULL;
+        pool->threads->prev = NULL;
+    }
+    return pool->threads->vm;
+#endif
+}
@@ -0,0 +1,54 @@
+#ifndef _IDRIS_EMBED_H
+#define _IDRIS_EMBED_H
+
+#include "idris_rts.h"
+#include "idris_opts.h"
+
+/* *** Calling Idris from C ***
+ * Exported Idris functions take the VM to run on as their first argument.
+ * idris_newVM makes one with the given options, the same as those given
+ * to a compiled program with +RTS, setting up the rest of the RTS first
+ * if this is the first VM.
+ *
+ * Making a VM reserves its stack and heap, which costs far more than a
+ * short call. A program which calls Idris often, such as a server calling
+ * it once per request, can take its VMs from a pool instead. A VM given
+ * back to its pool is reset, by a collection with nothing left alive, and
+ * its stack and heap are kept as they are for whoever takes it next.
+ * Values returned by Idris functions belong to the VM, and are no longer
+ * valid once it's given back.
+ *
+ * Alternatively each thread can keep one VM from the pool for all its
+ * calls, with idris_threadVM. It isn't reset between calls, so values
+ * stay valid until the thread exits, when the VM goes back to the pool.
+ */
+
+// Create a VM. Everything else the RTS needs is set up once, however many
+// threads make VMs at the same time.
+VM* idris_newVM(const RTSOpts* opts);
+// Free a VM created by idris_newVM, with all its heap. Its struct is kept
+// if it has ever started a thread, since that may still refer to it.
+void idris_freeVM(VM* vm);
+// Collect everything a VM has allocated, and empty its stack, so that it
+// can be used for something new
+void idris_resetVM(VM* vm);
+
+typedef struct VMPool VMPool;
+
+// A pool of VMs made with the given options, which keeps up to max_idle
+// of them for reuse, or any number if it's 0
+VMPool* idris_newPool(const RTSOpts* opts, int max_idle);
+// Free the pool and all its VMs, once none is in use
+void idris_freePool(VMPool* pool);
+
+// Take a VM from the pool, or make one if none is idle. It's set up for
+// the calling thread, and must only be used by that thread until it's
+// given back.
+VM* idris_takeVM(VMPool* pool);
+// Give a VM back to the pool, which resets it
+void idris_giveVM(VMPool* pool, VM* vm);
+
+// The calling thread's own VM from the pool, taken the first time
+VM* idris_threadVM(VMPool* pool);
+
+#endif // _IDRIS_EMBED_H
@@ -2,7 +2,16 @@
 #include "idris_rts.h"
 #include "idris_gc.h"
 #include "idris_bitstring.h"
+#include "idris_prof.h"
 #include <assert.h>
+#include <time.h>
+#ifdef HAS_PTHREAD
+#include <sched.h>
+#endif
+
+// Header type of an object which another thread is in the middle of copying,
+// in a parallel collection
+#define CT_BUSY 0xff
 
 static inline VAL copy_plain(VM* vm, VAL x, size_t sz) {
     VAL cl = iallocate(vm, sz, 1);
@@ -10,14 +19,62 @@ static inline VAL copy_plain(VM* vm, VAL x, size_t sz) {
     return cl;
 }
 
-VAL copy(VM* vm, VAL x) {
-    int ar;
+// Mark a closure as living in the heap, if it can be mutated
+static inline void set_old(VM* vm, VAL cl) {
+    if (vm->nursery.size > 0) {
+        switch(GETTY(cl)) {
+        case CT_CON:
+        case CT_ARRAY:
+        case CT_REF:
+            cl->hdr.u8 = GC_OLD | (cl->hdr.u8 & GC_LARGE);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+// Limbs which GMP allocated through idris_alloc, or NULL for a number which
+// hasn't needed any yet
+static inline VAL bigint_limbs(VAL x) {
+    mpz_t * z = getmpz((BigInt*)x);
+    if ((*z)->_mp_alloc == 0) {
+        return NULL;
+    }
+    return (VAL)((char*)(*z)->_mp_d - offsetof(RawData, raw));
+}
+
+// Once a full collection has found everything live, free what it didn't
+// find outside the heap, and the stack a deep recursion has finished with
+static void sweep_outside(VM* vm) {
+    c_heap_sweep(&vm->c_heap);
+    sweep_shared(&vm->shared);
+    clean_stack(vm);
+    shrink_stack(vm);
+}
+
+static VAL copy(void* ctx, VAL x) {
+    VM* vm = ctx;
     VAL cl;
-    if (x==NULL) {
+    if (x==NULL || ISIMM(x)) {
+        return x;
+    }
+    if (x->hdr.u8 & GC_LARGE) {
+        // Scanned by cheney once everything in the heap has been. It stays
+        // where it is, but is old from now on, like the copies.
+        mark_large(&vm->large, x);
+        set_old(vm, x);
+        return x;
+    }
+    if (x->hdr.u8 & GC_STATIC) {
+        return x;
+    }
+    if (x->hdr.u8 & GC_SHARED) {
+        // Never scanned: nothing in a shared region points out of it
+        reach_shared(&vm->shared, x);
         return x;
     }
     switch(GETTY(x)) {
-    case CT_INT: return x;
     case CT_BITS32: return copy_plain(vm, x, sizeof(Bits32));
     case CT_BITS64: return copy_plain(vm, x, sizeof(Bits64));
     case CT_FLOAT: return copy_plain(vm, x, sizeof(Float));
@@ -30,115 +87,1450 @@ VAL copy(VM* vm, VAL x) {
     case CT_BIGINT:
         cl = MKBIGMc(vm, GETMPZ(x));
         break;
-    case CT_CON:
-        ar = CARITY(x);
-        if (ar == 0 && CTAG(x) < 256) {
-            return x;
+    case CT_STROFFSET:
+        cl = copy_plain(vm, x, sizeof(StrOffset));
+        if (((StrOffset*)x)->flat != NULL) {
+            c_heap_mark_item(((StrOffset*)x)->flat);
         }
-        // FALLTHROUGH
+        break;
+    case CT_STRCONCAT:
+        cl = copy_plain(vm, x, sizeof(StrConcat));
+        if (((StrConcat*)x)->flat != NULL) {
+            c_heap_mark_item(((StrConcat*)x)->flat);
+        }
+        break;
+    case CT_CON:
     case CT_ARRAY:
     case CT_STRING:
     case CT_REF:
-    case CT_STROFFSET:
     case CT_PTR:
     case CT_MANAGEDPTR:
     case CT_RAWDATA:
-        cl = copy_plain(vm, x, x->hdr.sz);
+    case CT_PRIMARRAY:
+        cl = copy_plain(vm, x, valSize(x));
+        set_old(vm, cl);
         break;
     default:
         cl = NULL;
         assert(0);
         break;
     }
-    assert(x->hdr.sz >= sizeof(Fwd));
+    assert(valSize(x) >= sizeof(Fwd));
+    SETTY(x, CT_FWD);
+    ((Fwd*)x)->fwd = cl;
+    return cl;
+}
+
+// Copy a closure out of the nursery into the heap. Anything already in
+// the heap stays where it is.
+static VAL promote(void* ctx, VAL x) {
+    VM* vm = ctx;
+    if (x==NULL || ISIMM(x) || !in_nursery(&vm->nursery, x)) {
+        return x;
+    }
+    VAL cl;
+    switch(GETTY(x)) {
+    case CT_FWD:
+        return GETPTR(x);
+    case CT_BIGINT:
+        cl = MKBIGMc(vm, GETMPZ(x));
+        break;
+    case CT_CDATA:
+        // Not marked: the C heap is only swept after a full collection.
+    default:
+        cl = copy_plain(vm, x, valSize(x));
+        set_old(vm, cl);
+        break;
+    }
+    assert(valSize(x) >= sizeof(Fwd));
     SETTY(x, CT_FWD);
     ((Fwd*)x)->fwd = cl;
     return cl;
 }
 
+// Copy everything a closure points to, using the given copy function. The
+// context is the VM for a serial collection, or the collecting thread for a
+// parallel one.
+static inline void scan_closure(void *ctx, VAL heap_item, VAL (*cp)(void*, VAL)) {
+    // If it's a CT_CON, CT_REF, CT_STROFFSET or CT_STRCONCAT, copy its arguments
+    switch(GETTY(heap_item)) {
+    case CT_CON:
+        {
+            Con * c = (Con*)heap_item;
+            size_t len = CARITY(c);
+            for(size_t i = 0; i < len; ++i)
+                c->args[i] = cp(ctx, c->args[i]);
+        }
+        break;
+    case CT_ARRAY:
+        {
+            Array * a = (Array*)heap_item;
+            size_t len = CELEM(a);
+            for(size_t i = 0; i < len; ++i)
+                a->array[i] = cp(ctx, a->array[i]);
+        }
+        break;
+    case CT_REF:
+        {
+            Ref * r = (Ref*)heap_item;
+            r->ref = cp(ctx, r->ref);
+        }
+        break;
+    case CT_STROFFSET:
+        {
+            StrOffset * s = (StrOffset*)heap_item;
+            s->base = (String*)cp(ctx, (VAL)s->base);
+        }
+        break;
+    case CT_STRCONCAT:
+        {
+            StrConcat * s = (StrConcat*)heap_item;
+            s->left = cp(ctx, s->left);
+            s->right = cp(ctx, s->right);
+        }
+        break;
+    default: // Nothing to copy
+        break;
+    }
+}
+
+// A view of a small part of a String which hasn't been copied yet gets a
+// copy of just that part, so that the rest of the String can be collected
+// if nothing else needs it. Any room this takes has to come from the spare
+// room in the new heap, since the String may be copied anyway later on.
+// Returns the room the copy needs, or 0 if the view should be left alone.
+static size_t view_room(StrOffset * s, size_t spare) {
+    String * base = s->base;
+    // Another thread may be copying the String in a parallel collection
+    uint8_t ty = __atomic_load_n(&base->hdr.ty, __ATOMIC_ACQUIRE);
+    if (ty == CT_FWD || ty == CT_BUSY || s->len * 4 >= base->slen) {
+        return 0;
+    }
+    if ((base->hdr.u8 & GC_LARGE) && large_header(base)->marked) {
+        return 0;
+    }
+    // Nothing is saved by copying out of a literal
+    if (base->hdr.u8 & GC_STATIC) {
+        return 0;
+    }
+    size_t sz = aligned(sizeof(String) + s->len + 1);
+    return sz < spare ? sz : 0;
+}
+
+// Point a view at its own copy of its characters, in the given String.
+static void compact_view(StrOffset * s, String * cl) {
+    String * base = s->base;
+    SETTY(cl, CT_STRING);
+    cl->slen = s->len;
+    memcpy(cl->str, base->str + s->offset, s->len);
+    cl->str[s->len] = '\0';
+    if (base->hdr.u16 & STR_ASCII) {
+        cl->clen = s->len;
+        cl->hdr.u16 = STR_COUNTED | STR_ASCII;
+    }
+
+    s->base = cl;
+    s->offset = 0;
+}
+
 void cheney(VM *vm) {
     char* scan = aligned_heap_pointer(vm->heap.heap);
+    VAL large_item;
 
-    while(scan < vm->heap.next) {
-       VAL heap_item = (VAL)scan;
-       // If it's a CT_CON, CT_REF or CT_STROFFSET, copy its arguments
-       switch(GETTY(heap_item)) {
-       case CT_CON:
-           {
-               Con * c = (Con*)heap_item;
-               size_t len = CARITY(c);
-               for(size_t i = 0; i < len; ++i)
-                   c->args[i] = copy(vm, c->args[i]);
-           }
-           break;
-       case CT_ARRAY:
-           {
-               Array * a = (Array*)heap_item;
-               size_t len = CELEM(a);
-               for(size_t i = 0; i < len; ++i)
-                   a->array[i] = copy(vm, a->array[i]);
-           }
-           break;
-       case CT_REF:
-           {
-               Ref * r = (Ref*)heap_item;
-               r->ref = copy(vm, r->ref);
-           }
-           break;
-       case CT_STROFFSET:
-           {
+    do {
+        while(scan < vm->heap.next) {
+           VAL heap_item = (VAL)scan;
+           size_t sz;
+           if (GETTY(heap_item) == CT_STROFFSET &&
+               (sz = view_room((StrOffset*)heap_item, vm->heap.spare)) > 0) {
                StrOffset * s = (StrOffset*)heap_item;
-               s->base = (String*)copy(vm, (VAL)s->base);
+               vm->heap.spare -= sz;
+               compact_view(s, iallocate(vm, sizeof(String) + s->len + 1, 1));
+           } else {
+               scan_closure(vm, heap_item, copy);
            }
-           break;
-       default: // Nothing to copy
-           break;
-       }
-       scan += aligned(valSize(heap_item));
-    }
+           scan += aligned(valSize(heap_item));
+        }
+        // Scanning a large object may copy more into the heap
+        large_item = next_gray(&vm->large);
+        if (large_item != NULL) {
+            scan_closure(vm, large_item, copy);
+        }
+    } while(large_item != NULL);
     assert(scan == vm->heap.next);
 }
 
-void idris_gc(VM* vm) {
+// Add to a list of objects kept by an incremental collection
+static void inc_push(VAL ** list, size_t * count, size_t * size, VAL x) {
+    if (*count == *size) {
+        *size = *size ? *size * 2 : 1024;
+        *list = realloc(*list, *size * sizeof(VAL));
+        if (*list == NULL) {
+            fprintf(stderr, "RTS ERROR: Unable to grow incremental collection log.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*list)[(*count)++] = x;
+}
+
+void idris_remember(VM* vm, VAL x) {
+    Nursery * n = &vm->nursery;
+    // During an incremental cycle, an old object is one which has been
+    // replicated, and its replica needs bringing up to date
+    if (vm->inc.active) {
+        x->hdr.u8 |= GC_REMEMBERED;
+        inc_push(&vm->inc.log, &vm->inc.log_count, &vm->inc.log_size, x);
+        return;
+    }
+    if (n->size == 0) {
+        return;
+    }
+    if (n->remembered_count == n->remembered_size) {
+        n->remembered_size = n->remembered_size ? n->remembered_size * 2 : 1024;
+        n->remembered = realloc(n->remembered,
+                                n->remembered_size * sizeof(VAL));
+        if (n->remembered == NULL) {
+            fprintf(stderr, "RTS ERROR: Unable to grow remembered set.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (x->hdr.u8 & GC_OLD) {
+        x->hdr.u8 |= GC_REMEMBERED;
+    }
+    n->remembered[n->remembered_count++] = x;
+}
+
+static void copy_roots(VM* vm, VAL (*cp)(void*, VAL)) {
+    VAL* root;
+
+    for(root = vm->valstack; root < vm->valstack_top; ++root) {
+        *root = cp(vm, *root);
+    }
+
+    vm->ret = cp(vm, vm->ret);
+    vm->reg1 = cp(vm, vm->reg1);
+}
+
+void idris_minor_gc(VM* vm) {
+    Nursery * n = &vm->nursery;
+
+    // Promoting can't need more room than the nursery is using. If the heap
+    // doesn't have that, collect everything instead.
+    if (vm->heap.next + (n->next - n->heap) >= vm->heap.end) {
+        idris_gc(vm);
+        return;
+    }
+
     HEAP_CHECK(vm)
     STATS_ENTER_GC(vm->stats, vm->heap.size)
+    idris_profBeforeGC(vm);
+
+    n->collecting = 1;
+    char* start = vm->heap.next;
+    char* scan = start;
+
+    copy_roots(vm, promote);
+
+    size_t i;
+    for(i = 0; i < n->remembered_count; ++i) {
+        VAL x = n->remembered[i];
+        scan_closure(vm, x, promote);
+        set_old(vm, x);
+    }
+    n->remembered_count = 0;
+
+    while(scan < vm->heap.next) {
+       VAL heap_item = (VAL)scan;
+       scan_closure(vm, heap_item, promote);
+       scan += aligned(valSize(heap_item));
+    }
 
-    if (vm->heap.old != NULL)
-        free(vm->heap.old);
+    n->next = n->heap;
+    n->collecting = 0;
+    clean_stack(vm);
+
+    STATS_LEAVE_GC(vm->stats, vm->heap.size, vm->heap.next - start)
+    STATS_MINOR_GC(vm->stats)
+    idris_profAfterGC(vm, 0);
+    HEAP_CHECK(vm)
+}
 
-    /* Allocate swap heap. */
-    alloc_heap(&vm->heap, vm->heap.size, vm->heap.growth, vm->heap.heap);
+/* *** Parallel collection ***
+ * A full collection of a big heap can be shared between a pool of threads.
+ * Each thread copies the roots in its share of the value stack, then scans
+ * what it has copied, Cheney style. Threads copy into blocks of the new heap
+ * which they claim for themselves, and when a block fills up, the part which
+ * hasn't been scanned yet is queued as a range that idle threads can steal.
+ *
+ * An object is claimed for copying by swapping its header for a CT_BUSY one,
+ * so that only one thread copies it. The others wait for the forwarding
+ * pointer.
+ */
 
+#ifdef HAS_PTHREAD
+
+// The heap must have at least this much in use for a full collection to be
+// shared between threads
+#define PAR_GC_MIN (4 * 1024 * 1024)
+// Size of the blocks threads claim to copy into
+#define PAR_GC_BLOCK 32768
+// An object this big which doesn't fit in a thread's block gets a block of
+// its own, rather than the rest of the block being wasted
+#define PAR_GC_OWN_BLOCK 1024
+// Amount of copied but unscanned objects worth queueing for idle threads
+#define PAR_GC_SHARE 4096
+
+typedef struct {
+    char* start;
+    char* end;
+} ScanRange;
+
+typedef struct {
+    VM* vm;
+    char* next;    // Block being copied into
+    char* end;
+    char* scan;    // First object in the block which hasn't been scanned
+    char* pending; // Object with a block of its own, to queue once it's copied
+    size_t spare;  // This thread's share of the heap's spare room
+
+    VAL* roots;    // This thread's share of the value stack
+    VAL* roots_end;
+
+    pthread_mutex_t lock; // Protects the queue of ranges
+    ScanRange* ranges;
+    size_t range_count;
+    size_t range_size;
+
+    pthread_t thread;
+} GCThread;
+
+static struct {
+    int size;            // Threads wanted, including the collector
+    int started;         // Threads in the pool, including the collector
+    GCThread* threads;
+    int busy;            // Set while a collection is using the pool
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned generation; // Collections started, so helpers can tell a new one
+    int running;         // Helpers still collecting
+    int idle;            // Threads looking for work
+    int rooted;          // Threads which have copied their roots
+
+    pthread_mutex_t large_lock; // Protects the large object space's gray list
+} pool = {
+    .size = 1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+    .large_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+void idris_gc_threads(int threads) {
+    pool.size = threads > 1 ? threads : 1;
+}
+
+static void push_range(GCThread* t, char* start, char* end) {
+    pthread_mutex_lock(&t->lock);
+    if (t->range_count == t->range_size) {
+        t->range_size = t->range_size ? t->range_size * 2 : 256;
+        t->ranges = realloc(t->ranges, t->range_size * sizeof(ScanRange));
+        if (t->ranges == NULL) {
+            fprintf(stderr, "RTS ERROR: Unable to grow collector work queue.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    t->ranges[t->range_count] = (ScanRange){ start, end };
+    __atomic_store_n(&t->range_count, t->range_count + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static int pop_range(GCThread* t, ScanRange* r) {
+    int found = 0;
+    if (__atomic_load_n(&t->range_count, __ATOMIC_ACQUIRE) == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&t->lock);
+    if (t->range_count > 0) {
+        *r = t->ranges[t->range_count - 1];
+        __atomic_store_n(&t->range_count, t->range_count - 1, __ATOMIC_RELEASE);
+        found = 1;
+    }
+    pthread_mutex_unlock(&t->lock);
+    return found;
+}
+
+// Claim between need and want bytes at the end of the new heap
+static char* claim(VM* vm, size_t need, size_t want, size_t* got) {
+    char* p = __atomic_load_n(&vm->heap.next, __ATOMIC_RELAXED);
+    size_t size;
+    do {
+        size_t left = vm->heap.end - p;
+        if (left < need) {
+            // The new heap is sized so that this can't happen
+            fprintf(stderr, "RTS ERROR: Heap overflow in parallel collection.\n");
+            exit(EXIT_FAILURE);
+        }
+        size = left < want ? left : want;
+    } while (!__atomic_compare_exchange_n(&vm->heap.next, &p, p + size, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    *got = size;
+    return p;
+}
+
+// Finish with a thread's block: queue what hasn't been scanned, and fill
+// the rest with a RawData so the heap can still be walked
+static void retire_block(GCThread* t) {
+    if (t->scan < t->next) {
+        push_range(t, t->scan, t->next);
+    }
+    if (t->next < t->end) {
+        *((Hdr*)t->next) = (Hdr){ .ty = CT_RAWDATA, .sz = t->end - t->next };
+    }
+    t->next = t->end = t->scan = NULL;
+}
+
+// Until it's filled in, the object looks like a RawData, in case a thread
+// scanning a range walks past it
+static void* par_alloc(GCThread* t, size_t isize) {
+    size_t size = aligned(isize);
+    size_t got;
+    char* ptr;
+
+    if ((size_t)(t->end - t->next) < size) {
+        if (size >= PAR_GC_OWN_BLOCK) {
+            ptr = claim(t->vm, size, size, &got);
+            t->pending = ptr;
+            *((Hdr*)ptr) = (Hdr){ .ty = CT_RAWDATA, .sz = isize };
+            return ptr;
+        }
+        retire_block(t);
+        t->next = t->scan = claim(t->vm, size, PAR_GC_BLOCK, &got);
+        t->end = t->next + got;
+    }
+
+    ptr = t->next;
+    t->next += size;
+    *((Hdr*)ptr) = (Hdr){ .ty = CT_RAWDATA, .sz = isize };
+    return ptr;
+}
+
+static void par_mark_large(VM* vm, VAL x) {
+    if (!__atomic_load_n(&large_header(x)->marked, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&pool.large_lock);
+        mark_large(&vm->large, x);
+        set_old(vm, x);
+        pthread_mutex_unlock(&pool.large_lock);
+    }
+}
+
+static void* par_next_gray(VM* vm) {
+    void* item = NULL;
+    if (__atomic_load_n(&vm->large.gray, __ATOMIC_ACQUIRE) != NULL) {
+        pthread_mutex_lock(&pool.large_lock);
+        item = next_gray(&vm->large);
+        pthread_mutex_unlock(&pool.large_lock);
+    }
+    return item;
+}
+
+// Queue an object which was given a block of its own, now it's been copied
+static void flush_pending(GCThread* t) {
+    if (t->pending != NULL) {
+        char* end = t->pending + aligned(valSize((VAL)t->pending));
+        push_range(t, t->pending, end);
+        t->pending = NULL;
+    }
+}
+
+static VAL par_copy(void* ctx, VAL x) {
+    GCThread* t = ctx;
+    VM* vm = t->vm;
+    Hdr h, busy;
+    VAL cl;
+
+    if (x == NULL || ISIMM(x)) {
+        return x;
+    }
+
+    __atomic_load(&x->hdr, &h, __ATOMIC_ACQUIRE);
+    for (;;) {
+        if (h.u8 & GC_STATIC) {
+            return x;
+        }
+        if (h.u8 & GC_SHARED) {
+            reach_shared(&vm->shared, x);
+            return x;
+        }
+        if (h.u8 & GC_LARGE) {
+            // Scanned once it's been taken off the gray list
+            par_mark_large(vm, x);
+            return x;
+        }
+        switch(h.ty) {
+        case CT_INT:
+            return x;
+        case CT_FWD:
+            return GETPTR(x);
+        case CT_BUSY:
+            __atomic_load(&x->hdr, &h, __ATOMIC_ACQUIRE);
+            continue;
+        default:
+            break;
+        }
+        busy = h;
+        busy.ty = CT_BUSY;
+        if (__atomic_compare_exchange(&x->hdr, &h, &busy, 0,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+
+    // Until the forwarding pointer is written, nobody else touches x
+    switch(h.ty) {
+    case CT_CDATA:
+        c_heap_mark_item(GETCDATA(x));
+        break;
+    case CT_STROFFSET:
+        if (((StrOffset*)x)->flat != NULL) {
+            c_heap_mark_item(((StrOffset*)x)->flat);
+        }
+        break;
+    case CT_STRCONCAT:
+        if (((StrConcat*)x)->flat != NULL) {
+            c_heap_mark_item(((StrConcat*)x)->flat);
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (h.ty == CT_BIGINT) {
+        size_t sz = idris_bigCopySize(x);
+        if (sz >= LARGE_OBJECT_MIN) {
+            // Too big for the heap, so it goes in the large object space,
+            // limbs and all
+            pthread_mutex_lock(&pool.large_lock);
+            void* room = alloc_large(&vm->large, sz, true);
+            pthread_mutex_unlock(&pool.large_lock);
+            cl = idris_bigCopyInto(x, room);
+            cl->hdr.u8 = GC_LARGE;
+        } else {
+            cl = idris_bigCopyInto(x, par_alloc(t, sz));
+        }
+    } else {
+        size_t sz = hdrSize(&h);
+        cl = par_alloc(t, sz);
+        memcpy((char*)cl + sizeof(Hdr), (char*)x + sizeof(Hdr),
+               sz - sizeof(Hdr));
+        cl->hdr = h;
+        set_old(vm, cl);
+    }
+
+    assert(hdrSize(&h) >= sizeof(Fwd));
+    ((Fwd*)x)->fwd = cl;
+    h.ty = CT_FWD;
+    __atomic_store(&x->hdr, &h, __ATOMIC_RELEASE);
+
+    flush_pending(t);
+    return cl;
+}
+
+static void par_scan(GCThread* t, VAL heap_item) {
+    size_t sz;
+    if (GETTY(heap_item) == CT_STROFFSET &&
+        (sz = view_room((StrOffset*)heap_item, t->spare)) > 0) {
+        StrOffset * s = (StrOffset*)heap_item;
+        t->spare -= sz;
+        compact_view(s, par_alloc(t, sizeof(String) + s->len + 1));
+        flush_pending(t);
+    } else {
+        scan_closure(t, heap_item, par_copy);
+    }
+}
+
+// Scan everything this thread can get at without stealing
+static void par_scan_local(GCThread* t) {
+    ScanRange r;
+    VAL large_item;
+
+    for (;;) {
+        if (t->scan < t->next) {
+            // Copying may start a new block, queueing the rest of this one
+            VAL heap_item = (VAL)t->scan;
+            t->scan += aligned(valSize(heap_item));
+            par_scan(t, heap_item);
+            // Give threads with nothing to do some of the work
+            if (t->next - t->scan >= PAR_GC_SHARE &&
+                __atomic_load_n(&pool.idle, __ATOMIC_RELAXED) > 0) {
+                push_range(t, t->scan, t->next);
+                t->scan = t->next;
+            }
+        } else if (pop_range(t, &r)) {
+            while (r.start < r.end) {
+                VAL heap_item = (VAL)r.start;
+                par_scan(t, heap_item);
+                r.start += aligned(valSize(heap_item));
+            }
+        } else if ((large_item = par_next_gray(t->vm)) != NULL) {
+            scan_closure(t, large_item, par_copy);
+        } else {
+            return;
+        }
+    }
+}
+
+// Wait for some work to steal. Returns 0 once every thread is waiting, at
+// which point there's nothing left to scan.
+static int par_steal(GCThread* t) {
+    ScanRange r;
+    int i;
+
+    __atomic_add_fetch(&pool.idle, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+        for (i = 0; i < pool.started; ++i) {
+            GCThread* victim = &pool.threads[i];
+            if (__atomic_load_n(&victim->range_count, __ATOMIC_ACQUIRE) > 0 ||
+                __atomic_load_n(&t->vm->large.gray, __ATOMIC_ACQUIRE) != NULL) {
+                __atomic_sub_fetch(&pool.idle, 1, __ATOMIC_SEQ_CST);
+                if (pop_range(victim, &r)) {
+                    push_range(t, r.start, r.end);
+                    return 1;
+                }
+                if (__atomic_load_n(&t->vm->large.gray, __ATOMIC_ACQUIRE) != NULL) {
+                    return 1;
+                }
+                __atomic_add_fetch(&pool.idle, 1, __ATOMIC_SEQ_CST);
+            }
+        }
+        if (__atomic_load_n(&pool.idle, __ATOMIC_SEQ_CST) == pool.started) {
+            return 0;
+        }
+        sched_yield();
+    }
+}
+
+static void par_collect(GCThread* t) {
     VAL* root;
 
+    for (root = t->roots; root < t->roots_end; ++root) {
+        *root = par_copy(t, *root);
+    }
+    if (t == pool.threads) {
+        t->vm->ret = par_copy(t, t->vm->ret);
+        t->vm->reg1 = par_copy(t, t->vm->reg1);
+    }
+
+    // Wait for all the roots to be copied before scanning anything, so
+    // that compact_view knows which Strings are live
+    __atomic_add_fetch(&pool.rooted, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&pool.rooted, __ATOMIC_SEQ_CST) < pool.started) {
+        sched_yield();
+    }
+
+    do {
+        par_scan_local(t);
+    } while (par_steal(t));
+
+    retire_block(t);
+}
+
+static void* gc_helper(void* arg) {
+    GCThread* t = arg;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.generation == seen) {
+            pthread_cond_wait(&pool.start, &pool.lock);
+        }
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        par_collect(t);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.running == 0) {
+            pthread_cond_signal(&pool.done);
+        }
+    }
+    return NULL;
+}
+
+// A child process only has the thread which forked it, so it has to start
+// a pool of its own
+static void par_after_fork(void) {
+    pool.threads = NULL;
+    pool.started = 0;
+    pool.busy = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.start, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pthread_mutex_init(&pool.large_lock, NULL);
+}
+
+// Take the pool for a collection of vm, starting it if necessary. Returns
+// the number of threads to collect with, or 0 if the collection should be
+// done serially.
+static int par_begin(VM* vm, size_t live) {
+    int i;
+
+    if (pool.size <= 1 || live < PAR_GC_MIN) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.busy) {
+        // Another VM is using it
+        pthread_mutex_unlock(&pool.lock);
+        return 0;
+    }
+    if (pool.threads == NULL) {
+        pool.threads = calloc(pool.size, sizeof(GCThread));
+        if (pool.threads == NULL) {
+            pthread_mutex_unlock(&pool.lock);
+            return 0;
+        }
+        if (pool.generation == 0) {
+            pthread_atfork(NULL, NULL, par_after_fork);
+        }
+        pool.started = 1;
+        pthread_mutex_init(&pool.threads[0].lock, NULL);
+        for (i = 1; i < pool.size; ++i) {
+            GCThread* t = &pool.threads[i];
+            pthread_mutex_init(&t->lock, NULL);
+            if (pthread_create(&t->thread, NULL, gc_helper, t) != 0) {
+                break;
+            }
+            pthread_detach(t->thread);
+            pool.started++;
+        }
+    }
+    if (pool.started <= 1) {
+        pthread_mutex_unlock(&pool.lock);
+        return 0;
+    }
+    pool.busy = 1;
+    pthread_mutex_unlock(&pool.lock);
+    return pool.started;
+}
+
+// Copy everything reachable into the new heap with the pool's threads
+static void par_gc(VM* vm, int threads) {
+    size_t roots = vm->valstack_top - vm->valstack;
+    size_t share = (roots + threads - 1) / threads;
+    int i;
+
+    for (i = 0; i < threads; ++i) {
+        GCThread* t = &pool.threads[i];
+        size_t from = share * i < roots ? share * i : roots;
+        size_t to = from + share < roots ? from + share : roots;
+        t->vm = vm;
+        t->next = t->end = t->scan = t->pending = NULL;
+        t->spare = vm->heap.spare / threads;
+        t->roots = vm->valstack + from;
+        t->roots_end = vm->valstack + to;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.idle = 0;
+    pool.rooted = 0;
+    pool.running = threads - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    par_collect(&pool.threads[0]);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.running > 0) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pool.busy = 0;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+#else
+
+void idris_gc_threads(int threads) {
+    (void)threads;
+}
+
+#endif // HAS_PTHREAD
+
+static void heap_exhausted(VM* vm, size_t needed) {
+    fprintf(stderr, "RTS ERROR: Heap exhausted (%zu bytes needed, maximum %zu).\n"
+                    "Use `+RTS -M<size>' to increase the maximum heap size.\n",
+            needed, vm->heap.max_size);
+    exit(EXIT_FAILURE);
+}
+
+void check_max_heap(VM* vm, size_t needed) {
+    needed += vm->large.size;
+    if (vm->heap.max_size > 0 && needed > vm->heap.max_size) {
+        heap_exhausted(vm, needed);
+    }
+}
+
+/* *** Incremental collection *** */
+
+// Objects dealt with between looks at the clock
+#define INC_CLOCK_EVERY 64
+// Stack slots replicated at a time
+#define INC_ROOTS_CHUNK 256
+
+static double inc_now(void) {
+    return idris_clock_ns() / 1e6;
+}
+
+static inline uint32_t * inc_fwd(VM* vm, VAL x) {
+    return &vm->inc.fwd[((char*)x - vm->heap.heap) / sizeof(void*)];
+}
+
+static inline VAL inc_replica(VM* vm, VAL x) {
+    uint32_t f = *inc_fwd(vm, x);
+    return f == 0 ? NULL : (VAL)(vm->inc.space + (size_t)(f - 1) * sizeof(void*));
+}
+
+// Room for the replica of x. The other semispace is at least as big as the
+// heap, so it can't run out.
+static void * inc_alloc(VM* vm, VAL x, size_t sz) {
+    Incremental * inc = &vm->inc;
+    char * cl = inc->next;
+    inc->next += aligned(sz);
+    assert(inc->next <= inc->space + vm->heap.old_size);
+    *inc_fwd(vm, x) = (uint32_t)((cl - inc->space) / sizeof(void*)) + 1;
+    return cl;
+}
+
+static inline VAL inc_plain(VM* vm, VAL x, size_t sz) {
+    VAL cl = inc_alloc(vm, x, sz);
+    memcpy(cl, x, sz);
+    return cl;
+}
+
+// The replica of x, making one if it hasn't got one yet
+static VAL replicate(void* ctx, VAL x) {
+    VM* vm = ctx;
+    Incremental * inc = &vm->inc;
+    VAL cl;
+    if (x == NULL || ISIMM(x)) {
+        return x;
+    }
+    if (x->hdr.u8 & GC_LARGE) {
+        mark_large(&vm->large, x);
+        return x;
+    }
+    if (x->hdr.u8 & GC_SHARED) {
+        reach_shared(&vm->shared, x);
+        return x;
+    }
+    // Static nullaries, and replicas
+    if ((char*)x < vm->heap.heap || (char*)x >= inc->end) {
+        return x;
+    }
+    cl = inc_replica(vm, x);
+    if (cl != NULL) {
+        return cl;
+    }
+    switch(GETTY(x)) {
+    case CT_BITS32: return inc_plain(vm, x, sizeof(Bits32));
+    case CT_BITS64: return inc_plain(vm, x, sizeof(Bits64));
+    case CT_FLOAT: return inc_plain(vm, x, sizeof(Float));
+    case CT_CDATA:
+        cl = inc_plain(vm, x, sizeof(CDataC));
+        c_heap_mark_item(GETCDATA(x));
+        break;
+    case CT_BIGINT:
+        {
+            // Limbs in the large object space stay where they are
+            VAL limbs = bigint_limbs(x);
+            if (limbs != NULL && (limbs->hdr.u8 & GC_LARGE)) {
+                cl = inc_plain(vm, x, valSize(x));
+                mark_large(&vm->large, limbs);
+            } else {
+                cl = idris_bigCopyInto(x, inc_alloc(vm, x, idris_bigCopySize(x)));
+            }
+        }
+        break;
+    case CT_STROFFSET:
+        cl = inc_plain(vm, x, sizeof(StrOffset));
+        if (((StrOffset*)x)->flat != NULL) {
+            c_heap_mark_item(((StrOffset*)x)->flat);
+        }
+        break;
+    case CT_STRCONCAT:
+        cl = inc_plain(vm, x, sizeof(StrConcat));
+        if (((StrConcat*)x)->flat != NULL) {
+            c_heap_mark_item(((StrConcat*)x)->flat);
+        }
+        break;
+    case CT_CON:
+    case CT_ARRAY:
+    case CT_REF:
+        cl = inc_plain(vm, x, valSize(x));
+        cl->hdr.u8 = 0;
+        // From now on the write barrier logs changes to the original
+        x->hdr.u8 = GC_OLD;
+        break;
+    case CT_MANAGEDPTR:
+    case CT_RAWDATA:
+    case CT_PRIMARRAY:
+        cl = inc_plain(vm, x, valSize(x));
+        inc_push(&inc->raw, &inc->raw_count, &inc->raw_size, x);
+        break;
+    case CT_STRING:
+    case CT_PTR:
+        cl = inc_plain(vm, x, valSize(x));
+        break;
+    default:
+        cl = NULL;
+        assert(0);
+        break;
+    }
+    return cl;
+}
+
+// Large objects are shared with the program until the end of a cycle, so
+// what they point to is replicated without changing them.
+static VAL replicate_only(void* ctx, VAL x) {
+    replicate(ctx, x);
+    return x;
+}
+
+// Bring the replica of a logged object up to date
+static void inc_resync(VM* vm, VAL x) {
+    VAL cl = inc_replica(vm, x);
+    x->hdr.u8 = GC_OLD;
+    memcpy(cl, x, valSize(x));
+    cl->hdr.u8 = 0;
+    scan_closure(vm, cl, replicate);
+}
+
+static void inc_start(VM* vm) {
+    Incremental * inc = &vm->inc;
+    Heap * h = &vm->heap;
+    size_t capacity = inc->end - h->heap;
+
+    // Everything in the heap might be live by the end of the cycle
+    if (h->size < capacity) {
+        h->size = capacity;
+    }
+    inc->space = prepare_space(h);
+    inc->next = aligned_heap_pointer(inc->space);
+    inc->scan = inc->next;
+    inc->fwd = calloc(capacity / sizeof(void*) + 1, sizeof(uint32_t));
+    if (inc->fwd == NULL) {
+        fprintf(stderr, "RTS ERROR: Unable to start incremental collection.\n");
+        exit(EXIT_FAILURE);
+    }
+    inc->roots = 0;
+    inc->estimate = h->next - h->heap;
+    inc->active = 1;
+}
+
+// Work on the cycle until the deadline. Returns whether there's more to do.
+static int inc_work(VM* vm, double deadline) {
+    Incremental * inc = &vm->inc;
+    unsigned n = 0;
+    for (;;) {
+        if (++n % INC_CLOCK_EVERY == 0 && inc_now() >= deadline) {
+            return 1;
+        }
+        if (inc->log_count > 0) {
+            inc_resync(vm, inc->log[--inc->log_count]);
+            continue;
+        }
+        if (inc->scan < inc->next) {
+            VAL cl = (VAL)inc->scan;
+            inc->scan += aligned(valSize(cl));
+            scan_closure(vm, cl, replicate);
+            continue;
+        }
+        void * large_item = next_gray(&vm->large);
+        if (large_item != NULL) {
+            scan_closure(vm, large_item, replicate_only);
+            continue;
+        }
+        size_t depth = vm->valstack_top - vm->valstack;
+        if (inc->roots < depth) {
+            size_t end = inc->roots + INC_ROOTS_CHUNK;
+            if (end > depth) {
+                end = depth;
+            }
+            for (; inc->roots < end; ++inc->roots) {
+                replicate(vm, vm->valstack[inc->roots]);
+            }
+            continue;
+        }
+        return 0;
+    }
+}
+
+// Work done on the cycle so far, in bytes replicated and scanned
+static size_t inc_done(Incremental * inc) {
+    return (inc->next - inc->space) + (inc->scan - inc->space);
+}
+
+// Put the next step where, at the rate the last one worked, the cycle will
+// finish with room to spare; or, between cycles, where the next one starts.
+static void inc_pace(VM* vm, size_t worked) {
+    Incremental * inc = &vm->inc;
+    Heap * h = &vm->heap;
+    size_t quantum;
+
+    if (inc->active) {
+        size_t room = inc->end - h->next;
+        size_t done = inc_done(inc);
+        size_t left = 2 * inc->estimate > done ? 2 * inc->estimate - done
+                                               : inc->estimate / 8 + 1;
+        quantum = (size_t)((double)room * worked / (2.0 * left + worked));
+    } else {
+        char * start = h->heap + (inc->end - h->heap) / INC_START_FRACTION;
+        quantum = start > h->next ? (size_t)(start - h->next) : 0;
+    }
+    if (quantum < INC_MIN_QUANTUM) {
+        quantum = INC_MIN_QUANTUM;
+    }
+    h->end = (size_t)(inc->end - h->next) > quantum ? h->next + quantum : inc->end;
+}
+
+// The final pause: replicate everything still to do, then switch over to
+// the replicas
+static void inc_finish(VM* vm) {
+    Incremental * inc = &vm->inc;
+    Heap * h = &vm->heap;
+    LargeObject * lo;
+    void * large_item;
+    size_t i;
+
+    h->end = inc->end;
+    copy_roots(vm, replicate);
+    // Large objects may have changed since they were scanned
+    for (lo = vm->large.first; lo != NULL; lo = lo->next) {
+        if (lo->marked) {
+            scan_closure(vm, (VAL)(lo + 1), replicate);
+        }
+    }
+    do {
+        while (inc->log_count > 0 || inc->scan < inc->next) {
+            if (inc->log_count > 0) {
+                inc_resync(vm, inc->log[--inc->log_count]);
+            } else {
+                VAL cl = (VAL)inc->scan;
+                inc->scan += aligned(valSize(cl));
+                scan_closure(vm, cl, replicate);
+            }
+        }
+        large_item = next_gray(&vm->large);
+        if (large_item != NULL) {
+            scan_closure(vm, large_item, replicate);
+        }
+    } while (large_item != NULL);
+
+    for (i = 0; i < inc->raw_count; ++i) {
+        VAL x = inc->raw[i];
+        memcpy(inc_replica(vm, x), x, valSize(x));
+    }
+    inc->raw_count = 0;
+
+    switch_space(h);
+    h->next = inc->next;
+    free(inc->fwd);
+    inc->fwd = NULL;
+    inc->active = 0;
+
+    sweep_large(&vm->large);
+
+    size_t live = h->next - h->heap;
+    check_max_heap(vm, live);
+    resize_heap(h, live, vm->large.size);
+    sweep_outside(vm);
+
+    inc->end = h->end;
+    inc_pace(vm, 0);
+}
+
+void idris_inc_step(VM* vm) {
+    Incremental * inc = &vm->inc;
+    STATS_ENTER_GC(vm->stats, vm->heap.size)
+
+    if (!inc->active) {
+        inc_start(vm);
+    }
+    size_t before = inc_done(inc);
+    if (inc_work(vm, inc_now() + inc->pause)) {
+        inc_pace(vm, inc_done(inc) - before);
+        STATS_LEAVE_STEP(vm->stats)
+    } else {
+        inc_finish(vm);
+        STATS_LEAVE_GC(vm->stats, vm->heap.size, vm->heap.next - vm->heap.heap)
+        idris_profAfterGC(vm, 1);
+    }
+}
+
+void idris_gc_incremental(VM* vm, double pause) {
+    Incremental * inc = &vm->inc;
+    if (inc->active) {
+        idris_gc(vm);
+    }
+    if (inc->pause > 0) {
+        vm->heap.end = inc->end;
+    }
+    inc->pause = pause > 0 ? pause : 0;
+    if (inc->pause > 0) {
+        inc->end = vm->heap.end;
+        inc_pace(vm, 0);
+    }
+}
+
+/* *** Mark-compact collection ***
+ * Live objects are marked in a bitmap on the side, with a bit for each word
+ * they take up and another for the word they start at. The number of live
+ * words before an object is then where it slides down to: each group of 64
+ * words records how many were live before it, and the bitmap counts the
+ * rest. Pointers are updated before anything moves, and objects only ever
+ * move down, so they can be slid in address order.
+ */
+
+typedef struct {
+    VM* vm;
+    char* start;      // First object in the heap
+    char* dest;       // Where the first live object goes
+    uint64_t* live;   // Bit for each word of a live object
+    uint64_t* starts; // Bit for the first word of each live object
+    uint32_t* before; // Live words before each group of 64 words
+    size_t groups;
+
+    VAL* stack;       // Marked objects whose contents are still to be marked
+    size_t stack_count;
+    size_t stack_size;
+} Compactor;
+
+static inline size_t cm_word(Compactor* c, VAL x) {
+    return ((char*)x - c->start) / sizeof(void*);
+}
+
+static inline int cm_in_heap(Compactor* c, VAL x) {
+    return (char*)x >= c->start && (char*)x < c->vm->heap.next;
+}
+
+static void cm_mark(Compactor* c, VAL x) {
+    if (x == NULL || ISIMM(x)) {
+        return;
+    }
+    if (!cm_in_heap(c, x)) {
+        // Otherwise it's static
+        if (x->hdr.u8 & GC_LARGE) {
+            mark_large(&c->vm->large, x);
+        } else if (x->hdr.u8 & GC_SHARED) {
+            reach_shared(&c->vm->shared, x);
+        }
+        return;
+    }
+    size_t w = cm_word(c, x);
+    if (c->starts[w / 64] & ((uint64_t)1 << (w % 64))) {
+        return;
+    }
+    c->starts[w / 64] |= (uint64_t)1 << (w % 64);
+    size_t end = w + aligned(valSize(x)) / sizeof(void*);
+    for (; w < end; ++w) {
+        c->live[w / 64] |= (uint64_t)1 << (w % 64);
+    }
+
+    if (c->stack_count == c->stack_size) {
+        c->stack_size = c->stack_size ? c->stack_size * 2 : 4096;
+        c->stack = realloc(c->stack, c->stack_size * sizeof(VAL));
+        if (c->stack == NULL) {
+            fprintf(stderr, "RTS ERROR: Unable to grow mark stack.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    c->stack[c->stack_count++] = x;
+}
+
+static VAL cm_mark_field(void* ctx, VAL x) {
+    cm_mark(ctx, x);
+    return x;
+}
+
+// Mark everything an object points to
+static void cm_scan(Compactor* c, VAL x) {
+    switch(GETTY(x)) {
+    case CT_CDATA:
+        c_heap_mark_item(GETCDATA(x));
+        break;
+    case CT_BIGINT:
+        {
+            VAL limbs = bigint_limbs(x);
+            if (limbs != NULL) {
+                cm_mark(c, limbs);
+            }
+        }
+        break;
+    case CT_STROFFSET:
+        if (((StrOffset*)x)->flat != NULL) {
+            c_heap_mark_item(((StrOffset*)x)->flat);
+        }
+        break;
+    case CT_STRCONCAT:
+        if (((StrConcat*)x)->flat != NULL) {
+            c_heap_mark_item(((StrConcat*)x)->flat);
+        }
+        break;
+    default:
+        break;
+    }
+    scan_closure(c, x, cm_mark_field);
+}
+
+// Where a live object in the heap is going
+static inline VAL cm_new(Compactor* c, VAL x) {
+    size_t w = cm_word(c, x);
+    uint64_t below = c->live[w / 64] & (((uint64_t)1 << (w % 64)) - 1);
+    size_t rank = c->before[w / 64] + __builtin_popcountll(below);
+    return (VAL)(c->dest + rank * sizeof(void*));
+}
+
+static VAL cm_relocate(void* ctx, VAL x) {
+    Compactor* c = ctx;
+    if (x == NULL || ISIMM(x) || !cm_in_heap(c, x)) {
+        return x;
+    }
+    return cm_new(c, x);
+}
+
+// Point an object at where everything it points to is going
+static void cm_update(Compactor* c, VAL x) {
+    if (GETTY(x) == CT_BIGINT) {
+        VAL limbs = bigint_limbs(x);
+        if (limbs != NULL && cm_in_heap(c, limbs)) {
+            mpz_t * z = getmpz((BigInt*)x);
+            (*z)->_mp_d = (mp_limb_t*)((RawData*)cm_new(c, limbs))->raw;
+        }
+    }
+    scan_closure(c, x, cm_relocate);
+}
+
+static void cm_roots(Compactor* c, VAL (*cp)(void*, VAL)) {
+    VM* vm = c->vm;
+    VAL* root;
     for(root = vm->valstack; root < vm->valstack_top; ++root) {
-        *root = copy(vm, *root);
+        *root = cp(c, *root);
     }
+    vm->ret = cp(c, vm->ret);
+    vm->reg1 = cp(c, vm->reg1);
+}
 
-#ifdef HAS_PTHREAD
-    Msg* msg;
+// Call f on every live object in the heap, in address order
+#define CM_EACH_LIVE(c, x, f) \
+    for (size_t _g = 0; _g < (c)->groups; ++_g) { \
+        uint64_t _bits = (c)->starts[_g]; \
+        while (_bits != 0) { \
+            VAL x = (VAL)((c)->start + \
+                          (_g * 64 + __builtin_ctzll(_bits)) * sizeof(void*)); \
+            _bits &= _bits - 1; \
+            f; \
+        } \
+    }
+
+static void compact_heap(VM* vm) {
+    Heap* h = &vm->heap;
+    Compactor c = { .vm = vm };
+    LargeObject * lo;
+    void * large_item;
+    size_t i;
 
-    for(msg = vm->inbox; msg < vm->inbox_write; ++msg) {
-        msg->msg = copy(vm, msg->msg);
+    c.start = aligned_heap_pointer(h->heap);
+    c.groups = (h->next - c.start) / sizeof(void*) / 64 + 1;
+    c.live = calloc(c.groups, sizeof(uint64_t));
+    c.starts = calloc(c.groups, sizeof(uint64_t));
+    c.before = malloc(c.groups * sizeof(uint32_t));
+    if (c.live == NULL || c.starts == NULL || c.before == NULL) {
+        fprintf(stderr, "RTS ERROR: Unable to allocate mark bitmap.\n");
+        exit(EXIT_FAILURE);
     }
-#endif
 
-    vm->ret = copy(vm, vm->ret);
-    vm->reg1 = copy(vm, vm->reg1);
+    // Mark
+    cm_roots(&c, cm_mark_field);
+    do {
+        while (c.stack_count > 0) {
+            cm_scan(&c, c.stack[--c.stack_count]);
+        }
+        large_item = next_gray(&vm->large);
+        if (large_item != NULL) {
+            cm_scan(&c, large_item);
+        }
+    } while (large_item != NULL);
+    free(c.stack);
 
-    cheney(vm);
+    size_t live = 0;
+    for (i = 0; i < c.groups; ++i) {
+        c.before[i] = (uint32_t)live;
+        live += __builtin_popcountll(c.live[i]);
+    }
+    live *= sizeof(void*);
 
-    // After reallocation, if we've still more than half filled the new heap, grow the heap
-    // for next time.
+    // Sliding down a big heap which is mostly empty leaves it mostly empty,
+    // so it may as well go in a new smaller one, and likewise if it needs
+    // to grow
+    if (h->size < live) {
+        h->size = live;
+    }
+    char* space = compact_space(h);
+    c.dest = aligned_heap_pointer(space);
 
-    if ((vm->heap.next - vm->heap.heap) > vm->heap.size >> 1) {
-        vm->heap.size += vm->heap.growth;
+    // Update pointers
+    cm_roots(&c, cm_relocate);
+    CM_EACH_LIVE(&c, x, cm_update(&c, x))
+    for (lo = vm->large.first; lo != NULL; lo = lo->next) {
+        if (lo->marked) {
+            cm_update(&c, (VAL)(lo + 1));
+        }
     }
 
-    // finally, sweep the C heap
-    c_heap_sweep(&vm->c_heap);
+    // Slide
+    CM_EACH_LIVE(&c, x, memmove(cm_new(&c, x), x, aligned(valSize(x))))
+    replace_space(h, space);
+    h->next = c.dest + live;
+
+    free(c.live);
+    free(c.starts);
+    free(c.before);
+
+    sweep_large(&vm->large);
+    check_max_heap(vm, live);
+    resize_heap(h, live, vm->large.size);
+    sweep_outside(vm);
+}
+
+void idris_gc_compacting(VM* vm, int compact) {
+    vm->heap.compact = compact;
+    if (compact) {
+        free_old_space(&vm->heap);
+    }
+}
+
+void idris_gc_for(VM* vm, size_t size) {
+    Incremental * inc = &vm->inc;
+    // With a pause target, the end of the heap is only where the next step
+    // is due, unless the heap is really full
+    if (inc->pause > 0 && vm->heap.next + size <= inc->end) {
+        idris_inc_step(vm);
+        if (vm->heap.next + size <= inc->end) {
+            if (vm->heap.next + size > vm->heap.end) {
+                vm->heap.end = vm->heap.next + size;
+            }
+            return;
+        }
+    }
+
+    // If we're trying to allocate something bigger than the heap,
+    // grow the heap here so that the new heap is big enough.
+    if (size > vm->heap.size) {
+        vm->heap.size += size;
+    }
+    idris_gc(vm);
+
+    // If there's still not enough room, grow the heap and try again
+    if (vm->heap.next + size > vm->heap.end) {
+        size_t live = vm->heap.next - vm->heap.heap;
+        check_max_heap(vm, live + size);
+        vm->heap.size = live + size + vm->heap.growth;
+        idris_gc(vm);
+    }
+}
+
+void idris_gc(VM* vm) {
+    if (vm->inc.active) {
+        STATS_ENTER_GC(vm->stats, vm->heap.size)
+        idris_profBeforeGC(vm);
+        inc_finish(vm);
+        STATS_LEAVE_GC(vm->stats, vm->heap.size, vm->heap.next - vm->heap.heap)
+        idris_profAfterGC(vm, 1);
+        return;
+    }
+    if (vm->heap.compact) {
+        HEAP_CHECK(vm)
+        STATS_ENTER_GC(vm->stats, vm->heap.size)
+        idris_profBeforeGC(vm);
+        compact_heap(vm);
+        STATS_LEAVE_GC(vm->stats, vm->heap.size, vm->heap.next - vm->heap.heap)
+        idris_profAfterGC(vm, 1);
+        HEAP_CHECK(vm)
+        return;
+    }
+    if (vm->inc.pause > 0) {
+        vm->heap.end = vm->inc.end;
+    }
+
+    HEAP_CHECK(vm)
+    STATS_ENTER_GC(vm->stats, vm->heap.size)
+    idris_profBeforeGC(vm);
+
+    // The remembered set is dropped below. Copies start out unremembered,
+    // but large objects stay where they are, so forget them here or the
+    // write barrier would never record them again.
+    size_t i;
+    for(i = 0; i < vm->nursery.remembered_count; ++i) {
+        vm->nursery.remembered[i]->hdr.u8 &= ~GC_REMEMBERED;
+    }
+
+    // Everything live in the nursery is coming with us, so make sure
+    // there's room for it
+    size_t live = (vm->heap.next - vm->heap.heap) +
+                  (vm->nursery.next - vm->nursery.heap);
+    size_t need = live;
+#ifdef HAS_PTHREAD
+    // Threads leave the ends of their blocks empty
+    int threads = par_begin(vm, live);
+    if (threads > 0) {
+        need += live / 16 + threads * PAR_GC_BLOCK;
+    }
+#endif
+    if (vm->heap.size < need) {
+        vm->heap.size = need;
+    }
+
+    /* Swap semispaces. */
+    flip_heap(&vm->heap);
+    size_t room = vm->heap.end - vm->heap.next;
+    vm->heap.spare = room > need ? room - need : 0;
+    vm->nursery.collecting = 1;
+
+#ifdef HAS_PTHREAD
+    if (threads > 0) {
+        par_gc(vm, threads);
+    } else
+#endif
+    {
+        copy_roots(vm, copy);
+        cheney(vm);
+    }
+
+    // Everything is in the heap now
+    vm->nursery.next = vm->nursery.heap;
+    vm->nursery.remembered_count = 0;
+    vm->nursery.collecting = 0;
+
+    sweep_large(&vm->large);
+
+    // Size the next heap by how much of this one survived
+    live = vm->heap.next - vm->heap.heap;
+    check_max_heap(vm, live);
+    resize_heap(&vm->heap, live, vm->large.size);
+
+    // finally, sweep what lives outside the heap
+    sweep_outside(vm);
+
+    if (vm->inc.pause > 0) {
+        vm->inc.end = vm->heap.end;
+        inc_pace(vm, 0);
+    }
 
     STATS_LEAVE_GC(vm->stats, vm->heap.size, vm->heap.next - vm->heap.heap)
+    idris_profAfterGC(vm, 1);
     HEAP_CHECK(vm)
 }
 
@@ -148,9 +1540,13 @@ void idris_gcInfo(VM* vm, int doGC) {
     printf("Final heap use          %zd\n", vm->heap.next - vm->heap.heap);
     if (doGC) { idris_gc(vm); }
     printf("Final heap use after GC %zd\n", vm->heap.next - vm->heap.heap);
+    printf("Nursery size            %zd\n", vm->nursery.size);
 #ifdef IDRIS_ENABLE_STATS
     printf("Total allocations       %" PRIu64 "\n", vm->stats.allocations);
 #endif
     printf("Number of collections   %" PRIu32 "\n", vm->stats.collections);
+#ifdef IDRIS_ENABLE_STATS
+    printf("Minor collections       %" PRIu32 "\n", vm->stats.minor_collections);
+#endif
 
 }
@@ -4,6 +4,28 @@
 #include "idris_rts.h"
 
 void idris_gc(VM* vm);
+// Collect, then make sure there's room for the given number of bytes in the
+// heap, growing it if necessary
+void idris_gc_for(VM* vm, size_t size);
+// Stop with an error if the heap and large objects together would need more
+// than the maximum heap size to hold the given number of bytes in the heap
+void check_max_heap(VM* vm, size_t needed);
+// Collect the nursery only (falls back to idris_gc if the heap is full)
+void idris_minor_gc(VM* vm);
 void idris_gcInfo(VM* vm, int doGC);
+// Share full collections of big heaps between this many threads (1, the
+// default, collects on the collecting thread alone)
+void idris_gc_threads(int threads);
+// Collect incrementally, in steps of about the given number of milliseconds
+// between allocations, instead of all at once (0 goes back to collecting
+// all at once). The nursery must be disabled.
+void idris_gc_incremental(VM* vm, double pause);
+// Collect by sliding live objects down in place, rather than copying them
+// into another semispace, so that the heap only needs to exist once. The
+// nursery must be disabled, and collections mustn't be incremental.
+void idris_gc_compacting(VM* vm, int compact);
+// Do the next step of an incremental collection, starting one if none is
+// under way, or finishing it if there's nothing left to do
+void idris_inc_step(VM* vm);
 
 #endif
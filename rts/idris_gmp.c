@@ -1,41 +1,84 @@
 #include "idris_rts.h"
+#include "idris_num.h"
 #ifdef IDRIS_GMP
 #include <gmp.h>
 #else
 #include "mini-gmp.h"
 #endif
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-// TMP HACK! Require this much space in the heap before a GMP operation
-// so it doesn't garbage collect in the middle.
-// This is highly dodgy and needs to be done better because who knows if
-// GMP will need to allocate more than 64k... better to work out how
-// much space is needed (or find another way of preventing copying)
-#define IDRIS_MAXGMP 65536
-
 void init_gmpalloc(void) {
     mp_set_memory_functions(idris_alloc, idris_realloc, idris_free);
 }
 
-VAL MKBIGI(int val) {
-    return MKINT((i_int)val);
+// GMP allocates through idris_alloc, so a collection in the middle of an
+// operation would move its operands and its result from under it. Each
+// operation reserves enough room for everything it can allocate before it
+// starts, worked out from the size of its result:
+//
+// * the BigInt itself, and its limbs in a RawData block,
+// * the same again for GMP reallocating the result, or for temporaries,
+// * two boxed Int operands.
+#define BIG_ALLOC(limbs) (aligned(sizeof(BigInt) + sizeof(mpz_t)) + \
+                          aligned(sizeof(RawData) + (limbs) * sizeof(mp_limb_t)))
+#define INT_LIMBS ((sizeof(i_int) + sizeof(mp_limb_t) - 1) / sizeof(mp_limb_t))
+
+static size_t limbs(VAL x) {
+    return ISINT(x) ? INT_LIMBS : mpz_size(GETMPZ(x));
+}
+
+static size_t maxLimbs(VAL x, VAL y) {
+    size_t lx = limbs(x);
+    size_t ly = limbs(y);
+    return lx > ly ? lx : ly;
+}
+
+// Reserve room for an operation whose result has at most the given number
+// of limbs, updating its operands (either of which may be NULL) if they move.
+// The operands are kept on the stack while reserving, so that they're
+// roots of any collection it does.
+static void reserveBig(VM * vm, size_t limbs, VAL * x, VAL * y) {
+    RESERVENOALLOC(2);
+    TOP(0) = x != NULL ? *x : NULL;
+    TOP(1) = y != NULL ? *y : NULL;
+    ADDTOP(2);
+    idris_requireAlloc(vm, 2 * BIG_ALLOC(limbs) + 2 * BIG_ALLOC(INT_LIMBS));
+    if (x != NULL) {
+        *x = TOP(-2);
+    }
+    if (y != NULL) {
+        *y = TOP(-1);
+    }
+    ADDTOP(-2);
 }
 
+// Callers must have reserved room, or be collecting.
 static BigInt * allocBig(VM * vm) {
-    idris_requireAlloc(vm, IDRIS_MAXGMP);
     BigInt * cl = iallocate(vm, sizeof(*cl) + sizeof(mpz_t), 0);
-    idris_doneAlloc(vm);
     SETTY(cl, CT_BIGINT);
     mpz_init(*getmpz(cl));
     return cl;
 }
 
+VAL MKBIGI(int val) {
+    return MKINT((i_int)val);
+}
+
 VAL MKBIGC(VM* vm, char* val) {
     if (*val == '\0') {
         return MKBIGI(0);
     }
     else {
+        // Each digit takes less than 4 bits. GMP also makes a copy of the
+        // digits while converting them.
+        size_t len = strlen(val);
+        reserveBig(vm, len / (2 * sizeof(mp_limb_t)) + 1 +
+                       len / sizeof(mp_limb_t) + 1, NULL, NULL);
         BigInt * cl = allocBig(vm);
         mpz_set_str(*getmpz(cl), val, 10);
         return (VAL)cl;
@@ -43,24 +86,56 @@ VAL MKBIGC(VM* vm, char* val) {
 }
 
 VAL MKBIGM(VM* vm, void* ibig) {
+    reserveBig(vm, mpz_size(*((mpz_t*)ibig)), NULL, NULL);
     BigInt * cl = allocBig(vm);
     mpz_set(*getmpz(cl), *((mpz_t*)ibig));
     return (VAL)cl;
 }
 
+// Used by the collector to copy a BigInt, so it doesn't reserve.
 VAL MKBIGMc(VM* vm, void* ibig) {
     BigInt * cl = allocBig(vm);
     mpz_init_set(*getmpz(cl), *((mpz_t*)ibig));
     return (VAL)cl;
 }
 
+size_t idris_bigCopySize(VAL x) {
+    size_t n = mpz_size(GETMPZ(x));
+    return BIG_ALLOC(n > 0 ? n : 1);
+}
+
+// The limbs go in a RawData block straight after the copy, as if GMP had
+// allocated them through idris_alloc.
+VAL idris_bigCopyInto(VAL x, void* room) {
+    mpz_t * src = getmpz((BigInt*)x);
+    size_t n = mpz_size(*src);
+    size_t alloc = n > 0 ? n : 1;
+
+    BigInt * cl = room;
+    size_t sz = sizeof(*cl) + sizeof(mpz_t);
+    cl->hdr = (Hdr){ .ty = CT_BIGINT, .sz = sz };
+
+    RawData * limbs = (RawData*)((char*)room + aligned(sz));
+    limbs->hdr = (Hdr){ .ty = CT_RAWDATA,
+                        .sz = sizeof(*limbs) + alloc * sizeof(mp_limb_t) };
+    memcpy(limbs->raw, (*src)->_mp_d, n * sizeof(mp_limb_t));
+
+    mpz_t * dst = getmpz(cl);
+    (*dst)->_mp_alloc = alloc;
+    (*dst)->_mp_size = (*src)->_mp_size;
+    (*dst)->_mp_d = (mp_limb_t*)limbs->raw;
+    return (VAL)cl;
+}
+
 VAL MKBIGUI(VM* vm, unsigned long val) {
+    reserveBig(vm, INT_LIMBS, NULL, NULL);
     BigInt * cl = allocBig(vm);
     mpz_init_set_ui(*getmpz(cl), val);
     return (VAL)cl;
 }
 
 VAL MKBIGSI(VM* vm, signed long val) {
+    reserveBig(vm, INT_LIMBS, NULL, NULL);
     BigInt * cl = allocBig(vm);
     mpz_init_set_si(*getmpz(cl), val);
     return (VAL)cl;
@@ -83,72 +158,99 @@ static BigInt * getbig(VM * vm, VAL x) {
 
 #define GETBIG (VAL)getbig
 
+// Tagged integers hold one bit less than an i_int, so the range of Int is
+// [INT_MINVAL, INT_MAXVAL] rather than that of i_int.
+#define INT_MAXVAL (INTPTR_MAX >> 1)
+#define INT_MINVAL (INTPTR_MIN >> 1)
+
+// Results which fit in an Int go back to being unboxed, so that arithmetic
+// on them can take the fast paths again.
+static VAL smallBig(BigInt * cl) {
+    if (mpz_fits_slong_p(*getmpz(cl))) {
+        long v = mpz_get_si(*getmpz(cl));
+        if (v >= INT_MINVAL && v <= INT_MAXVAL) {
+            return MKINT((i_int)v);
+        }
+    }
+    return (VAL)cl;
+}
+
 VAL bigAdd(VM* vm, VAL x, VAL y) {
+    reserveBig(vm, maxLimbs(x, y) + 1, &x, &y);
     BigInt * cl = allocBig(vm);
     mpz_add(*getmpz(cl), *getmpz(getbig(vm,x)), *getmpz(getbig(vm,y)));
-    return (VAL)cl;
+    return smallBig(cl);
 }
 
 VAL bigSub(VM* vm, VAL x, VAL y) {
+    reserveBig(vm, maxLimbs(x, y) + 1, &x, &y);
     BigInt * cl = allocBig(vm);
     mpz_sub(*getmpz(cl), *getmpz(getbig(vm,x)), *getmpz(getbig(vm,y)));
-    return (VAL)cl;
+    return smallBig(cl);
 }
 
 VAL bigMul(VM* vm, VAL x, VAL y) {
+    reserveBig(vm, limbs(x) + limbs(y), &x, &y);
     BigInt * cl = allocBig(vm);
     mpz_mul(*getmpz(cl), *getmpz(getbig(vm,x)), *getmpz(getbig(vm,y)));
-    return (VAL)cl;
+    return smallBig(cl);
 }
 
 VAL bigDiv(VM* vm, VAL x, VAL y) {
+    reserveBig(vm, limbs(x) + 1, &x, &y);
     BigInt * cl = allocBig(vm);
     mpz_tdiv_q(*getmpz(cl), *getmpz(getbig(vm,x)), *getmpz(getbig(vm,y)));
-    return (VAL)cl;
+    return smallBig(cl);
 }
 
 VAL bigMod(VM* vm, VAL x, VAL y) {
+    reserveBig(vm, limbs(x) + 1, &x, &y);
     BigInt * cl = allocBig(vm);
     mpz_tdiv_r(*getmpz(cl), *getmpz(getbig(vm,x)), *getmpz(getbig(vm,y)));
-    return (VAL)cl;
+    return smallBig(cl);
 }
 
 VAL bigAnd(VM* vm, VAL x, VAL y) {
+    reserveBig(vm, maxLimbs(x, y) + 1, &x, &y);
     BigInt * cl = allocBig(vm);
     mpz_and(*getmpz(cl), *getmpz(getbig(vm,x)), *getmpz(getbig(vm,y)));
     return (VAL)cl;
 }
 
 VAL bigOr(VM* vm, VAL x, VAL y) {
+    reserveBig(vm, maxLimbs(x, y) + 1, &x, &y);
     BigInt * cl = allocBig(vm);
     mpz_ior(*getmpz(cl), *getmpz(getbig(vm,x)), *getmpz(getbig(vm,y)));
     return (VAL)cl;
 }
 
 VAL bigShiftLeft(VM* vm, VAL x, VAL y) {
+    reserveBig(vm, limbs(x) + GETINT(y) / (8 * sizeof(mp_limb_t)) + 1, &x, NULL);
     BigInt * cl = allocBig(vm);
     mpz_mul_2exp(*getmpz(cl), *getmpz(getbig(vm,x)), GETINT(y));
-    return (VAL)cl;
+    return smallBig(cl);
 }
 
 
 VAL bigLShiftRight(VM* vm, VAL x, VAL y) {
+    reserveBig(vm, limbs(x) + 1, &x, NULL);
     BigInt * cl = allocBig(vm);
     mpz_fdiv_q_2exp(*getmpz(cl), *getmpz(getbig(vm,x)), GETINT(y));
-    return (VAL)cl;
+    return smallBig(cl);
 }
 
 VAL bigAShiftRight(VM* vm, VAL x, VAL y) {
+    reserveBig(vm, limbs(x) + 1, &x, NULL);
     BigInt * cl = allocBig(vm);
     mpz_fdiv_q_2exp(*getmpz(cl), *getmpz(getbig(vm,x)), GETINT(y));
-    return (VAL)cl;
+    return smallBig(cl);
 }
 
 VAL idris_bigAnd(VM* vm, VAL x, VAL y) {
     if (ISINT(x) && ISINT(y)) {
         return INTOP(&, x, y);
     } else {
-        return bigAnd(vm, GETBIG(vm, x), GETBIG(vm, y));
+        return bigAnd(vm, x, y);
     }
 }
 
@@ -156,104 +258,107 @@ VAL idris_bigOr(VM* vm, VAL x, VAL y) {
     if (ISINT(x) && ISINT(y)) {
         return INTOP(|, x, y);
     } else {
-        return bigOr(vm, GETBIG(vm, x), GETBIG(vm, y));
+        return bigOr(vm, x, y);
     }
 }
 
+// The fast paths work on the tagged representations directly: for tagged
+// x = 2a+1 and y = 2b+1, x + (y-1) is the tagged a+b, x - (y-1) is the
+// tagged a-b, and (x-1) * b + 1 is the tagged a*b. Each of these overflows
+// an i_int exactly when the result doesn't fit in an Int.
+
 VAL idris_bigPlus(VM* vm, VAL x, VAL y) {
-    if (ISINT(x) && ISINT(y)) {
-        i_int vx = GETINT(x);
-        i_int vy = GETINT(y);
-        if ((vx <= 0 && vy >=0) || (vx >=0 && vy <=0)) {
-            return ADD(x, y);
-        }
-        i_int res = vx + vy;
-        if (res >= 1<<30 || res <= -(1 << 30)) {
-            return bigAdd(vm, GETBIG(vm, x), GETBIG(vm, y));
-        } else {
-            return MKINT(res);
-        }
+    i_int res;
+    if (ISINT(x) && ISINT(y) &&
+        !__builtin_add_overflow((i_int)x, (i_int)y - 1, &res)) {
+        return (VAL)res;
     } else {
-        return bigAdd(vm, GETBIG(vm, x), GETBIG(vm, y));
+        return bigAdd(vm, x, y);
     }
 }
 
 VAL idris_bigMinus(VM* vm, VAL x, VAL y) {
-    if (ISINT(x) && ISINT(y)) {
-        i_int vx = GETINT(x);
-        i_int vy = GETINT(y);
-        if ((vx <= 0 && vy <=0) || (vx >=0 && vy <=0)) {
-            return INTOP(-, x, y);
-        }
-        i_int res = vx - vy;
-        if (res >= 1<<30 || res <= -(1 << 30)) {
-            return bigSub(vm, GETBIG(vm, x), GETBIG(vm, y));
-        } else {
-            return MKINT(res);
-        }
+    i_int res;
+    if (ISINT(x) && ISINT(y) &&
+        !__builtin_sub_overflow((i_int)x, (i_int)y - 1, &res)) {
+        return (VAL)res;
     } else {
-        return bigSub(vm, GETBIG(vm, x), GETBIG(vm, y));
+        return bigSub(vm, x, y);
     }
 }
 
 VAL idris_bigTimes(VM* vm, VAL x, VAL y) {
+    i_int res;
+    if (ISINT(x) && ISINT(y) &&
+        !__builtin_mul_overflow((i_int)x - 1, GETINT(y), &res)) {
+        return (VAL)(res + 1);
+    } else {
+        return bigMul(vm, x, y);
+    }
+}
+
+VAL idris_bigShiftLeft(VM* vm, VAL x, VAL y) {
     if (ISINT(x) && ISINT(y)) {
         i_int vx = GETINT(x);
         i_int vy = GETINT(y);
-        // we could work out likelihood of overflow by checking the number
-        // of necessary bits. Here's a quick conservative hack instead.
-        if ((vx < (1<<15) && vy < (1<<16)) ||
-            (vx < (1<<16) && vy < (1<<15)) ||
-            (vx < (1<<20) && vy < (1<<11)) ||
-            (vx < (1<<11) && vy < (1<<20)) ||
-            (vx < (1<<23) && vy < (1<<8)) ||
-            (vx < (1<<8) && vy < (1<<23))) { // ultra-conservative!
-            return INTOP(*,x,y);
-        } else {
-            return bigMul(vm, GETBIG(vm, x), GETBIG(vm, y));
+        // Exact if shifting back gets x again, and the result is an Int
+        if (vx == 0) {
+            return x;
+        }
+        if (vy >= 0 && vy < (i_int)(sizeof(i_int) * 8 - 1)) {
+            i_int res = (i_int)((uintptr_t)vx << vy);
+            if ((res >> vy) == vx && res >= INT_MINVAL && res <= INT_MAXVAL) {
+                return MKINT(res);
+            }
         }
-    } else {
-        return bigMul(vm, GETBIG(vm, x), GETBIG(vm, y));
     }
+    return bigShiftLeft(vm, x, y);
 }
 
-VAL idris_bigShiftLeft(VM* vm, VAL x, VAL y) {
-    if (ISINT(x) && ISINT(y)) {
-        return INTOP(<<, x, y);
-    } else {
-        return bigShiftLeft(vm, GETBIG(vm, x), y);
+// Both right shifts round towards minus infinity, like mpz_fdiv_q_2exp.
+static VAL intShiftRight(VAL x, VAL y) {
+    i_int vx = GETINT(x);
+    i_int vy = GETINT(y);
+    if (vy >= (i_int)(sizeof(i_int) * 8 - 1)) {
+        return MKINT((i_int)(vx < 0 ? -1 : 0));
     }
+    return MKINT((i_int)(vx >> vy));
 }
 
 VAL idris_bigAShiftRight(VM* vm, VAL x, VAL y) {
-    if (ISINT(x) && ISINT(y)) {
-        return INTOP(>>, x, y);
+    if (ISINT(x) && ISINT(y) && GETINT(y) >= 0) {
+        return intShiftRight(x, y);
     } else {
-        return bigAShiftRight(vm, GETBIG(vm, x), y);
+        return bigAShiftRight(vm, x, y);
     }
 }
 
 VAL idris_bigLShiftRight(VM* vm, VAL x, VAL y) {
-    if (ISINT(x) && ISINT(y)) {
-        return INTOP(>>, x, y);
+    if (ISINT(x) && ISINT(y) && GETINT(y) >= 0) {
+        return intShiftRight(x, y);
     } else {
-        return bigLShiftRight(vm, GETBIG(vm, x), y);
+        return bigLShiftRight(vm, x, y);
     }
 }
 
 VAL idris_bigDivide(VM* vm, VAL x, VAL y) {
-    if (ISINT(x) && ISINT(y)) {
+    // The only quotient of Ints which isn't an Int is INT_MINVAL / -1
+    if (ISINT(x) && ISINT(y) && (GETINT(y) != -1 || GETINT(x) != INT_MINVAL)) {
         return INTOP(/, x, y);
     } else {
-        return bigDiv(vm, GETBIG(vm, x), GETBIG(vm, y));
+        return bigDiv(vm, x, y);
     }
 }
 
 VAL idris_bigMod(VM* vm, VAL x, VAL y) {
     if (ISINT(x) && ISINT(y)) {
         return INTOP(%, x, y);
+    } else if (ISINT(y) && GETINT(y) > 0 && (uintptr_t)GETINT(y) <= ULONG_MAX) {
+        // The remainder has the sign of x, and is smaller than y
+        unsigned long r = mpz_tdiv_ui(GETMPZ(x), GETINT(y));
+        return MKINT((i_int)(mpz_sgn(GETMPZ(x)) < 0 ? -(i_int)r : (i_int)r));
     } else {
-        return bigMod(vm, GETBIG(vm, x), GETBIG(vm, y));
+        return bigMod(vm, x, y);
     }
 }
 
@@ -285,44 +390,39 @@ VAL bigGe(VM* vm, VAL x, VAL y) {
     return MKINT((i_int)(mpz_cmp(GETMPZ(x), GETMPZ(y)) >= 0));
 }
 
-VAL idris_bigEq(VM* vm, VAL x, VAL y) {
+// Compare x and y, returning a negative, zero or positive number like
+// mpz_cmp. Only boxes an Int which is too wide for a long.
+static int bigCompare(VM* vm, VAL x, VAL y) {
     if (ISINT(x) && ISINT(y)) {
-        return MKINT((i_int)(GETINT(x) == GETINT(y)));
+        return (GETINT(x) > GETINT(y)) - (GETINT(x) < GETINT(y));
+    } else if (ISINT(x) && GETINT(x) >= LONG_MIN && GETINT(x) <= LONG_MAX) {
+        return -mpz_cmp_si(GETMPZ(y), GETINT(x));
+    } else if (ISINT(y) && GETINT(y) >= LONG_MIN && GETINT(y) <= LONG_MAX) {
+        return mpz_cmp_si(GETMPZ(x), GETINT(y));
     } else {
-        return bigEq(vm, GETBIG(vm, x), GETBIG(vm, y));
+        reserveBig(vm, INT_LIMBS, &x, &y);
+        return mpz_cmp(GETMPZ(GETBIG(vm, x)), GETMPZ(GETBIG(vm, y)));
     }
 }
 
+VAL idris_bigEq(VM* vm, VAL x, VAL y) {
+    return MKINT((i_int)(bigCompare(vm, x, y) == 0));
+}
+
 VAL idris_bigLt(VM* vm, VAL x, VAL y) {
-    if (ISINT(x) && ISINT(y)) {
-        return MKINT((i_int)(GETINT(x) < GETINT(y)));
-    } else {
-        return bigLt(vm, GETBIG(vm, x), GETBIG(vm, y));
-    }
+    return MKINT((i_int)(bigCompare(vm, x, y) < 0));
 }
 
 VAL idris_bigLe(VM* vm, VAL x, VAL y) {
-    if (ISINT(x) && ISINT(y)) {
-        return MKINT((i_int)(GETINT(x) <= GETINT(y)));
-    } else {
-        return bigLe(vm, GETBIG(vm, x), GETBIG(vm, y));
-    }
+    return MKINT((i_int)(bigCompare(vm, x, y) <= 0));
 }
 
 VAL idris_bigGt(VM* vm, VAL x, VAL y) {
-    if (ISINT(x) && ISINT(y)) {
-        return MKINT((i_int)(GETINT(x) > GETINT(y)));
-    } else {
-        return bigGt(vm, GETBIG(vm, x), GETBIG(vm, y));
-    }
+    return MKINT((i_int)(bigCompare(vm, x, y) > 0));
 }
 
 VAL idris_bigGe(VM* vm, VAL x, VAL y) {
-    if (ISINT(x) && ISINT(y)) {
-        return MKINT((i_int)(GETINT(x) >= GETINT(y)));
-    } else {
-        return bigGe(vm, GETBIG(vm, x), GETBIG(vm, y));
-    }
+    return MKINT((i_int)(bigCompare(vm, x, y) >= 0));
 }
 
 
@@ -348,18 +448,45 @@ VAL idris_castBigFloat(VM* vm, VAL i) {
 
 VAL idris_castFloatBig(VM* vm, VAL f) {
     double val = GETFLOAT(f);
+    int exp = 0;
+    frexp(val, &exp);
+    reserveBig(vm, (exp > 0 ? exp / (8 * sizeof(mp_limb_t)) : 0) + 1, NULL, NULL);
     BigInt * cl = allocBig(vm);
     mpz_init_set_d(*getmpz(cl), val);
     return (VAL)cl;
 }
 
 VAL idris_castStrBig(VM* vm, VAL i) {
-    return MKBIGC(vm, GETSTR(i));
+    const char* str = GETSTR(i);
+    // Up to 18 digits can't overflow an int64_t, so they're read directly,
+    // and GMP only sees strings which might need a bignum.
+    if (GETSTRLEN(i) <= 18 && (*str == '-' || (*str >= '0' && *str <= '9'))) {
+        const char* end;
+        int64_t v = idris_parse_i64(str, &end);
+        if (*end == '\0' && v >= INT_MINVAL && v <= INT_MAXVAL) {
+            return MKINT((i_int)v);
+        }
+    }
+    return MKBIGC(vm, (char*)str);
 }
 
 VAL idris_castBigStr(VM* vm, VAL i) {
-    char* str = mpz_get_str(NULL, 10, *getmpz(getbig(vm, i)));
-    return MKSTR(vm, str);
+    if (ISINT(i)) {
+        char buf[IDRIS_INT_DIGITS];
+        return MKSTRlen(vm, buf, idris_fmt_i64(buf, GETINT(i)));
+    }
+    // GMP needs room for a copy of the number while converting it. The
+    // digits go outside the heap, so that building the String can collect.
+    reserveBig(vm, limbs(i), &i, NULL);
+    char* str = malloc(mpz_sizeinbase(GETMPZ(i), 10) + 2);
+    if (str == NULL) {
+        fprintf(stderr, "Out of memory converting an Integer to a String\n");
+        exit(EXIT_FAILURE);
+    }
+    mpz_get_str(str, 10, GETMPZ(i));
+    VAL res = MKSTR(vm, str);
+    free(str);
+    return res;
 }
 
 // Get 64 bits out of a big int with special handling
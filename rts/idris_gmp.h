@@ -16,6 +16,11 @@ VAL MKBIGI(int val);
 VAL MKBIGC(VM* vm, char* bigint);
 VAL MKBIGM(VM* vm, void* bigint);
 VAL MKBIGMc(VM* vm, void* bigint);
+// Copy a BigInt without allocating through GMP, for the parallel collector.
+// The room must be idris_bigCopySize(x) bytes, and holds the copy followed
+// by its limbs.
+size_t idris_bigCopySize(VAL x);
+VAL idris_bigCopyInto(VAL x, void* room);
 VAL MKBIGUI(VM* vm, unsigned long val);
 VAL MKBIGSI(VM* vm, signed long val);
 
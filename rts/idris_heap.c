@@ -1,3 +1,8 @@
+#ifndef _WIN32
+// For anonymous mappings
+#define _DEFAULT_SOURCE
+#endif
+
 #include "idris_heap.h"
 #include "idris_rts.h"
 #include "idris_gc.h"
@@ -7,23 +12,126 @@
 #include <stdio.h>
 #include <assert.h>
 
-static void c_heap_free_item(CHeap * heap, CHeapItem * item)
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static void c_heap_finalize(CHeapItem * item)
 {
-    assert(item->size <= heap->size);
-    heap->size -= item->size;
+    item->finalizer(item->data);
+    free(item);
+}
 
-    // fix links
-    if (item->next != NULL)
-    {
-        item->next->prev_next = item->prev_next;
+#ifdef HAS_PTHREAD
+/* Finalizers for swept items are run by a background thread, started when
+ * the first one is needed, so that collections don't wait for them.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  waiting; // Signalled when items are queued
+    pthread_cond_t  done;    // Signalled when the thread has run a batch
+    CHeapItem * queue;       // Items waiting to be finalized
+    int started;
+    int running;             // Set while the thread runs a batch
+    int registered;
+} finalizers = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                 PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0 };
+
+static void * finalizer_thread(void * arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&finalizers.lock);
+    for (;;) {
+        while (finalizers.queue == NULL) {
+            pthread_cond_wait(&finalizers.waiting, &finalizers.lock);
+        }
+        CHeapItem * item = finalizers.queue;
+        finalizers.queue = NULL;
+        finalizers.running = 1;
+        pthread_mutex_unlock(&finalizers.lock);
+
+        while (item != NULL) {
+            CHeapItem * next = item->next;
+            c_heap_finalize(item);
+            item = next;
+        }
+
+        pthread_mutex_lock(&finalizers.lock);
+        finalizers.running = 0;
+        pthread_cond_broadcast(&finalizers.done);
     }
-    *(item->prev_next) = item->next;
+    return NULL;
+}
 
-    // free payload
-    item->finalizer(item->data);
+// The thread doesn't exist in a forked child, and neither can the lock be
+// trusted. Anything queued in the parent is left to the parent.
+static void finalizers_after_fork(void)
+{
+    pthread_mutex_init(&finalizers.lock, NULL);
+    pthread_cond_init(&finalizers.waiting, NULL);
+    pthread_cond_init(&finalizers.done, NULL);
+    finalizers.queue = NULL;
+    finalizers.started = 0;
+    finalizers.running = 0;
+}
+#endif
 
-    // free item struct
-    free(item);
+// Finalize a chain of items, in the background if possible
+static void c_heap_queue(CHeapItem * first, CHeapItem * last)
+{
+#ifdef HAS_PTHREAD
+    pthread_mutex_lock(&finalizers.lock);
+    if (!finalizers.started) {
+        pthread_t thread;
+        if (!finalizers.registered) {
+            pthread_atfork(NULL, NULL, finalizers_after_fork);
+            finalizers.registered = 1;
+        }
+        if (pthread_create(&thread, NULL, finalizer_thread, NULL) == 0) {
+            pthread_detach(thread);
+            finalizers.started = 1;
+        }
+    }
+    if (finalizers.started) {
+        last->next = finalizers.queue;
+        finalizers.queue = first;
+        pthread_cond_signal(&finalizers.waiting);
+        pthread_mutex_unlock(&finalizers.lock);
+        return;
+    }
+    pthread_mutex_unlock(&finalizers.lock);
+#endif
+    (void)last;
+    while (first != NULL) {
+        CHeapItem * next = first->next;
+        c_heap_finalize(first);
+        first = next;
+    }
+}
+
+// Run whatever is waiting to be finalized, and wait for the background
+// thread to finish what it's running
+static void c_heap_drain(void)
+{
+#ifdef HAS_PTHREAD
+    pthread_mutex_lock(&finalizers.lock);
+    CHeapItem * item = finalizers.queue;
+    finalizers.queue = NULL;
+    pthread_mutex_unlock(&finalizers.lock);
+
+    while (item != NULL) {
+        CHeapItem * next = item->next;
+        c_heap_finalize(item);
+        item = next;
+    }
+
+    pthread_mutex_lock(&finalizers.lock);
+    while (finalizers.running) {
+        pthread_cond_wait(&finalizers.done, &finalizers.lock);
+    }
+    pthread_mutex_unlock(&finalizers.lock);
+#endif
 }
 
 CHeapItem * c_heap_create_item(void * data, size_t size, CDataFinalizer * finalizer)
@@ -33,67 +141,118 @@ CHeapItem * c_heap_create_item(void * data, size_t size, CDataFinalizer * finali
     item->data = data;
     item->size = size;
     item->finalizer = finalizer;
-    item->is_used = false;
+    item->slab = NULL;
+    item->slot = 0;
     item->next = NULL;
-    item->prev_next = NULL;
 
     return item;
 }
 
 void c_heap_insert_if_needed(VM * vm, CHeap * heap, CHeapItem * item)
 {
-    if (item->prev_next != NULL) return;  // already inserted
+    if (item->slab != NULL) return;  // already inserted
 
-    if (heap->first != NULL)
+    c_heap_link_item(heap, item);
+    if (heap->size >= heap->gc_trigger_size)
     {
-        heap->first->prev_next = &item->next;
+        c_heap_mark_item(item);  // don't collect what we're inserting
+        idris_gc(vm);
     }
+}
 
-    item->prev_next = &heap->first;
-    item->next = heap->first;
+void c_heap_link_item(CHeap * heap, CHeapItem * item)
+{
+    if (item->slab != NULL) return;  // already inserted
 
-    heap->first = item;
+    // Find a slab with a free slot, starting from the last one which had
+    // one, or make a new one
+    CHeapSlab * slab = heap->free;
+    while (slab != NULL && slab->used == ~(uint64_t)0) {
+        slab = slab->next;
+    }
+    if (slab == NULL) {
+        slab = (CHeapSlab *) malloc(sizeof(CHeapSlab));
+        if (slab == NULL) {
+            fprintf(stderr, "RTS ERROR: Unable to grow the C heap.\n");
+            exit(EXIT_FAILURE);
+        }
+        slab->used = 0;
+        slab->marked = 0;
+        slab->next = heap->first;
+        heap->first = slab;
+    }
+    heap->free = slab;
 
-    // at this point, links are done; let's calculate sizes
+    unsigned slot = __builtin_ctzll(~slab->used);
+    slab->used |= (uint64_t)1 << slot;
+    slab->items[slot] = item;
+    item->slab = slab;
+    item->slot = slot;
 
     heap->size += item->size;
-    if (heap->size >= heap->gc_trigger_size)
-    {
-        item->is_used = true;  // don't collect what we're inserting
-        idris_gc(vm);
-    }
 }
 
 void c_heap_mark_item(CHeapItem * item)
 {
-    item->is_used = true;
+    // Several threads may be marking items in the same slab
+    if (item->slab != NULL) {
+        __atomic_fetch_or(&item->slab->marked, (uint64_t)1 << item->slot,
+                          __ATOMIC_RELAXED);
+    }
 }
 
 void c_heap_sweep(CHeap * heap)
 {
-    CHeapItem * p = heap->first;
-    while (p != NULL)
+    CHeapItem * first = NULL;
+    CHeapItem * last = NULL;
+    CHeapSlab ** link = &heap->first;
+
+    heap->free = NULL;
+    while (*link != NULL)
     {
-        if (p->is_used)
+        CHeapSlab * slab = *link;
+        uint64_t unused = slab->used & ~slab->marked;
+        while (unused != 0)
         {
-            p->is_used = false;
-            p = p->next;
+            unsigned slot = __builtin_ctzll(unused);
+            unused &= unused - 1;
+
+            CHeapItem * item = slab->items[slot];
+            assert(item->size <= heap->size);
+            heap->size -= item->size;
+            item->slab = NULL;
+            item->next = first;
+            first = item;
+            if (last == NULL) {
+                last = item;
+            }
         }
-        else
-        {
-            CHeapItem * unused_item = p;
-            p = p->next;
+        slab->used &= slab->marked;
+        slab->marked = 0;
 
-            c_heap_free_item(heap, unused_item);
+        if (slab->used == 0)
+        {
+            *link = slab->next;
+            free(slab);
+            continue;
         }
+        if (heap->free == NULL && slab->used != ~(uint64_t)0)
+        {
+            heap->free = slab;
+        }
+        link = &slab->next;
     }
 
+    if (first != NULL) {
+        c_heap_queue(first, last);
+    }
     heap->gc_trigger_size = C_HEAP_GC_TRIGGER_SIZE(heap->size);
 }
 
 void c_heap_init(CHeap * heap)
 {
     heap->first = NULL;
+    heap->free = NULL;
     heap->size = 0;
     heap->gc_trigger_size = C_HEAP_GC_TRIGGER_SIZE(heap->size);
 }
@@ -102,41 +261,527 @@ void c_heap_destroy(CHeap * heap)
 {
     while (heap->first != NULL)
     {
-        c_heap_free_item(heap, heap->first);  // will update heap->first via the backward link
+        CHeapSlab * slab = heap->first;
+        uint64_t used = slab->used;
+        while (used != 0)
+        {
+            unsigned slot = __builtin_ctzll(used);
+            used &= used - 1;
+            c_heap_finalize(slab->items[slot]);
+        }
+        heap->first = slab->next;
+        free(slab);
     }
+    heap->free = NULL;
+    heap->size = 0;
+    c_heap_drain();
 }
 
-/* Used for initializing the FP heap. */
-void alloc_heap(Heap * h, size_t heap_size, size_t growth, char * old)
+/* Semispaces are mapped directly, so the OS only supplies (zeroed) pages
+ * as the heap fills up, and nothing else has to clear them.
+ */
+static char * map_space(size_t size, int huge_pages)
 {
-    char * mem = malloc(heap_size);
-
+#ifdef _WIN32
+    char * mem = malloc(size);
+#else
+    char * mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        mem = NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (mem != NULL && huge_pages) {
+        madvise(mem, size, MADV_HUGEPAGE);
+    }
+#endif
+#endif
     if (mem == NULL) {
         fprintf(stderr,
                 "RTS ERROR: Unable to allocate heap. Requested %zd bytes.\n",
-                heap_size);
+                size);
         exit(EXIT_FAILURE);
     }
-    memset(mem, 0, heap_size);
+    return mem;
+}
+
+static void unmap_space(char * space, size_t size)
+{
+#ifdef _WIN32
+    free(space);
+#else
+    munmap(space, size);
+#endif
+}
+
+static size_t page_size(void)
+{
+#ifdef _WIN32
+    return 4096;
+#else
+    static size_t size = 0;
+    if (size == 0) {
+        size = sysconf(_SC_PAGESIZE);
+    }
+    return size;
+#endif
+}
+
+// Bytes which the first slots of a stack take up, in whole pages
+static size_t stack_bytes(size_t slots)
+{
+    size_t page = page_size();
+    return (slots * sizeof(VAL) + page - 1) / page * page;
+}
+
+void alloc_stack(VM * vm, size_t size)
+{
+    size_t usable = size;
+#ifdef _WIN32
+    // Zeroed, as fresh pages are elsewhere: frames rely on unused slots
+    // being NULL
+    VAL * stack = calloc(size, sizeof(VAL));
+#else
+    VAL * stack = mmap(NULL, stack_bytes(size), PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (stack == MAP_FAILED) {
+        stack = NULL;
+    }
+    if (stack != NULL && size > STACK_INITIAL_SIZE) {
+        usable = stack_bytes(STACK_INITIAL_SIZE) / sizeof(VAL);
+    }
+    if (stack != NULL &&
+        mprotect(stack, stack_bytes(usable), PROT_READ | PROT_WRITE) != 0) {
+        munmap(stack, stack_bytes(size));
+        stack = NULL;
+    }
+#endif
+    if (stack == NULL) {
+        fprintf(stderr,
+                "RTS ERROR: Unable to allocate stack. Requested %zd bytes.\n",
+                size * sizeof(VAL));
+        exit(EXIT_FAILURE);
+    }
+    vm->valstack = stack;
+    vm->valstack_top = stack;
+    vm->valstack_base = stack;
+    vm->stack_max = stack + usable;
+    vm->stack_limit = stack + size;
+    vm->stack_dirty = stack;
+}
+
+void free_stack(VM * vm)
+{
+#ifdef _WIN32
+    free(vm->valstack);
+#else
+    munmap(vm->valstack, stack_bytes(vm->stack_limit - vm->valstack));
+#endif
+}
+
+void grow_stack(VM * vm, size_t need)
+{
+    size_t want = (vm->valstack_top + need) - vm->valstack;
+    size_t limit = vm->stack_limit - vm->valstack;
+    if (want > limit) {
+        stackOverflow();
+    }
+    size_t usable = vm->stack_max - vm->valstack;
+    if (usable < want) {
+        while (usable < want) {
+            usable = usable > 0 ? 2 * usable : want;
+        }
+        if (usable > limit) {
+            usable = limit;
+        }
+#ifndef _WIN32
+        // Pages which are already usable are left as they are
+        if (mprotect(vm->valstack, stack_bytes(usable),
+                     PROT_READ | PROT_WRITE) != 0) {
+            fprintf(stderr, "RTS ERROR: Unable to grow stack to %zd bytes.\n",
+                    usable * sizeof(VAL));
+            exit(EXIT_FAILURE);
+        }
+#endif
+        vm->stack_max = vm->valstack + usable;
+    }
 
-    h->heap = mem;
+    size_t dirty = want + STACK_DIRTY_SLACK;
+    vm->stack_dirty = vm->valstack + (dirty < usable ? dirty : usable);
+}
+
+void clean_stack(VM * vm)
+{
+    if (vm->stack_dirty > vm->valstack_top) {
+        memset(vm->valstack_top, 0,
+               (vm->stack_dirty - vm->valstack_top) * sizeof(VAL));
+    }
+    vm->stack_dirty = vm->valstack_top;
+}
+
+void shrink_stack(VM * vm)
+{
+#ifndef _WIN32
+    size_t used = (vm->valstack_top - vm->valstack) + STACK_INITIAL_SIZE;
+    size_t usable = vm->stack_max - vm->valstack;
+    if (usable / 4 < used) {
+        return;
+    }
+    size_t keep = stack_bytes(2 * used);
+    size_t bytes = stack_bytes(usable);
+    char * from = (char *)vm->valstack + keep;
+    madvise(from, bytes - keep, MADV_DONTNEED);
+    mprotect(from, bytes - keep, PROT_NONE);
+    vm->stack_max = vm->valstack + keep / sizeof(VAL);
+#else
+    (void)vm;
+#endif
+}
+
+/* Used for initializing the FP heap. */
+void alloc_heap(Heap * h, size_t heap_size, size_t growth)
+{
+    h->huge_pages = 0;
+    h->heap = map_space(heap_size, h->huge_pages);
     h->next = aligned_heap_pointer(h->heap);
     h->end  = h->heap + heap_size;
 
     h->size   = heap_size;
     h->growth = growth;
+    h->spare  = 0;
+
+    h->min_size = heap_size;
+    h->max_size = 0;
+    h->growth_factor = HEAP_GROWTH_FACTOR;
+    h->low_count = 0;
 
-    h->old = old;
+    h->old = NULL;
+    h->old_size = 0;
+    h->compact = 0;
+}
+
+char * prepare_space(Heap * h)
+{
+    // The old semispace has only held forwarders since the last collection,
+    // so it can be copied into, unless the heap has outgrown it or shrunk
+    // well below it
+    if (h->old == NULL || h->old_size < h->size ||
+        h->old_size - h->size > h->size / 4) {
+        if (h->old != NULL) {
+            unmap_space(h->old, h->old_size);
+        }
+        h->old = map_space(h->size, h->huge_pages);
+        h->old_size = h->size;
+    }
+    return h->old;
+}
+
+void switch_space(Heap * h)
+{
+    char * space = h->old;
+    size_t space_size = h->old_size;
+
+    h->old = h->heap;
+    h->old_size = h->end - h->heap;
+
+    h->heap = space;
+    h->next = aligned_heap_pointer(h->heap);
+    h->end  = h->heap + space_size;
+    h->spare = 0;
+}
+
+void flip_heap(Heap * h)
+{
+    prepare_space(h);
+    switch_space(h);
+}
+
+char * compact_space(Heap * h)
+{
+    size_t capacity = h->end - h->heap;
+    if (h->size > capacity || capacity - h->size > h->size / 4) {
+        return map_space(h->size, h->huge_pages);
+    }
+    return h->heap;
+}
+
+void replace_space(Heap * h, char * space)
+{
+    if (space != h->heap) {
+        unmap_space(h->heap, h->end - h->heap);
+        h->heap = space;
+        h->end  = space + h->size;
+    }
+}
+
+void free_old_space(Heap * h)
+{
+    if (h->old != NULL) {
+        unmap_space(h->old, h->old_size);
+        h->old = NULL;
+        h->old_size = 0;
+    }
+}
+
+void resize_heap(Heap * h, size_t live, size_t large)
+{
+    size_t max = h->max_size > large ? h->max_size - large : 0;
+
+    if (live > h->size / 2) {
+        size_t grown = (size_t)(h->size * h->growth_factor);
+        if (grown < h->size + h->growth) {
+            grown = h->size + h->growth;
+        }
+        h->size = grown;
+        h->low_count = 0;
+    } else if (live < h->size / 8 && h->size > h->min_size) {
+        if (++h->low_count >= HEAP_SHRINK_AFTER) {
+            size_t shrunk = h->size / 2;
+            if (shrunk < h->min_size) {
+                shrunk = h->min_size;
+            }
+            if (shrunk < live * 4) {
+                shrunk = live * 4;
+            }
+            h->size = shrunk;
+            h->low_count = 0;
+        }
+    } else {
+        h->low_count = 0;
+    }
+
+    if (h->max_size > 0 && h->size > max) {
+        h->size = max > live ? max : live;
+    }
+}
+
+void heap_use_huge_pages(Heap * h)
+{
+    h->huge_pages = 1;
+#if !defined(_WIN32) && defined(MADV_HUGEPAGE)
+    madvise(h->heap, h->end - h->heap, MADV_HUGEPAGE);
+#endif
 }
 
 void free_heap(Heap * h) {
-    free(h->heap);
+    unmap_space(h->heap, h->end - h->heap);
 
     if (h->old != NULL) {
-        free(h->old);
+        unmap_space(h->old, h->old_size);
     }
 }
 
+/* Used for initializing the nursery. A size of 0 disables it. */
+void alloc_nursery(Nursery * n, size_t size)
+{
+    if (size > 0 && size < NURSERY_MIN_SIZE) {
+        size = NURSERY_MIN_SIZE;
+    }
+
+    n->heap = NULL;
+    if (size > 0) {
+        n->heap = malloc(size);
+        if (n->heap == NULL) {
+            fprintf(stderr,
+                    "RTS ERROR: Unable to allocate nursery. Requested %zd bytes.\n",
+                    size);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    n->next  = n->heap;
+    n->end   = n->heap + size;
+    n->size  = size;
+    n->large = size / 4;
+
+    n->collecting = 0;
+
+    n->remembered = NULL;
+    n->remembered_count = 0;
+    n->remembered_size = 0;
+}
+
+void free_nursery(Nursery * n) {
+    free(n->heap);
+    free(n->remembered);
+    n->heap = n->next = n->end = NULL;
+    n->size = 0;
+}
+
+void init_large(LargeObjects * large)
+{
+    large->first = NULL;
+    large->gray = NULL;
+    large->size = 0;
+    large->trigger_size = LARGE_GC_TRIGGER_SIZE(large->size);
+}
+
+void free_large(LargeObjects * large)
+{
+    while (large->first != NULL)
+    {
+        LargeObject * lo = large->first;
+        large->first = lo->next;
+        free(lo);
+    }
+    large->size = 0;
+}
+
+void * alloc_large(LargeObjects * large, size_t size, bool marked)
+{
+    LargeObject * lo = malloc(sizeof(LargeObject) + size);
+    if (lo == NULL) {
+        fprintf(stderr,
+                "RTS ERROR: Unable to allocate large object. Requested %zd bytes.\n",
+                size);
+        exit(EXIT_FAILURE);
+    }
+    return adopt_large(large, lo, size, marked);
+}
+
+void * adopt_large(LargeObjects * large, void * block, size_t size, bool marked)
+{
+    LargeObject * lo = block;
+    lo->next = large->first;
+    lo->gray = NULL;
+    lo->size = size;
+    lo->marked = marked;
+    large->first = lo;
+    large->size += size;
+
+    return lo + 1;
+}
+
+void sweep_large(LargeObjects * large)
+{
+    LargeObject ** link = &large->first;
+    while (*link != NULL)
+    {
+        LargeObject * lo = *link;
+        if (lo->marked)
+        {
+            lo->marked = false;
+            link = &lo->next;
+        }
+        else
+        {
+            *link = lo->next;
+            large->size -= lo->size;
+            free(lo);
+        }
+    }
+
+    large->trigger_size = LARGE_GC_TRIGGER_SIZE(large->size);
+}
+
+void init_shared(SharedSpace * space)
+{
+    space->refs = NULL;
+    space->count = 0;
+    space->size = 0;
+}
+
+void free_shared(SharedSpace * space)
+{
+    for (size_t i = 0; i < space->count; ++i) {
+        release_shared(space->refs[i].region);
+    }
+    free(space->refs);
+    init_shared(space);
+}
+
+SharedRegion * alloc_shared(size_t size)
+{
+    SharedRegion * region = malloc(sizeof(SharedRegion) + size);
+    if (region == NULL) {
+        fprintf(stderr,
+                "RTS ERROR: Unable to allocate shared region. Requested %zd bytes.\n",
+                size);
+        exit(EXIT_FAILURE);
+    }
+    region->refs = 1;
+    region->size = size;
+    return region;
+}
+
+void retain_shared(SharedRegion * region)
+{
+    __atomic_add_fetch(&region->refs, 1, __ATOMIC_RELAXED);
+}
+
+void release_shared(SharedRegion * region)
+{
+    // Whoever lets go last must see everything the others did with it
+    if (__atomic_sub_fetch(&region->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(region);
+    }
+}
+
+// Position of the first region at or after the given address
+static size_t shared_position(SharedSpace * space, char * addr)
+{
+    size_t lo = 0, hi = space->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((char *)space->refs[mid].region < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void attach_shared(SharedSpace * space, SharedRegion * region, int reached)
+{
+    size_t i = shared_position(space, (char *)region);
+    if (i < space->count && space->refs[i].region == region) {
+        release_shared(region);
+        space->refs[i].reached |= reached;
+        return;
+    }
+    if (space->count == space->size) {
+        space->size = space->size ? space->size * 2 : 16;
+        space->refs = realloc(space->refs, space->size * sizeof(SharedRef));
+        if (space->refs == NULL) {
+            fprintf(stderr, "RTS ERROR: Unable to grow shared regions.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memmove(space->refs + i + 1, space->refs + i,
+            (space->count - i) * sizeof(SharedRef));
+    space->refs[i] = (SharedRef){ .region = region, .reached = reached };
+    space->count++;
+}
+
+SharedRef * find_shared(SharedSpace * space, void * obj)
+{
+    // The last region starting at or before the object
+    size_t i = shared_position(space, (char *)obj);
+    if (i == 0) {
+        return NULL;
+    }
+    SharedRef * ref = &space->refs[i - 1];
+    char * objects = shared_objects(ref->region);
+    if ((char *)obj < objects || (char *)obj >= objects + ref->region->size) {
+        return NULL;
+    }
+    return ref;
+}
+
+void sweep_shared(SharedSpace * space)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < space->count; ++i) {
+        if (space->refs[i].reached) {
+            space->refs[i].reached = 0;
+            space->refs[kept++] = space->refs[i];
+        } else {
+            release_shared(space->refs[i].region);
+        }
+    }
+    space->count = kept;
+}
 
 // TODO: more testing
 /******************** Heap testing ********************************************/
@@ -157,13 +802,17 @@ void heap_check_overflow(Heap * heap) {
 }
 
 int is_valid_ref(VAL v) {
-    return (v != NULL) && !(ISINT(v));
+    return (v != NULL) && !(ISIMM(v));
 }
 
 int ref_in_heap(Heap * heap, VAL v) {
     return ((VAL)heap->heap <= v) && (v < (VAL)heap->next);
 }
 
+int ref_in_nursery(Nursery * nursery, VAL v) {
+    return ((VAL)nursery->heap <= v) && (v < (VAL)nursery->next);
+}
+
 char* aligned_heap_pointer(char * heap) {
 #ifdef FORCE_ALIGNMENT
     if (((i_int)heap&1) == 1) {
@@ -177,13 +826,13 @@ char* aligned_heap_pointer(char * heap) {
 
 // Checks three important properties:
 // 1. Closure.
-//      Check if all pointers in the _heap_ points only to heap.
+//      Check if all pointers in the _heap_ points only to heap or nursery.
 // 2. Unidirectionality. (if compact gc)
 //      All references in the heap should be are unidirectional. In other words,
 //      more recently allocated closure can point only to earlier allocated one.
 // 3. After gc there should be no forward references.
 //
-void heap_check_pointers(Heap * heap) {
+void heap_check_pointers(Heap * heap, Nursery * nursery) {
     char* scan = NULL;
 
     size_t item_size = 0;
@@ -202,7 +851,8 @@ void heap_check_pointers(Heap * heap) {
 
                  if (is_valid_ref(ptr)) {
                      // Check for closure.
-                     if (!ref_in_heap(heap, ptr)) {
+                     if (!ref_in_heap(heap, ptr) && !ref_in_nursery(nursery, ptr) &&
+                         !(ptr->hdr.u8 & (GC_LARGE | GC_SHARED | GC_STATIC))) {
                          fprintf(stderr,
                                  "RTS ERROR: heap closure broken. "\
                                  "<HEAP %p %p %p> <REF %p>\n",
@@ -234,9 +884,9 @@ void heap_check_pointers(Heap * heap) {
     }
 }
 
-void heap_check_all(Heap * heap)
+void heap_check_all(Heap * heap, Nursery * nursery)
 {
     heap_check_underflow(heap);
     heap_check_overflow(heap);
-    heap_check_pointers(heap);
+    heap_check_pointers(heap, nursery);
 }
@@ -3,12 +3,16 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 /* *** C heap ***
  * Objects with finalizers. Mark&sweep-collected.
  *
- * The C heap is implemented as a doubly linked list
- * of pointers coupled with their finalizers.
+ * The C heap keeps track of its items in slabs of slots, each with a
+ * bitmap of the slots in use and another of the items which the last
+ * traversal of the FP heap reached. A sweep only has to look at the items
+ * which weren't reached. Their finalizers are run by a background thread,
+ * where there is one, rather than during the collection.
  */
 
 struct VM;
@@ -19,6 +23,9 @@ struct VM;
         : 2 * heap_size  \
     )
 
+// Slots in a slab, one for each bit of its bitmaps
+#define C_HEAP_SLAB_SIZE 64
+
 typedef void CDataFinalizer(void *);
 
 typedef struct CHeapItem {
@@ -33,22 +40,31 @@ typedef struct CHeapItem {
     /// Finalizer that will be called on the payload pointer.
     /// Its job is to deallocate all associated resources,
     /// including the memory pointed to by `data` (if any).
+    /// It may be called on another thread.
     CDataFinalizer * finalizer;
 
-    /// The mark bit set by the FP heap traversal,
-    /// cleared by C heap sweep.
-    bool is_used;
+    /// Slab holding the item. NULL if it isn't in a heap yet.
+    struct CHeapSlab * slab;
+    /// The item's slot in its slab.
+    unsigned slot;
 
-    /// Next item in the C heap.
+    /// Next item waiting to be finalized.
     struct CHeapItem * next;
-
-    /// Pointer to the previous next-pointer.
-    struct CHeapItem ** prev_next;
 } CHeapItem;
 
+typedef struct CHeapSlab {
+    struct CHeapSlab * next;
+    uint64_t used;    // Slots holding an item
+    uint64_t marked;  // Slots whose item is reachable, set by the traversal
+    CHeapItem * items[C_HEAP_SLAB_SIZE];
+} CHeapSlab;
+
 typedef struct CHeap {
-    /// The first item in the heap. NULL if the heap is empty.
-    CHeapItem * first;
+    /// The first slab in the heap. NULL if the heap is empty.
+    CHeapSlab * first;
+
+    /// A slab which may have free slots, to try first when inserting.
+    CHeapSlab * free;
 
     /// Total size of the heap. (Sum of sizes of items.)
     /// This may not be a precise size since individual items'
@@ -63,17 +79,23 @@ typedef struct CHeap {
 void c_heap_init(CHeap * c_heap);
 
 /// Destroy the given C heap. Will not deallocate the given pointer.
-/// Will call finalizers & deallocate all blocks in the heap.
+/// Will call finalizers & deallocate all blocks in the heap, and wait for
+/// any finalizers still waiting to run on the background thread.
 void c_heap_destroy(CHeap * c_heap);
 
 /// Insert the given item into the heap if it's not there yet.
 /// The VM pointer is needed because this operation may trigger GC.
 void c_heap_insert_if_needed(struct VM * vm, CHeap * c_heap, CHeapItem * item);
 
+/// Insert the given item into the heap if it's not there yet, without
+/// triggering GC. The next insertion will collect if the heap is too big.
+void c_heap_link_item(CHeap * c_heap, CHeapItem * item);
+
 /// Mark the given item as used.
 void c_heap_mark_item(CHeapItem * item);
 
-/// Sweep the C heap, finalizing and freeing unused blocks.
+/// Sweep the C heap, removing unused items and queueing them to be finalized
+/// and freed.
 void c_heap_sweep(CHeap * c_heap);
 
 /// Create a C heap item from its payload, size estimate, and finalizer.
@@ -90,20 +112,296 @@ typedef struct {
     char*  heap;   // Point to bottom of heap
     char*  end;    // Point to top of heap
     size_t size;   // Size of _next_ heap. Size of current heap is /end - heap/.
-    size_t growth; // Quantity of heap growth in bytes.
+    size_t growth; // Least the heap grows by, in bytes.
+    size_t spare;  // Room in the heap which a collection won't need for copying.
+
+    size_t min_size;      // Size the heap shrinks back towards (its initial size)
+    size_t max_size;      // Limit on the heap and large objects together. 0 for none.
+    double growth_factor; // How many times bigger the heap gets when it grows
+    int    low_count;     // Consecutive collections leaving the heap mostly empty
 
-    char* old;
+    char*  old;      // The other semispace, holding the last collection's forwarders
+    size_t old_size; // Size of the other semispace
+    int    huge_pages; // Whether to ask for transparent huge pages
+    int    compact;    // Collect by sliding live objects down in place
 } Heap;
 
 
-void alloc_heap(Heap * heap, size_t heap_size, size_t growth, char * old);
+void alloc_heap(Heap * heap, size_t heap_size, size_t growth);
+/// Make the other semispace the current (empty) heap, so that the live
+/// contents of the current one can be copied into it. It's replaced if it's
+/// smaller than the size the heap is due to be, or much bigger.
+void flip_heap(Heap * heap);
+/// The first half of flip_heap: make sure the other semispace is big enough
+/// to copy into, and return it.
+char* prepare_space(Heap * heap);
+/// The second half of flip_heap: make the prepared semispace the current
+/// heap, and the current one the other semispace.
+void switch_space(Heap * heap);
+/// For collecting in place: the space to slide the live contents of the
+/// heap into. It's the heap itself unless that's smaller than the size the
+/// heap is due to be, or much bigger, in which case a new space of that size
+/// is mapped, to be installed by replace_space once everything has moved.
+char* compact_space(Heap * heap);
+/// Make a space from compact_space the current heap, freeing the old one.
+void replace_space(Heap * heap, char * space);
+/// Free the other semispace, which isn't needed for collecting in place.
+void free_old_space(Heap * heap);
+/// Ask for the heap to be backed by transparent huge pages, where available.
+void heap_use_huge_pages(Heap * heap);
+
+// Growth factor when none is given
+#define HEAP_GROWTH_FACTOR 2.0
+// Number of consecutive collections leaving less than an eighth of the heap
+// live before it shrinks
+#define HEAP_SHRINK_AFTER 4
+
+/// Choose the size of the next heap, given how much was live after a full
+/// collection: grow by the growth factor if it's more than half full, or
+/// halve it, down to its initial size, if it has been nearly empty for a
+/// while. Neither takes it past its maximum size, if it has one.
+void resize_heap(Heap * heap, size_t live, size_t large);
 void free_heap(Heap * heap);
 char* aligned_heap_pointer(char * heap);
 
+/* *** Nursery ***
+ * Young generation in front of the Idris heap. Small objects are
+ * bump-allocated here and promoted into the Idris heap by a minor
+ * collection, which only copies what survived. Old objects which are
+ * mutated to point into the nursery are recorded in the remembered set
+ * by the write barrier, and act as extra roots for the minor collection.
+ */
+
+// Smallest nursery we're prepared to run with. It must comfortably fit
+// an idris_requireAlloc reservation.
+#define NURSERY_MIN_SIZE 131072
+
+typedef struct {
+    char*  next;   // Next allocated chunk. Should always (heap <= next < end).
+    char*  heap;   // Point to bottom of nursery
+    char*  end;    // Point to top of nursery
+    size_t size;   // Size of nursery. 0 if generational collection is disabled.
+    size_t large;  // Objects of at least this size are allocated in the heap.
+
+    int collecting; // Set during collections, when allocation must go to the heap.
+
+    struct Val ** remembered;  // Old objects which may point into the nursery
+    size_t remembered_count;
+    size_t remembered_size;
+} Nursery;
+
+void alloc_nursery(Nursery * nursery, size_t size);
+void free_nursery(Nursery * nursery);
+
+static inline int in_nursery(Nursery * nursery, void * ptr) {
+    return (char*)ptr >= nursery->heap && (char*)ptr < nursery->end;
+}
+
+/* *** Large object space ***
+ * Objects of at least LARGE_OBJECT_MIN bytes are allocated one at a time
+ * outside the Idris heap, and never move. A full collection marks the ones
+ * it reaches instead of copying them, then frees the rest.
+ */
+
+#define LARGE_OBJECT_MIN 65536
+
+#define LARGE_GC_TRIGGER_SIZE(size) \
+    (size < 4 * LARGE_OBJECT_MIN \
+        ? 8 * LARGE_OBJECT_MIN   \
+        : 2 * size               \
+    )
+
+typedef struct LargeObject {
+    struct LargeObject * next; // Next object in the space
+    struct LargeObject * gray; // Next marked object waiting to be scanned
+    size_t size;
+    bool marked;
+    // The object itself follows
+} LargeObject;
+
+typedef struct {
+    LargeObject * first;
+    LargeObject * gray;    // Marked objects whose contents are still to scan
+    size_t size;           // Total size of the objects
+    size_t trigger_size;   // When the space reaches this size, collect
+} LargeObjects;
+
+void init_large(LargeObjects * large);
+void free_large(LargeObjects * large);
+
+/// Allocate an object of the given size. The caller is responsible for
+/// collecting first if the space has grown past its trigger size.
+/// Objects allocated during a collection are marked, so that they survive it.
+void * alloc_large(LargeObjects * large, size_t size, bool marked);
+
+/// Add a block from malloc of sizeof(LargeObject) + size bytes to the space,
+/// as alloc_large would have allocated it, without copying the object in it.
+void * adopt_large(LargeObjects * large, void * block, size_t size, bool marked);
+
+static inline LargeObject * large_header(void * obj) {
+    return (LargeObject *)obj - 1;
+}
+
+/// Mark an object, queueing it for scanning the first time it's marked.
+static inline void mark_large(LargeObjects * large, void * obj) {
+    LargeObject * lo = large_header(obj);
+    if (!lo->marked) {
+        lo->marked = true;
+        lo->gray = large->gray;
+        large->gray = lo;
+    }
+}
+
+/// Next object waiting to be scanned, or NULL if there aren't any.
+static inline void * next_gray(LargeObjects * large) {
+    LargeObject * lo = large->gray;
+    if (lo == NULL) {
+        return NULL;
+    }
+    large->gray = lo->gray;
+    return lo + 1;
+}
+
+/// Free every object which isn't marked, and clear the marks.
+void sweep_large(LargeObjects * large);
+
+/* *** Shared regions ***
+ * A value can be frozen into a region of its own, outside any VM's heap,
+ * which VMs share instead of copying it. The region is self-contained and
+ * never changes, so collections treat the objects in it as roots which they
+ * don't need to scan. It is freed when the last VM which could reach it,
+ * and the last message in transit which refers to it, have let it go.
+ */
+
+typedef struct SharedRegion {
+    size_t refs;  // VMs and messages holding the region
+    size_t size;  // Size of the objects, which follow
+} SharedRegion;
+
+static inline char * shared_objects(SharedRegion * region) {
+    return (char *)(region + 1);
+}
+
+typedef struct {
+    SharedRegion * region;
+    int reached;  // Set when a full collection finds an object in the region
+} SharedRef;
+
+typedef struct {
+    SharedRef * refs;  // Regions this VM holds, in order of address
+    size_t count;
+    size_t size;
+} SharedSpace;
+
+void init_shared(SharedSpace * space);
+/// Let go of every region in the space.
+void free_shared(SharedSpace * space);
+
+/// Allocate a region with room for the given size of objects, held once.
+SharedRegion * alloc_shared(size_t size);
+void retain_shared(SharedRegion * region);
+/// Let go of a region, freeing it if nothing else holds it.
+void release_shared(SharedRegion * region);
+
+/// Add a region to the space, taking over one hold on it. If the region is
+/// already there, the hold is let go of. Regions added during an incremental
+/// cycle count as reached by it.
+void attach_shared(SharedSpace * space, SharedRegion * region, int reached);
+
+/// The region holding an object which is in one of the space's regions.
+SharedRef * find_shared(SharedSpace * space, void * obj);
+
+/// Record that a collection reached an object in a shared region. Parallel
+/// collections may call this from several threads at once.
+static inline void reach_shared(SharedSpace * space, void * obj) {
+    SharedRef * ref = find_shared(space, obj);
+    if (ref != NULL && !__atomic_load_n(&ref->reached, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&ref->reached, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/// Let go of every region which the last full collection didn't reach, and
+/// clear the marks.
+void sweep_shared(SharedSpace * space);
+
+/* *** Value stack ***
+ * Address space for a VM's value stack is reserved up front, at its maximum
+ * size, but only made usable a piece at a time as the stack grows, so a new
+ * thread only pays for the stack it uses. Full collections hand back most of
+ * what a deep recursion left unused. The stack never moves, so pointers
+ * into it stay good.
+ *
+ * New frames aren't cleared. Instead, every slot above the stack's dirty
+ * mark is NULL, and every slot below it is NULL or was written since the
+ * last collection, so it holds something which is still in the heap. A
+ * collection scans up to the top, then clears from the top to the dirty
+ * mark, which it lowers to the top: anything left there may point at
+ * objects which have just moved or been freed.
+ */
+
+// Slots usable from the start, and the least a collection leaves usable
+// above the top of the stack: room reserved but not yet pushed must not be
+// taken away from under it.
+#define STACK_INITIAL_SIZE 16384
+// Slots the dirty mark is raised by, beyond what's needed, so that a
+// program which stays at much the same depth rarely has to raise it
+#define STACK_DIRTY_SLACK 1024
+
+/// Reserve a stack of up to the given number of slots for a VM.
+void alloc_stack(struct VM * vm, size_t size);
+void free_stack(struct VM * vm);
+/// Make room for the given number of slots above the top of the stack,
+/// raising the dirty mark past them, or exit with a stack overflow if that
+/// would take the stack past its maximum size.
+void grow_stack(struct VM * vm, size_t need);
+/// After a collection, clear what's past the top of the stack.
+void clean_stack(struct VM * vm);
+/// Hand back what's usable well beyond the top of the stack. The stack must
+/// be clean.
+void shrink_stack(struct VM * vm);
+
+/* *** Incremental collection ***
+ * With a pause target, full collections are done a step at a time between
+ * allocations rather than all at once. Live objects are replicated into the
+ * other semispace while the program carries on using the originals, which
+ * are left intact. Mutable originals are marked old, so that the write
+ * barrier logs them when they change and their replicas are brought up to
+ * date. Once everything has been replicated, a final pause switches the
+ * program over to the replicas.
+ */
+
+// Fraction of the heap in use before a cycle starts
+#define INC_START_FRACTION 2
+// Least allocation between steps, in bytes
+#define INC_MIN_QUANTUM 4096
+
+typedef struct {
+    double pause;      // Target for each step in milliseconds. 0 if disabled.
+    int    active;     // Set while a cycle is under way
+
+    char*  end;        // End of the heap. heap.end is where the next step is.
+    char*  space;      // Semispace being replicated into
+    char*  next;       // Next free byte in space
+    char*  scan;       // Next replica whose contents need replicating
+    uint32_t* fwd;     // Replica of each word of the heap, as an offset into
+                       // space in words plus one, or 0 if it hasn't got one
+    size_t roots;      // Stack slots whose values have been replicated
+    size_t estimate;   // Bytes in use when the cycle started
+
+    struct Val ** log; // Replicated objects which have changed since
+    size_t log_count;
+    size_t log_size;
+
+    struct Val ** raw; // Replicated objects which can change without the
+                       // write barrier, and are copied again at the end
+    size_t raw_count;
+    size_t raw_size;
+} Incremental;
+
 #ifdef IDRIS_DEBUG
-void heap_check_all(Heap * heap);
+void heap_check_all(Heap * heap, Nursery * nursery);
 // Should be used _between_ gc's.
-#define HEAP_CHECK(vm) heap_check_all(&(vm->heap));
+#define HEAP_CHECK(vm) heap_check_all(&(vm->heap), &(vm->nursery));
 #else
 #define HEAP_CHECK(vm)
 #endif // IDRIS_DEBUG
@@ -0,0 +1,437 @@
+#include "idris_image.h"
+#include "idris_gmp.h"
+#include "idris_utf8.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define IMAGE_MAGIC "IDRSIMG2"
+
+// Where images are laid out to be mapped: well away from where heaps,
+// stacks and libraries usually go, so the address is normally free
+#if UINTPTR_MAX > 0xffffffffu
+#define IMAGE_BASE ((uintptr_t)0x5e0000000000ULL)
+#else
+#define IMAGE_BASE ((uintptr_t)0x60000000UL)
+#endif
+
+typedef struct {
+    char magic[8];
+    uint64_t program;
+    uint64_t base;  // The address the image was laid out to be mapped at
+    uint64_t size;  // In bytes, including this header
+    uint64_t root;  // The saved value, as a pointer into the image or an Int
+    uint32_t word;  // sizeof(void*), and sizeof(mp_limb_t) below, since
+    uint32_t limb;  // the objects are laid out as in memory
+} ImageHeader;
+
+typedef struct {
+    char* start;
+    size_t size;
+    VAL root;
+} Image;
+
+static uint64_t program_id = 0;
+
+void idris_imageProgram(uint64_t id) {
+    program_id = id;
+}
+
+uint64_t idris_programId(void) {
+    return program_id;
+}
+
+// An image being built: objects are appended to a buffer, each once,
+// and the pointers in them are replaced by the addresses their targets
+// will have once the image is mapped.
+typedef struct {
+    char* buf;
+    size_t used;
+    size_t room;
+    // Open addressing, from object to offset in the image, with a NULL
+    // key marking an empty slot
+    VAL* keys;
+    size_t* offsets;
+    size_t slots; // A power of 2
+    size_t count;
+} Builder;
+
+static size_t hash_val(VAL x, size_t slots) {
+    uint64_t h = (uint64_t)(uintptr_t)x * 0x9e3779b97f4a7c15ULL;
+    return (size_t)(h >> 32) & (slots - 1);
+}
+
+static int map_insert(Builder* b, VAL x, size_t offset) {
+    size_t i;
+    if (2 * (b->count + 1) > b->slots) {
+        size_t old = b->slots;
+        VAL* keys = b->keys;
+        size_t* offsets = b->offsets;
+        b->slots = old ? old * 2 : 1024;
+        b->keys = calloc(b->slots, sizeof(VAL));
+        b->offsets = malloc(b->slots * sizeof(size_t));
+        if (b->keys == NULL || b->offsets == NULL) {
+            free(keys);
+            free(offsets);
+            return 0;
+        }
+        for (i = 0; i < old; ++i) {
+            if (keys[i] != NULL) {
+                size_t j = hash_val(keys[i], b->slots);
+                while (b->keys[j] != NULL) {
+                    j = (j + 1) & (b->slots - 1);
+                }
+                b->keys[j] = keys[i];
+                b->offsets[j] = offsets[i];
+            }
+        }
+        free(keys);
+        free(offsets);
+    }
+    i = hash_val(x, b->slots);
+    while (b->keys[i] != NULL) {
+        i = (i + 1) & (b->slots - 1);
+    }
+    b->keys[i] = x;
+    b->offsets[i] = offset;
+    b->count++;
+    return 1;
+}
+
+static int map_find(Builder* b, VAL x, size_t* offset) {
+    size_t i;
+    if (b->slots == 0) {
+        return 0;
+    }
+    for (i = hash_val(x, b->slots); b->keys[i] != NULL;
+         i = (i + 1) & (b->slots - 1)) {
+        if (b->keys[i] == x) {
+            *offset = b->offsets[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Room for an object of the given size at the end of the image, zeroed
+// so that the padding is too. Returns its offset, or 0 if out of memory.
+static size_t reserve(Builder* b, size_t size) {
+    size_t offset = b->used;
+    size = aligned(size);
+    if (b->used + size > b->room) {
+        size_t room = b->room * 2 > b->used + size ? b->room * 2 : b->used + size;
+        char* buf = realloc(b->buf, room);
+        if (buf == NULL) {
+            return 0;
+        }
+        b->buf = buf;
+        b->room = room;
+    }
+    memset(b->buf + offset, 0, size);
+    b->used += size;
+    return offset;
+}
+
+// Start a string of len bytes at the end of the image, and return it. The
+// characters are to be filled in, and then counted by finish_string.
+static String* add_string(Builder* b, size_t len, size_t* offset) {
+    *offset = reserve(b, sizeof(String) + len + 1);
+    if (*offset == 0) {
+        return NULL;
+    }
+    String* s = (String*)(b->buf + *offset);
+    SETTY(s, CT_STRING);
+    s->hdr.u8 = GC_STATIC;
+    s->hdr.sz = sizeof(String) + len + 1;
+    s->slen = len;
+    return s;
+}
+
+// Strings count their characters the first time they're needed, which
+// can't be done in a read-only image, so it's done now
+static void finish_string(String* s) {
+    if (!(s->hdr.u16 & STR_COUNTED)) {
+        int ascii;
+        s->clen = idris_utf8_count(s->str, s->slen, &ascii);
+        s->hdr.u16 |= STR_COUNTED | (ascii ? STR_ASCII : 0);
+    }
+    s->hdr.u16 &= ~STR_INTERNED;
+}
+
+// The address x will have in the image, appending a copy of it if it isn't
+// there already. Returns 0 if it can't be saved. Pointers in constructors
+// are still those of the original, until the constructor is scanned.
+static int place(Builder* b, VAL x, uint64_t* addr) {
+    size_t offset;
+    if (x == NULL || ISIMM(x)) {
+        *addr = (uint64_t)(uintptr_t)x;
+        return 1;
+    }
+    if (map_find(b, x, &offset)) {
+        *addr = IMAGE_BASE + offset;
+        return 1;
+    }
+
+    switch(GETTY(x)) {
+    case CT_CON:
+    case CT_FLOAT:
+    case CT_BITS32:
+    case CT_BITS64: {
+        offset = reserve(b, valSize(x));
+        if (offset == 0) {
+            return 0;
+        }
+        VAL cl = (VAL)(b->buf + offset);
+        memcpy(cl, x, valSize(x));
+        cl->hdr.u8 = GC_STATIC;
+    } break;
+    case CT_STRING: {
+        String* s = add_string(b, ((String*)x)->slen, &offset);
+        if (s == NULL) {
+            return 0;
+        }
+        memcpy(s, x, valSize(x));
+        s->hdr.u8 = (x->hdr.u8 & STR_NULL) | GC_STATIC;
+        finish_string(s);
+    } break;
+    case CT_STROFFSET:
+    case CT_STRCONCAT: {
+        // Copied as a plain string
+        size_t len = GETSTRLEN(x);
+        const char* chars = GETSTR(x);
+        String* s = add_string(b, len, &offset);
+        if (s == NULL) {
+            return 0;
+        }
+        memcpy(s->str, chars, len);
+        finish_string(s);
+    } break;
+    case CT_BIGINT: {
+        // The limbs go in a RawData block after it, as in a region
+        mpz_t* big = getmpz((BigInt*)x);
+        size_t limbs = mpz_size(*big);
+        size_t alloc = limbs ? limbs : 1;
+        size_t size = sizeof(BigInt) + sizeof(mpz_t);
+        offset = reserve(b, size);
+        size_t raw = reserve(b, sizeof(RawData) + alloc * sizeof(mp_limb_t));
+        if (offset == 0 || raw == 0) {
+            return 0;
+        }
+        BigInt* cl = (BigInt*)(b->buf + offset);
+        SETTY(cl, CT_BIGINT);
+        cl->hdr.u8 = GC_STATIC;
+        cl->hdr.sz = size;
+        RawData* d = (RawData*)(b->buf + raw);
+        SETTY(d, CT_RAWDATA);
+        d->hdr.u8 = GC_STATIC;
+        d->hdr.sz = sizeof(RawData) + alloc * sizeof(mp_limb_t);
+        memcpy(d->raw, mpz_limbs_read(*big), limbs * sizeof(mp_limb_t));
+        mpz_t* copy = getmpz(cl);
+        (*copy)->_mp_alloc = alloc;
+        (*copy)->_mp_size = mpz_sgn(*big) < 0 ? -(int)limbs : (int)limbs;
+        (*copy)->_mp_d = (mp_limb_t*)(uintptr_t)
+            (IMAGE_BASE + raw + offsetof(RawData, raw));
+    } break;
+    default:
+        // Mutable, or belonging to the running program
+        return 0;
+    }
+
+    if (!map_insert(b, x, offset)) {
+        return 0;
+    }
+    *addr = IMAGE_BASE + offset;
+    return 1;
+}
+
+int idris_saveImage(const char* path, VAL x) {
+    Builder b = { NULL, 0, 0, NULL, NULL, 0, 0 };
+    ImageHeader hdr;
+    b.room = 4096;
+    b.used = aligned(sizeof(ImageHeader));
+    b.buf = malloc(b.room);
+    int ok = b.buf != NULL;
+    size_t scan = b.used;
+    uint64_t root = 0;
+
+    ok = ok && place(&b, x, &root);
+    // Everything appended is scanned in turn, so the image is built
+    // breadth first, without recursion
+    while (ok && scan < b.used) {
+        VAL cl = (VAL)(b.buf + scan);
+        size_t size = aligned(valSize(cl));
+        if (GETTY(cl) == CT_CON) {
+            uint32_t i, arity = CARITY(cl);
+            for (i = 0; ok && i < arity; ++i) {
+                uint64_t addr;
+                // place can move the buffer
+                ok = place(&b, ((Con*)(b.buf + scan))->args[i], &addr);
+                ((Con*)(b.buf + scan))->args[i] = (VAL)(uintptr_t)addr;
+            }
+        }
+        scan += size;
+    }
+
+    if (ok) {
+        memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+        hdr.program = program_id;
+        hdr.base = IMAGE_BASE;
+        hdr.size = b.used;
+        hdr.root = root;
+        hdr.word = sizeof(void*);
+        hdr.limb = sizeof(mp_limb_t);
+        memcpy(b.buf, &hdr, sizeof(hdr));
+    }
+
+    // Written alongside and renamed, so that a program starting meanwhile
+    // never sees half an image
+    char* tmp = malloc(strlen(path) + 5);
+    FILE* f = NULL;
+    if (ok && tmp != NULL) {
+        sprintf(tmp, "%s.tmp", path);
+        f = fopen(tmp, "wb");
+    }
+    if (f != NULL) {
+        ok = fwrite(b.buf, 1, b.used, f) == b.used;
+        ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+        remove(path);
+#endif
+        ok = ok && rename(tmp, path) == 0;
+        if (!ok) {
+            remove(tmp);
+        }
+    } else {
+        ok = 0;
+    }
+
+    free(tmp);
+    free(b.buf);
+    free(b.keys);
+    free(b.offsets);
+    return ok;
+}
+
+// Move the pointers in an image which was mapped somewhere other than
+// where it was laid out for
+static void relocate(char* start, size_t size, intptr_t delta) {
+    char* scan = start + aligned(sizeof(ImageHeader));
+#define RELOCATE(p) \
+    if ((p) != NULL && !ISIMM((VAL)(p))) { \
+        (p) = (void*)((char*)(p) + delta); \
+    }
+    while (scan < start + size) {
+        VAL cl = (VAL)scan;
+        uint32_t i;
+        switch(GETTY(cl)) {
+        case CT_CON:
+            for (i = 0; i < CARITY(cl); ++i) {
+                RELOCATE(((Con*)cl)->args[i]);
+            }
+            break;
+        case CT_BIGINT:
+            RELOCATE((*getmpz((BigInt*)cl))->_mp_d);
+            break;
+        default:
+            break;
+        }
+        scan += aligned(valSize(cl));
+    }
+#undef RELOCATE
+    ImageHeader* hdr = (ImageHeader*)start;
+    if (hdr->root != 0 && !ISIMM((VAL)(uintptr_t)hdr->root)) {
+        hdr->root += delta;
+    }
+}
+
+static int valid_header(const ImageHeader* hdr, size_t size) {
+    return memcmp(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic)) == 0 &&
+           hdr->program == program_id &&
+           hdr->size == size &&
+           hdr->word == sizeof(void*) &&
+           hdr->limb == sizeof(mp_limb_t);
+}
+
+void* idris_loadImage(const char* path) {
+    ImageHeader hdr;
+    char* start = NULL;
+    size_t size;
+
+#ifdef _WIN32
+    // No mapping: the image is read into memory and always relocated
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        fseek(f, 0, SEEK_END) != 0) {
+        fclose(f);
+        return NULL;
+    }
+    size = (size_t)ftell(f);
+    if (!valid_header(&hdr, size) || (start = malloc(size)) == NULL) {
+        fclose(f);
+        return NULL;
+    }
+    rewind(f);
+    if (fread(start, 1, size, f) != size) {
+        fclose(f);
+        free(start);
+        return NULL;
+    }
+    fclose(f);
+    relocate(start, size, (intptr_t)(start - (char*)(uintptr_t)hdr.base));
+#else
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 ||
+        pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        !valid_header(&hdr, (size_t)st.st_size)) {
+        close(fd);
+        return NULL;
+    }
+    size = (size_t)st.st_size;
+    // A private mapping: the file's pages are shared with every other
+    // process using the image, until relocation writes to them
+    start = mmap((void*)(uintptr_t)hdr.base, size, PROT_READ, MAP_PRIVATE,
+                 fd, 0);
+    close(fd);
+    if (start == MAP_FAILED) {
+        return NULL;
+    }
+    if ((uintptr_t)start != hdr.base) {
+        if (mprotect(start, size, PROT_READ | PROT_WRITE) != 0) {
+            munmap(start, size);
+            return NULL;
+        }
+        relocate(start, size, (intptr_t)(start - (char*)(uintptr_t)hdr.base));
+        mprotect(start, size, PROT_READ);
+    }
+#endif
+
+    Image* image = malloc(sizeof(Image));
+    if (image == NULL) {
+        return NULL;
+    }
+    image->start = start;
+    image->size = size;
+    image->root = (VAL)(uintptr_t)((ImageHeader*)start)->root;
+    return image;
+}
+
+VAL idris_imageRoot(void* image) {
+    return ((Image*)image)->root;
+}
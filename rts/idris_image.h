@@ -0,0 +1,43 @@
+#ifndef _IDRIS_IMAGE_H
+#define _IDRIS_IMAGE_H
+
+#include "idris_rts.h"
+
+/* *** Heap images ***
+ * A value which takes a long time to build, but never changes once it's
+ * built, such as a table computed at startup, can be saved in an image
+ * file and loaded again by later runs of the same program instead of
+ * being built again.
+ *
+ * The image holds a copy of everything the value refers to, laid out as
+ * it would be in the heap, sharing preserved. Loading maps the file into
+ * memory read-only and uses it where it is: its objects are marked
+ * GC_STATIC, so the collector neither moves nor scans them, as for
+ * interned strings. Any VM may use them. They're laid out for a fixed
+ * address, so if the file can be mapped there, loading costs no more
+ * than the pages which are actually touched. Otherwise the pointers in it
+ * are moved first. An image stays mapped until the program exits.
+ *
+ * Only values which can't change can be saved: constructors, numbers and
+ * strings. Arrays, references, buffers and pointers can't. Constructor
+ * tags mean different things in different programs, so an image only
+ * loads in the program which saved it, identified by a hash of its code
+ * which the code generator defines as IDRIS_PROGRAM_ID.
+ */
+
+// The program id recorded in images and serialized values, and checked
+// when they are read back
+void idris_imageProgram(uint64_t id);
+uint64_t idris_programId(void);
+
+// Save x in an image file. Returns 0 if it holds anything which can't be
+// saved, or the file can't be written.
+int idris_saveImage(const char* path, VAL x);
+
+// Load an image file, or return NULL if it's missing, unreadable, or was
+// saved by a different program.
+void* idris_loadImage(const char* path);
+// The value saved in a loaded image
+VAL idris_imageRoot(void* image);
+
+#endif // _IDRIS_IMAGE_H
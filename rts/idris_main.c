@@ -1,5 +1,8 @@
-#include "idris_gmp.h"
+#include "idris_embed.h"
+#include "idris_image.h"
 #include "idris_opts.h"
+#include "idris_par.h"
+#include "idris_prof.h"
 #include "idris_rts.h"
 #include "idris_stats.h"
 
@@ -32,12 +35,7 @@ int win32_get_argv_utf8(int *argc_ptr, char ***argv_ptr)
 
 #endif
 
-// The default options should give satisfactory results under many circumstances.
-RTSOpts opts = {
-    .init_heap_size = 16384000,
-    .max_stack_size = 4096000,
-    .show_summary   = 0
-};
+RTSOpts opts = IDRIS_DEFAULT_OPTS;
 
 #ifdef _WIN32
 int main() {
@@ -52,13 +50,29 @@ int main(int argc, char **argv) {
     __idris_argc = argc;
     __idris_argv = argv;
 
-    VM* vm = init_vm(opts.max_stack_size, opts.init_heap_size, 1);
-    init_threadkeys();
-    init_threaddata(vm);
-    init_gmpalloc();
+    VM* vm = idris_newVM(&opts);
+    idris_imageProgram(IDRIS_PROGRAM_ID);
+    idris_parApply(IDRIS_APPLY);
 
-    init_nullaries();
-    init_signals();
+#ifdef IDRIS_PROFILE
+    const char** sites = idris_prof_sites;
+    int site_count = IDRIS_PROF_SITES;
+#else
+    const char** sites = NULL;
+    int site_count = 0;
+#endif
+    if (opts.heap_profile > 0 &&
+        !idris_profStart(vm, argv[0], opts.heap_profile, sites, site_count)) {
+        fprintf(stderr, "RTS Opts: Unable to open the heap profile.\n");
+    }
+    if (opts.sample_interval > 0) {
+        if (sites == NULL) {
+            fprintf(stderr, "RTS Opts: Sampling needs a program compiled with -DIDRIS_PROFILE.\n");
+        } else if (!idris_sampleStart(vm, argv[0], opts.sample_interval,
+                                      sites, site_count)) {
+            fprintf(stderr, "RTS Opts: Unable to start sampling.\n");
+        }
+    }
 
     _idris__123_runMain_95_0_125_(vm, NULL);
 
@@ -73,6 +87,15 @@ int main(int argc, char **argv) {
     if (opts.show_summary) {
         print_stats(&stats);
     }
+    if (opts.stats_file != NULL) {
+        FILE* f = fopen(opts.stats_file, "w");
+        if (f == NULL) {
+            fprintf(stderr, "RTS: Unable to write stats to %s.\n", opts.stats_file);
+        } else {
+            write_stats_json(f, &stats);
+            fclose(f);
+        }
+    }
 
     return EXIT_SUCCESS;
 }
@@ -1,6 +1,10 @@
 // C-Side of the Idris network library
 // (C) Simon Fowler, 2014
 // MIT Licensed. Have fun!
+#if defined(__APPLE__)
+// For the BSD types kqueue uses
+#define _DARWIN_C_SOURCE
+#endif
 #include "idris_net.h"
 #include <errno.h>
 #include <stdbool.h>
@@ -11,6 +15,17 @@
 #ifndef _WIN32
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#if defined(__linux__)
+#define IDRNET_EPOLL
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
+      defined(__NetBSD__) || defined(__DragonFly__)
+#define IDRNET_KQUEUE
+#include <sys/event.h>
+#include <time.h>
+#endif
 #else
 static int socket_inited = 0;
 static WSADATA wsa_data;
@@ -349,3 +364,275 @@ int idrnet_geteagain() {
     return EAGAIN;
 }
 
+
+int idrnet_set_nonblocking(int sockfd, int on) {
+#ifdef _WIN32
+    u_long mode = on;
+    return ioctlsocket(sockfd, FIONBIO, &mode) == 0 ? 0 : -1;
+#else
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    flags = on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(sockfd, F_SETFL, flags);
+#endif
+}
+
+// Readiness notification, over epoll on Linux and kqueue on the BSDs and
+// macOS. Elsewhere, creating a poller fails.
+
+#if defined(IDRNET_EPOLL)
+typedef struct epoll_event idrnet_event;
+#elif defined(IDRNET_KQUEUE)
+typedef struct kevent idrnet_event;
+#else
+typedef int idrnet_event;
+#endif
+
+typedef struct idrnet_poller {
+    int fd;                // The epoll or kqueue descriptor
+    int max_events;
+    int ready;             // Number of events from the last wait
+    int next_timer;        // Next timer id, for kqueue
+    idrnet_event events[]; // Events from the last wait
+} idrnet_poller;
+
+#ifdef IDRNET_EPOLL
+// Timers are timerfds, told apart from sockets in the event's data
+#define EPOLL_TIMER_TAG ((uint64_t)1 << 32)
+
+static uint32_t epoll_flags(int events, int edge) {
+    return ((events & IDRNET_READ) ? EPOLLIN | EPOLLRDHUP : 0) |
+           ((events & IDRNET_WRITE) ? EPOLLOUT : 0) |
+           (edge ? EPOLLET : 0);
+}
+#endif
+
+#ifdef IDRNET_KQUEUE
+static int kqueue_change(int kq, uintptr_t ident, short filter, unsigned short flags,
+                         intptr_t data) {
+    struct kevent ev;
+    EV_SET(&ev, ident, filter, flags, 0, data, NULL);
+    return kevent(kq, &ev, 1, NULL, 0, NULL);
+}
+
+static int kqueue_set(idrnet_poller* p, int fd, int events, int edge) {
+    unsigned short clear = edge ? EV_CLEAR : 0;
+    int res = 0;
+    // Deleting a filter which isn't there fails, which is fine
+    if (events & IDRNET_READ) {
+        res |= kqueue_change(p->fd, fd, EVFILT_READ, EV_ADD | clear, 0);
+    } else {
+        kqueue_change(p->fd, fd, EVFILT_READ, EV_DELETE, 0);
+    }
+    if (events & IDRNET_WRITE) {
+        res |= kqueue_change(p->fd, fd, EVFILT_WRITE, EV_ADD | clear, 0);
+    } else {
+        kqueue_change(p->fd, fd, EVFILT_WRITE, EV_DELETE, 0);
+    }
+    return res == 0 ? 0 : -1;
+}
+#endif
+
+void* idrnet_poller_create(int max_events) {
+    if (max_events <= 0) {
+        return NULL;
+    }
+#if defined(IDRNET_EPOLL) || defined(IDRNET_KQUEUE)
+    idrnet_poller* p = malloc(sizeof(idrnet_poller) +
+                              max_events * sizeof(idrnet_event));
+    if (p == NULL) {
+        return NULL;
+    }
+#ifdef IDRNET_EPOLL
+    p->fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+    p->fd = kqueue();
+#endif
+    if (p->fd == -1) {
+        free(p);
+        return NULL;
+    }
+    p->max_events = max_events;
+    p->ready = 0;
+    p->next_timer = 0;
+    return p;
+#else
+    return NULL;
+#endif
+}
+
+void idrnet_poller_free(void* poller) {
+    idrnet_poller* p = poller;
+#if defined(IDRNET_EPOLL) || defined(IDRNET_KQUEUE)
+    close(p->fd);
+#endif
+    free(p);
+}
+
+int idrnet_poller_add(void* poller, int sockfd, int events, int edge) {
+    idrnet_poller* p = poller;
+#if defined(IDRNET_EPOLL)
+    struct epoll_event ev = { .events = epoll_flags(events, edge),
+                              .data.u64 = (uint32_t)sockfd };
+    return epoll_ctl(p->fd, EPOLL_CTL_ADD, sockfd, &ev);
+#elif defined(IDRNET_KQUEUE)
+    return kqueue_set(p, sockfd, events, edge);
+#else
+    (void)p;
+    return -1;
+#endif
+}
+
+int idrnet_poller_modify(void* poller, int sockfd, int events, int edge) {
+    idrnet_poller* p = poller;
+#if defined(IDRNET_EPOLL)
+    struct epoll_event ev = { .events = epoll_flags(events, edge),
+                              .data.u64 = (uint32_t)sockfd };
+    return epoll_ctl(p->fd, EPOLL_CTL_MOD, sockfd, &ev);
+#elif defined(IDRNET_KQUEUE)
+    return kqueue_set(p, sockfd, events, edge);
+#else
+    (void)p;
+    return -1;
+#endif
+}
+
+int idrnet_poller_remove(void* poller, int sockfd) {
+    idrnet_poller* p = poller;
+#if defined(IDRNET_EPOLL)
+    struct epoll_event ev = { 0 };
+    return epoll_ctl(p->fd, EPOLL_CTL_DEL, sockfd, &ev);
+#elif defined(IDRNET_KQUEUE)
+    return kqueue_set(p, sockfd, 0, 0);
+#else
+    (void)p;
+    return -1;
+#endif
+}
+
+int idrnet_poller_add_timer(void* poller, int ms, int repeat) {
+    idrnet_poller* p = poller;
+    if (ms <= 0) {
+        return -1;
+    }
+#if defined(IDRNET_EPOLL)
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd == -1) {
+        return -1;
+    }
+    struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+    struct itimerspec its = { .it_value = ts };
+    if (repeat) {
+        its.it_interval = ts;
+    }
+    struct epoll_event ev = { .events = EPOLLIN,
+                              .data.u64 = EPOLL_TIMER_TAG | (uint32_t)tfd };
+    if (timerfd_settime(tfd, 0, &its, NULL) == -1 ||
+        epoll_ctl(p->fd, EPOLL_CTL_ADD, tfd, &ev) == -1) {
+        close(tfd);
+        return -1;
+    }
+    return tfd;
+#elif defined(IDRNET_KQUEUE)
+    int id = p->next_timer++;
+    unsigned short flags = EV_ADD | (repeat ? 0 : EV_ONESHOT);
+    return kqueue_change(p->fd, id, EVFILT_TIMER, flags, ms) == 0 ? id : -1;
+#else
+    (void)p;
+    return -1;
+#endif
+}
+
+int idrnet_poller_remove_timer(void* poller, int timer) {
+    idrnet_poller* p = poller;
+#if defined(IDRNET_EPOLL)
+    struct epoll_event ev = { 0 };
+    epoll_ctl(p->fd, EPOLL_CTL_DEL, timer, &ev);
+    return close(timer);
+#elif defined(IDRNET_KQUEUE)
+    return kqueue_change(p->fd, timer, EVFILT_TIMER, EV_DELETE, 0);
+#else
+    (void)p;
+    return -1;
+#endif
+}
+
+int idrnet_poller_wait(void* poller, int timeout_ms) {
+    idrnet_poller* p = poller;
+    int n;
+#if defined(IDRNET_EPOLL)
+    do {
+        n = epoll_wait(p->fd, p->events, p->max_events, timeout_ms);
+    } while (n == -1 && errno == EINTR);
+    // Acknowledge expired timers, so that they don't stay ready
+    int i;
+    for (i = 0; i < n; ++i) {
+        if (p->events[i].data.u64 & EPOLL_TIMER_TAG) {
+            uint64_t expirations;
+            ssize_t r = read((int)(uint32_t)p->events[i].data.u64,
+                             &expirations, sizeof(expirations));
+            (void)r;
+        }
+    }
+#elif defined(IDRNET_KQUEUE)
+    struct timespec ts = { .tv_sec = timeout_ms / 1000,
+                           .tv_nsec = (timeout_ms % 1000) * 1000000L };
+    do {
+        n = kevent(p->fd, NULL, 0, p->events, p->max_events,
+                   timeout_ms < 0 ? NULL : &ts);
+    } while (n == -1 && errno == EINTR);
+#else
+    (void)timeout_ms;
+    n = -1;
+#endif
+    p->ready = n > 0 ? n : 0;
+    return n;
+}
+
+int idrnet_poller_ready_fd(void* poller, int i) {
+    idrnet_poller* p = poller;
+    if (i < 0 || i >= p->ready) {
+        return -1;
+    }
+#if defined(IDRNET_EPOLL)
+    return (int)(uint32_t)p->events[i].data.u64;
+#elif defined(IDRNET_KQUEUE)
+    return (int)p->events[i].ident;
+#else
+    (void)p;
+    return -1;
+#endif
+}
+
+int idrnet_poller_ready_events(void* poller, int i) {
+    idrnet_poller* p = poller;
+    if (i < 0 || i >= p->ready) {
+        return 0;
+    }
+#if defined(IDRNET_EPOLL)
+    struct epoll_event* ev = &p->events[i];
+    if (ev->data.u64 & EPOLL_TIMER_TAG) {
+        return IDRNET_TIMER;
+    }
+    return ((ev->events & EPOLLIN) ? IDRNET_READ : 0) |
+           ((ev->events & EPOLLOUT) ? IDRNET_WRITE : 0) |
+           ((ev->events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) ? IDRNET_HANGUP : 0);
+#elif defined(IDRNET_KQUEUE)
+    struct kevent* ev = &p->events[i];
+    switch (ev->filter) {
+    case EVFILT_TIMER:
+        return IDRNET_TIMER;
+    case EVFILT_READ:
+        return IDRNET_READ | ((ev->flags & (EV_EOF | EV_ERROR)) ? IDRNET_HANGUP : 0);
+    case EVFILT_WRITE:
+        return IDRNET_WRITE | ((ev->flags & (EV_EOF | EV_ERROR)) ? IDRNET_HANGUP : 0);
+    default:
+        return 0;
+    }
+#else
+    (void)p;
+    return 0;
+#endif
+}
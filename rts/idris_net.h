@@ -88,4 +88,38 @@ int idrnet_getaddrinfo(struct addrinfo** address_res, char* host,
 
 int idrnet_geteagain();
 
+// Set or clear O_NONBLOCK. Returns -1 on failure.
+int idrnet_set_nonblocking(int sockfd, int on);
+
+// Readiness notification for many descriptors at once. Events are a
+// combination of these flags.
+#define IDRNET_READ 1
+#define IDRNET_WRITE 2
+#define IDRNET_HANGUP 4
+#define IDRNET_TIMER 8
+
+// Returns NULL on failure, or if the platform has no epoll or kqueue.
+// At most max_events ready descriptors are reported by each wait.
+void* idrnet_poller_create(int max_events);
+void idrnet_poller_free(void* poller);
+
+// If edge is non-zero, a descriptor is only reported when it becomes ready,
+// rather than for as long as it is. These return -1 on failure.
+int idrnet_poller_add(void* poller, int sockfd, int events, int edge);
+int idrnet_poller_modify(void* poller, int sockfd, int events, int edge);
+int idrnet_poller_remove(void* poller, int sockfd);
+
+// Returns a timer id, which is reported as a ready descriptor with
+// IDRNET_TIMER set, after ms milliseconds and then every ms milliseconds
+// if repeat is non-zero. Returns -1 on failure.
+int idrnet_poller_add_timer(void* poller, int ms, int repeat);
+int idrnet_poller_remove_timer(void* poller, int timer);
+
+// Wait for up to timeout_ms milliseconds, or indefinitely if it's negative.
+// Returns the number of ready descriptors or timers, or -1 on failure. A
+// descriptor may be reported once for reading and once for writing.
+int idrnet_poller_wait(void* poller, int timeout_ms);
+int idrnet_poller_ready_fd(void* poller, int i);
+int idrnet_poller_ready_events(void* poller, int i);
+
 #endif
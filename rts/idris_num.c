@@ -0,0 +1,797 @@
+#include "idris_num.h"
+
+#include <ctype.h>
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char DIGIT_PAIRS[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static int countDigits(uint64_t x) {
+    int n = 1;
+    for (;;) {
+        if (x < 10) return n;
+        if (x < 100) return n + 1;
+        if (x < 1000) return n + 2;
+        if (x < 10000) return n + 3;
+        x /= 10000;
+        n += 4;
+    }
+}
+
+// Write exactly n digits of x, which must have no more than that, to buf.
+// Two digits at a time, from the end.
+static void writeDigits(char* buf, uint64_t x, int n) {
+    char* p = buf + n;
+    while (x >= 100) {
+        unsigned d = (unsigned)(x % 100) * 2;
+        x /= 100;
+        *--p = DIGIT_PAIRS[d + 1];
+        *--p = DIGIT_PAIRS[d];
+    }
+    if (x >= 10) {
+        *--p = DIGIT_PAIRS[x * 2 + 1];
+        *--p = DIGIT_PAIRS[x * 2];
+    } else {
+        *--p = '0' + (char)x;
+    }
+    // Leading zeros, if n is more than x needs
+    while (p > buf) {
+        *--p = '0';
+    }
+}
+
+size_t idris_fmt_u64(char* buf, uint64_t x) {
+    int n = countDigits(x);
+    writeDigits(buf, x, n);
+    return n;
+}
+
+size_t idris_fmt_i64(char* buf, int64_t x) {
+    if (x < 0) {
+        *buf = '-';
+        // Negate unsigned, so INT64_MIN is all right
+        return 1 + idris_fmt_u64(buf + 1, 0 - (uint64_t)x);
+    }
+    return idris_fmt_u64(buf, (uint64_t)x);
+}
+
+/* Shortest round trip doubles, following Ulf Adams, "Ryū: fast
+   float-to-string conversion" (PLDI 2018). The mantissa is scaled by a
+   128 bit approximation of a power of 5 from the tables below, which
+   finds the decimal interval of numbers which would read back as the
+   same double, and then digits are removed for as long as the interval
+   still contains a number with that many digits.
+
+   POW5_INV_SPLIT[q] is 2^(pow5bits(q) - 1 + 125) / 5^q, plus one, and
+   POW5_SPLIT[i] is 5^i shifted to 125 bits, least significant half
+   first. They were generated by this Python:
+
+     def pow5bits(e): return ((e * 1217359) >> 19) + 1
+     inv = [(1 << (pow5bits(q) - 1 + 125)) // 5**q + 1 for q in range(342)]
+     fwd = [5**i >> (pow5bits(i) - 125) if pow5bits(i) > 125
+            else 5**i << (125 - pow5bits(i)) for i in range(326)]
+*/
+
+#define POW5_INV_BITCOUNT 125
+#define POW5_BITCOUNT 125
+
+static const uint64_t POW5_INV_SPLIT[342][2] = {
+    { 1U, 2305843009213693952U }, { 11068046444225730970U, 1844674407370955161U },
+    { 5165088340638674453U, 1475739525896764129U }, { 7821419487252849886U, 1180591620717411303U },
+    { 8824922364862649494U, 1888946593147858085U }, { 7059937891890119595U, 1511157274518286468U },
+    { 13026647942995916322U, 1208925819614629174U }, { 9774590264567735146U, 1934281311383406679U },
+    { 11509021026396098440U, 1547425049106725343U }, { 16585914450600699399U, 1237940039285380274U },
+    { 15469416676735388068U, 1980704062856608439U }, { 16064882156130220778U, 1584563250285286751U },
+    { 9162556910162266299U, 1267650600228229401U }, { 7281393426775805432U, 2028240960365167042U },
+    { 16893161185646375315U, 1622592768292133633U }, { 2446482504291369283U, 1298074214633706907U },
+    { 7603720821608101175U, 2076918743413931051U }, { 2393627842544570617U, 1661534994731144841U },
+    { 16672297533003297786U, 1329227995784915872U }, { 11918280793837635165U, 2126764793255865396U },
+    { 5845275820328197809U, 1701411834604692317U }, { 15744267100488289217U, 1361129467683753853U },
+    { 3054734472329800808U, 2177807148294006166U }, { 17201182836831481939U, 1742245718635204932U },
+    { 6382248639981364905U, 1393796574908163946U }, { 2832900194486363201U, 2230074519853062314U },
+    { 5955668970331000884U, 1784059615882449851U }, { 1075186361522890384U, 1427247692705959881U },
+    { 12788344622662355584U, 2283596308329535809U }, { 13920024512871794791U, 1826877046663628647U },
+    { 3757321980813615186U, 1461501637330902918U }, { 10384555214134712795U, 1169201309864722334U },
+    { 5547241898389809503U, 1870722095783555735U }, { 4437793518711847602U, 1496577676626844588U },
+    { 10928932444453298728U, 1197262141301475670U }, { 17486291911125277965U, 1915619426082361072U },
+    { 6610335899416401726U, 1532495540865888858U }, { 12666966349016942027U, 1225996432692711086U },
+    { 12888448528943286597U, 1961594292308337738U }, { 17689456452638449924U, 1569275433846670190U },
+    { 14151565162110759939U, 1255420347077336152U }, { 7885109000409574610U, 2008672555323737844U },
+    { 9997436015069570011U, 1606938044258990275U }, { 7997948812055656009U, 1285550435407192220U },
+    { 12796718099289049614U, 2056880696651507552U }, { 2858676849947419045U, 1645504557321206042U },
+    { 13354987924183666206U, 1316403645856964833U }, { 17678631863951955605U, 2106245833371143733U },
+    { 3074859046935833515U, 1684996666696914987U }, { 13527933681774397782U, 1347997333357531989U },
+    { 10576647446613305481U, 2156795733372051183U }, { 15840015586774465031U, 1725436586697640946U },
+    { 8982663654677661702U, 1380349269358112757U }, { 18061610662226169046U, 2208558830972980411U },
+    { 10759939715039024913U, 1766847064778384329U }, { 12297300586773130254U, 1413477651822707463U },
+    { 15986332124095098083U, 2261564242916331941U }, { 9099716884534168143U, 1809251394333065553U },
+    { 14658471137111155161U, 1447401115466452442U }, { 4348079280205103483U, 1157920892373161954U },
+    { 14335624477811986218U, 1852673427797059126U }, { 7779150767507678651U, 1482138742237647301U },
+    { 2533971799264232598U, 1185710993790117841U }, { 15122401323048503126U, 1897137590064188545U },
+    { 12097921058438802501U, 1517710072051350836U }, { 5988988032009131678U, 1214168057641080669U },
+    { 16961078480698431330U, 1942668892225729070U }, { 13568862784558745064U, 1554135113780583256U },
+    { 7165741412905085728U, 1243308091024466605U }, { 11465186260648137165U, 1989292945639146568U },
+    { 16550846638002330379U, 1591434356511317254U }, { 16930026125143774626U, 1273147485209053803U },
+    { 4951948911778577463U, 2037035976334486086U }, { 272210314680951647U, 1629628781067588869U },
+    { 3907117066486671641U, 1303703024854071095U }, { 6251387306378674625U, 2085924839766513752U },
+    { 16069156289328670670U, 1668739871813211001U }, { 9165976216721026213U, 1334991897450568801U },
+    { 7286864317269821294U, 2135987035920910082U }, { 16897537898041588005U, 1708789628736728065U },
+    { 13518030318433270404U, 1367031702989382452U }, { 6871453250525591353U, 2187250724783011924U },
+    { 9186511415162383406U, 1749800579826409539U }, { 11038557946871817048U, 1399840463861127631U },
+    { 10282995085511086630U, 2239744742177804210U }, { 8226396068408869304U, 1791795793742243368U },
+    { 13959814484210916090U, 1433436634993794694U }, { 11267656730511734774U, 2293498615990071511U },
+    { 5324776569667477496U, 1834798892792057209U }, { 7949170070475892320U, 1467839114233645767U },
+    { 17427382500606444826U, 1174271291386916613U }, { 5747719112518849781U, 1878834066219066582U },
+    { 15666221734240810795U, 1503067252975253265U }, { 12532977387392648636U, 1202453802380202612U },
+    { 5295368560860596524U, 1923926083808324180U }, { 4236294848688477220U, 1539140867046659344U },
+    { 7078384693692692099U, 1231312693637327475U }, { 11325415509908307358U, 1970100309819723960U },
+    { 9060332407926645887U, 1576080247855779168U }, { 14626963555825137356U, 1260864198284623334U },
+    { 12335095245094488799U, 2017382717255397335U }, { 9868076196075591040U, 1613906173804317868U },
+    { 15273158586344293478U, 1291124939043454294U }, { 13369007293925138595U, 2065799902469526871U },
+    { 7005857020398200553U, 1652639921975621497U }, { 16672732060544291412U, 1322111937580497197U },
+    { 11918976037903224966U, 2115379100128795516U }, { 5845832015580669650U, 1692303280103036413U },
+    { 12055363241948356366U, 1353842624082429130U }, { 841837113407818570U, 2166148198531886609U },
+    { 4362818505468165179U, 1732918558825509287U }, { 14558301248600263113U, 1386334847060407429U },
+    { 12225235553534690011U, 2218135755296651887U }, { 2401490813343931363U, 1774508604237321510U },
+    { 1921192650675145090U, 1419606883389857208U }, { 17831303500047873437U, 2271371013423771532U },
+    { 6886345170554478103U, 1817096810739017226U }, { 1819727321701672159U, 1453677448591213781U },
+    { 16213177116328979020U, 1162941958872971024U }, { 14873036941900635463U, 1860707134196753639U },
+    { 15587778368262418694U, 1488565707357402911U }, { 8780873879868024632U, 1190852565885922329U },
+    { 2981351763563108441U, 1905364105417475727U }, { 13453127855076217722U, 1524291284333980581U },
+    { 7073153469319063855U, 1219433027467184465U }, { 11317045550910502167U, 1951092843947495144U },
+    { 12742985255470312057U, 1560874275157996115U }, { 10194388204376249646U, 1248699420126396892U },
+    { 1553625868034358140U, 1997919072202235028U }, { 8621598323911307159U, 1598335257761788022U },
+    { 17965325103354776697U, 1278668206209430417U }, { 13987124906400001422U, 2045869129935088668U },
+    { 121653480894270168U, 1636695303948070935U }, { 97322784715416134U, 1309356243158456748U },
+    { 14913111714512307107U, 2094969989053530796U }, { 8241140556867935363U, 1675975991242824637U },
+    { 17660958889720079260U, 1340780792994259709U }, { 17189487779326395846U, 2145249268790815535U },
+    { 13751590223461116677U, 1716199415032652428U }, { 18379969808252713988U, 1372959532026121942U },
+    { 14650556434236701088U, 2196735251241795108U }, { 652398703163629901U, 1757388200993436087U },
+    { 11589965406756634890U, 1405910560794748869U }, { 7475898206584884855U, 2249456897271598191U },
+    { 2291369750525997561U, 1799565517817278553U }, { 9211793429904618695U, 1439652414253822842U },
+    { 18428218302589300235U, 2303443862806116547U }, { 7363877012587619542U, 1842755090244893238U },
+    { 13269799239553916280U, 1474204072195914590U }, { 10615839391643133024U, 1179363257756731672U },
+    { 2227947767661371545U, 1886981212410770676U }, { 16539753473096738529U, 1509584969928616540U },
+    { 13231802778477390823U, 1207667975942893232U }, { 6413489186596184024U, 1932268761508629172U },
+    { 16198837793502678189U, 1545815009206903337U }, { 5580372605318321905U, 1236652007365522670U },
+    { 8928596168509315048U, 1978643211784836272U }, { 18210923379033183008U, 1582914569427869017U },
+    { 7190041073742725760U, 1266331655542295214U }, { 436019273762630246U, 2026130648867672343U },
+    { 7727513048493924843U, 1620904519094137874U }, { 9871359253537050198U, 1296723615275310299U },
+    { 4726128361433549347U, 2074757784440496479U }, { 7470251503888749801U, 1659806227552397183U },
+    { 13354898832594820487U, 1327844982041917746U }, { 13989140502667892133U, 2124551971267068394U },
+    { 14880661216876224029U, 1699641577013654715U }, { 11904528973500979224U, 1359713261610923772U },
+    { 4289851098633925465U, 2175541218577478036U }, { 18189276137874781665U, 1740432974861982428U },
+    { 3483374466074094362U, 1392346379889585943U }, { 1884050330976640656U, 2227754207823337509U },
+    { 5196589079523222848U, 1782203366258670007U }, { 15225317707844309248U, 1425762693006936005U },
+    { 5913764258841343181U, 2281220308811097609U }, { 8420360221814984868U, 1824976247048878087U },
+    { 17804334621677718864U, 1459980997639102469U }, { 17932816512084085415U, 1167984798111281975U },
+    { 10245762345624985047U, 1868775676978051161U }, { 4507261061758077715U, 1495020541582440929U },
+    { 7295157664148372495U, 1196016433265952743U }, { 7982903447895485668U, 1913626293225524389U },
+    { 10075671573058298858U, 1530901034580419511U }, { 4371188443704728763U, 1224720827664335609U },
+    { 14372599139411386667U, 1959553324262936974U }, { 15187428126271019657U, 1567642659410349579U },
+    { 15839291315758726049U, 1254114127528279663U }, { 3206773216762499739U, 2006582604045247462U },
+    { 13633465017635730761U, 1605266083236197969U }, { 14596120828850494932U, 1284212866588958375U },
+    { 4907049252451240275U, 2054740586542333401U }, { 236290587219081897U, 1643792469233866721U },
+    { 14946427728742906810U, 1315033975387093376U }, { 16535586736504830250U, 2104054360619349402U },
+    { 5849771759720043554U, 1683243488495479522U }, { 15747863852001765813U, 1346594790796383617U },
+    { 10439186904235184007U, 2154551665274213788U }, { 15730047152871967852U, 1723641332219371030U },
+    { 12584037722297574282U, 1378913065775496824U }, { 9066413911450387881U, 2206260905240794919U },
+    { 10942479943902220628U, 1765008724192635935U }, { 8753983955121776503U, 1412006979354108748U },
+    { 10317025513452932081U, 2259211166966573997U }, { 874922781278525018U, 1807368933573259198U },
+    { 8078635854506640661U, 1445895146858607358U }, { 13841606313089133175U, 1156716117486885886U },
+    { 14767872471458792434U, 1850745787979017418U }, { 746251532941302978U, 1480596630383213935U },
+    { 597001226353042382U, 1184477304306571148U }, { 15712597221132509104U, 1895163686890513836U },
+    { 8880728962164096960U, 1516130949512411069U }, { 10793931984473187891U, 1212904759609928855U },
+    { 17270291175157100626U, 1940647615375886168U }, { 2748186495899949531U, 1552518092300708935U },
+    { 2198549196719959625U, 1242014473840567148U }, { 18275073973719576693U, 1987223158144907436U },
+    { 10930710364233751031U, 1589778526515925949U }, { 12433917106128911148U, 1271822821212740759U },
+    { 8826220925580526867U, 2034916513940385215U }, { 7060976740464421494U, 1627933211152308172U },
+    { 16716827836597268165U, 1302346568921846537U }, { 11989529279587987770U, 2083754510274954460U },
+    { 9591623423670390216U, 1667003608219963568U }, { 15051996368420132820U, 1333602886575970854U },
+    { 13015147745246481542U, 2133764618521553367U }, { 3033420566713364587U, 1707011694817242694U },
+    { 6116085268112601993U, 1365609355853794155U }, { 9785736428980163188U, 2184974969366070648U },
+    { 15207286772667951197U, 1747979975492856518U }, { 1097782973908629988U, 1398383980394285215U },
+    { 1756452758253807981U, 2237414368630856344U }, { 5094511021344956708U, 1789931494904685075U },
+    { 4075608817075965366U, 1431945195923748060U }, { 6520974107321544586U, 2291112313477996896U },
+    { 1527430471115325346U, 1832889850782397517U }, { 12289990821117991246U, 1466311880625918013U },
+    { 17210690286378213644U, 1173049504500734410U }, { 9090360384495590213U, 1876879207201175057U },
+    { 18340334751822203140U, 1501503365760940045U }, { 14672267801457762512U, 1201202692608752036U },
+    { 16096930852848599373U, 1921924308174003258U }, { 1809498238053148529U, 1537539446539202607U },
+    { 12515645034668249793U, 1230031557231362085U }, { 1578287981759648052U, 1968050491570179337U },
+    { 12330676829633449412U, 1574440393256143469U }, { 13553890278448669853U, 1259552314604914775U },
+    { 3239480371808320148U, 2015283703367863641U }, { 17348979556414297411U, 1612226962694290912U },
+    { 6500486015647617283U, 1289781570155432730U }, { 10400777625036187652U, 2063650512248692368U },
+    { 15699319729512770768U, 1650920409798953894U }, { 16248804598352126938U, 1320736327839163115U },
+    { 7551343283653851484U, 2113178124542660985U }, { 6041074626923081187U, 1690542499634128788U },
+    { 12211557331022285596U, 1352433999707303030U }, { 1091747655926105338U, 2163894399531684849U },
+    { 4562746939482794594U, 1731115519625347879U }, { 7339546366328145998U, 1384892415700278303U },
+    { 8053925371383123274U, 2215827865120445285U }, { 6443140297106498619U, 1772662292096356228U },
+    { 12533209867169019542U, 1418129833677084982U }, { 5295740528502789974U, 2269007733883335972U },
+    { 15304638867027962949U, 1815206187106668777U }, { 4865013464138549713U, 1452164949685335022U },
+    { 14960057215536570740U, 1161731959748268017U }, { 9178696285890871890U, 1858771135597228828U },
+    { 14721654658196518159U, 1487016908477783062U }, { 4398626097073393881U, 1189613526782226450U },
+    { 7037801755317430209U, 1903381642851562320U }, { 5630241404253944167U, 1522705314281249856U },
+    { 814844308661245011U, 1218164251424999885U }, { 1303750893857992017U, 1949062802279999816U },
+    { 15800395974054034906U, 1559250241823999852U }, { 5261619149759407279U, 1247400193459199882U },
+    { 12107939454356961969U, 1995840309534719811U }, { 5997002748743659252U, 1596672247627775849U },
+    { 8486951013736837725U, 1277337798102220679U }, { 2511075177753209390U, 2043740476963553087U },
+    { 13076906586428298482U, 1634992381570842469U }, { 14150874083884549109U, 1307993905256673975U },
+    { 4194654460505726958U, 2092790248410678361U }, { 18113118827372222859U, 1674232198728542688U },
+    { 3422448617672047318U, 1339385758982834151U }, { 16543964232501006678U, 2143017214372534641U },
+    { 9545822571258895019U, 1714413771498027713U }, { 15015355686490936662U, 1371531017198422170U },
+    { 5577825024675947042U, 2194449627517475473U }, { 11840957649224578280U, 1755559702013980378U },
+    { 16851463748863483271U, 1404447761611184302U }, { 12204946739213931940U, 2247116418577894884U },
+    { 13453306206113055875U, 1797693134862315907U }, { 3383947335406624054U, 1438154507889852726U },
+    { 16482362180876329456U, 2301047212623764361U }, { 9496540929959153242U, 1840837770099011489U },
+    { 11286581558709232917U, 1472670216079209191U }, { 5339916432225476010U, 1178136172863367353U },
+    { 4854517476818851293U, 1885017876581387765U }, { 3883613981455081034U, 1508014301265110212U },
+    { 14174937629389795797U, 1206411441012088169U }, { 11611853762797942306U, 1930258305619341071U },
+    { 5600134195496443521U, 1544206644495472857U }, { 15548153800622885787U, 1235365315596378285U },
+    { 6430302007287065643U, 1976584504954205257U }, { 16212288050055383484U, 1581267603963364205U },
+    { 12969830440044306787U, 1265014083170691364U }, { 9683682259845159889U, 2024022533073106183U },
+    { 15125643437359948558U, 1619218026458484946U }, { 8411165935146048523U, 1295374421166787957U },
+    { 17147214310975587960U, 2072599073866860731U }, { 10028422634038560045U, 1658079259093488585U },
+    { 8022738107230848036U, 1326463407274790868U }, { 9147032156827446534U, 2122341451639665389U },
+    { 11006974540203867551U, 1697873161311732311U }, { 5116230817421183718U, 1358298529049385849U },
+    { 15564666937357714594U, 2173277646479017358U }, { 1383687105660440706U, 1738622117183213887U },
+    { 12174996128754083534U, 1390897693746571109U }, { 8411947361780802685U, 2225436309994513775U },
+    { 6729557889424642148U, 1780349047995611020U }, { 5383646311539713719U, 1424279238396488816U },
+    { 1235136468979721303U, 2278846781434382106U }, { 15745504434151418335U, 1823077425147505684U },
+    { 16285752362063044992U, 1458461940118004547U }, { 5649904260166615347U, 1166769552094403638U },
+    { 5350498001524674232U, 1866831283351045821U }, { 591049586477829062U, 1493465026680836657U },
+    { 11540886113407994219U, 1194772021344669325U }, { 18673707743239135U, 1911635234151470921U },
+    { 14772334225162232601U, 1529308187321176736U }, { 8128518565387875758U, 1223446549856941389U },
+    { 1937583260394870242U, 1957514479771106223U }, { 8928764237799716840U, 1566011583816884978U },
+    { 14521709019723594119U, 1252809267053507982U }, { 8477339172590109297U, 2004494827285612772U },
+    { 17849917782297818407U, 1603595861828490217U }, { 6901236596354434079U, 1282876689462792174U },
+    { 18420676183650915173U, 2052602703140467478U }, { 3668494502695001169U, 1642082162512373983U },
+    { 10313493231639821582U, 1313665730009899186U }, { 9122891541139893884U, 2101865168015838698U },
+    { 14677010862395735754U, 1681492134412670958U }, { 673562245690857633U, 1345193707530136767U },
+};
+
+static const uint64_t POW5_SPLIT[326][2] = {
+    { 0U, 1152921504606846976U }, { 0U, 1441151880758558720U },
+    { 0U, 1801439850948198400U }, { 0U, 2251799813685248000U },
+    { 0U, 1407374883553280000U }, { 0U, 1759218604441600000U },
+    { 0U, 2199023255552000000U }, { 0U, 1374389534720000000U },
+    { 0U, 1717986918400000000U }, { 0U, 2147483648000000000U },
+    { 0U, 1342177280000000000U }, { 0U, 1677721600000000000U },
+    { 0U, 2097152000000000000U }, { 0U, 1310720000000000000U },
+    { 0U, 1638400000000000000U }, { 0U, 2048000000000000000U },
+    { 0U, 1280000000000000000U }, { 0U, 1600000000000000000U },
+    { 0U, 2000000000000000000U }, { 0U, 1250000000000000000U },
+    { 0U, 1562500000000000000U }, { 0U, 1953125000000000000U },
+    { 0U, 1220703125000000000U }, { 0U, 1525878906250000000U },
+    { 0U, 1907348632812500000U }, { 0U, 1192092895507812500U },
+    { 0U, 1490116119384765625U }, { 4611686018427387904U, 1862645149230957031U },
+    { 9799832789158199296U, 1164153218269348144U }, { 12249790986447749120U, 1455191522836685180U },
+    { 15312238733059686400U, 1818989403545856475U }, { 14528612397897220096U, 2273736754432320594U },
+    { 13692068767113150464U, 1421085471520200371U }, { 12503399940464050176U, 1776356839400250464U },
+    { 15629249925580062720U, 2220446049250313080U }, { 9768281203487539200U, 1387778780781445675U },
+    { 7598665485932036096U, 1734723475976807094U }, { 274959820560269312U, 2168404344971008868U },
+    { 9395221924704944128U, 1355252715606880542U }, { 2520655369026404352U, 1694065894508600678U },
+    { 12374191248137781248U, 2117582368135750847U }, { 14651398557727195136U, 1323488980084844279U },
+    { 13702562178731606016U, 1654361225106055349U }, { 3293144668132343808U, 2067951531382569187U },
+    { 18199116482078572544U, 1292469707114105741U }, { 8913837547316051968U, 1615587133892632177U },
+    { 15753982952572452864U, 2019483917365790221U }, { 12152082354571476992U, 1262177448353618888U },
+    { 15190102943214346240U, 1577721810442023610U }, { 9764256642163156992U, 1972152263052529513U },
+    { 17631875447420442880U, 1232595164407830945U }, { 8204786253993389888U, 1540743955509788682U },
+    { 1032610780636961552U, 1925929944387235853U }, { 2951224747111794922U, 1203706215242022408U },
+    { 3689030933889743652U, 1504632769052528010U }, { 13834660704216955373U, 1880790961315660012U },
+    { 17870034976990372916U, 1175494350822287507U }, { 17725857702810578241U, 1469367938527859384U },
+    { 3710578054803671186U, 1836709923159824231U }, { 26536550077201078U, 2295887403949780289U },
+    { 11545800389866720434U, 1434929627468612680U }, { 14432250487333400542U, 1793662034335765850U },
+    { 8816941072311974870U, 2242077542919707313U }, { 17039803216263454053U, 1401298464324817070U },
+    { 12076381983474541759U, 1751623080406021338U }, { 5872105442488401391U, 2189528850507526673U },
+    { 15199280947623720629U, 1368455531567204170U }, { 9775729147674874978U, 1710569414459005213U },
+    { 16831347453020981627U, 2138211768073756516U }, { 1296220121283337709U, 1336382355046097823U },
+    { 15455333206886335848U, 1670477943807622278U }, { 10095794471753144002U, 2088097429759527848U },
+    { 6309871544845715001U, 1305060893599704905U }, { 12499025449484531656U, 1631326116999631131U },
+    { 11012095793428276666U, 2039157646249538914U }, { 11494245889320060820U, 1274473528905961821U },
+    { 532749306367912313U, 1593091911132452277U }, { 5277622651387278295U, 1991364888915565346U },
+    { 7910200175544436838U, 1244603055572228341U }, { 14499436237857933952U, 1555753819465285426U },
+    { 8900923260467641632U, 1944692274331606783U }, { 12480606065433357876U, 1215432671457254239U },
+    { 10989071563364309441U, 1519290839321567799U }, { 9124653435777998898U, 1899113549151959749U },
+    { 8008751406574943263U, 1186945968219974843U }, { 5399253239791291175U, 1483682460274968554U },
+    { 15972438586593889776U, 1854603075343710692U }, { 759402079766405302U, 1159126922089819183U },
+    { 14784310654990170340U, 1448908652612273978U }, { 9257016281882937117U, 1811135815765342473U },
+    { 16182956370781059300U, 2263919769706678091U }, { 7808504722524468110U, 1414949856066673807U },
+    { 5148944884728197234U, 1768687320083342259U }, { 1824495087482858639U, 2210859150104177824U },
+    { 1140309429676786649U, 1381786968815111140U }, { 1425386787095983311U, 1727233711018888925U },
+    { 6393419502297367043U, 2159042138773611156U }, { 13219259225790630210U, 1349401336733506972U },
+    { 16524074032238287762U, 1686751670916883715U }, { 16043406521870471799U, 2108439588646104644U },
+    { 803757039314269066U, 1317774742903815403U }, { 14839754354425000045U, 1647218428629769253U },
+    { 4714634887749086344U, 2059023035787211567U }, { 9864175832484260821U, 1286889397367007229U },
+    { 16941905809032713930U, 1608611746708759036U }, { 2730638187581340797U, 2010764683385948796U },
+    { 10930020904093113806U, 1256727927116217997U }, { 18274212148543780162U, 1570909908895272496U },
+    { 4396021111970173586U, 1963637386119090621U }, { 5053356204195052443U, 1227273366324431638U },
+    { 15540067292098591362U, 1534091707905539547U }, { 14813398096695851299U, 1917614634881924434U },
+    { 13870059828862294966U, 1198509146801202771U }, { 12725888767650480803U, 1498136433501503464U },
+    { 15907360959563101004U, 1872670541876879330U }, { 14553786618154326031U, 1170419088673049581U },
+    { 4357175217410743827U, 1463023860841311977U }, { 10058155040190817688U, 1828779826051639971U },
+    { 7961007781811134206U, 2285974782564549964U }, { 14199001900486734687U, 1428734239102843727U },
+    { 13137066357181030455U, 1785917798878554659U }, { 11809646928048900164U, 2232397248598193324U },
+    { 16604401366885338411U, 1395248280373870827U }, { 16143815690179285109U, 1744060350467338534U },
+    { 10956397575869330579U, 2180075438084173168U }, { 6847748484918331612U, 1362547148802608230U },
+    { 17783057643002690323U, 1703183936003260287U }, { 17617136035325974999U, 2128979920004075359U },
+    { 17928239049719816230U, 1330612450002547099U }, { 17798612793722382384U, 1663265562503183874U },
+    { 13024893955298202172U, 2079081953128979843U }, { 5834715712847682405U, 1299426220705612402U },
+    { 16516766677914378815U, 1624282775882015502U }, { 11422586310538197711U, 2030353469852519378U },
+    { 11750802462513761473U, 1268970918657824611U }, { 10076817059714813937U, 1586213648322280764U },
+    { 12596021324643517422U, 1982767060402850955U }, { 5566670318688504437U, 1239229412751781847U },
+    { 2346651879933242642U, 1549036765939727309U }, { 7545000868343941206U, 1936295957424659136U },
+    { 4715625542714963254U, 1210184973390411960U }, { 5894531928393704067U, 1512731216738014950U },
+    { 16591536947346905892U, 1890914020922518687U }, { 17287239619732898039U, 1181821263076574179U },
+    { 16997363506238734644U, 1477276578845717724U }, { 2799960309088866689U, 1846595723557147156U },
+    { 10973347230035317489U, 1154122327223216972U }, { 13716684037544146861U, 1442652909029021215U },
+    { 12534169028502795672U, 1803316136286276519U }, { 11056025267201106687U, 2254145170357845649U },
+    { 18439230838069161439U, 1408840731473653530U }, { 13825666510731675991U, 1761050914342066913U },
+    { 3447025083132431277U, 2201313642927583642U }, { 6766076695385157452U, 1375821026829739776U },
+    { 8457595869231446815U, 1719776283537174720U }, { 10571994836539308519U, 2149720354421468400U },
+    { 6607496772837067824U, 1343575221513417750U }, { 17482743002901110588U, 1679469026891772187U },
+    { 17241742735199000331U, 2099336283614715234U }, { 15387775227926763111U, 1312085177259197021U },
+    { 5399660979626290177U, 1640106471573996277U }, { 11361262242960250625U, 2050133089467495346U },
+    { 11712474920277544544U, 1281333180917184591U }, { 10028907631919542777U, 1601666476146480739U },
+    { 7924448521472040567U, 2002083095183100924U }, { 14176152362774801162U, 1251301934489438077U },
+    { 3885132398186337741U, 1564127418111797597U }, { 9468101516160310080U, 1955159272639746996U },
+    { 15140935484454969608U, 1221974545399841872U }, { 479425281859160394U, 1527468181749802341U },
+    { 5210967620751338397U, 1909335227187252926U }, { 17091912818251750210U, 1193334516992033078U },
+    { 12141518985959911954U, 1491668146240041348U }, { 15176898732449889943U, 1864585182800051685U },
+    { 11791404716994875166U, 1165365739250032303U }, { 10127569877816206054U, 1456707174062540379U },
+    { 8047776328842869663U, 1820883967578175474U }, { 836348374198811271U, 2276104959472719343U },
+    { 7440246761515338900U, 1422565599670449589U }, { 13911994470321561530U, 1778206999588061986U },
+    { 8166621051047176104U, 2222758749485077483U }, { 2798295147690791113U, 1389224218428173427U },
+    { 17332926989895652603U, 1736530273035216783U }, { 17054472718942177850U, 2170662841294020979U },
+    { 8353202440125167204U, 1356664275808763112U }, { 10441503050156459005U, 1695830344760953890U },
+    { 3828506775840797949U, 2119787930951192363U }, { 86973725686804766U, 1324867456844495227U },
+    { 13943775212390669669U, 1656084321055619033U }, { 3594660960206173375U, 2070105401319523792U },
+    { 2246663100128858359U, 1293815875824702370U }, { 12031700912015848757U, 1617269844780877962U },
+    { 5816254103165035138U, 2021587305976097453U }, { 5941001823691840913U, 1263492066235060908U },
+    { 7426252279614801142U, 1579365082793826135U }, { 4671129331091113523U, 1974206353492282669U },
+    { 5225298841145639904U, 1233878970932676668U }, { 6531623551432049880U, 1542348713665845835U },
+    { 3552843420862674446U, 1927935892082307294U }, { 16055585193321335241U, 1204959932551442058U },
+    { 10846109454796893243U, 1506199915689302573U }, { 18169322836923504458U, 1882749894611628216U },
+    { 11355826773077190286U, 1176718684132267635U }, { 9583097447919099954U, 1470898355165334544U },
+    { 11978871809898874942U, 1838622943956668180U }, { 14973589762373593678U, 2298278679945835225U },
+    { 2440964573842414192U, 1436424174966147016U }, { 3051205717303017741U, 1795530218707683770U },
+    { 13037379183483547984U, 2244412773384604712U }, { 8148361989677217490U, 1402757983365377945U },
+    { 14797138505523909766U, 1753447479206722431U }, { 13884737113477499304U, 2191809349008403039U },
+    { 15595489723564518921U, 1369880843130251899U }, { 14882676136028260747U, 1712351053912814874U },
+    { 9379973133180550126U, 2140438817391018593U }, { 17391698254306313589U, 1337774260869386620U },
+    { 3292878744173340370U, 1672217826086733276U }, { 4116098430216675462U, 2090272282608416595U },
+    { 266718509671728212U, 1306420176630260372U }, { 333398137089660265U, 1633025220787825465U },
+    { 5028433689789463235U, 2041281525984781831U }, { 10060300083759496378U, 1275800953740488644U },
+    { 12575375104699370472U, 1594751192175610805U }, { 1884160825592049379U, 1993438990219513507U },
+    { 17318501580490888525U, 1245899368887195941U }, { 7813068920331446945U, 1557374211108994927U },
+    { 5154650131986920777U, 1946717763886243659U }, { 915813323278131534U, 1216698602428902287U },
+    { 14979824709379828129U, 1520873253036127858U }, { 9501408849870009354U, 1901091566295159823U },
+    { 12855909558809837702U, 1188182228934474889U }, { 2234828893230133415U, 1485227786168093612U },
+    { 2793536116537666769U, 1856534732710117015U }, { 8663489100477123587U, 1160334207943823134U },
+    { 1605989338741628675U, 1450417759929778918U }, { 11230858710281811652U, 1813022199912223647U },
+    { 9426887369424876662U, 2266277749890279559U }, { 12809333633531629769U, 1416423593681424724U },
+    { 16011667041914537212U, 1770529492101780905U }, { 6179525747111007803U, 2213161865127226132U },
+    { 13085575628799155685U, 1383226165704516332U }, { 16356969535998944606U, 1729032707130645415U },
+    { 15834525901571292854U, 2161290883913306769U }, { 2979049660840976177U, 1350806802445816731U },
+    { 17558870131333383934U, 1688508503057270913U }, { 8113529608884566205U, 2110635628821588642U },
+    { 9682642023980241782U, 1319147268013492901U }, { 16714988548402690132U, 1648934085016866126U },
+    { 11670363648648586857U, 2061167606271082658U }, { 11905663298832754689U, 1288229753919426661U },
+    { 1047021068258779650U, 1610287192399283327U }, { 15143834390605638274U, 2012858990499104158U },
+    { 4853210475701136017U, 1258036869061940099U }, { 1454827076199032118U, 1572546086327425124U },
+    { 1818533845248790147U, 1965682607909281405U }, { 3442426662494187794U, 1228551629943300878U },
+    { 13526405364972510550U, 1535689537429126097U }, { 3072948650933474476U, 1919611921786407622U },
+    { 15755650962115585259U, 1199757451116504763U }, { 15082877684217093670U, 1499696813895630954U },
+    { 9630225068416591280U, 1874621017369538693U }, { 8324733676974063502U, 1171638135855961683U },
+    { 5794231077790191473U, 1464547669819952104U }, { 7242788847237739342U, 1830684587274940130U },
+    { 18276858095901949986U, 2288355734093675162U }, { 16034722328366106645U, 1430222333808546976U },
+    { 1596658836748081690U, 1787777917260683721U }, { 6607509564362490017U, 2234722396575854651U },
+    { 1823850468512862308U, 1396701497859909157U }, { 6891499104068465790U, 1745876872324886446U },
+    { 17837745916940358045U, 2182346090406108057U }, { 4231062170446641922U, 1363966306503817536U },
+    { 5288827713058302403U, 1704957883129771920U }, { 6611034641322878003U, 2131197353912214900U },
+    { 13355268687681574560U, 1331998346195134312U }, { 16694085859601968200U, 1664997932743917890U },
+    { 11644235287647684442U, 2081247415929897363U }, { 4971804045566108824U, 1300779634956185852U },
+    { 6214755056957636030U, 1625974543695232315U }, { 3156757802769657134U, 2032468179619040394U },
+    { 6584659645158423613U, 1270292612261900246U }, { 17454196593302805324U, 1587865765327375307U },
+    { 17206059723201118751U, 1984832206659219134U }, { 6142101308573311315U, 1240520129162011959U },
+    { 3065940617289251240U, 1550650161452514949U }, { 8444111790038951954U, 1938312701815643686U },
+    { 665883850346957067U, 1211445438634777304U }, { 832354812933696334U, 1514306798293471630U },
+    { 10263815553021896226U, 1892883497866839537U }, { 17944099766707154901U, 1183052186166774710U },
+    { 13206752671529167818U, 1478815232708468388U }, { 16508440839411459773U, 1848519040885585485U },
+    { 12623618533845856310U, 1155324400553490928U }, { 15779523167307320387U, 1444155500691863660U },
+    { 1277659885424598868U, 1805194375864829576U }, { 1597074856780748586U, 2256492969831036970U },
+    { 5609857803915355770U, 1410308106144398106U }, { 16235694291748970521U, 1762885132680497632U },
+    { 1847873790976661535U, 2203606415850622041U }, { 12684136165428883219U, 1377254009906638775U },
+    { 11243484188358716120U, 1721567512383298469U }, { 219297180166231438U, 2151959390479123087U },
+    { 7054589765244976505U, 1344974619049451929U }, { 13429923224983608535U, 1681218273811814911U },
+    { 12175718012802122765U, 2101522842264768639U }, { 14527352785642408584U, 1313451776415480399U },
+    { 13547504963625622826U, 1641814720519350499U }, { 12322695186104640628U, 2052268400649188124U },
+    { 16925056528170176201U, 1282667750405742577U }, { 7321262604930556539U, 1603334688007178222U },
+    { 18374950293017971482U, 2004168360008972777U }, { 4566814905495150320U, 1252605225005607986U },
+    { 14931890668723713708U, 1565756531257009982U }, { 9441491299049866327U, 1957195664071262478U },
+    { 1289246043478778550U, 1223247290044539049U }, { 6223243572775861092U, 1529059112555673811U },
+    { 3167368447542438461U, 1911323890694592264U }, { 1979605279714024038U, 1194577431684120165U },
+    { 7086192618069917952U, 1493221789605150206U }, { 18081112809442173248U, 1866527237006437757U },
+    { 13606538515115052232U, 1166579523129023598U }, { 7784801107039039482U, 1458224403911279498U },
+    { 507629346944023544U, 1822780504889099373U }, { 5246222702107417334U, 2278475631111374216U },
+    { 3278889188817135834U, 1424047269444608885U }, { 8710297504448807696U, 1780059086805761106U },
+};
+
+// ceil(log2(5^e)), or 1 when e is 0
+static inline int pow5bits(int e) {
+    return ((e * 1217359) >> 19) + 1;
+}
+
+// floor(log10(2^e))
+static inline int log10Pow2(int e) {
+    return (e * 78913) >> 18;
+}
+
+// floor(log10(5^e))
+static inline int log10Pow5(int e) {
+    return (e * 732923) >> 20;
+}
+
+static inline int multipleOfPowerOf5(uint64_t x, int p) {
+    int count = 0;
+    while (x % 5 == 0) {
+        x /= 5;
+        ++count;
+    }
+    return count >= p;
+}
+
+static inline int multipleOfPowerOf2(uint64_t x, int p) {
+    return (x & ((1ull << p) - 1)) == 0;
+}
+
+#ifndef __SIZEOF_INT128__
+// a * b, returning the low 64 bits and putting the high 64 bits in *hi
+static inline uint64_t umul128(uint64_t a, uint64_t b, uint64_t* hi) {
+    uint64_t aLo = (uint32_t)a, aHi = a >> 32;
+    uint64_t bLo = (uint32_t)b, bHi = b >> 32;
+    uint64_t b00 = aLo * bLo, b01 = aLo * bHi;
+    uint64_t b10 = aHi * bLo, b11 = aHi * bHi;
+    uint64_t mid1 = b10 + (b00 >> 32);
+    uint64_t mid2 = b01 + (uint32_t)mid1;
+    *hi = b11 + (mid1 >> 32) + (mid2 >> 32);
+    return (mid2 << 32) | (uint32_t)b00;
+}
+#endif
+
+// (m * mul) >> j, where mul is 128 bits, m at most 55 bits, and j > 64
+static inline uint64_t mulShift64(uint64_t m, const uint64_t* mul, int j) {
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 b0 = (unsigned __int128)m * mul[0];
+    unsigned __int128 b2 = (unsigned __int128)m * mul[1];
+    return (uint64_t)(((b0 >> 64) + b2) >> (j - 64));
+#else
+    uint64_t hi0, hi2;
+    umul128(m, mul[0], &hi0);
+    uint64_t lo2 = umul128(m, mul[1], &hi2);
+    uint64_t lo = lo2 + hi0;
+    uint64_t hi = hi2 + (lo < lo2);
+    int s = j - 64;
+    return s >= 64 ? hi >> (s - 64) : (lo >> s) | (hi << (64 - s));
+#endif
+}
+
+// Find the shortest decimal which reads back as the double with the
+// given mantissa and exponent bits: *digits * 10^*exp10.
+static void shortest(uint64_t ieeeMantissa, int ieeeExponent,
+                     uint64_t* digits, int* exp10) {
+    int e2;
+    uint64_t m2;
+    if (ieeeExponent == 0) {
+        e2 = 1 - 1023 - 52 - 2;
+        m2 = ieeeMantissa;
+    } else {
+        e2 = ieeeExponent - 1023 - 52 - 2;
+        m2 = (1ull << 52) | ieeeMantissa;
+    }
+    int acceptBounds = (m2 & 1) == 0;
+
+    // The interval of numbers which round to this double is (mm, mp)
+    // around mv, all scaled by 4 so they're integers.
+    uint64_t mv = 4 * m2;
+    int mmShift = ieeeMantissa != 0 || ieeeExponent <= 1;
+
+    uint64_t vr, vp, vm;
+    int e10;
+    int vmIsTrailingZeros = 0, vrIsTrailingZeros = 0;
+    if (e2 >= 0) {
+        int q = log10Pow2(e2) - (e2 > 3);
+        e10 = q;
+        int k = POW5_INV_BITCOUNT + pow5bits(q) - 1;
+        int i = -e2 + q + k;
+        vr = mulShift64(4 * m2, POW5_INV_SPLIT[q], i);
+        vp = mulShift64(4 * m2 + 2, POW5_INV_SPLIT[q], i);
+        vm = mulShift64(4 * m2 - 1 - mmShift, POW5_INV_SPLIT[q], i);
+        if (q <= 21) {
+            // Only here can any of the three be a multiple of 5^q
+            if (mv % 5 == 0) {
+                vrIsTrailingZeros = multipleOfPowerOf5(mv, q);
+            } else if (acceptBounds) {
+                vmIsTrailingZeros = multipleOfPowerOf5(mv - 1 - mmShift, q);
+            } else {
+                vp -= multipleOfPowerOf5(mv + 2, q);
+            }
+        }
+    } else {
+        int q = log10Pow5(-e2) - (-e2 > 1);
+        e10 = q + e2;
+        int i = -e2 - q;
+        int k = pow5bits(i) - POW5_BITCOUNT;
+        int j = q - k;
+        vr = mulShift64(4 * m2, POW5_SPLIT[i], j);
+        vp = mulShift64(4 * m2 + 2, POW5_SPLIT[i], j);
+        vm = mulShift64(4 * m2 - 1 - mmShift, POW5_SPLIT[i], j);
+        if (q <= 1) {
+            // mv has at least q trailing zero bits, and so do mp and mm
+            vrIsTrailingZeros = 1;
+            if (acceptBounds) {
+                vmIsTrailingZeros = mmShift == 1;
+            } else {
+                --vp;
+            }
+        } else if (q < 63) {
+            vrIsTrailingZeros = multipleOfPowerOf2(mv, q);
+        }
+    }
+
+    // Remove digits while the interval still has a shorter number in it
+    int removed = 0;
+    int lastRemovedDigit = 0;
+    uint64_t output;
+    if (vmIsTrailingZeros || vrIsTrailingZeros) {
+        // Rare: track exactness, for rounding to even and the lower bound
+        while (vp / 10 > vm / 10) {
+            vmIsTrailingZeros &= vm % 10 == 0;
+            vrIsTrailingZeros &= lastRemovedDigit == 0;
+            lastRemovedDigit = (int)(vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            ++removed;
+        }
+        if (vmIsTrailingZeros) {
+            while (vm % 10 == 0) {
+                vrIsTrailingZeros &= lastRemovedDigit == 0;
+                lastRemovedDigit = (int)(vr % 10);
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                ++removed;
+            }
+        }
+        if (vrIsTrailingZeros && lastRemovedDigit == 5 && vr % 2 == 0) {
+            // Exactly halfway: round to even
+            lastRemovedDigit = 4;
+        }
+        output = vr + ((vr == vm && (!acceptBounds || !vmIsTrailingZeros)) ||
+                       lastRemovedDigit >= 5);
+    } else {
+        int roundUp = 0;
+        while (vp / 10 > vm / 10) {
+            roundUp = vr % 10 >= 5;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            ++removed;
+        }
+        output = vr + (vr == vm || roundUp);
+    }
+    *digits = output;
+    *exp10 = e10 + removed;
+}
+
+size_t idris_fmt_double(char* buf, double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    uint64_t ieeeMantissa = bits & ((1ull << 52) - 1);
+    int ieeeExponent = (int)((bits >> 52) & 0x7ff);
+    int sign = (int)(bits >> 63);
+
+    char* p = buf;
+    if (sign) {
+        *p++ = '-';
+    }
+    if (ieeeExponent == 0x7ff) {
+        // As glibc's printf spells them
+        memcpy(p, ieeeMantissa == 0 ? "inf" : "nan", 3);
+        return p + 3 - buf;
+    }
+    if (ieeeExponent == 0 && ieeeMantissa == 0) {
+        *p++ = '0';
+        return p - buf;
+    }
+
+    uint64_t digits;
+    int exp10;
+    int e2 = ieeeExponent - 1023 - 52;
+    uint64_t m2 = (1ull << 52) | ieeeMantissa;
+    if (ieeeExponent != 0 && e2 <= 0 && e2 >= -52 &&
+        (m2 & ((1ull << -e2) - 1)) == 0) {
+        // An integer below 2^53: the digits are exact
+        digits = m2 >> -e2;
+        exp10 = 0;
+        while (digits % 10 == 0) {
+            digits /= 10;
+            ++exp10;
+        }
+    } else {
+        shortest(ieeeMantissa, ieeeExponent, &digits, &exp10);
+    }
+
+    int n = countDigits(digits);
+    // Exponent of the first digit
+    int e = exp10 + n - 1;
+    if (e < -4 || e >= 16) {
+        // d.ddde+XX
+        writeDigits(p + 1, digits, n);
+        p[0] = p[1];
+        if (n > 1) {
+            p[1] = '.';
+            p += n + 1;
+        } else {
+            p += 1;
+        }
+        *p++ = 'e';
+        *p++ = e < 0 ? '-' : '+';
+        if (e < 0) e = -e;
+        if (e >= 100) {
+            *p++ = '0' + e / 100;
+            e %= 100;
+        }
+        *p++ = DIGIT_PAIRS[e * 2];
+        *p++ = DIGIT_PAIRS[e * 2 + 1];
+    } else if (e < 0) {
+        // 0.000ddd
+        *p++ = '0';
+        *p++ = '.';
+        for (int i = -1; i > e; --i) {
+            *p++ = '0';
+        }
+        writeDigits(p, digits, n);
+        p += n;
+    } else if (exp10 >= 0) {
+        // ddd000
+        writeDigits(p, digits, n);
+        p += n;
+        for (int i = 0; i < exp10; ++i) {
+            *p++ = '0';
+        }
+    } else {
+        // ddd.ddd, written in place and then moved along for the point
+        writeDigits(p, digits, n);
+        memmove(p + e + 2, p + e + 1, n - e - 1);
+        p[e + 1] = '.';
+        p += n + 1;
+    }
+    return p - buf;
+}
+
+int64_t idris_parse_i64(const char* s, const char** end) {
+    const char* p = s;
+    while (isspace((unsigned char)*p)) {
+        ++p;
+    }
+    int neg = 0;
+    if (*p == '-' || *p == '+') {
+        neg = *p == '-';
+        ++p;
+    }
+    if (*p < '0' || *p > '9') {
+        *end = s;
+        return 0;
+    }
+    // Accumulate negatively, so that INT64_MIN fits
+    uint64_t limit = neg ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+    uint64_t v = 0;
+    int overflow = 0;
+    for (; *p >= '0' && *p <= '9'; ++p) {
+        unsigned d = *p - '0';
+        if (v > (limit - d) / 10) {
+            overflow = 1;
+        } else {
+            v = v * 10 + d;
+        }
+    }
+    *end = p;
+    if (overflow) {
+        return neg ? INT64_MIN : INT64_MAX;
+    }
+    return neg ? (int64_t)(0 - v) : (int64_t)v;
+}
+
+// Powers of ten which are exact doubles
+static const double EXACT_POW10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+double idris_parse_double(const char* s) {
+    // Clinger's fast path: when the digits, without the point, fit in the
+    // 53 bits of a double's mantissa and the power of ten is exact too, a
+    // single multiplication or division rounds correctly. That's almost
+    // every number a program reads from text. Anything else, such as
+    // long or hex mantissas, big exponents, inf and nan, goes to strtod,
+    // as does everything where doubles are computed with extra precision.
+    const char* p = s;
+    int neg = 0;
+    if (*p == '-' || *p == '+') {
+        neg = *p == '-';
+        ++p;
+    }
+    uint64_t m = 0;
+    int ndigits = 0;
+    int exp10 = 0;
+    const char* start = p;
+    while (*p == '0') {
+        ++p;
+    }
+    for (; *p >= '0' && *p <= '9'; ++p) {
+        m = m * 10 + (*p - '0');
+        ++ndigits;
+    }
+    int whole = p != start;
+    if (*p == '.') {
+        ++p;
+        const char* frac = p;
+        if (ndigits == 0) {
+            // Leading zeros after the point only move it
+            while (*p == '0') {
+                ++p;
+            }
+        }
+        for (; *p >= '0' && *p <= '9'; ++p) {
+            m = m * 10 + (*p - '0');
+            ++ndigits;
+        }
+        exp10 -= (int)(p - frac);
+        whole |= p != frac;
+    }
+    if (!whole || ndigits > 19 || *p == 'x' || *p == 'X') {
+        return strtod(s, NULL);
+    }
+    if (*p == 'e' || *p == 'E') {
+        const char* q = p + 1;
+        int eneg = 0;
+        if (*q == '-' || *q == '+') {
+            eneg = *q == '-';
+            ++q;
+        }
+        if (*q >= '0' && *q <= '9') {
+            int e = 0;
+            for (; *q >= '0' && *q <= '9'; ++q) {
+                if (e < 10000) {
+                    e = e * 10 + (*q - '0');
+                }
+            }
+            exp10 += eneg ? -e : e;
+        }
+    }
+
+    double d;
+    if (m == 0) {
+        d = 0.0;
+#if FLT_EVAL_METHOD == 0
+    } else if (m <= (1ull << 53) && exp10 >= -22 && exp10 <= 22) {
+        d = (double)m;
+        d = exp10 < 0 ? d / EXACT_POW10[-exp10] : d * EXACT_POW10[exp10];
+#endif
+    } else {
+        return strtod(s, NULL);
+    }
+    return neg ? -d : d;
+}
@@ -0,0 +1,35 @@
+#ifndef _IDRIS_NUM_H
+#define _IDRIS_NUM_H
+
+/* Converting numbers to and from decimal, without going through printf
+   or the locale dependent strto* functions. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Room for the longest result of each of the formatting functions, not
+// including a terminating null.
+#define IDRIS_INT_DIGITS 20    // -9223372036854775808, 18446744073709551615
+#define IDRIS_DOUBLE_DIGITS 24 // -2.2250738585072014e-308
+
+// Write a number in decimal to buf, without a terminating null, and return
+// the number of bytes written.
+size_t idris_fmt_u64(char* buf, uint64_t x);
+size_t idris_fmt_i64(char* buf, int64_t x);
+
+// Write a double in decimal to buf, without a terminating null, and return
+// the number of bytes written. It uses the fewest digits which read back as
+// the same double, and otherwise looks like %g with a precision of 16: the
+// exponent is only written if it's below -4 or at least 16.
+size_t idris_fmt_double(char* buf, double x);
+
+// Read a decimal integer, after any white space, as strtol does. Returns
+// the first byte after it in *end, or s itself if there are no digits.
+// Out of range values are clamped to INT64_MIN or INT64_MAX.
+int64_t idris_parse_i64(const char* s, const char** end);
+
+// Read a double from the start of a string, as strtod would in the C
+// locale.
+double idris_parse_double(const char* s);
+
+#endif
@@ -11,22 +11,41 @@
     "Options:\n\n"                                              \
     "  -?    Print this message and exits.\n"                   \
     "  -s    Summary GC statistics.\n"                          \
+    "  -S    Write GC statistics as JSON to a file at exit. Egs: -Sstats.json\n" \
     "  -H    Initial heap size. Egs: -H4M, -H500K, -H1G\n"      \
+    "  -M    Maximum heap size, including large objects. Egs: -M2G\n" \
+    "  -F    Factor by which the heap grows, more than 1. Egs: -F1.5\n" \
     "  -K    Sets the maximum stack size. Egs: -K8M\n"          \
+    "  -A    Nursery size for generational GC (0 disables). Egs: -A1M\n" \
+    "  -N    Worker threads for processes (0: one per processor). Egs: -N4\n" \
+    "  -k    C stack for each process (default 8M). Egs: -k64M\n"  \
+    "  -G    Threads for collecting big heaps in parallel (1 disables). Egs: -G8\n" \
+    "  -j    Threads for data parallel array operations (0: one per processor,\n" \
+    "        1 disables). Egs: -j4\n"                                \
+    "  -c    Compact the heap in place rather than copying it, needing about\n" \
+    "        half the memory. Disables the nursery.\n"                  \
+    "  -I    Collect incrementally, aiming for pauses of this many milliseconds.\n" \
+    "        Disables the nursery. Egs: -I5, -I0.5, -I5ms\n"         \
+    "  -P    Use transparent huge pages for the heap, where available.\n" \
+    "  -h    Write a heap profile to <prog>.hp, with a census after every\n" \
+    "        collection, or every N of them. Egs: -h, -h10\n"            \
+    "  -p    Sample the running Idris functions every N microseconds of CPU\n" \
+    "        time (default 1000), writing folded stacks to <prog>.folded.\n" \
+    "        Needs a program compiled with -DIDRIS_PROFILE. Egs: -p, -p100\n" \
     "\n"
 
 void print_usage(FILE * s) {
     fprintf(s, USAGE);
 }
 
-int read_size(char * str) {
-    int size = 0;
+size_t read_size(char * str) {
+    unsigned long long size = 0;
     char mult = ' ';
 
-    int r = sscanf(str, "%u%c", &size, &mult);
+    int r = sscanf(str, "%llu%c", &size, &mult);
 
     if (r == 1)
-        return size;
+        return (size_t)size;
 
     if (r == 2) {
         switch (mult) {
@@ -41,7 +60,7 @@ int read_size(char * str) {
             print_usage(stderr);
             exit(EXIT_FAILURE);
         }
-        return size;
+        return (size_t)size;
     }
 
     fprintf(stderr, "RTS Opts: Unable to parse size. Egs: 1K, 10M, 2G.\n");
@@ -49,6 +68,34 @@ int read_size(char * str) {
     exit(EXIT_FAILURE);
 }
 
+double read_factor(char * str) {
+    double factor = 0;
+    char rest;
+
+    if (sscanf(str, "%lf%c", &factor, &rest) == 1 && factor > 1) {
+        return factor;
+    }
+
+    fprintf(stderr, "RTS Opts: Growth factor should be a number more than 1. Egs: 1.5, 2.\n");
+    print_usage(stderr);
+    exit(EXIT_FAILURE);
+}
+
+double read_pause(char * str) {
+    char * rest;
+    double pause = strtod(str, &rest);
+
+    // The unit may be given, as in -I5ms
+    if (rest != str && (*rest == '\0' || strcmp(rest, "ms") == 0) &&
+        pause > 0) {
+        return pause;
+    }
+
+    fprintf(stderr, "RTS Opts: Pause target should be a number of milliseconds. Egs: 5, 0.5, 5ms.\n");
+    print_usage(stderr);
+    exit(EXIT_FAILURE);
+}
+
 
 int parse_args(RTSOpts * opts, int argc, char *argv[])
 {
@@ -81,14 +128,81 @@ int parse_args(RTSOpts * opts, int argc, char *argv[])
             opts->show_summary = 1;
             break;
 
+        case 'S':
+            if (argv[i][2] == '\0') {
+                fprintf(stderr, "RTS Opts: -S needs a file name. Egs: -Sstats.json\n");
+                print_usage(stderr);
+                exit(EXIT_FAILURE);
+            }
+            opts->stats_file = argv[i] + 2;
+            break;
+
         case 'H':
             opts->init_heap_size = read_size(argv[i] + 2);
             break;
 
+        case 'M':
+            opts->max_heap_size = read_size(argv[i] + 2);
+            break;
+
+        case 'F':
+            opts->heap_growth_factor = read_factor(argv[i] + 2);
+            break;
+
         case 'K':
             opts->max_stack_size = read_size(argv[i] + 2);
             break;
 
+        case 'A':
+            opts->nursery_size = read_size(argv[i] + 2);
+            break;
+
+        case 'N':
+            opts->max_threads = atoi(argv[i] + 2);
+            break;
+
+        case 'k':
+            opts->process_stack_size = read_size(argv[i] + 2);
+            break;
+
+        case 'G':
+            opts->gc_threads = atoi(argv[i] + 2);
+            break;
+
+        case 'j':
+            opts->par_workers = atoi(argv[i] + 2);
+            break;
+
+        case 'c':
+            opts->compact = 1;
+            break;
+
+        case 'I':
+            opts->gc_pause = read_pause(argv[i] + 2);
+            break;
+
+        case 'P':
+            opts->huge_pages = 1;
+            break;
+
+        case 'h':
+            opts->heap_profile = argv[i][2] ? atoi(argv[i] + 2) : 1;
+            if (opts->heap_profile <= 0) {
+                fprintf(stderr, "RTS Opts: Census interval should be a number of collections. Egs: -h10.\n");
+                print_usage(stderr);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'p':
+            opts->sample_interval = argv[i][2] ? atoi(argv[i] + 2) : 1000;
+            if (opts->sample_interval <= 0) {
+                fprintf(stderr, "RTS Opts: Sampling interval should be a number of microseconds. Egs: -p100.\n");
+                print_usage(stderr);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
         default:
             printf("RTS opts: Wrong argument: %s\n", argv[i]);
             print_usage(stderr);
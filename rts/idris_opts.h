@@ -7,9 +7,43 @@
 typedef struct {
     size_t init_heap_size;
     size_t max_stack_size;
+    size_t nursery_size;
+    size_t max_heap_size;      // 0 for no limit
+    double heap_growth_factor;
+    int    max_threads;
+    size_t process_stack_size; // C stack for each process, 0 for the default
+    int    gc_threads;
+    int    par_workers;        // Threads for data parallel operations, 0 for one per processor
+    int    compact;            // Collect in place, rather than copying
+    double gc_pause;           // Pause target in milliseconds, 0 to collect all at once
     int    show_summary;
+    const char * stats_file;   // Write the stats as JSON here at exit
+    int    huge_pages;
+    int    heap_profile;       // Census every this many collections, 0 for none
+    int    sample_interval;    // Microseconds between samples, 0 for none
 } RTSOpts;
 
+// The default options should give satisfactory results under many
+// circumstances. (HEAP_GROWTH_FACTOR is in idris_heap.h.)
+#define IDRIS_DEFAULT_OPTS { \
+    .init_heap_size = 16384000, \
+    .max_stack_size = 4096000, \
+    .nursery_size   = 0, \
+    .max_heap_size  = 0, \
+    .heap_growth_factor = HEAP_GROWTH_FACTOR, \
+    .max_threads    = 0, \
+    .process_stack_size = 0, \
+    .gc_threads     = 1, \
+    .par_workers    = 0, \
+    .compact        = 0, \
+    .gc_pause       = 0, \
+    .show_summary   = 0, \
+    .stats_file     = NULL, \
+    .huge_pages     = 0, \
+    .heap_profile   = 0, \
+    .sample_interval = 0 \
+}
+
 void print_usage(FILE * s);
 
 // Parse rts options and shift arguments such that rts options becomes invisible
@@ -0,0 +1,523 @@
+#include "idris_par.h"
+#include "idris_buffer.h"
+
+#include <stdlib.h>
+#ifdef HAS_PTHREAD
+#include <unistd.h>
+#endif
+
+// Chunks the elements are cut into for each worker, so that those which
+// finish early have something to take from the others
+#define PAR_CHUNKS 16
+// Initial heap for a worker's VM, which grows as it needs to
+#define PAR_HEAP_SIZE 1048576
+
+static func par_apply = NULL;
+
+typedef enum {
+    PAR_MAP, PAR_GENERATE, PAR_REDUCE
+} ParOp;
+
+// Elements of a PrimArray, or the bytes of a Buffer, from a position
+typedef struct {
+    VAL* obj;    // Slot holding the array or buffer, so collections update it
+    int buffer;
+    int start;
+    PrimArrayKind kind;
+} View;
+
+// The closures, the views' objects and the starting value of a reduction
+// are kept in slots on the calling VM's stack, in this order
+enum { SLOT_F, SLOT_G, SLOT_SRC, SLOT_DEST, SLOT_Z, SLOTS };
+
+typedef struct {
+    ParOp op;
+    VAL* slots;
+    View src;
+    View dest;
+    i_int len;
+} Job;
+
+void idris_parApply(func apply) {
+    par_apply = apply;
+}
+
+int idris_parReady(void) {
+    return par_apply != NULL;
+}
+
+static inline char* view_data(View* v) {
+    char* data = v->buffer ? (char*)idris_getBufferData(GETMPTR(*v->obj))
+                           : ((PrimArray*)*v->obj)->data;
+    return data + (size_t)v->start * primArrayElemSize(v->kind);
+}
+
+static VAL get_elem(VM* vm, View* v, i_int i) {
+    char* data = view_data(v);
+    switch (v->kind) {
+    case PA_BITS8: return MKB8(vm, ((uint8_t*)data)[i]);
+    case PA_BITS32: return MKB32(vm, ((uint32_t*)data)[i]);
+    case PA_INT: return MKINT(((i_int*)data)[i]);
+    default: return MKFLOAT(vm, ((double*)data)[i]);
+    }
+}
+
+static void set_elem(View* v, i_int i, VAL x) {
+    char* data = view_data(v);
+    switch (v->kind) {
+    case PA_BITS8: ((uint8_t*)data)[i] = GETBITS8(x); break;
+    case PA_BITS32: ((uint32_t*)data)[i] = GETBITS32(x); break;
+    case PA_INT: ((i_int*)data)[i] = GETINT(x); break;
+    default: ((double*)data)[i] = GETFLOAT(x); break;
+    }
+}
+
+static inline void push(VM* vm, VAL x) {
+    RESERVE(1);
+    TOP(0) = x;
+    ADDTOP(1);
+}
+
+// Apply the closure in a slot to the n values on top of the stack, one at
+// a time, as the generated code does, and pop them
+static VAL apply_top(VM* vm, VAL* f, int n) {
+    INITFRAME;
+    VAL* args = vm->valstack_top - n;
+    VAL* base = vm->valstack_base;
+    VAL r = *f;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        RESERVE(2);
+        TOP(0) = r;
+        TOP(1) = args[i];
+        STOREOLD;
+        BASETOP(0);
+        ADDTOP(2);
+        CALL(par_apply);
+        vm->valstack_base = base;
+        vm->valstack_top = args + n;
+        r = RVAL;
+    }
+    vm->valstack_top = args;
+    return r;
+}
+
+// Run a job over the elements from lo up to hi. A reduction folds them into
+// the value on top of the stack, or starts with the first if that's NULL.
+static void run(VM* vm, Job* job, i_int lo, i_int hi) {
+    VAL x;
+    i_int i;
+
+    for (i = lo; i < hi; ++i) {
+        switch (job->op) {
+        case PAR_MAP:
+            push(vm, get_elem(vm, &job->src, i));
+            x = apply_top(vm, &job->slots[SLOT_F], 1);
+            set_elem(&job->dest, i, x);
+            break;
+        case PAR_GENERATE:
+            push(vm, MKINT(i));
+            x = apply_top(vm, &job->slots[SLOT_F], 1);
+            set_elem(&job->dest, i, x);
+            break;
+        case PAR_REDUCE:
+            push(vm, get_elem(vm, &job->src, i));
+            x = apply_top(vm, &job->slots[SLOT_F], 1);
+            if (TOP(-1) == NULL) {
+                TOP(-1) = x;
+            } else {
+                push(vm, x);
+                x = apply_top(vm, &job->slots[SLOT_G], 2);
+                push(vm, x);
+            }
+            break;
+        }
+    }
+}
+
+// Whether another VM can use a value without it moving or dying under it
+static int shareable(VAL x) {
+    return x == NULL || ISIMM(x) ||
+           (x->hdr.u8 & (GC_SHARED | GC_STATIC));
+}
+
+#ifdef HAS_PTHREAD
+
+typedef struct {
+    pthread_mutex_t lock;
+    i_int next;          // The chunks this worker has left, up to end
+    i_int end;
+    VM* vm;
+    pthread_t thread;
+} Worker;
+
+static struct {
+    int size;            // Workers wanted, including the calling thread
+    int started;         // Workers in the pool, including the calling thread
+    Worker* workers;
+    int busy;            // Set while a job is using the pool
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned generation; // Jobs started, so workers can tell a new one
+    int running;         // Workers still running the job, apart from the caller
+
+    Job* job;
+    i_int grain;         // Elements in each chunk
+    i_int chunks;
+    VAL** partials;      // Each chunk's part of a reduction, on the stack of
+                         // the worker which ran it
+} pool = {
+    .size = 0,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER
+};
+
+void idris_parWorkers(int workers) {
+    pool.size = workers > 0 ? workers : 0;
+}
+
+// Take the next chunk of a worker's own share
+static int take(Worker* w, i_int* chunk) {
+    int found = 0;
+    pthread_mutex_lock(&w->lock);
+    if (w->next < w->end) {
+        *chunk = w->next++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return found;
+}
+
+// Take over the second half of what another worker has left, starting on
+// the first chunk of it. Returns 0 once nobody has anything left.
+static int steal(Worker* w, i_int* chunk) {
+    int self = w - pool.workers;
+    int i;
+
+    for (i = 1; i < pool.started; ++i) {
+        Worker* victim = &pool.workers[(self + i) % pool.started];
+        i_int lo, hi;
+
+        pthread_mutex_lock(&victim->lock);
+        hi = victim->end;
+        lo = hi - (hi - victim->next + 1) / 2;
+        victim->end = lo;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (lo < hi) {
+            pthread_mutex_lock(&w->lock);
+            w->next = lo + 1;
+            w->end = hi;
+            pthread_mutex_unlock(&w->lock);
+            *chunk = lo;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void par_work(Worker* w) {
+    VM* vm = w->vm;
+    Job* job = pool.job;
+    i_int chunk;
+
+    while (take(w, &chunk) || steal(w, &chunk)) {
+        i_int lo = chunk * pool.grain;
+        i_int hi = lo + pool.grain < job->len ? lo + pool.grain : job->len;
+        if (job->op == PAR_REDUCE) {
+            // Left on the stack until the caller has collected it
+            push(vm, NULL);
+            run(vm, job, lo, hi);
+            pool.partials[chunk] = vm->valstack_top - 1;
+        } else {
+            run(vm, job, lo, hi);
+        }
+    }
+    // Nothing may be left pointing at the closures, which can be freed
+    // once the caller's done with them
+    vm->ret = NULL;
+    vm->reg1 = NULL;
+}
+
+static void* par_worker(void* arg) {
+    Worker* w = arg;
+    unsigned seen = 0;
+
+    init_threaddata(w->vm);
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.generation == seen) {
+            pthread_cond_wait(&pool.start, &pool.lock);
+        }
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        par_work(w);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.running == 0) {
+            pthread_cond_signal(&pool.done);
+        }
+    }
+    return NULL;
+}
+
+// A child process only has the thread which forked it, so it has to start
+// a pool of its own
+static void par_after_fork(void) {
+    pool.workers = NULL;
+    pool.started = 0;
+    pool.busy = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.start, NULL);
+    pthread_cond_init(&pool.done, NULL);
+}
+
+// A VM for a worker, set up like the one which starts the pool
+static VM* worker_vm(VM* caller) {
+    VM* vm = init_vm(caller->stack_limit - caller->valstack, PAR_HEAP_SIZE, 0);
+    vm->heap.growth_factor = caller->heap.growth_factor;
+    vm->heap.max_size = caller->heap.max_size;
+    alloc_nursery(&(vm->nursery), caller->nursery.size);
+    return vm;
+}
+
+static void start_pool(VM* vm) {
+    int size = pool.size;
+    int i;
+
+    if (size <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+        size = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        if (size <= 0) {
+            size = 1;
+        }
+    }
+    pool.workers = calloc(size, sizeof(Worker));
+    if (pool.workers == NULL) {
+        return;
+    }
+    if (pool.generation == 0) {
+        pthread_atfork(NULL, NULL, par_after_fork);
+    }
+    // The calling thread is the first worker
+    pthread_mutex_init(&pool.workers[0].lock, NULL);
+    pool.workers[0].vm = worker_vm(vm);
+    pool.started = 1;
+    for (i = 1; i < size; ++i) {
+        Worker* w = &pool.workers[i];
+        pthread_mutex_init(&w->lock, NULL);
+        w->vm = worker_vm(vm);
+        if (pthread_create(&w->thread, NULL, par_worker, w) != 0) {
+            terminate(w->vm);
+            free(w->vm);
+            break;
+        }
+        pthread_detach(w->thread);
+        pool.started++;
+    }
+}
+
+// Take the pool for a job, starting it if necessary. Returns 0 if the job
+// should run on the calling VM instead.
+static int par_begin(VM* vm, Job* job) {
+    if (pool.size == 1 || job->len < 2) {
+        return 0;
+    }
+    pthread_mutex_lock(&pool.lock);
+    if (pool.busy) {
+        // Another VM is using it, or this is a worker
+        pthread_mutex_unlock(&pool.lock);
+        return 0;
+    }
+    if (pool.workers == NULL) {
+        start_pool(vm);
+    }
+    if (pool.started <= 1) {
+        pthread_mutex_unlock(&pool.lock);
+        return 0;
+    }
+    pool.busy = 1;
+    pthread_mutex_unlock(&pool.lock);
+    return 1;
+}
+
+static void par_end(void) {
+    pthread_mutex_lock(&pool.lock);
+    pool.busy = 0;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Run a job on the pool, with the calling thread as the first worker, and
+// wait for the others to finish. Returns the result of a reduction.
+static VAL par_run(VM* vm, Job* job) {
+    VAL result = NULL;
+    i_int chunks = pool.started * PAR_CHUNKS;
+    i_int c;
+    int i;
+
+    if (chunks > job->len) {
+        chunks = job->len;
+    }
+    pool.grain = (job->len + chunks - 1) / chunks;
+    pool.chunks = (job->len + pool.grain - 1) / pool.grain;
+    pool.partials = NULL;
+    if (job->op == PAR_REDUCE) {
+        pool.partials = malloc(pool.chunks * sizeof(VAL*));
+        if (pool.partials == NULL) {
+            fprintf(stderr, "RTS ERROR: Unable to allocate parallel reduction\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < pool.started; ++i) {
+        pool.workers[i].next = pool.chunks * i / pool.started;
+        pool.workers[i].end = pool.chunks * (i + 1) / pool.started;
+    }
+    pool.job = job;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.running = pool.started - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    init_threaddata(pool.workers[0].vm);
+    par_work(&pool.workers[0]);
+    init_threaddata(vm);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.running > 0) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if (job->op == PAR_REDUCE) {
+        // Combine the chunks' parts in order, copying each out of the
+        // worker's heap as it's needed
+        push(vm, job->slots[SLOT_Z]);
+        for (c = 0; c < pool.chunks; ++c) {
+            VAL part = *pool.partials[c];
+            push(vm, ISIMM(part) ? part : copyTo(vm, part));
+            push(vm, apply_top(vm, &job->slots[SLOT_G], 2));
+        }
+        result = TOP(-1);
+        ADDTOP(-1);
+        free(pool.partials);
+    }
+    for (i = 0; i < pool.started; ++i) {
+        VM* wvm = pool.workers[i].vm;
+        wvm->valstack_top = wvm->valstack;
+        wvm->valstack_base = wvm->valstack;
+    }
+    return result;
+}
+
+#else
+
+void idris_parWorkers(int workers) {
+    (void)workers;
+}
+
+// Without threads there's nobody to share the work with
+static int par_begin(VM* vm, Job* job) {
+    (void)vm;
+    (void)job;
+    return 0;
+}
+
+static void par_end(void) {
+}
+
+static VAL par_run(VM* vm, Job* job) {
+    (void)vm;
+    (void)job;
+    return NULL;
+}
+
+#endif
+
+// Run a job whose slots are on top of the calling VM's stack, and pop them
+static VAL par_job(VM* vm, Job* job) {
+    VAL* slots = vm->valstack_top - SLOTS;
+    VAL result = NULL;
+    int parallel = 0;
+
+    job->slots = slots;
+    job->src.obj = &slots[SLOT_SRC];
+    job->dest.obj = &slots[SLOT_DEST];
+
+    if (par_begin(vm, job)) {
+        slots[SLOT_F] = idris_freeze(vm, slots[SLOT_F]);
+        slots[SLOT_G] = idris_freeze(vm, slots[SLOT_G]);
+        parallel = shareable(slots[SLOT_F]) && shareable(slots[SLOT_G]);
+        if (parallel) {
+            result = par_run(vm, job);
+        }
+        par_end();
+    }
+    if (!parallel) {
+        if (job->op == PAR_REDUCE) {
+            push(vm, slots[SLOT_Z]);
+        }
+        run(vm, job, 0, job->len);
+        if (job->op == PAR_REDUCE) {
+            result = TOP(-1);
+        }
+    }
+    vm->valstack_top = slots;
+    return result;
+}
+
+static void push_slots(VM* vm, VAL f, VAL g, VAL src, VAL dest, VAL z) {
+    RESERVE(SLOTS);
+    TOP(SLOT_F) = f;
+    TOP(SLOT_G) = g;
+    TOP(SLOT_SRC) = src;
+    TOP(SLOT_DEST) = dest;
+    TOP(SLOT_Z) = z;
+    ADDTOP(SLOTS);
+}
+
+void idris_parMap(VM* vm, VAL f, VAL src, VAL dest, int len) {
+    Job job = { .op = PAR_MAP, .len = len,
+                .src = { .kind = PAKIND(src) },
+                .dest = { .kind = PAKIND(dest) } };
+    push_slots(vm, f, NULL, src, dest, NULL);
+    par_job(vm, &job);
+}
+
+void idris_parGenerate(VM* vm, VAL f, VAL dest, int len) {
+    Job job = { .op = PAR_GENERATE, .len = len,
+                .dest = { .kind = PAKIND(dest) } };
+    push_slots(vm, f, NULL, NULL, dest, NULL);
+    par_job(vm, &job);
+}
+
+VAL idris_parMapReduce(VM* vm, VAL m, VAL g, VAL z, VAL src, int len) {
+    Job job = { .op = PAR_REDUCE, .len = len,
+                .src = { .kind = PAKIND(src) } };
+    push_slots(vm, m, g, src, NULL, z);
+    return par_job(vm, &job);
+}
+
+void idris_parMapBuffer(VM* vm, VAL f, VAL src, int start, int len,
+                        VAL dest, int loc) {
+    Job job = { .op = PAR_MAP, .len = len,
+                .src = { .buffer = 1, .start = start, .kind = PA_BITS8 },
+                .dest = { .buffer = 1, .start = loc, .kind = PA_BITS8 } };
+    push_slots(vm, f, NULL, src, dest, NULL);
+    par_job(vm, &job);
+}
+
+VAL idris_parMapReduceBuffer(VM* vm, VAL m, VAL g, VAL z,
+                             VAL buffer, int loc, int len) {
+    Job job = { .op = PAR_REDUCE, .len = len,
+                .src = { .buffer = 1, .start = loc, .kind = PA_BITS8 } };
+    push_slots(vm, m, g, buffer, NULL, z);
+    return par_job(vm, &job);
+}
@@ -0,0 +1,59 @@
+#ifndef _IDRIS_PAR_H
+#define _IDRIS_PAR_H
+
+#include "idris_rts.h"
+
+/* *** Data parallelism ***
+ * Maps, reductions and loops over the elements of a PrimArray or the bytes
+ * of a Buffer, split between a pool of worker threads shared by every VM.
+ * The elements are cut into chunks, a few for each worker, and each worker
+ * starts with an even share of them. A worker which runs out takes half of
+ * what's left of another's, so an uneven load still keeps them all busy.
+ * The thread which asks for the work is one of the workers.
+ *
+ * Each worker runs the closure on a VM of its own, where whatever it
+ * allocates is collected without stopping the others. Nothing is copied
+ * in: the calling VM waits while the workers run, so its heap doesn't move
+ * and they can read the array or buffer where it is, and write results
+ * straight into the one given for them. The closure is frozen (see
+ * idris_freeze) first, which copies what it refers to once, however many
+ * workers use it. The partial results of a reduction are copied back, one
+ * for each chunk, and combined in order on the calling VM, so the
+ * combining function needs to be associative, but not commutative.
+ *
+ * Everything runs on the calling VM, one element after another, when the
+ * pool is in use by another VM or by the caller itself, as when a closure
+ * running on a worker asks for more parallel work, or when the closure
+ * refers to an array, reference or anything else which can't be frozen.
+ */
+
+// Register the function which applies a closure to an argument, which the
+// generated main does before anything else runs
+void idris_parApply(func apply);
+// Whether it's registered. The operations below mustn't be used until it
+// is, so a program without it has to do the work itself.
+int idris_parReady(void);
+
+// Use this many workers, including the calling thread, or one per
+// processor if it's 0, once the pool starts. 1 runs everything on the
+// calling VM.
+void idris_parWorkers(int workers);
+
+// Set each of the first len elements of dest to f applied to the element of
+// src at the same position. The arrays may be the same.
+void idris_parMap(VM* vm, VAL f, VAL src, VAL dest, int len);
+// Set each of the first len elements of dest to f applied to its position
+void idris_parGenerate(VM* vm, VAL f, VAL dest, int len);
+// Fold g over m applied to each of the first len elements of src, starting
+// from z
+VAL idris_parMapReduce(VM* vm, VAL m, VAL g, VAL z, VAL src, int len);
+
+// As above, over len bytes of Data.Buffers from the given locations. The
+// buffers are heap objects (Raw ManagedPtr), since the calling VM may
+// collect while it does the work itself.
+void idris_parMapBuffer(VM* vm, VAL f, VAL src, int start, int len,
+                        VAL dest, int loc);
+VAL idris_parMapReduceBuffer(VM* vm, VAL m, VAL g, VAL z,
+                             VAL buffer, int loc, int len);
+
+#endif // _IDRIS_PAR_H
@@ -0,0 +1,485 @@
+#if defined(__linux__)
+#define _DEFAULT_SOURCE // for setitimer
+#endif
+
+#include "idris_prof.h"
+#include "idris_stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__) || defined(__DragonFly__)
+#define HAS_SAMPLING
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+// Pseudo closure type for counts by allocation site
+#define PROF_SITE 255
+
+typedef struct {
+    uint64_t key; // Closure type + 1 in the top half, tag or site in the bottom
+    uint64_t count;
+    uint64_t bytes;
+} ProfEntry;
+
+// Open addressing, with key 0 marking an empty slot
+typedef struct {
+    ProfEntry* entries;
+    size_t size;  // A power of 2
+    size_t used;
+} ProfTable;
+
+typedef struct Profile {
+    FILE* out;
+    int every;           // Collections between censuses
+    int collections;     // Collections since the last census
+    uint32_t census;     // Censuses written
+    uint64_t start;      // When profiling started
+
+    const char** sites;  // Names of the allocation sites
+    int site_count;
+
+    char* heap_mark;     // Where allocation into the heap started
+    LargeObject* large_mark; // Newest large object before then
+
+    ProfTable alloc;     // Objects allocated since the last census
+    ProfTable live;      // Scratch table for a census
+} Profile;
+
+static const char* type_names[] = {
+    "CON", "ARRAY", "INT", "BIGINT", "FLOAT", "STRING", "STROFFSET",
+    "STRCONCAT", "BITS32", "BITS64", "PTR", "REF", "FWD", "MANAGEDPTR",
+    "RAWDATA", "CDATA", "PRIMARRAY"
+};
+
+static uint64_t entry_key(int type, uint32_t tag) {
+    return ((uint64_t)(type + 1) << 32) | tag;
+}
+
+static void table_init(ProfTable* t) {
+    t->size = 64;
+    t->used = 0;
+    t->entries = calloc(t->size, sizeof(ProfEntry));
+}
+
+static void table_clear(ProfTable* t) {
+    memset(t->entries, 0, t->size * sizeof(ProfEntry));
+    t->used = 0;
+}
+
+static ProfEntry* table_find(ProfTable* t, uint64_t key) {
+    size_t mask = t->size - 1;
+    size_t i = (key * 0x9E3779B97F4A7C15ull) >> 32 & mask;
+    while (t->entries[i].key != 0 && t->entries[i].key != key) {
+        i = (i + 1) & mask;
+    }
+    return &t->entries[i];
+}
+
+static void table_add(ProfTable* t, uint64_t key, uint64_t count,
+                      uint64_t bytes) {
+    ProfEntry* e = table_find(t, key);
+    if (e->key == 0) {
+        if ((t->used + 1) * 4 > t->size * 3) {
+            ProfEntry* old = t->entries;
+            size_t i, old_size = t->size;
+            t->size *= 2;
+            t->entries = calloc(t->size, sizeof(ProfEntry));
+            for (i = 0; i < old_size; ++i) {
+                if (old[i].key != 0) {
+                    *table_find(t, old[i].key) = old[i];
+                }
+            }
+            free(old);
+            e = table_find(t, key);
+        }
+        e->key = key;
+        t->used++;
+    }
+    e->count += count;
+    e->bytes += bytes;
+}
+
+static void count_object(ProfTable* t, VAL x, size_t size) {
+    int type = GETTY(x);
+    table_add(t, entry_key(type, type == CT_CON ? CTAG(x) : 0), 1, size);
+}
+
+static void count_range(ProfTable* t, char* start, char* end) {
+    char* p = start;
+    while (p < end) {
+        size_t size = aligned(valSize((VAL)p));
+        if (size == 0) {
+            break;
+        }
+        count_object(t, (VAL)p, size);
+        p += size;
+    }
+}
+
+// Large objects newer than 'until', which come first in the list
+static void count_large(ProfTable* t, LargeObject* first, LargeObject* until) {
+    LargeObject* lo;
+    for (lo = first; lo != NULL && lo != until; lo = lo->next) {
+        count_object(t, (VAL)(lo + 1), lo->size);
+    }
+}
+
+static int by_bytes(const void* a, const void* b) {
+    const ProfEntry* x = a;
+    const ProfEntry* y = b;
+    return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+static void write_table(Profile* p, ProfTable* t, uint64_t time,
+                        const char* gc, const char* measure) {
+    size_t i, n = 0;
+    ProfEntry* rows = malloc(t->used * sizeof(ProfEntry) + 1);
+    for (i = 0; i < t->size; ++i) {
+        if (t->entries[i].key != 0) {
+            rows[n++] = t->entries[i];
+        }
+    }
+    qsort(rows, n, sizeof(ProfEntry), by_bytes);
+
+    for (i = 0; i < n; ++i) {
+        int type = (int)(rows[i].key >> 32) - 1;
+        uint32_t tag = (uint32_t)rows[i].key;
+        fprintf(p->out, "%" PRIu32 "\t%" PRIu64 "\t%s\t%s\t", p->census, time,
+                gc, measure);
+        if (type == PROF_SITE) {
+            if ((int)tag < p->site_count) {
+                fprintf(p->out, "SITE\t%s", p->sites[tag]);
+            } else {
+                fprintf(p->out, "SITE\t%" PRIu32, tag);
+            }
+        } else if (type < (int)(sizeof(type_names) / sizeof(type_names[0]))) {
+            fprintf(p->out, "%s\t%" PRIu32, type_names[type], tag);
+        } else {
+            fprintf(p->out, "%d\t%" PRIu32, type, tag);
+        }
+        fprintf(p->out, "\t%" PRIu64 "\t%" PRIu64 "\n", rows[i].count,
+                rows[i].bytes);
+    }
+    free(rows);
+}
+
+// Open <program's base name><ext> in the current directory
+static FILE* open_output(const char* program, const char* ext) {
+    const char* base = strrchr(program, '/');
+    size_t len, ext_len = strlen(ext);
+    char* path;
+    FILE* out;
+
+#ifdef _WIN32
+    const char* back = strrchr(program, '\\');
+    if (back != NULL && (base == NULL || back > base)) {
+        base = back;
+    }
+#endif
+    base = base == NULL ? program : base + 1;
+    len = strlen(base);
+    path = malloc(len + ext_len + 1);
+    memcpy(path, base, len);
+    memcpy(path + len, ext, ext_len + 1);
+    out = fopen(path, "w");
+    free(path);
+    return out;
+}
+
+static void census(VM* vm, const char* gc) {
+    Profile* p = vm->prof;
+    uint64_t time = idris_clock_ns() - p->start;
+
+    table_clear(&p->live);
+    count_range(&p->live, aligned_heap_pointer(vm->heap.heap), vm->heap.next);
+    if (vm->nursery.size > 0) {
+        count_range(&p->live, vm->nursery.heap, vm->nursery.next);
+    }
+    count_large(&p->live, vm->large.first, NULL);
+
+    write_table(p, &p->live, time, gc, "live");
+    write_table(p, &p->alloc, time, gc, "alloc");
+    fflush(p->out);
+
+    table_clear(&p->alloc);
+    p->census++;
+    p->collections = 0;
+}
+
+int idris_profStart(VM* vm, const char* program, int every,
+                    const char** sites, int site_count) {
+    Profile* p;
+    FILE* out = open_output(program, ".hp");
+    if (out == NULL) {
+        return 0;
+    }
+    fprintf(out, "census\ttime_ns\tgc\tmeasure\ttype\ttag\tcount\tbytes\n");
+
+    p = malloc(sizeof(Profile));
+    p->out = out;
+    p->every = every > 0 ? every : 1;
+    p->collections = 0;
+    p->census = 0;
+    p->start = idris_clock_ns();
+    p->sites = sites;
+    p->site_count = site_count;
+    p->heap_mark = vm->heap.next;
+    p->large_mark = vm->large.first;
+    table_init(&p->alloc);
+    table_init(&p->live);
+    vm->prof = p;
+    return 1;
+}
+
+void idris_profStop(VM* vm) {
+    Profile* p = vm->prof;
+    if (p == NULL) {
+        return;
+    }
+    idris_profBeforeGC(vm);
+    census(vm, "exit");
+    fclose(p->out);
+    free(p->alloc.entries);
+    free(p->live.entries);
+    free(p);
+    vm->prof = NULL;
+}
+
+void idris_profBeforeGC(VM* vm) {
+    Profile* p = vm->prof;
+    if (p == NULL || vm->inc.pause > 0) {
+        return;
+    }
+    if (vm->nursery.size > 0) {
+        count_range(&p->alloc, vm->nursery.heap, vm->nursery.next);
+    }
+    count_range(&p->alloc, p->heap_mark, vm->heap.next);
+    count_large(&p->alloc, vm->large.first, p->large_mark);
+}
+
+void idris_profAfterGC(VM* vm, int full) {
+    Profile* p = vm->prof;
+    if (p == NULL) {
+        return;
+    }
+    if (++p->collections >= p->every) {
+        census(vm, full ? "full" : "minor");
+    }
+    p->heap_mark = vm->heap.next;
+    p->large_mark = vm->large.first;
+}
+
+void idris_profAlloc(VM* vm, int site, VAL x) {
+    Profile* p = vm->prof;
+    if (p != NULL) {
+        table_add(&p->alloc, entry_key(PROF_SITE, site), 1,
+                  aligned(valSize(x)));
+    }
+}
+
+/* *** Sampling *** */
+
+#ifdef HAS_SAMPLING
+
+#define SAMPLE_DEPTH 128              // Frames kept, a power of 2
+#define SAMPLE_STACKS 65536           // Distinct stacks, a power of 2
+#define SAMPLE_ARENA (4 * 1024 * 1024) // Frames of all the stacks together
+
+typedef struct {
+    uint32_t hash;
+    uint32_t start;     // First frame in the arena
+    uint16_t length;
+    uint16_t truncated; // Outer frames were dropped
+    uint32_t count;     // Samples; 0 for an unused slot
+} SampleStack;
+
+static struct {
+    VM* volatile vm;    // Being sampled, NULL if none
+    FILE* out;
+    const char** sites;
+    int site_count;
+#ifdef HAS_PTHREAD
+    pthread_t thread;   // Running the VM
+#endif
+
+    SampleStack* stacks;
+    uint32_t used;      // Slots in stacks
+    uint32_t* arena;
+    uint32_t arena_used;
+    uint64_t dropped;   // Samples of new stacks with no room left
+} sampler;
+
+static int same_frames(const uint32_t* x, const uint32_t* y, uint32_t n) {
+    uint32_t i;
+    for (i = 0; i < n; ++i) {
+        if (x[i] != y[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// The signal handler. It mustn't allocate or take locks.
+static void take_sample(int sig) {
+    VM* vm = sampler.vm;
+    uint32_t frames[SAMPLE_DEPTH];
+    uint32_t depth, n, i, hash, truncated, slot;
+    SampleStack* st;
+    (void)sig;
+
+    if (vm == NULL) {
+        return;
+    }
+#ifdef HAS_PTHREAD
+    // The timer counts CPU time of the whole process, so the signal can
+    // arrive in any thread
+    if (!pthread_equal(pthread_self(), sampler.thread)) {
+        return;
+    }
+#endif
+
+    depth = vm->prof_depth;
+    truncated = depth >= SAMPLE_DEPTH;
+    n = truncated ? SAMPLE_DEPTH : depth + 1;
+    hash = 2166136261u ^ truncated;
+    for (i = 0; i < n; ++i) {
+        frames[i] = vm->prof_frames[(depth - n + 1 + i) & vm->prof_mask];
+        hash = (hash ^ frames[i]) * 16777619u;
+    }
+
+    slot = hash & (SAMPLE_STACKS - 1);
+    for (;;) {
+        st = &sampler.stacks[slot];
+        if (st->count == 0) {
+            break;
+        }
+        if (st->hash == hash && st->length == n &&
+            st->truncated == truncated &&
+            same_frames(sampler.arena + st->start, frames, n)) {
+            st->count++;
+            return;
+        }
+        slot = (slot + 1) & (SAMPLE_STACKS - 1);
+    }
+
+    // A new stack. Keep a quarter of the table empty so probes stay short.
+    if (sampler.used >= SAMPLE_STACKS / 4 * 3 ||
+        sampler.arena_used + n > SAMPLE_ARENA) {
+        sampler.dropped++;
+        return;
+    }
+    memcpy(sampler.arena + sampler.arena_used, frames, n * sizeof(uint32_t));
+    st->hash = hash;
+    st->start = sampler.arena_used;
+    st->length = n;
+    st->truncated = truncated;
+    st->count = 1;
+    sampler.arena_used += n;
+    sampler.used++;
+}
+
+static void set_timer(int interval_us) {
+    struct itimerval timer;
+    timer.it_interval.tv_sec = interval_us / 1000000;
+    timer.it_interval.tv_usec = interval_us % 1000000;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+static void write_site(uint32_t site) {
+    const char* c;
+    if ((int)site >= sampler.site_count) {
+        fprintf(sampler.out, "%" PRIu32, site);
+        return;
+    }
+    // Semicolons separate frames, and the count follows the last space
+    for (c = sampler.sites[site]; *c != '\0'; ++c) {
+        fputc(*c == ';' || *c == '\n' ? '_' : *c, sampler.out);
+    }
+}
+
+#endif // HAS_SAMPLING
+
+int idris_sampleStart(VM* vm, const char* program, int interval_us,
+                      const char** sites, int site_count) {
+#ifdef HAS_SAMPLING
+    struct sigaction action;
+
+    if (sampler.vm != NULL) {
+        return 0;
+    }
+    sampler.out = open_output(program, ".folded");
+    if (sampler.out == NULL) {
+        return 0;
+    }
+    sampler.sites = sites;
+    sampler.site_count = site_count;
+    sampler.stacks = calloc(SAMPLE_STACKS, sizeof(SampleStack));
+    sampler.arena = malloc(SAMPLE_ARENA * sizeof(uint32_t));
+    sampler.used = 0;
+    sampler.arena_used = 0;
+    sampler.dropped = 0;
+
+    // Frames may already have been entered, in prof_frame
+    vm->prof_frames = calloc(SAMPLE_DEPTH, sizeof(uint32_t));
+    vm->prof_frames[vm->prof_depth & (SAMPLE_DEPTH - 1)] = vm->prof_frame;
+    vm->prof_mask = SAMPLE_DEPTH - 1;
+#ifdef HAS_PTHREAD
+    sampler.thread = pthread_self();
+#endif
+    sampler.vm = vm;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = take_sample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+    set_timer(interval_us > 0 ? interval_us : 1);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+void idris_sampleStop(VM* vm) {
+#ifdef HAS_SAMPLING
+    uint32_t i, j;
+    if (vm == NULL || sampler.vm != vm) {
+        return;
+    }
+    set_timer(0);
+    signal(SIGPROF, SIG_IGN);
+    sampler.vm = NULL;
+
+    for (i = 0; i < SAMPLE_STACKS; ++i) {
+        SampleStack* st = &sampler.stacks[i];
+        if (st->count == 0) {
+            continue;
+        }
+        if (st->truncated) {
+            fputs("...;", sampler.out);
+        }
+        for (j = 0; j < st->length; ++j) {
+            if (j > 0) {
+                fputc(';', sampler.out);
+            }
+            write_site(sampler.arena[st->start + j]);
+        }
+        fprintf(sampler.out, " %" PRIu32 "\n", st->count);
+    }
+    fclose(sampler.out);
+    if (sampler.dropped > 0) {
+        fprintf(stderr, "RTS: %" PRIu64 " samples of new stacks were dropped "
+                "for want of room.\n", sampler.dropped);
+    }
+
+    free(sampler.stacks);
+    free(sampler.arena);
+    free(vm->prof_frames);
+    vm->prof_frames = &vm->prof_frame;
+    vm->prof_mask = 0;
+#endif
+}
@@ -0,0 +1,73 @@
+#ifndef _IDRIS_PROF_H
+#define _IDRIS_PROF_H
+
+#include "idris_rts.h"
+
+/* *** Heap profiling ***
+ * With +RTS -h, the main VM writes a heap census after every Nth
+ * collection: the number and total size of the objects in the heap, by
+ * closure type and, for constructors, by tag. Alongside it go the objects
+ * allocated since the previous census, counted the same way. These are
+ * found by walking the space allocated into since the last collection,
+ * so allocation itself costs nothing extra. They aren't counted with the
+ * incremental collector, whose steps copy into the same space.
+ *
+ * Code compiled with IDRIS_PROFILE also counts the constructors each
+ * Idris function allocates. Generated functions declare their site with
+ * PROF_FUNCTION, an index into the table of their names which the code
+ * generator writes out, and call PROF_CON after each allocation.
+ *
+ * The profile is written to <program>.hp as tab separated columns:
+ *   census  time_ns  gc  measure  type  tag  count  bytes
+ * where gc is "full" or "minor" (after a minor collection, the census
+ * includes whatever in the old generation has died since the last full
+ * one), measure is "live" or "alloc", and tag is the constructor tag, the
+ * name of the site for type SITE, or 0. The unused ends of the blocks used
+ * by the parallel collector show up as RAWDATA.
+ */
+
+/* *** Sampling ***
+ * With +RTS -p, a profiling timer interrupts the main VM's thread every
+ * so often, and its signal handler records which Idris functions are
+ * running: code compiled with IDRIS_PROFILE keeps them in the VM's
+ * prof_frames (see idris_rts.h). Identical stacks are counted together,
+ * in a table allocated up front, so taking a sample doesn't allocate and
+ * costs about as much as comparing the stack with one seen before. Only
+ * the innermost SAMPLE_DEPTH functions of a deeper stack are kept.
+ *
+ * At exit the stacks are written to <program>.folded, one per line as
+ * the outermost function first, separated by semicolons, then the number
+ * of samples: the input expected by flame graph tools.
+ */
+
+// Start profiling, with a census after every 'every' collections. The
+// names of the allocation sites, if any, must outlive the VM. Returns 0
+// if the output can't be opened.
+int idris_profStart(VM* vm, const char* program, int every,
+                    const char** sites, int site_count);
+// Write a last census and close the output
+void idris_profStop(VM* vm);
+
+// Called by the collector at the start and end of each collection
+void idris_profBeforeGC(VM* vm);
+void idris_profAfterGC(VM* vm, int full);
+
+void idris_profAlloc(VM* vm, int site, VAL x);
+
+// Start sampling every interval_us microseconds of CPU time. Returns 0 if
+// the output can't be opened or there is no profiling timer.
+int idris_sampleStart(VM* vm, const char* program, int interval_us,
+                      const char** sites, int site_count);
+// Stop sampling and write the stacks out, if vm is being sampled
+void idris_sampleStop(VM* vm);
+
+#ifdef IDRIS_PROFILE
+#define PROF_FUNCTION(n) const int prof_site = (n); \
+    vm->prof_frames[vm->prof_depth & vm->prof_mask] = prof_site;
+#define PROF_CON(x) if (vm->prof != NULL) { idris_profAlloc(vm, prof_site, x); }
+#else
+#define PROF_FUNCTION(n)
+#define PROF_CON(x)
+#endif
+
+#endif // _IDRIS_PROF_H
@@ -1,9 +1,13 @@
 #include <assert.h>
 #include <errno.h>
+#include <time.h>
 
 #include "idris_rts.h"
 #include "idris_gc.h"
+#include "idris_sched.h"
 #include "idris_utf8.h"
+#include "idris_num.h"
+#include "idris_prof.h"
 #include "idris_bitstring.h"
 #include "getline.h"
 
@@ -27,52 +31,52 @@ void free_key(void *vvm) {
 }
 
 VM* init_vm(int stack_size, size_t heap_size,
-            int max_threads // not implemented yet
+            int max_threads // 0 for one worker thread per processor
             ) {
 
     VM* vm = malloc(sizeof(VM));
     STATS_INIT_STATS(vm->stats)
     STATS_ENTER_INIT(vm->stats)
-
-    VAL* valstack = malloc(stack_size * sizeof(VAL));
+    vm->prof = NULL;
+    vm->prof_frames = &vm->prof_frame;
+    vm->prof_mask = 0;
+    vm->prof_depth = 0;
 
     vm->active = 1;
-    vm->valstack = valstack;
-    vm->valstack_top = valstack;
-    vm->valstack_base = valstack;
-    vm->stack_max = valstack + stack_size;
+    alloc_stack(vm, stack_size);
 
-    alloc_heap(&(vm->heap), heap_size, heap_size, NULL);
+    alloc_heap(&(vm->heap), heap_size, heap_size);
+    // Generational collection is off unless a nursery size is given
+    alloc_nursery(&(vm->nursery), 0);
+    init_large(&(vm->large));
+    memset(&(vm->inc), 0, sizeof(Incremental));
+    init_shared(&(vm->shared));
 
     c_heap_init(&vm->c_heap);
 
     vm->ret = NULL;
     vm->reg1 = NULL;
 #ifdef HAS_PTHREAD
-    vm->inbox = malloc(1024*sizeof(vm->inbox[0]));
-    assert(vm->inbox);
-    memset(vm->inbox, 0, 1024*sizeof(vm->inbox[0]));
-    vm->inbox_end = vm->inbox + 1024;
-    vm->inbox_write = vm->inbox;
+    vm->inbox_incoming = NULL;
+    vm->inbox = NULL;
+    vm->inbox_tail = &vm->inbox;
     vm->inbox_nextid = 1;
 
-    // The allocation lock must be reentrant. The lock exists to ensure that
-    // no memory is allocated during the message sending process, but we also
-    // check the lock in calls to allocate.
-    // The problem comes when we use requireAlloc to guarantee a chunk of memory
-    // first: this sets the lock, and since it is not reentrant, we get a deadlock.
-    pthread_mutexattr_t rec_attr;
-    pthread_mutexattr_init(&rec_attr);
-    pthread_mutexattr_settype(&rec_attr, PTHREAD_MUTEX_RECURSIVE);
-
-    pthread_mutex_init(&(vm->inbox_lock), NULL);
+    // There is no allocation lock: only the thread running a VM allocates
+    // in its heap. Messages are copied into a region of their own by the
+    // sender (see idris_sendMessage) and into the heap by the receiver.
     pthread_mutex_init(&(vm->inbox_block), NULL);
-    pthread_mutex_init(&(vm->alloc_lock), &rec_attr);
     pthread_cond_init(&(vm->inbox_waiting), NULL);
 
     vm->max_threads = max_threads;
     vm->processes = 0;
+    vm->spawned = 0;
     vm->creator = NULL;
+    vm->proc = NULL;
+
+    pthread_mutex_init(&(vm->stats_lock), NULL);
+    memset(&(vm->finished), 0, sizeof(Stats));
+    vm->stats_closed = 0;
 
 #else
     global_vm = vm;
@@ -81,17 +85,6 @@ VM* init_vm(int stack_size, size_t heap_size,
     return vm;
 }
 
-VM* idris_vm(void) {
-    VM* vm = init_vm(4096000, 4096000, 1);
-    init_threadkeys();
-    init_threaddata(vm);
-    init_gmpalloc();
-    init_nullaries();
-    init_signals();
-
-    return vm;
-}
-
 VM* get_vm(void) {
 #ifdef HAS_PTHREAD
     return pthread_getspecific(vm_key);
@@ -100,10 +93,6 @@ VM* get_vm(void) {
 #endif
 }
 
-void close_vm(VM* vm) {
-    terminate(vm);
-}
-
 #ifdef HAS_PTHREAD
 void create_key(void) {
     pthread_key_create(&vm_key, free_key);
@@ -129,18 +118,85 @@ void init_signals(void) {
 #endif
 }
 
-Stats terminate(VM* vm) {
+#ifdef HAS_PTHREAD
+// Add a finished VM's stats to those of its creator, or if that has
+// finished too, to the nearest one up the chain which hasn't.
+static void report_stats(VM* vm, const Stats* stats) {
+    VM* up;
+    for (up = vm->creator; up != NULL; up = up->creator) {
+        pthread_mutex_lock(&(up->stats_lock));
+        if (!up->stats_closed) {
+            aggregate_stats(&(up->finished), stats);
+            pthread_mutex_unlock(&(up->stats_lock));
+            return;
+        }
+        pthread_mutex_unlock(&(up->stats_lock));
+    }
+}
+#endif
+
+Stats idris_currentStats(VM* vm) {
     Stats stats = vm->stats;
+#ifdef HAS_PTHREAD
+    pthread_mutex_lock(&(vm->stats_lock));
+    aggregate_stats(&stats, &(vm->finished));
+    pthread_mutex_unlock(&(vm->stats_lock));
+#endif
+    return stats;
+}
+
+i_int idris_stat(VM* vm, int which) {
+    Stats stats = idris_currentStats(vm);
+    switch (which) {
+    case STAT_COLLECTIONS: return stats.collections;
+    case STAT_VMS: return stats.vms;
+#ifdef IDRIS_ENABLE_STATS
+    case STAT_ALLOCATED: return stats.allocations;
+    case STAT_ALLOCATIONS: return stats.alloc_count;
+    case STAT_COPIED: return stats.copied;
+    case STAT_MAX_HEAP: return stats.max_heap_size;
+    case STAT_MINOR: return stats.minor_collections;
+    case STAT_GC_TIME: return stats.gc_time;
+    case STAT_OTHERS_GC_TIME: return stats.others_gc_time;
+    case STAT_MAX_PAUSE: return stats.max_gc_pause;
+    case STAT_ELAPSED: return idris_clock_ns() - stats.start_time;
+    default:
+        if (which >= STAT_PAUSES && which < STAT_PAUSES + STATS_PAUSE_BUCKETS) {
+            return stats.pauses[which - STAT_PAUSES];
+        }
+#endif
+    }
+    return 0;
+}
+
+Stats terminate(VM* vm) {
+#ifdef HAS_PTHREAD
+    // Children finishing from now on report to our creator instead
+    pthread_mutex_lock(&(vm->stats_lock));
+    vm->stats_closed = 1;
+    pthread_mutex_unlock(&(vm->stats_lock));
+#endif
+    Stats stats = idris_currentStats(vm);
     STATS_ENTER_EXIT(stats)
-    free(vm->valstack);
+    idris_profStop(vm);
+    idris_sampleStop(vm);
+    free_stack(vm);
+    // The end of the heap is moved to pace incremental collections
+    if (vm->inc.pause > 0) {
+        vm->heap.end = vm->inc.end;
+    }
+    free(vm->inc.fwd);
+    free(vm->inc.log);
+    free(vm->inc.raw);
     free_heap(&(vm->heap));
+    free_nursery(&(vm->nursery));
+    free_large(&(vm->large));
+    free_shared(&(vm->shared));
     c_heap_destroy(&(vm->c_heap));
 #ifdef HAS_PTHREAD
-    pthread_mutex_destroy(&(vm->inbox_lock));
     pthread_mutex_destroy(&(vm->inbox_block));
-    pthread_mutex_destroy(&(vm->alloc_lock));
     pthread_cond_destroy(&(vm->inbox_waiting));
-    free(vm->inbox);
+    idris_freeMessages(vm);
     if (vm->creator != NULL) {
         vm->creator->processes--;
     }
@@ -153,6 +209,9 @@ Stats terminate(VM* vm) {
     vm->active = 0;
 
     STATS_LEAVE_EXIT(stats)
+#ifdef HAS_PTHREAD
+    report_stats(vm, &stats);
+#endif
     return stats;
 }
 
@@ -168,27 +227,40 @@ CData cdata_manage(void * data, size_t size, CDataFinalizer finalizer)
 }
 
 void idris_requireAlloc(VM * vm, size_t size) {
-    if (!(vm->heap.next + size < vm->heap.end)) {
-        idris_gc(vm);
-    }
-#ifdef HAS_PTHREAD
-    int lock = vm->processes > 0;
-    if (lock) { // We only need to lock if we're in concurrent mode
-       pthread_mutex_lock(&vm->alloc_lock);
+    // Allocation under the reservation may go to the nursery, the heap or
+    // the large object space, so make sure they all have room. Nothing may
+    // be collected while we're already collecting, though.
+    if (!vm->nursery.collecting) {
+        if (vm->nursery.size > 0 &&
+            !(vm->nursery.next + size < vm->nursery.end)) {
+            idris_minor_gc(vm);
+        }
+        if (!(vm->heap.next + size < vm->heap.end)) {
+            idris_gc_for(vm, size);
+        } else if (!(vm->large.size + size < vm->large.trigger_size) &&
+                   vm->inc.pause == 0) {
+            idris_gc(vm);
+        }
+        // The large object space mustn't collect until the reservation has
+        // been used, however big it is
+        if (!(vm->large.size + size < vm->large.trigger_size)) {
+            vm->large.trigger_size = vm->large.size + size + 1;
+        }
     }
-#endif
 }
 
 void idris_doneAlloc(VM * vm) {
-#ifdef HAS_PTHREAD
-    int lock = vm->processes > 0;
-    if (lock) { // We only need to lock if we're in concurrent mode
-       pthread_mutex_unlock(&vm->alloc_lock);
-    }
-#endif
 }
 
 int space(VM* vm, size_t size) {
+    size = aligned(size);
+    if (size >= LARGE_OBJECT_MIN) {
+        return vm->large.size < vm->large.trigger_size;
+    }
+    if (vm->nursery.size > 0 && size < vm->nursery.large &&
+        !vm->nursery.collecting) {
+        return (vm->nursery.next + size) < vm->nursery.end;
+    }
     return (vm->heap.next + size) < vm->heap.end;
 }
 
@@ -211,61 +283,127 @@ void * allocate(size_t sz, int lock) {
     return iallocate(get_vm(), sz, lock);
 }
 
+// Large objects don't move, so they're allocated separately rather than
+// in the heap. The block is NULL, or the caller's own block to adopt.
+static void* placeLarge(VM * vm, void * block, size_t isize) {
+    // Collect once the space has grown enough since the last collection
+    if (!vm->nursery.collecting &&
+        vm->large.size >= vm->large.trigger_size) {
+        if (vm->inc.pause > 0) {
+            // Large objects pace an incremental collection as well. Its
+            // end resets the trigger.
+            idris_inc_step(vm);
+            if (vm->large.size >= vm->large.trigger_size) {
+                vm->large.trigger_size = vm->large.size + 4 * LARGE_OBJECT_MIN;
+            }
+        } else {
+            idris_gc(vm);
+        }
+    }
+    if (!vm->nursery.collecting) {
+        check_max_heap(vm, (vm->heap.next - vm->heap.heap) + isize);
+    }
+
+    STATS_ALLOC(vm->stats, isize)
+    Hdr* ptr = block != NULL
+        ? adopt_large(&vm->large, block, isize, vm->nursery.collecting)
+        : alloc_large(&vm->large, isize, vm->nursery.collecting);
+    *ptr = (Hdr){ .ty = CT_RAWDATA, .u8 = GC_LARGE, .sz = isize };
+
+    // As for a large object allocated in the heap, it may be initialised
+    // with pointers into the nursery.
+    if (vm->nursery.size > 0 && !vm->nursery.collecting) {
+        idris_remember(vm, (VAL)ptr);
+    }
+    return ptr;
+}
+
+static void* allocLarge(VM * vm, size_t isize) {
+    return placeLarge(vm, NULL, isize);
+}
+
 void* iallocate(VM * vm, size_t isize, int outerlock) {
     size_t size = aligned(isize);
 
-#ifdef HAS_PTHREAD
-    int lock = vm->processes > 0 && !outerlock;
+    if (size >= LARGE_OBJECT_MIN) {
+        return allocLarge(vm, isize);
+    }
 
-    if (lock) { // not message passing
-       pthread_mutex_lock(&vm->alloc_lock);
+    // Small objects go in the nursery, unless we're promoting out of it
+    if (vm->nursery.size > 0 && size < vm->nursery.large &&
+        !vm->nursery.collecting) {
+        if (vm->nursery.next + size < vm->nursery.end) {
+            STATS_ALLOC(vm->stats, size)
+            char* ptr = vm->nursery.next;
+            vm->nursery.next += size;
+            assert(vm->nursery.next <= vm->nursery.end);
+            // The nursery is reused, so the header must be cleared
+            *((Hdr*)ptr) = (Hdr){ .ty = CT_RAWDATA, .sz = isize };
+            return (void*)ptr;
+        } else {
+            idris_minor_gc(vm);
+            return iallocate(vm, isize, outerlock);
+        }
     }
-#endif
 
-    if (vm->heap.next + size < vm->heap.end) {
+    if (vm->heap.next + size <= vm->heap.end) {
         STATS_ALLOC(vm->stats, size)
         char* ptr = vm->heap.next;
         vm->heap.next += size;
         assert(vm->heap.next <= vm->heap.end);
-        ((Hdr*)ptr)->sz = isize;
+        *((Hdr*)ptr) = (Hdr){ .ty = CT_RAWDATA, .sz = isize };
 
-#ifdef HAS_PTHREAD
-        if (lock) { // not message passing
-           pthread_mutex_unlock(&vm->alloc_lock);
+        // A large object allocated straight into the heap is about to be
+        // initialised, possibly with pointers into the nursery.
+        if (vm->nursery.size > 0 && !vm->nursery.collecting) {
+            idris_remember(vm, (VAL)ptr);
         }
-#endif
         return (void*)ptr;
     } else {
-        // If we're trying to allocate something bigger than the heap,
-        // grow the heap here so that the new heap is big enough.
-        if (size > vm->heap.size) {
-            vm->heap.size += size;
-        }
-        idris_gc(vm);
-
-        // If there's still not enough room, grow the heap and try again
-        if (vm->heap.next + size >= vm->heap.end) {
-            vm->heap.size += size+vm->heap.growth;
-            idris_gc(vm);
-        }
-
-#ifdef HAS_PTHREAD
-        if (lock) { // not message passing
-           pthread_mutex_unlock(&vm->alloc_lock);
-        }
-#endif
-        return iallocate(vm, size, outerlock);
+        idris_gc_for(vm, size);
+        return iallocate(vm, isize, outerlock);
     }
 
 }
 
+// The characters aren't known yet, so they're counted when they're first
+// needed, unless the caller sets the count.
 static String * allocStr(VM * vm, size_t len, int outer) {
     String * cl = iallocate(vm, sizeof(*cl) + len + 1, outer);
     SETTY(cl, CT_STRING);
     cl->slen = len;
+    cl->str[len] = '\0';
     return cl;
 }
 
+static void countStr(String * s) {
+    if (!(s->hdr.u16 & STR_COUNTED)) {
+        int ascii;
+        s->clen = idris_utf8_count(s->str, s->slen, &ascii);
+        s->hdr.u16 |= STR_COUNTED | (ascii ? STR_ASCII : 0);
+    }
+}
+
+static void setASCII(String * s) {
+    s->clen = s->slen;
+    s->hdr.u16 |= STR_COUNTED | STR_ASCII;
+}
+
+// Whether every character of a string is a single byte
+static int isASCII(VAL s) {
+    switch(GETTY(s)) {
+    case CT_STRING:
+        countStr((String*)s);
+        return (s->hdr.u16 & STR_ASCII) != 0;
+    case CT_STROFFSET:
+        return isASCII((VAL)((StrOffset*)s)->base);
+    case CT_STRCONCAT:
+        return (s->hdr.u16 & STR_ASCII) != 0;
+    default:
+        return 0;
+    }
+}
+
 static VAL mkfloat(VM* vm, double val, int outer) {
     Float * cl = iallocate(vm, sizeof(*cl), outer);
     SETTY(cl, CT_FLOAT);
@@ -283,10 +421,25 @@ VAL MKFLOATc(VM* vm, double val) {
 
 static VAL mkstrlen(VM* vm, const char * str, size_t len, int outer) {
     String * cl = allocStr(vm, len, outer);
-    // hdr.u8 used to mark a null string
-    cl->hdr.u8 = str == NULL;
-    if (!cl->hdr.u8)
+    if (str == NULL)
+      cl->hdr.u8 |= STR_NULL;
+    else
       memcpy(cl->str, str, len);
+    countStr(cl);
+    return (VAL)cl;
+}
+
+VAL MKSTRadopt(VM* vm, void* block, size_t len, int ascii) {
+    size_t isize = sizeof(String) + len + 1;
+    String * cl = placeLarge(vm, block, isize);
+    SETTY(cl, CT_STRING);
+    cl->slen = len;
+    cl->str[len] = '\0';
+    if (ascii) {
+        setASCII(cl);
+    } else {
+        countStr(cl);
+    }
     return (VAL)cl;
 }
 
@@ -310,19 +463,84 @@ static char * getstroff(StrOffset * stroff) {
     return stroff->base->str + stroff->offset;
 }
 
-char* GETSTROFF(VAL stroff) {
-    // Assume STROFF
-    return getstroff((StrOffset*)stroff);
+// The bytes of any kind of string, which may not be followed by a terminator
+static char * strBytes(VAL x) {
+    switch(GETTY(x)) {
+    case CT_STRING:
+        return ((String*)x)->str;
+    case CT_STROFFSET:
+        return getstroff((StrOffset*)x);
+    default:
+        return GETSTR(x);
+    }
 }
 
-static size_t getstrofflen(StrOffset * stroff) {
-    return stroff->base->slen - stroff->offset;
+// Copy the characters of any kind of string to dst, without a terminator.
+// Each recursive call is on the shorter half of a concatenation, so the
+// C stack only grows logarithmically, however the concatenation was built.
+static void flattenInto(char* dst, VAL x) {
+    while (GETTY(x) == CT_STRCONCAT && ((StrConcat*)x)->flat == NULL) {
+        StrConcat * cl = (StrConcat*)x;
+        size_t llen = GETSTRLEN(cl->left);
+        if (llen <= cl->slen - llen) {
+            flattenInto(dst, cl->left);
+            dst += llen;
+            x = cl->right;
+        } else {
+            flattenInto(dst + llen, cl->right);
+            x = cl->left;
+        }
+    }
+    memcpy(dst, strBytes(x), GETSTRLEN(x));
+}
+
+// Copy a string into a terminated C heap buffer belonging to the current
+// VM. Flattening can't allocate in the heap, since nothing says the caller
+// is ready for a collection.
+static CHeapItem * flatten(VAL x, size_t len) {
+    char * buf = malloc(len + 1);
+    if (buf == NULL) {
+        fprintf(stderr, "Out of memory flattening a string\n");
+        exit(EXIT_FAILURE);
+    }
+    flattenInto(buf, x);
+    buf[len] = '\0';
+    CHeapItem * item = c_heap_create_item(buf, len + 1, free);
+    c_heap_link_item(&get_vm()->c_heap, item);
+    return item;
+}
+
+char* GETSTROFF(VAL stroff) {
+    // Assume STROFF
+    StrOffset * cl = (StrOffset*)stroff;
+    if (cl->offset + cl->len == cl->base->slen) {
+        return getstroff(cl);
+    }
+    if (cl->flat == NULL) {
+        cl->flat = flatten(stroff, cl->len);
+    }
+    return cl->flat->data;
 }
 
 size_t GETSTROFFLEN(VAL stroff) {
     // Assume STROFF
     // we're working in char* here so no worries about utf8 char length
-    return getstrofflen((StrOffset*)stroff);
+    return ((StrOffset*)stroff)->len;
+}
+
+char* GETSTRCONCAT(VAL strcat) {
+    // Assume STRCONCAT
+    StrConcat * cl = (StrConcat*)strcat;
+    if (cl->flat == NULL) {
+        cl->flat = flatten(strcat, cl->slen);
+        cl->left = NULL;
+        cl->right = NULL;
+    }
+    return cl->flat->data;
+}
+
+size_t GETSTRCONCATLEN(VAL strcat) {
+    return ((StrConcat*)strcat)->slen;
 }
 
 static VAL mkcdata(VM * vm, CHeapItem * item, int outer) {
@@ -380,13 +598,20 @@ VAL MKB16(VM* vm, uint16_t bits16) {
 }
 
 VAL MKB32(VM* vm, uint32_t bits32) {
+#ifdef IDRIS_UNBOXED_BITS32
+    return MKINT((i_int)bits32);
+#else
     Bits32 * cl = iallocate(vm, sizeof(*cl), 1);
     SETTY(cl, CT_BITS32);
     cl->bits32 = bits32;
     return (VAL)cl;
+#endif
 }
 
 VAL MKB64(VM* vm, uint64_t bits64) {
+    if (bits64 <= BITS64_MAXINT) {
+        return MKINT((i_int)bits64);
+    }
     Bits64 * cl = iallocate(vm, sizeof(*cl), 1);
     SETTY(cl, CT_BITS64);
     cl->bits64 = bits64;
@@ -447,6 +672,19 @@ void dumpVal(VAL v) {
             printf("]");
         }
         break;
+    case CT_STRCONCAT:
+        {
+            StrConcat * cl = (StrConcat*)v;
+            if (cl->flat != NULL) {
+                printf("CONCAT[%s]", (char*)cl->flat->data);
+            } else {
+                printf("CONCAT[");
+                dumpVal(cl->left);
+                dumpVal(cl->right);
+                printf("]");
+            }
+        }
+        break;
     case CT_FWD:
         {
             Fwd * cl = (Fwd*)v;
@@ -506,43 +744,44 @@ void idris_memmove(void* dest, void* src, i_int dest_offset, i_int src_offset, i
     memmove((char *)dest + dest_offset, (char *)src + src_offset, size);
 }
 
-VAL idris_castIntStr(VM* vm, VAL i) {
-    int x = (int) GETINT(i);
-    String * cl = allocStr(vm, 16, 0);
-    cl->slen = sprintf(cl->str, "%d", x);
+// Make a string from the digits of a number, which are all ASCII
+static VAL mkNumStr(VM* vm, const char* digits, size_t len) {
+    String * cl = allocStr(vm, len, 0);
+    memcpy(cl->str, digits, len);
+    setASCII(cl);
     return (VAL)cl;
 }
 
+VAL idris_castIntStr(VM* vm, VAL i) {
+    char buf[IDRIS_INT_DIGITS];
+    return mkNumStr(vm, buf, idris_fmt_i64(buf, GETINT(i)));
+}
+
 VAL idris_castBitsStr(VM* vm, VAL i) {
-    String * cl;
+    char buf[IDRIS_INT_DIGITS];
     ClosureType ty = GETTY(i);
+    uint64_t x;
 
     switch (ty) {
-    case CT_INT: // 8/16 bits
-        // max length 16 bit unsigned int str 5 chars (65,535)
-        cl = allocStr(vm, 6, 0);
-        cl->slen = sprintf(cl->str, "%" PRIu16, (uint16_t)GETBITS16(i));
+    case CT_INT: // 8/16 bits, and unboxed 32/64 bits
+        x = (uintptr_t)GETINT(i);
         break;
     case CT_BITS32:
-        // max length 32 bit unsigned int str 10 chars (4,294,967,295)
-        cl = allocStr(vm, 11, 0);
-        cl->slen = sprintf(cl->str, "%" PRIu32, GETBITS32(i));
+        x = GETBITS32(i);
         break;
     case CT_BITS64:
-        // max length 64 bit unsigned int str 20 chars (18,446,744,073,709,551,615)
-        cl = allocStr(vm, 21, 0);
-        cl->slen = sprintf(cl->str, "%" PRIu64, GETBITS64(i));
+        x = GETBITS64(i);
         break;
     default:
         fprintf(stderr, "Fatal Error: ClosureType %d, not an integer type", ty);
         exit(EXIT_FAILURE);
     }
-    return (VAL)cl;
+    return mkNumStr(vm, buf, idris_fmt_u64(buf, x));
 }
 
 VAL idris_castStrInt(VM* vm, VAL i) {
-    char *end;
-    i_int v = strtol(GETSTR(i), &end, 10);
+    const char *end;
+    i_int v = (i_int)idris_parse_i64(GETSTR(i), &end);
     if (*end == '\0' || *end == '\n' || *end == '\r')
         return MKINT(v);
     else
@@ -550,43 +789,327 @@ VAL idris_castStrInt(VM* vm, VAL i) {
 }
 
 VAL idris_castFloatStr(VM* vm, VAL i) {
-    String * cl = allocStr(vm, 32, 0);
-    cl->slen = snprintf(cl->str, 32, "%.16g", GETFLOAT(i));
-    return (VAL)cl;
+    char buf[IDRIS_DOUBLE_DIGITS];
+    return mkNumStr(vm, buf, idris_fmt_double(buf, GETFLOAT(i)));
 }
 
 VAL idris_castStrFloat(VM* vm, VAL i) {
-    return MKFLOAT(vm, strtod(GETSTR(i), NULL));
+    return MKFLOAT(vm, idris_parse_double(GETSTR(i)));
 }
 
-VAL idris_concat(VM* vm, VAL l, VAL r) {
-    char *rs = GETSTR(r);
-    char *ls = GETSTR(l);
+static int isConcat(VAL x) {
+    return GETTY(x) == CT_STRCONCAT && ((StrConcat*)x)->flat == NULL;
+}
+
+// Copy two short strings into a new string. They're copied out first, since
+// allocating may move them.
+static VAL joinShort(VM* vm, VAL l, VAL r) {
+    char buf[2 * STRCONCAT_MIN];
     size_t llen = GETSTRLEN(l);
     size_t rlen = GETSTRLEN(r);
+    assert(llen + rlen <= sizeof(buf));
+    memcpy(buf, strBytes(l), llen);
+    memcpy(buf + llen, strBytes(r), rlen);
 
     String * cl = allocStr(vm, llen + rlen, 0);
-    memcpy(cl->str, ls, llen);
-    memcpy(cl->str + llen, rs, rlen);
+    memcpy(cl->str, buf, llen + rlen);
     return (VAL)cl;
 }
 
+// Build TOP(-2) ++ TOP(-1) lazily. They're kept on the stack, so that they
+// can be found again after allocating.
+static VAL mkStrConcat(VM* vm) {
+    size_t llen = GETSTRLEN(TOP(-2));
+    size_t rlen = GETSTRLEN(TOP(-1));
+
+    // Merge short pieces into the near end of a concatenation, so that
+    // building a string a character at a time doesn't need a node for
+    // every character.
+    if (rlen < STRCONCAT_MIN && isConcat(TOP(-2))) {
+        VAL lr = ((StrConcat*)TOP(-2))->right;
+        if (GETSTRLEN(lr) + rlen < STRCONCAT_MIN) {
+            TOP(-1) = joinShort(vm, lr, TOP(-1));
+            TOP(-2) = ((StrConcat*)TOP(-2))->left;
+        }
+    } else if (llen < STRCONCAT_MIN && isConcat(TOP(-1))) {
+        VAL rl = ((StrConcat*)TOP(-1))->left;
+        if (llen + GETSTRLEN(rl) < STRCONCAT_MIN) {
+            TOP(-2) = joinShort(vm, TOP(-2), rl);
+            TOP(-1) = ((StrConcat*)TOP(-1))->right;
+        }
+    }
+
+    StrConcat * cl = iallocate(vm, sizeof(*cl), 0);
+    SETTY(cl, CT_STRCONCAT);
+    cl->slen = llen + rlen;
+    cl->left = TOP(-2);
+    cl->right = TOP(-1);
+    cl->flat = NULL;
+    if (isASCII(cl->left) && isASCII(cl->right)) {
+        cl->hdr.u16 = STR_ASCII;
+    }
+    return (VAL)cl;
+}
+
+VAL idris_concat(VM* vm, VAL l, VAL r) {
+    size_t llen = GETSTRLEN(l);
+    size_t rlen = GETSTRLEN(r);
+
+    // Long results are built lazily, so that repeated appends take time
+    // linear in the total length rather than quadratic.
+    if (llen + rlen >= STRCONCAT_MIN) {
+        if (llen == 0) {
+            return r;
+        }
+        if (rlen == 0) {
+            return l;
+        }
+        RESERVENOALLOC(2);
+        TOP(0) = l;
+        TOP(1) = r;
+        ADDTOP(2);
+        VAL cl = mkStrConcat(vm);
+        ADDTOP(-2);
+        return cl;
+    }
+
+    return joinShort(vm, l, r);
+}
+
+int idris_strPieces(VAL str, int (*f)(const char*, size_t, void*), void* env) {
+    // Right halves still to visit. Short pieces are merged into the ends of
+    // concatenations, so this only gets deep for very long strings.
+    VAL local[64];
+    VAL* pending = local;
+    size_t cap = sizeof(local) / sizeof(VAL);
+    size_t n = 0;
+    int res = 0;
+
+    for (;;) {
+        while (isConcat(str)) {
+            if (n == cap) {
+                VAL* bigger = malloc(2 * cap * sizeof(VAL));
+                if (bigger == NULL) {
+                    fprintf(stderr, "Out of memory walking a string\n");
+                    exit(EXIT_FAILURE);
+                }
+                memcpy(bigger, pending, n * sizeof(VAL));
+                if (pending != local) {
+                    free(pending);
+                }
+                pending = bigger;
+                cap *= 2;
+            }
+            pending[n++] = ((StrConcat*)str)->right;
+            str = ((StrConcat*)str)->left;
+        }
+        size_t len = GETSTRLEN(str);
+        if (len > 0 && (res = f(strBytes(str), len, env)) != 0) {
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        str = pending[--n];
+    }
+    if (pending != local) {
+        free(pending);
+    }
+    return res;
+}
+
+// Compare strings like strcmp, without needing terminators
+static int strCompare(VAL l, VAL r) {
+    size_t llen = GETSTRLEN(l);
+    size_t rlen = GETSTRLEN(r);
+    int cmp = memcmp(strBytes(l), strBytes(r), llen < rlen ? llen : rlen);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return llen < rlen ? -1 : llen > rlen;
+}
+
 VAL idris_strlt(VM* vm, VAL l, VAL r) {
-    char *ls = GETSTR(l);
-    char *rs = GETSTR(r);
+    return MKINT((i_int)(strCompare(l, r) < 0));
+}
 
-    return MKINT((i_int)(strcmp(ls, rs) < 0));
+static int isInterned(VAL x) {
+    return ISSTR(x) && (x->hdr.u16 & STR_INTERNED);
 }
 
 VAL idris_streq(VM* vm, VAL l, VAL r) {
-    char *ls = GETSTR(l);
-    char *rs = GETSTR(r);
-
-    return MKINT((i_int)(strcmp(ls, rs) == 0));
+    if (l == r) {
+        return MKINT(1);
+    }
+    // There's only one interned copy of each string
+    if (isInterned(l) && isInterned(r)) {
+        return MKINT(0);
+    }
+    if (GETSTRLEN(l) != GETSTRLEN(r)) {
+        return MKINT(0);
+    }
+    return MKINT((i_int)(strCompare(l, r) == 0));
 }
 
 VAL idris_strlen(VM* vm, VAL l) {
-    return MKINT((i_int)(idris_utf8_strlen(GETSTR(l))));
+    if (ISSTR(l)) {
+        countStr((String*)l);
+        return MKINT((i_int)(((String*)l)->clen));
+    }
+    if (isASCII(l)) {
+        return MKINT((i_int)(GETSTRLEN(l)));
+    }
+    int ascii;
+    return MKINT((i_int)(idris_utf8_count(strBytes(l), GETSTRLEN(l), &ascii)));
+}
+
+// Interned strings live outside every heap, for as long as the program
+// runs, in a table shared by all the VMs. The table is split into shards,
+// each with its own lock, so that threads interning different strings
+// rarely wait for each other.
+//
+// Nothing is ever removed, so the strings are limited to INTERN_LIMIT bytes
+// in all. Beyond that, strings which aren't already in the table are
+// returned as they are: they still compare equal to their interned copies,
+// just not in constant time.
+#define INTERN_SHARDS 64
+#define INTERN_INITIAL 64
+#define INTERN_LIMIT (16 * 1024 * 1024)
+
+typedef struct {
+    uint64_t hash;
+    String * str;
+} InternSlot;
+
+typedef struct {
+#ifdef HAS_PTHREAD
+    pthread_mutex_t lock;
+#endif
+    size_t count;
+    size_t size; // a power of two, or 0 before anything is interned
+    InternSlot * slots;
+} InternShard;
+
+static InternShard intern_table[INTERN_SHARDS];
+static size_t intern_bytes; // In all the shards
+
+#ifdef HAS_PTHREAD
+static pthread_once_t intern_once = PTHREAD_ONCE_INIT;
+
+static void internInit(void) {
+    for (int i = 0; i < INTERN_SHARDS; ++i) {
+        pthread_mutex_init(&intern_table[i].lock, NULL);
+    }
+}
+#endif
+
+// FNV-1a
+static uint64_t internHash(const char * str, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ (uint8_t)str[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static void internGrow(InternShard * shard) {
+    size_t size = shard->size ? shard->size * 2 : INTERN_INITIAL;
+    InternSlot * slots = calloc(size, sizeof(InternSlot));
+    if (slots == NULL) {
+        fprintf(stderr, "Out of memory interning a string\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < shard->size; ++i) {
+        InternSlot * old = &shard->slots[i];
+        if (old->str != NULL) {
+            size_t j = old->hash & (size - 1);
+            while (slots[j].str != NULL) {
+                j = (j + 1) & (size - 1);
+            }
+            slots[j] = *old;
+        }
+    }
+    free(shard->slots);
+    shard->slots = slots;
+    shard->size = size;
+}
+
+// Count size more bytes towards INTERN_LIMIT, unless it would go over
+static int internReserve(size_t size) {
+#ifdef HAS_PTHREAD
+    size_t used = __atomic_load_n(&intern_bytes, __ATOMIC_RELAXED);
+    do {
+        if (used + size > INTERN_LIMIT) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&intern_bytes, &used, used + size,
+                                          1, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    return 1;
+#else
+    if (intern_bytes + size > INTERN_LIMIT) {
+        return 0;
+    }
+    intern_bytes += size;
+    return 1;
+#endif
+}
+
+static String * internCopy(const char * str, size_t len) {
+    String * cl = malloc(sizeof(*cl) + len + 1);
+    if (cl == NULL) {
+        fprintf(stderr, "Out of memory interning a string\n");
+        exit(EXIT_FAILURE);
+    }
+    SETTY(cl, CT_STRING);
+    cl->hdr.u8 = GC_STATIC;
+    cl->hdr.u16 = STR_INTERNED;
+    cl->hdr.sz = sizeof(*cl) + len + 1;
+    cl->slen = len;
+    memcpy(cl->str, str, len);
+    cl->str[len] = '\0';
+    countStr(cl);
+    return cl;
+}
+
+VAL idris_intern(VM* vm, VAL str) {
+    if (isInterned(str) || (ISSTR(str) && (str->hdr.u8 & STR_NULL))) {
+        return str;
+    }
+    const char * bytes = strBytes(str);
+    size_t len = GETSTRLEN(str);
+    uint64_t hash = internHash(bytes, len);
+    // The low bits pick the slot, so the shard comes from the high bits
+    InternShard * shard = &intern_table[hash >> 58];
+    String * found = NULL;
+
+#ifdef HAS_PTHREAD
+    pthread_once(&intern_once, internInit);
+    pthread_mutex_lock(&shard->lock);
+#endif
+    if (shard->count + 1 > shard->size / 4 * 3) {
+        internGrow(shard);
+    }
+    size_t i = hash & (shard->size - 1);
+    while (shard->slots[i].str != NULL) {
+        InternSlot * slot = &shard->slots[i];
+        if (slot->hash == hash && slot->str->slen == len &&
+            memcmp(slot->str->str, bytes, len) == 0) {
+            found = slot->str;
+            break;
+        }
+        i = (i + 1) & (shard->size - 1);
+    }
+    if (found == NULL && internReserve(sizeof(String) + len + 1)) {
+        found = internCopy(bytes, len);
+        shard->slots[i].hash = hash;
+        shard->slots[i].str = found;
+        shard->count++;
+    }
+#ifdef HAS_PTHREAD
+    pthread_mutex_unlock(&shard->lock);
+#endif
+    return found != NULL ? (VAL)found : str;
 }
 
 VAL idris_readStr(VM* vm, FILE* h) {
@@ -633,31 +1156,52 @@ VAL MKSTROFFc(VM* vm, VAL basestr) {
     StrOffset * cl = iallocate(vm, sizeof(*cl), 1);
     SETTY(cl, CT_STROFFSET);
     cl->base = (String*)basestr;
+    cl->offset = 0;
+    cl->len = cl->base->slen;
+    cl->flat = NULL;
+    return (VAL)cl;
+}
+
+// A view of len bytes of str, from start. There must be room for it, or
+// str may move.
+static VAL mkStrOffset(VM* vm, VAL str, size_t start, size_t len) {
+    StrOffset * cl = iallocate(vm, sizeof(*cl), 0);
+    SETTY(cl, CT_STROFFSET);
+    // Views are always of a String, never of another view
+    if (ISSTROFF(str)) {
+        cl->base = ((StrOffset*)str)->base;
+        cl->offset = ((StrOffset*)str)->offset + start;
+    } else {
+        cl->base = (String*)str;
+        cl->offset = start;
+    }
+    cl->len = len;
+    cl->flat = NULL;
     return (VAL)cl;
 }
 
+// Byte offset of the num-th character of str
+static size_t shiftOffset(VAL str, int num) {
+    size_t len = GETSTRLEN(str);
+    if (num <= 0) {
+        return 0;
+    }
+    if (isASCII(str)) {
+        return (size_t)num < len ? (size_t)num : len;
+    }
+    return idris_utf8_offset(strBytes(str), len, num);
+}
+
 VAL idris_strShift(VM* vm, VAL str, int num) {
     size_t sz = sizeof(StrOffset);
     // If there's no room, just copy the string, or we'll have a problem after
-    // gc moves str
-    if (space(vm, sz)) {
-        int offset = 0;
-        StrOffset * root = (StrOffset*)str;
-        StrOffset * cl = iallocate(vm, sz, 0);
-        SETTY(cl, CT_STROFFSET);
-
-        while(root!=NULL && !ISSTR(root)) { // find the root, carry on.
-                              // In theory, at most one step here!
-            offset += root->offset;
-            root = (StrOffset*)root->base;
-        }
-
-        cl->base = (String*)root;
-        cl->offset = offset+idris_utf8_findOffset(GETSTR(str), num);
-        return (VAL)cl;
+    // gc moves str. Concatenations are copied too, since an offset needs a
+    // String to point into.
+    size_t shift = shiftOffset(str, num);
+    if (space(vm, sz) && GETTY(str) != CT_STRCONCAT) {
+        return mkStrOffset(vm, str, shift, GETSTRLEN(str) - shift);
     } else {
-        char* nstr = GETSTR(str);
-        return MKSTR(vm, nstr+idris_utf8_charlen(nstr));
+        return MKSTRlen(vm, strBytes(str) + shift, GETSTRLEN(str) - shift);
     }
 }
 
@@ -666,7 +1210,7 @@ VAL idris_strTail(VM* vm, VAL str) {
 }
 
 VAL idris_strCons(VM* vm, VAL x, VAL xs) {
-    char *xstr = GETSTR(xs);
+    char *xstr = strBytes(xs);
     int xval = GETINT(x);
     size_t xlen = GETSTRLEN(xs);
     String * cl;
@@ -688,28 +1232,52 @@ VAL idris_strCons(VM* vm, VAL x, VAL xs) {
 }
 
 VAL idris_strIndex(VM* vm, VAL str, VAL i) {
-    int idx = idris_utf8_index(GETSTR(str), GETINT(i));
-    return MKINT((i_int)idx);
+    if (isASCII(str)) {
+        return MKINT((i_int)(unsigned char)strBytes(str)[GETINT(i)]);
+    }
+    char* s = strBytes(str);
+    s += idris_utf8_offset(s, GETSTRLEN(str), GETINT(i));
+    return MKINT((i_int)idris_utf8_index(s, 0));
 }
 
 VAL idris_substr(VM* vm, VAL offset, VAL length, VAL str) {
     size_t offset_val = GETINT(offset);
     size_t length_val = GETINT(length);
-    char* str_val = GETSTR(str);
+    char* str_val = strBytes(str);
 
     // If the substring is a suffix, use idris_strShift to avoid reallocating
     if (offset_val + length_val >= GETSTRLEN(str)) {
         return idris_strShift(vm, str, offset_val);
     }
     else {
-        char *start = idris_utf8_advance(str_val, offset_val);
-        char *end = idris_utf8_advance(start, length_val);
+        int ascii = isASCII(str);
+        char *start, *end;
+        if (ascii) {
+            // Both in bounds, since this isn't a suffix
+            start = str_val + offset_val;
+            end = start + length_val;
+        } else {
+            size_t len = GETSTRLEN(str);
+            start = str_val + idris_utf8_offset(str_val, len, offset_val);
+            end = start + idris_utf8_offset(start, len - (start - str_val),
+                                            length_val);
+        }
         size_t sz = end - start;
 
+        // Long substrings are views, so that slicing doesn't copy. They
+        // need a String to point into, though.
+        if (sz >= STROFFSET_MIN && GETTY(str) != CT_STRCONCAT &&
+            space(vm, sizeof(StrOffset))) {
+            return mkStrOffset(vm, str, start - str_val, sz);
+        }
+
         if (space(vm, sz)) {
             String * newstr = allocStr(vm, sz, 0);
             memcpy(newstr->str, start, sz);
             newstr->str[sz] = '\0';
+            if (ascii) {
+                setASCII(newstr);
+            }
             return (VAL)newstr;
         } else {
             // Need to copy into an intermediate string before allocating,
@@ -722,6 +1290,9 @@ VAL idris_substr(VM* vm, VAL offset, VAL length, VAL str) {
             memcpy(newstr->str, cpystr, sz);
             newstr->str[sz] = '\0';
             free(cpystr);
+            if (ascii) {
+                setASCII(newstr);
+            }
             return (VAL)newstr;
         }
     }
@@ -731,8 +1302,13 @@ VAL idris_strRev(VM* vm, VAL str) {
     char *xstr = GETSTR(str);
     size_t xlen = GETSTRLEN(str);
 
+    int ascii = isASCII(str);
+
     String * cl = allocStr(vm, xlen, 0);
     idris_utf8_rev(xstr, cl->str);
+    if (ascii) {
+        setASCII(cl);
+    }
     return (VAL)cl;
 }
 
@@ -749,6 +1325,7 @@ VAL idris_newRef(VAL x) {
 
 void idris_writeRef(VAL ref, VAL x) {
     Ref * r = (Ref*)ref;
+    idris_writeBarrier(ref);
     r->ref = x;
     SETTY(ref, CT_REF);
 }
@@ -770,6 +1347,7 @@ VAL idris_newArray(VM* vm, int size, VAL def) {
 
 void idris_arraySet(VAL arr, int index, VAL newval) {
     Array * cl = (Array*)arr;
+    idris_writeBarrier(arr);
     cl->array[index] = newval;
 }
 
@@ -778,6 +1356,102 @@ VAL idris_arrayGet(VAL arr, int index) {
     return cl->array[index];
 }
 
+VAL idris_newPrimArray(VM* vm, int kind, int size) {
+    size_t bytes = primArrayElemSize(kind) * size;
+    PrimArray * cl = iallocate(vm, sizeof(*cl) + bytes, 0);
+    SETTY(cl, CT_PRIMARRAY);
+    cl->hdr.u16 = kind;
+    memset(cl->data, 0, bytes);
+    return (VAL)cl;
+}
+
+int idris_primArrayLength(VAL arr) {
+    return PAELEM(arr);
+}
+
+#define PRIMARRAY(ty, arr) ((ty*)((PrimArray*)(arr))->data)
+
+uint8_t idris_primArrayGetBits8(VAL arr, int index) {
+    return PRIMARRAY(uint8_t, arr)[index];
+}
+
+uint32_t idris_primArrayGetBits32(VAL arr, int index) {
+    return PRIMARRAY(uint32_t, arr)[index];
+}
+
+i_int idris_primArrayGetInt(VAL arr, int index) {
+    return PRIMARRAY(i_int, arr)[index];
+}
+
+double idris_primArrayGetDouble(VAL arr, int index) {
+    return PRIMARRAY(double, arr)[index];
+}
+
+void idris_primArraySetBits8(VAL arr, int index, uint8_t val) {
+    PRIMARRAY(uint8_t, arr)[index] = val;
+}
+
+void idris_primArraySetBits32(VAL arr, int index, uint32_t val) {
+    PRIMARRAY(uint32_t, arr)[index] = val;
+}
+
+void idris_primArraySetInt(VAL arr, int index, i_int val) {
+    PRIMARRAY(i_int, arr)[index] = val;
+}
+
+void idris_primArraySetDouble(VAL arr, int index, double val) {
+    PRIMARRAY(double, arr)[index] = val;
+}
+
+void idris_primArrayFillBits8(VAL arr, int start, int len, uint8_t val) {
+    memset(PRIMARRAY(uint8_t, arr) + start, val, len);
+}
+
+void idris_primArrayFillBits32(VAL arr, int start, int len, uint32_t val) {
+    uint32_t * p = PRIMARRAY(uint32_t, arr) + start;
+    for (int i = 0; i < len; ++i) {
+        p[i] = val;
+    }
+}
+
+void idris_primArrayFillInt(VAL arr, int start, int len, i_int val) {
+    i_int * p = PRIMARRAY(i_int, arr) + start;
+    for (int i = 0; i < len; ++i) {
+        p[i] = val;
+    }
+}
+
+void idris_primArrayFillDouble(VAL arr, int start, int len, double val) {
+    double * p = PRIMARRAY(double, arr) + start;
+    for (int i = 0; i < len; ++i) {
+        p[i] = val;
+    }
+}
+
+void idris_primArrayCopy(VAL from, int start, int len, VAL to, int loc) {
+    size_t sz = primArrayElemSize(PAKIND(from));
+    memmove(((PrimArray*)to)->data + loc * sz,
+            ((PrimArray*)from)->data + start * sz, len * sz);
+}
+
+VAL idris_primArraySlice(VM* vm, VAL arr, int start, int len) {
+    PrimArrayKind kind = PAKIND(arr);
+    size_t sz = primArrayElemSize(kind);
+    // Allocating may move arr
+    RESERVENOALLOC(1);
+    TOP(0) = arr;
+    ADDTOP(1);
+    PrimArray * cl = iallocate(vm, sizeof(*cl) + len * sz, 0);
+    arr = TOP(-1);
+    ADDTOP(-1);
+    SETTY(cl, CT_PRIMARRAY);
+    cl->hdr.u16 = kind;
+    memcpy(cl->data, ((PrimArray*)arr)->data + start * sz, len * sz);
+    return (VAL)cl;
+}
+
+#undef PRIMARRAY
+
 VAL idris_systemInfo(VM* vm, VAL index) {
     int i = GETINT(index);
     switch(i) {
@@ -811,31 +1485,50 @@ void* runThread(void* arg) {
     free(td);
     fn(vm, NULL);
 
-    //    Stats stats =
+    // This reports the VM's stats to its creator
     terminate(vm);
-    //    aggregate_stats(&(td->vm->stats), &stats);
     return NULL;
 }
 
 void* vmThread(VM* callvm, func f, VAL arg) {
-    VM* vm = init_vm(callvm->stack_max - callvm->valstack, callvm->heap.size,
+#ifdef IDRIS_GREEN_THREADS
+    // Processes are meant to be cheap, so start small
+    VM* vm = init_vm(callvm->stack_limit - callvm->valstack, PROCESS_HEAP_SIZE,
+                     callvm->max_threads);
+#else
+    VM* vm = init_vm(callvm->stack_limit - callvm->valstack, callvm->heap.size,
                      callvm->max_threads);
+#endif
+    vm->heap.growth_factor = callvm->heap.growth_factor;
+    vm->heap.max_size = callvm->heap.max_size;
     vm->processes=1; // since it can send and receive messages
     vm->creator = callvm;
+    alloc_nursery(&(vm->nursery), callvm->nursery.size);
+    idris_gc_incremental(vm, callvm->inc.pause);
+    idris_gc_compacting(vm, callvm->heap.compact);
+    VAL varg = copyTo(vm, arg);
+
+    callvm->processes++;
+    callvm->spawned = 1;
+
+#ifdef IDRIS_GREEN_THREADS
+    if (idris_spawn(vm, f, varg)) {
+        return vm;
+    } else {
+        terminate(vm);
+        return NULL;
+    }
+#else
     pthread_t t;
     pthread_attr_t attr;
-//    size_t stacksize;
 
     pthread_attr_init(&attr);
-//    pthread_attr_getstacksize (&attr, &stacksize);
-//    pthread_attr_setstacksize (&attr, stacksize*64);
+    pthread_attr_setstacksize(&attr, idris_processStackSize());
 
     ThreadData *td = malloc(sizeof(ThreadData)); // free'd in runThread
     td->vm = vm;
     td->fn = f;
-    td->arg = copyTo(vm, arg);
-
-    callvm->processes++;
+    td->arg = varg;
 
     int ok = pthread_create(&t, &attr, runThread, td);
     pthread_attr_destroy(&attr);
@@ -846,56 +1539,165 @@ void* vmThread(VM* callvm, func f, VAL arg) {
         terminate(vm);
         return NULL;
     }
+#endif
 }
 
 void* idris_stopThread(VM* vm) {
     terminate(vm);
+#ifdef IDRIS_GREEN_THREADS
+    if (vm->proc != NULL) {
+        idris_exit(vm);
+    }
+#endif
     pthread_exit(NULL);
     return NULL;
 }
 
-static VAL doCopyTo(VM* vm, VAL x);
+// Values are copied between VMs through a region: a block of memory outside
+// any VM's heap, laid out exactly as the copy will be laid out in the
+// destination heap. The region is built by the thread which owns the value,
+// and moved into the destination heap in one step by the thread which owns
+// that, so no thread ever allocates in another VM's heap.
 
-static void copyArray(VM* vm, VAL * dst, VAL * src, size_t len) {
-    size_t i;
-    for(i = 0; i < len; ++i)
-      dst[i] = doCopyTo(vm, src[i]);
+// Objects which can't be frozen into a shared region, because they can
+// change, or belong to the VM which made them
+static int unshareable(VAL x) {
+    switch(GETTY(x)) {
+    case CT_ARRAY:
+    case CT_CDATA:
+    case CT_MANAGEDPTR:
+    case CT_RAWDATA:
+    case CT_PRIMARRAY:
+        return 1;
+    default:
+        return 0;
+    }
 }
 
+// The room a copy of x needs. Structures can be far deeper than the C
+// stack, so the closures still to look at are kept on a stack of our own.
+// If unshared isn't NULL, it's set if any of them can't be frozen.
+static size_t msgSize(VAL x, int* unshared) {
+    VAL* stack = NULL;
+    size_t count = 0;
+    size_t room = 0;
+    size_t size = 0;
+    size_t i;
 
-// VM is assumed to be a different vm from the one x lives on
+    for (;;) {
+        size_t fields = 0;
+        VAL* field = NULL;
+        // Literals are the same in every VM
+        if (x != NULL && !ISIMM(x) && !(x->hdr.u8 & GC_STATIC)) {
+            if (unshared != NULL && unshareable(x)) {
+                *unshared = 1;
+            }
+            switch(GETTY(x)) {
+            case CT_CON:
+                fields = CARITY(x);
+                field = ((Con*)x)->args;
+                size += aligned(valSize(x));
+                break;
+            case CT_ARRAY:
+                fields = CELEM(x);
+                field = ((Array*)x)->array;
+                size += aligned(valSize(x));
+                break;
+            case CT_BIGINT: {
+                size_t limbs = mpz_size(GETMPZ(x));
+                // The limbs go in a RawData block, as if GMP had allocated them
+                size += aligned(sizeof(BigInt) + sizeof(mpz_t)) +
+                        aligned(sizeof(RawData) + (limbs ? limbs : 1) * sizeof(mp_limb_t));
+            } break;
+            case CT_STROFFSET:
+            case CT_STRCONCAT:
+                // Copied as a plain string
+                size += aligned(sizeof(String) + GETSTRLEN(x) + 1);
+                break;
+            case CT_CDATA:
+            case CT_STRING:
+            case CT_FLOAT:
+            case CT_PTR:
+            case CT_MANAGEDPTR:
+            case CT_BITS32:
+            case CT_BITS64:
+            case CT_RAWDATA:
+            case CT_PRIMARRAY:
+                size += aligned(valSize(x));
+                break;
+            default:
+                assert(0); // We're in trouble if this happens...
+            }
+        }
+
+        if (count + fields > room) {
+            room = count + fields > 2 * room ? count + fields : 2 * room;
+            stack = realloc(stack, room * sizeof(VAL));
+            if (stack == NULL) {
+                fprintf(stderr, "Out of memory copying a value between threads\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for(i = 0; i < fields; ++i) {
+            if (field[i] != NULL && !ISIMM(field[i])) {
+                stack[count++] = field[i];
+            }
+        }
+
+        if (count == 0) {
+            break;
+        }
+        x = stack[--count];
+    }
+    free(stack);
+    return size;
+}
 
-static VAL doCopyTo(VM* vm, VAL x) {
-    int ar;
+static void* regionAlloc(char** next, size_t size) {
+    Hdr* ptr = (Hdr*)*next;
+    *next += aligned(size);
+    *ptr = (Hdr){ .ty = CT_RAWDATA, .sz = size };
+    return ptr;
+}
+
+// Copy a closure into a region, leaving anything it points to where it is
+static VAL copyOneToRegion(char** next, VAL x) {
     VAL cl;
-    if (x==NULL) {
+    if (x==NULL || ISIMM(x) || (x->hdr.u8 & GC_STATIC)) {
         return x;
     }
     switch(GETTY(x)) {
-    case CT_INT:
-        return x;
-    case CT_CDATA:
-        cl = MKCDATAc(vm, GETCDATA(x));
-        break;
-    case CT_BIGINT:
-        cl = MKBIGMc(vm, GETMPZ(x));
-        break;
     case CT_CON:
-        ar = CARITY(x);
-        if (ar == 0 && CTAG(x) < 256) { // globally allocated
-            cl = x;
-        } else {
-            Con * c = allocConF(vm, CTAG(x), ar, 1);
-            copyArray(vm, c->args, ((Con*)x)->args, ar);
-            cl = (VAL)c;
-        }
+    case CT_ARRAY:
+        cl = regionAlloc(next, valSize(x));
+        memcpy(cl, x, valSize(x));
+        cl->hdr.u8 = 0;
         break;
-    case CT_ARRAY: {
-        size_t len = CELEM(x);
-        Array * a = allocArrayF(vm, len, 1);
-        copyArray(vm, a->array, ((Array*)x)->array, len);
-        cl = (VAL)a;
+    case CT_BIGINT: {
+        // Build the mpz by hand: GMP would allocate its limbs in our heap.
+        size_t limbs = mpz_size(GETMPZ(x));
+        size_t alloc = limbs ? limbs : 1;
+        BigInt* b = regionAlloc(next, sizeof(BigInt) + sizeof(mpz_t));
+        SETTY(b, CT_BIGINT);
+        RawData* d = regionAlloc(next, sizeof(RawData) + alloc * sizeof(mp_limb_t));
+        SETTY(d, CT_RAWDATA);
+        memcpy(d->raw, mpz_limbs_read(GETMPZ(x)), limbs * sizeof(mp_limb_t));
+        (*getmpz(b))->_mp_alloc = alloc;
+        (*getmpz(b))->_mp_size = mpz_sgn(GETMPZ(x)) < 0 ? -(int)limbs : (int)limbs;
+        (*getmpz(b))->_mp_d = (mp_limb_t*)d->raw;
+        cl = (VAL)b;
+    } break;
+    case CT_STROFFSET:
+    case CT_STRCONCAT: {
+        size_t len = GETSTRLEN(x);
+        String* str = regionAlloc(next, sizeof(String) + len + 1);
+        SETTY(str, CT_STRING);
+        str->slen = len;
+        flattenInto(str->str, x);
+        str->str[len] = '\0';
+        cl = (VAL)str;
     } break;
+    case CT_CDATA:
     case CT_STRING:
     case CT_FLOAT:
     case CT_PTR:
@@ -903,210 +1705,448 @@ static VAL doCopyTo(VM* vm, VAL x) {
     case CT_BITS32:
     case CT_BITS64:
     case CT_RAWDATA:
-        {
-            cl = iallocate(vm, x->hdr.sz, 0);
-            memcpy(cl, x, x->hdr.sz);
-        }
+    case CT_PRIMARRAY:
+        cl = regionAlloc(next, valSize(x));
+        memcpy(cl, x, valSize(x));
+        cl->hdr.u8 &= ~(GC_LARGE | GC_SHARED);
         break;
     default:
         assert(0); // We're in trouble if this happens...
-	cl = NULL;
+        cl = NULL;
     }
     return cl;
 }
 
-VAL copyTo(VM* vm, VAL x) {
-    VAL ret = doCopyTo(vm, x);
-    return ret;
+// Copy x into a region, breadth first: the copies in the region are scanned
+// in order, as in a Cheney collection, and whatever they still point to
+// outside it is copied onto the end.
+static VAL copyToRegion(char** next, VAL x) {
+    char* scan = *next;
+    size_t i;
+    x = copyOneToRegion(next, x);
+    while (scan < *next) {
+        VAL cl = (VAL)scan;
+        switch(GETTY(cl)) {
+        case CT_CON:
+            for(i = 0; i < CARITY(cl); ++i) {
+                ((Con*)cl)->args[i] = copyOneToRegion(next, ((Con*)cl)->args[i]);
+            }
+            break;
+        case CT_ARRAY:
+            for(i = 0; i < CELEM(cl); ++i) {
+                ((Array*)cl)->array[i] = copyOneToRegion(next, ((Array*)cl)->array[i]);
+            }
+            break;
+        default:
+            break;
+        }
+        scan += aligned(valSize(cl));
+    }
+    return x;
 }
 
-// Add a message to another VM's message queue
-int idris_sendMessage(VM* sender, int channel_id, VM* dest, VAL msg) {
-    // FIXME: If GC kicks in in the middle of the copy, we're in trouble.
-    // Probably best check there is enough room in advance. (How?)
+// Copy x into a new region. Returns NULL if x needs no copying (so x itself
+// can be used in any VM), otherwise sets *size and replaces *x by the copy.
+static char* makeRegion(VAL* x, size_t* size) {
+    *size = msgSize(*x, NULL);
+    if (*size == 0) {
+        return NULL;
+    }
+    char* region = malloc(*size);
+    if (region == NULL) {
+        fprintf(stderr, "Out of memory copying a value between threads\n");
+        exit(EXIT_FAILURE);
+    }
+    char* next = region;
+    *x = copyToRegion(&next, *x);
+    assert(next == region + *size);
+    return region;
+}
 
-    // Also a problem if we're allocating at the same time as the
-    // destination thread (which is very likely)
-    // Should the inbox be a different memory space?
+// Move the contents of a region holding x into vm's heap, and return the
+// new location of x. The region can be freed afterwards.
+static VAL moveRegion(VM* vm, char* region, size_t size, VAL x) {
+    if (region == NULL) {
+        return x;
+    }
+
+    // The copy goes in the heap in one piece, so nothing can be collected
+    // part way through. Make room first, growing the heap if necessary.
+    if (vm->heap.next + size > vm->heap.end) {
+        idris_gc_for(vm, size);
+    }
 
-    // So: we try to copy, if a collection happens, we do the copy again
-    // under the assumption there's enough space this time.
+    STATS_ALLOC(vm->stats, size)
+    char* dst = vm->heap.next;
+    vm->heap.next += size;
+    memcpy(dst, region, size);
 
-    if (dest->active == 0) { return 0; } // No VM to send to
+#define RELOCATE(p) \
+    if ((p) != NULL && !ISIMM((VAL)(p)) && \
+        (char*)(p) >= region && (char*)(p) < region + size) { \
+        (p) = (void*)((char*)(p) + (dst - region)); \
+    }
+
+    char* scan;
+    size_t i;
+    for(scan = dst; scan < dst + size; scan += aligned(valSize((VAL)scan))) {
+        VAL cl = (VAL)scan;
+        switch(GETTY(cl)) {
+        case CT_CON:
+            for(i = 0; i < CARITY(cl); ++i) {
+                RELOCATE(((Con*)cl)->args[i]);
+            }
+            if (vm->nursery.size > 0) {
+                cl->hdr.u8 = GC_OLD;
+            }
+            break;
+        case CT_ARRAY:
+            for(i = 0; i < CELEM(cl); ++i) {
+                RELOCATE(((Array*)cl)->array[i]);
+            }
+            if (vm->nursery.size > 0) {
+                cl->hdr.u8 = GC_OLD;
+            }
+            break;
+        case CT_BIGINT:
+            RELOCATE((*getmpz((BigInt*)cl))->_mp_d);
+            break;
+        case CT_CDATA:
+            // Can't collect here, since the copy isn't reachable yet
+            c_heap_link_item(&vm->c_heap, ((CDataC*)cl)->item);
+            break;
+        default:
+            break;
+        }
+    }
+    RELOCATE(x);
+#undef RELOCATE
+    return x;
+}
 
-    int gcs = dest->stats.collections;
-    pthread_mutex_lock(&dest->alloc_lock);
-    VAL dmsg = copyTo(dest, msg);
-    pthread_mutex_unlock(&dest->alloc_lock);
+// VM is assumed to be a different vm from the one x lives on
+
+// The shared region which x was frozen into, held once more, or NULL if it
+// wasn't frozen.
+static SharedRegion* holdShared(VM* vm, VAL x) {
+    if (x == NULL || ISIMM(x) || !(x->hdr.u8 & GC_SHARED)) {
+        return NULL;
+    }
+    SharedRef* ref = find_shared(&vm->shared, x);
+    if (ref == NULL) {
+        return NULL;
+    }
+    retain_shared(ref->region);
+    return ref->region;
+}
+
+VAL idris_freeze(VM* vm, VAL x) {
+    if (x == NULL || ISIMM(x) || (x->hdr.u8 & GC_SHARED)) {
+        return x;
+    }
+    int unshared = 0;
+    size_t size = msgSize(x, &unshared);
+    if (size == 0 || unshared) {
+        return x;
+    }
 
-    if (dest->stats.collections > gcs) {
-        // a collection will have invalidated the copy
-        pthread_mutex_lock(&dest->alloc_lock);
-        dmsg = copyTo(dest, msg); // try again now there's room...
-        pthread_mutex_unlock(&dest->alloc_lock);
+    SharedRegion* region = alloc_shared(size);
+    char* start = shared_objects(region);
+    char* next = start;
+    x = copyToRegion(&next, x);
+    assert(next == start + size);
+    for(char* scan = start; scan < next; scan += aligned(valSize((VAL)scan))) {
+        ((VAL)scan)->hdr.u8 |= GC_SHARED;
     }
 
-    pthread_mutex_lock(&(dest->inbox_lock));
+    attach_shared(&vm->shared, region, vm->inc.active);
+    return x;
+}
 
-    if (dest->inbox_write >= dest->inbox_end) {
-        // FIXME: This is obviously bad in the long run. This should
-        // either block, make the inbox bigger, or return an error code,
-        // or possibly make it user configurable
-        fprintf(stderr, "Inbox full");
-        exit(-1);
+VAL copyTo(VM* vm, VAL x) {
+    SharedRegion* shared = holdShared(get_vm(), x);
+    if (shared != NULL) {
+        attach_shared(&vm->shared, shared, vm->inc.active);
+        return x;
     }
+    size_t size;
+    char* region = makeRegion(&x, &size);
+    x = moveRegion(vm, region, size, x);
+    free(region);
+    return x;
+}
 
-    dest->inbox_write->msg = dmsg;
+// Add a message to another VM's message queue
+int idris_sendMessage(VM* sender, int channel_id, VM* dest, VAL msg) {
+    if (dest->active == 0) { return 0; } // No VM to send to
+
+    // Copy the message out of our heap. This only touches our own memory;
+    // the receiver moves the copy into its heap when it reads the message.
+    // A frozen message isn't copied at all: the receiver takes over a hold
+    // on its region instead.
+    size_t size = 0;
+    VAL dmsg = msg;
+    char* region = NULL;
+    SharedRegion* shared = holdShared(sender, msg);
+    if (shared == NULL) {
+        region = makeRegion(&dmsg, &size);
+    }
+
+    Msg* m = malloc(sizeof(*m));
+    if (m == NULL) {
+        fprintf(stderr, "Out of memory sending message\n");
+        exit(EXIT_FAILURE);
+    }
+    m->msg = dmsg;
+    m->region = region;
+    m->region_size = size;
+    m->shared = shared;
     if (channel_id == 0) {
         // Set lowest bit to indicate this message is initiating a channel
-        channel_id = 1 + ((dest->inbox_nextid++) << 1);
+        channel_id = 1 + (__atomic_fetch_add(&dest->inbox_nextid, 1,
+                                             __ATOMIC_RELAXED) << 1);
     } else {
         channel_id = channel_id << 1;
     }
-    dest->inbox_write->channel_id = channel_id;
-
-    dest->inbox_write->sender = sender;
-    dest->inbox_write++;
-
-    // Wake up the other thread
+    m->channel_id = channel_id;
+    m->sender = sender;
+
+    // Push the message onto the destination's incoming stack. Only the
+    // destination ever takes messages off, and it takes them all at once,
+    // so a compare and swap is all we need.
+    m->next = __atomic_load_n(&dest->inbox_incoming, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&dest->inbox_incoming, &m->next, m,
+                                        1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        ;
+
+#ifdef IDRIS_GREEN_THREADS
+    if (dest->proc != NULL) {
+        idris_wake(dest);
+        return channel_id >> 1;
+    }
+#endif
+    // Wake up the other thread. It only waits with inbox_block held,
+    // after it has looked at inbox_incoming, so it can't miss this.
     pthread_mutex_lock(&dest->inbox_block);
     pthread_cond_signal(&dest->inbox_waiting);
     pthread_mutex_unlock(&dest->inbox_block);
 
-//    printf("Sending [signalled]...\n");
-
-    pthread_mutex_unlock(&(dest->inbox_lock));
-//    printf("Sending [unlock]...\n");
     return channel_id >> 1;
 }
 
-VM* idris_checkMessages(VM* vm) {
-    return idris_checkMessagesFrom(vm, 0, NULL);
-}
-
-Msg* idris_checkInitMessages(VM* vm) {
-    Msg* msg;
+// Move everything which has been sent to vm since we last looked onto the
+// end of its inbox.
+static void collectMessages(VM* vm) {
+    Msg* msg = __atomic_exchange_n(&vm->inbox_incoming, NULL, __ATOMIC_SEQ_CST);
+    Msg* batch = NULL;
+    Msg* last = msg;
 
-    for (msg = vm->inbox; msg < vm->inbox_end && msg->msg != NULL; ++msg) {
-	if ((msg->channel_id & 1) == 1) { // init bit set
-            return msg;
-        }
+    // The incoming messages are newest first, so reverse them
+    while (msg != NULL) {
+        Msg* next = msg->next;
+        msg->next = batch;
+        batch = msg;
+        msg = next;
+    }
+    if (batch != NULL) {
+        *vm->inbox_tail = batch;
+        vm->inbox_tail = &last->next;
     }
-    return 0;
 }
 
-VM* idris_checkMessagesFrom(VM* vm, int channel_id, VM* sender) {
-    Msg* msg;
+// Find the first matching message in vm's inbox, and return the link
+// pointing to it (or NULL if there isn't one), so that it can be removed.
+static Msg** findMessage(VM* vm, int channel_id, VM* sender) {
+    Msg** link;
 
-    for (msg = vm->inbox; msg < vm->inbox_end && msg->msg != NULL; ++msg) {
+    collectMessages(vm);
+    for (link = &vm->inbox; *link != NULL; link = &(*link)->next) {
+        Msg* msg = *link;
         if (sender == NULL || msg->sender == sender) {
             if (channel_id == 0 || channel_id == msg->channel_id >> 1) {
-                return msg->sender;
+                return link;
             }
         }
     }
-    return 0;
+    return NULL;
 }
 
-VM* idris_checkMessagesTimeout(VM* vm, int delay) {
-    VM* sender = idris_checkMessagesFrom(vm, 0, NULL);
-    if (sender != NULL) {
-        return sender;
+static Msg* removeMessage(VM* vm, Msg** link) {
+    Msg* msg = *link;
+    *link = msg->next;
+    if (msg->next == NULL) {
+        vm->inbox_tail = link;
     }
+    msg->next = NULL;
+    return msg;
+}
 
-    struct timespec timeout;
-    int status;
+void idris_freeMessages(VM* vm) {
+    Msg* msg;
 
-    // Wait either for a timeout or until we get a signal that a message
-    // has arrived.
+    collectMessages(vm);
+    while (vm->inbox != NULL) {
+        msg = removeMessage(vm, &vm->inbox);
+        idris_freeMsg(msg);
+    }
+}
+
+// Waiting for messages. Processes park, so that their worker can get on
+// with something else; the root VM waits for its condition variable, which
+// must be locked while looking at the inbox, to be sure of being woken.
+
+static void lockInbox(VM* vm) {
+#ifdef IDRIS_GREEN_THREADS
+    if (vm->proc != NULL) {
+        return;
+    }
+#endif
     pthread_mutex_lock(&vm->inbox_block);
-    timeout.tv_sec = time (NULL) + delay;
-    timeout.tv_nsec = 0;
-    status = pthread_cond_timedwait(&vm->inbox_waiting, &vm->inbox_block,
-                               &timeout);
-    (void)(status); //don't emit 'unused' warning
+}
+
+static void unlockInbox(VM* vm) {
+#ifdef IDRIS_GREEN_THREADS
+    if (vm->proc != NULL) {
+        return;
+    }
+#endif
     pthread_mutex_unlock(&vm->inbox_block);
+}
 
-    return idris_checkMessagesFrom(vm, 0, NULL);
+// Wait for a message to arrive, for at most timeout milliseconds if it's
+// not negative. May return early.
+static void waitInbox(VM* vm, int timeout) {
+    struct timespec until;
+
+#ifdef IDRIS_GREEN_THREADS
+    if (vm->proc != NULL) {
+        idris_park(vm, timeout);
+        return;
+    }
+#endif
+    if (timeout < 0) {
+        pthread_cond_wait(&vm->inbox_waiting, &vm->inbox_block);
+    } else {
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += timeout / 1000;
+        until.tv_nsec += (long)(timeout % 1000) * 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&vm->inbox_waiting, &vm->inbox_block, &until);
+    }
 }
 
+// Called when polling finds nothing, so polling loops don't hog a worker
+static void pollInbox(VM* vm) {
+#ifdef IDRIS_GREEN_THREADS
+    if (vm->proc != NULL) {
+        idris_yield(vm);
+    }
+#endif
+}
 
-Msg* idris_getMessageFrom(VM* vm, int channel_id, VM* sender) {
+VM* idris_checkMessages(VM* vm) {
+    return idris_checkMessagesFrom(vm, 0, NULL);
+}
+
+Msg* idris_checkInitMessages(VM* vm) {
     Msg* msg;
 
-    for (msg = vm->inbox; msg < vm->inbox_write; ++msg) {
-        if (sender == NULL || msg->sender == sender) {
-            if (channel_id == 0 || channel_id == msg->channel_id >> 1) {
-                return msg;
-            }
+    collectMessages(vm);
+    for (msg = vm->inbox; msg != NULL; msg = msg->next) {
+        if ((msg->channel_id & 1) == 1) { // init bit set
+            return msg;
         }
     }
-    return NULL;
+    pollInbox(vm);
+    return 0;
 }
 
-// block until there is a message in the queue
-Msg* idris_recvMessage(VM* vm) {
-    return idris_recvMessageFrom(vm, 0, NULL);
+VM* idris_checkMessagesFrom(VM* vm, int channel_id, VM* sender) {
+    Msg* msg = idris_getMessageFrom(vm, channel_id, sender);
+    if (msg == NULL) {
+        pollInbox(vm);
+        return NULL;
+    }
+    return msg->sender;
 }
 
-Msg* idris_recvMessageFrom(VM* vm, int channel_id, VM* sender) {
+VM* idris_checkMessagesTimeout(VM* vm, int delay) {
     Msg* msg;
-    Msg* ret;
 
-    struct timespec timeout;
-    int status;
-
-    if (sender && sender->active == 0) { return NULL; } // No VM to receive from
-
-    pthread_mutex_lock(&vm->inbox_block);
-    msg = idris_getMessageFrom(vm, channel_id, sender);
-
-    while (msg == NULL) {
-//        printf("No message yet\n");
-//        printf("Waiting [lock]...\n");
-        timeout.tv_sec = time (NULL) + 3;
-        timeout.tv_nsec = 0;
-        status = pthread_cond_timedwait(&vm->inbox_waiting, &vm->inbox_block,
-                               &timeout);
-        (void)(status); //don't emit 'unused' warning
-//        printf("Waiting [unlock]... %d\n", status);
-        msg = idris_getMessageFrom(vm, channel_id, sender);
+    // Wait either for a timeout or until we get a signal that a message
+    // has arrived.
+    lockInbox(vm);
+    msg = idris_getMessageFrom(vm, 0, NULL);
+    if (msg == NULL) {
+        waitInbox(vm, delay * 1000);
+        msg = idris_getMessageFrom(vm, 0, NULL);
     }
-    pthread_mutex_unlock(&vm->inbox_block);
+    unlockInbox(vm);
+
+    return msg == NULL ? NULL : msg->sender;
+}
 
-    if (msg != NULL) {
-        ret = malloc(sizeof(*ret));
-        ret->msg = msg->msg;
-        ret->sender = msg->sender;
 
-        pthread_mutex_lock(&(vm->inbox_lock));
+Msg* idris_getMessageFrom(VM* vm, int channel_id, VM* sender) {
+    Msg** link = findMessage(vm, channel_id, sender);
+    return link == NULL ? NULL : *link;
+}
 
-        // Slide everything down after the message in the inbox,
-        // Move the inbox_write pointer down, and clear the value at the
-        // end - O(n) but it's easier since the message from a specific
-        // sender could be anywhere in the inbox
+// block until there is a message in the queue
+Msg* idris_recvMessage(VM* vm) {
+    return idris_recvMessageFrom(vm, 0, NULL);
+}
 
-        for(;msg < vm->inbox_write; ++msg) {
-            if (msg+1 != vm->inbox_end) {
-                msg->sender = (msg + 1)->sender;
-                msg->msg = (msg + 1)->msg;
+Msg* idris_recvMessageFrom(VM* vm, int channel_id, VM* sender) {
+    Msg** link;
+
+    lockInbox(vm);
+    while ((link = findMessage(vm, channel_id, sender)) == NULL) {
+        if (sender != NULL && sender->active == 0) {
+            // No VM to receive from, but it may have sent something just
+            // before it stopped
+            link = findMessage(vm, channel_id, sender);
+            if (link == NULL) {
+                unlockInbox(vm);
+                return NULL;
             }
+            break;
         }
-
-        vm->inbox_write->msg = NULL;
-        vm->inbox_write->sender = NULL;
-        vm->inbox_write--;
-
-        pthread_mutex_unlock(&(vm->inbox_lock));
-    } else {
-        fprintf(stderr, "No messages waiting");
-        exit(-1);
+        // Nothing will wake us if the sender stops, so check now and again
+        waitInbox(vm, sender == NULL ? -1 : 1000);
     }
-    return ret;
+    unlockInbox(vm);
+
+    // The message was malloc'd by the sender and is ours now, until it is
+    // released by idris_freeMsg
+    return removeMessage(vm, link);
+}
+#else
+// Without threads there's nothing to share a value with
+VAL idris_freeze(VM* vm, VAL x) {
+    (void)vm;
+    return x;
 }
 #endif
 
 VAL idris_getMsg(Msg* msg) {
+#ifdef HAS_PTHREAD
+    // The first time we look at a received message, move it from its
+    // region into our heap.
+    if (msg->region != NULL) {
+        msg->msg = moveRegion(get_vm(), msg->region, msg->region_size, msg->msg);
+        free(msg->region);
+        msg->region = NULL;
+    }
+    if (msg->shared != NULL) {
+        VM* vm = get_vm();
+        attach_shared(&vm->shared, msg->shared, vm->inc.active);
+        msg->shared = NULL;
+    }
+#endif
     return msg->msg;
 }
 
@@ -1119,6 +2159,12 @@ int idris_getChannel(Msg* msg) {
 }
 
 void idris_freeMsg(Msg* msg) {
+#ifdef HAS_PTHREAD
+    free(msg->region);
+    if (msg->shared != NULL) {
+        release_shared(msg->shared);
+    }
+#endif
     free(msg);
 }
 
@@ -1130,18 +2176,6 @@ char* idris_showerror(int err) {
     return strerror(err);
 }
 
-Con nullary_cons[256];
-
-void init_nullaries(void) {
-    int i;
-    for(i = 0; i < 256; ++i) {
-        Con * cl = nullary_cons + i;
-        cl->hdr.sz = sizeof(*cl);
-        SETTY(cl, CT_CON);
-        cl->tag = i;
-    }
-}
-
 int __idris_argc;
 char **__idris_argv;
 
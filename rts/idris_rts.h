@@ -24,9 +24,9 @@
 // Closures
 typedef enum {
     CT_CON, CT_ARRAY, CT_INT, CT_BIGINT,
-    CT_FLOAT, CT_STRING, CT_STROFFSET, CT_BITS32,
-    CT_BITS64, CT_PTR, CT_REF, CT_FWD,
-    CT_MANAGEDPTR, CT_RAWDATA, CT_CDATA
+    CT_FLOAT, CT_STRING, CT_STROFFSET, CT_STRCONCAT,
+    CT_BITS32, CT_BITS64, CT_PTR, CT_REF, CT_FWD,
+    CT_MANAGEDPTR, CT_RAWDATA, CT_CDATA, CT_PRIMARRAY
 } ClosureType;
 
 typedef struct Hdr {
@@ -42,9 +42,20 @@ typedef struct Val {
 
 typedef struct Val * VAL;
 
+// hdr.u8 flags used by the generational collector on mutable closures
+// (CT_CON, CT_ARRAY and CT_REF). Other closure types may use hdr.u8 for
+// their own purposes, apart from GC_LARGE, GC_SHARED and GC_STATIC, which
+// any closure may have.
+#define GC_OLD 1        // lives in the heap, so mutation needs a write barrier
+#define GC_REMEMBERED 2 // already in the remembered set
+#define GC_LARGE 4      // lives in the large object space, so never moves
+#define GC_SHARED 8     // lives in a shared region, so never moves or changes
+#define GC_STATIC 16    // allocated statically, so never moves, changes or dies
+
+// A constructor's size follows from its arity, kept in hdr.u16, so hdr.sz
+// holds its tag instead, and a cons cell is only three words
 typedef struct Con {
     Hdr hdr;
-    uint32_t tag;
     VAL args[0];
 } Con;
 
@@ -53,6 +64,17 @@ typedef struct Array {
     VAL array[0];
 } Array;
 
+// A flat array of unboxed numbers, which the collector copies without
+// looking inside. hdr.u16 holds the kind of element.
+typedef struct PrimArray {
+    Hdr hdr;
+    char data[0]; // As aligned as the heap, since Hdr is 8 bytes
+} PrimArray;
+
+typedef enum {
+    PA_BITS8, PA_BITS32, PA_INT, PA_DOUBLE
+} PrimArrayKind;
+
 typedef struct BigInt {
     Hdr hdr;
     char big[0];
@@ -66,15 +88,55 @@ typedef struct Float {
 typedef struct String {
     Hdr hdr;
     size_t slen;
+    size_t clen; // length in characters, once STR_COUNTED is set
     char str[0];
 } String;
 
+// hdr.u16 flags on strings. Only CT_STRING has a character count, but
+// CT_STRCONCAT also records whether it's ASCII.
+#define STR_COUNTED 1 // clen is known
+#define STR_ASCII 2   // every character is one byte, so can be found directly
+#define STR_INTERNED 4 // the only copy in the interning table, from idris_intern
+
+// A string literal, allocated statically rather than in the heap, with its
+// length in bytes and in characters already known. It never changes, so
+// every thread can use it.
+#define STATIC_STRING(name, len, chars, flags, lit) \
+    static struct { \
+        Hdr hdr; size_t slen; size_t clen; char str[(len) + 1]; \
+    } name = { { CT_STRING, GC_STATIC, STR_COUNTED | (flags), \
+                 sizeof(String) + (len) + 1 }, \
+               (len), (chars), lit }
+
+// A view of len bytes of base, from offset. Unless the view is a suffix of
+// base, its characters aren't followed by a terminator, so they're copied
+// into a C heap buffer if they're needed as a C string.
 typedef struct StrOffset {
     Hdr hdr;
     String * base;
     size_t offset;
+    size_t len;
+    CHeapItem * flat;
 } StrOffset;
 
+// Substrings shorter than this are copied rather than viewed
+#define STROFFSET_MIN 32
+
+// A concatenation which hasn't been carried out yet. The characters are
+// copied out into a C heap buffer the first time they're needed, after
+// which the two halves are no longer referenced.
+typedef struct StrConcat {
+    Hdr hdr;
+    size_t slen;
+    VAL left;
+    VAL right;
+    CHeapItem * flat;
+} StrConcat;
+
+// Concatenations shorter than this are copied straight away, and short
+// pieces added to either end of a StrConcat are copied into its halves.
+#define STRCONCAT_MIN 64
+
 typedef struct Bits32 {
     Hdr hdr;
     uint32_t bits32;
@@ -123,6 +185,14 @@ struct Msg_t {
     // Lowest bit is set if the id is the first message in a conversation.
     int channel_id;
     VAL msg;
+    // Memory holding the message while it's in transit. NULL once the
+    // message has been copied into the receiver's heap.
+    char* region;
+    size_t region_size;
+    // Shared region the message lives in, if it was frozen, until the
+    // receiver takes it over.
+    SharedRegion* shared;
+    struct Msg_t* next; // Next message in the inbox
 };
 
 typedef struct Msg_t Msg;
@@ -135,26 +205,53 @@ struct VM {
     VAL* valstack;
     VAL* valstack_top;
     VAL* valstack_base;
-    VAL* stack_max;
+    VAL* stack_max;   // End of the part of the stack which is usable now
+    VAL* stack_limit; // End of the space reserved for the stack
+    VAL* stack_dirty; // Slots from here up are NULL
 
     CHeap c_heap;
     Heap heap;
+    Nursery nursery;
+    LargeObjects large;
+    Incremental inc;
+    SharedSpace shared;
 #ifdef HAS_PTHREAD
-    pthread_mutex_t inbox_lock;
     pthread_mutex_t inbox_block;
-    pthread_mutex_t alloc_lock;
     pthread_cond_t inbox_waiting;
 
-    Msg* inbox; // Block of memory for storing messages
-    Msg* inbox_end; // End of block of memory
+    // Messages which have been sent but not yet looked at, newest first.
+    // Senders push onto this without taking a lock.
+    Msg* inbox_incoming;
+    // Messages waiting to be received, oldest first. Only the VM's own
+    // thread touches these.
+    Msg* inbox;
+    Msg** inbox_tail; // The last 'next' link in inbox
     int inbox_nextid; // Next channel id
-    Msg* inbox_write; // Location of next message to write
 
     int processes; // Number of child processes
-    int max_threads; // maximum number of threads to run in parallel
+    int spawned; // Whether it has ever created a child, which may refer to it
+    int max_threads; // Worker threads to run processes on (0: one per processor)
     struct VM* creator; // The VM that created this VM, NULL for root VM
+    struct Process* proc; // Green thread running this VM, NULL for root VM
+
+    // Stats of the child VMs which have finished, and their own children,
+    // which terminate adds to the nearest creator still running. Never
+    // destroyed, since a VM's struct outlives it.
+    pthread_mutex_t stats_lock;
+    Stats finished;
+    int stats_closed; // This VM has finished, so add to its creator
 #endif
     Stats stats;
+    struct Profile* prof; // Heap profile, NULL unless profiling
+
+    // The Idris functions running, for the sampling profiler. Code compiled
+    // with IDRIS_PROFILE stores the site of each function it enters at
+    // prof_frames[prof_depth & prof_mask], and CALL counts the depth. Until
+    // the VM is sampled, they all go in prof_frame.
+    uint32_t* prof_frames;
+    uint32_t prof_mask;
+    uint32_t prof_depth;
+    uint32_t prof_frame;
 
     VAL ret;
     VAL reg1;
@@ -204,13 +301,20 @@ void init_threaddata(VM *vm);
 Stats terminate(VM* vm);
 
 // Create a new VM, set up everything with sensible defaults (use when
-// calling Idris from C)
+// calling Idris from C). See idris_embed.h for VMs with other options, and
+// for reusing them.
 VM* idris_vm(void);
+// Finish with a VM from idris_vm, freeing it unless other threads may
+// still refer to it
 void close_vm(VM* vm);
 
 // Set up key for thread-local data - called once from idris_main
 void init_threadkeys(void);
 
+// The stats of a VM so far, including those of the child VMs it has
+// created which have finished.
+Stats idris_currentStats(VM* vm);
+
 // Functions all take a pointer to their VM, and previous stack base,
 // and return nothing.
 typedef void*(*func)(VM*, VAL*);
@@ -223,37 +327,57 @@ typedef void*(*func)(VM*, VAL*);
 #define REG1 (vm->reg1)
 
 // Retrieving values
+// hdr.u8 flag marking a null string
+#define STR_NULL 1
+
 static inline char * getstr(String * x) {
-    // hdr.u8 used to mark a null string
-    return x->hdr.u8? NULL : x->str;
+    return (x->hdr.u8 & STR_NULL) ? NULL : x->str;
 }
 
 static inline size_t getstrlen(String * x) {
     return x->slen;
 }
 
-#define GETSTR(x) (ISSTR(x) ? getstr((String*)(x)) : GETSTROFF(x))
-#define GETSTRLEN(x) (ISSTR(x) ? getstrlen((String*)(x)) : GETSTROFFLEN(x))
+#define GETSTR(x) (ISSTR(x) ? getstr((String*)(x)) : \
+                   ISSTROFF(x) ? GETSTROFF(x) : GETSTRCONCAT(x))
+#define GETSTRLEN(x) (ISSTR(x) ? getstrlen((String*)(x)) : \
+                      ISSTROFF(x) ? GETSTROFFLEN(x) : GETSTRCONCATLEN(x))
 #define GETPTR(x) (((Ptr*)(x))->ptr)
 #define GETMPTR(x) (((ManagedPtr*)(x))->mptr)
 #define GETFLOAT(x) (((Float*)(x))->f)
 #define GETCDATA(x) (((CDataC*)(x))->item)
 
+// Bits8 and Bits16 are always tagged integers, and so is Bits32 where a
+// tagged integer has room for it. A Bits64 is only boxed if it's too big
+// to be a non-negative tagged integer.
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#define IDRIS_UNBOXED_BITS32
+#endif
+
+#define BITS64_MAXINT ((uint64_t)(INTPTR_MAX >> 1))
+
 #define GETBITS8(x) (GETINT(x))
 #define GETBITS16(x) (GETINT(x))
+#ifdef IDRIS_UNBOXED_BITS32
+#define GETBITS32(x) ((uint32_t)GETINT(x))
+#else
 #define GETBITS32(x) (((Bits32*)(x))->bits32)
-#define GETBITS64(x) (((Bits64*)(x))->bits64)
+#endif
+#define GETBITS64(x) (ISINT(x) ? (uint64_t)GETINT(x) : ((Bits64*)(x))->bits64)
 
-// Already checked it's a CT_CON
-#define CTAG(x) (((Con*)(x))->tag)
-#define CARITY(x) (((Con*)(x))->hdr.u16) // hdr.u16 used to store arity
+// Already checked it's a CT_CON. A nullary constructor carries its tag in
+// the value itself (see MKNULLARY), so no load is needed for it.
+#define CTAG(x) (ISNULLARY(x) ? NULLARYTAG(x) : ((Con*)(x))->hdr.sz) // hdr.sz used to store tag
+#define CARITY(x) (ISNULLARY(x) ? 0 : ((Con*)(x))->hdr.u16) // hdr.u16 used to store arity
 
-#define TAG(x) (ISINT(x) || x == NULL ? (-1) : ( GETTY(x) == CT_CON ? CTAG((Con*)x) : (-1)) )
-#define ARITY(x) (ISINT(x) || x == NULL ? (-1) : ( GETTY(x) == CT_CON ? CARITY((Con*)x) : (-1)) )
+#define TAG(x) (ISNULLARY(x) ? (int)NULLARYTAG(x) : ISINT(x) || x == NULL ? (-1) : ( GETTY(x) == CT_CON ? CTAG((Con*)x) : (-1)) )
+#define ARITY(x) (ISNULLARY(x) ? 0 : ISINT(x) || x == NULL ? (-1) : ( GETTY(x) == CT_CON ? CARITY((Con*)x) : (-1)) )
 
 #define CELEM(x) (((x)->hdr.sz - sizeof(Array)) / sizeof(VAL))
+#define PAKIND(x) ((PrimArrayKind)(x)->hdr.u16)
+#define PAELEM(x) (((x)->hdr.sz - sizeof(PrimArray)) / primArrayElemSize(PAKIND(x)))
 
-#define GETTY(x) (ISINT(x)? CT_INT : (ClosureType)((x)->hdr.ty))
+#define GETTY(x) (ISINT(x)? CT_INT : ISNULLARY(x) ? CT_CON : (ClosureType)((x)->hdr.ty))
 #define SETTY(x,t) ((x)->hdr.ty = t)
 
 // Integers, floats and operators
@@ -265,7 +389,17 @@ typedef intptr_t i_int;
 #define MKINT(x) ((void*)((i_int)((((uintptr_t)x)<<1)+1)))
 #define GETINT(x) ((i_int)(x)>>1)
 #define ISINT(x) ((((i_int)x)&1) == 1)
+
+// Nullary constructors are immediate values too, whatever their tag: the
+// tag is shifted above the low two bits, which are 10. Heap objects are
+// word aligned, so both low bits of a pointer are 0.
+#define MKNULLARY(t) ((VAL)((((uintptr_t)(t))<<2)+2))
+#define NULLARYTAG(x) ((uint32_t)(((uintptr_t)(x))>>2))
+#define ISNULLARY(x) ((((i_int)x)&3) == 2)
+// An Int or a nullary constructor, rather than a pointer to an object
+#define ISIMM(x) ((((i_int)x)&3) != 0)
 #define ISSTR(x) (GETTY(x) == CT_STRING)
+#define ISSTROFF(x) (GETTY(x) == CT_STROFFSET)
 
 #define INTOP(op,x,y) MKINT((i_int)((((i_int)x)>>1) op (((i_int)y)>>1)))
 #define UINTOP(op,x,y) MKINT((i_int)((((uintptr_t)x)>>1) op (((uintptr_t)y)>>1)))
@@ -287,28 +421,58 @@ typedef intptr_t i_int;
                   void* callres
 
 #define REBASE vm->valstack_base = oldbase; return NULL
+// Frames don't need clearing: whatever slots past the top of the stack hold
+// is safe for a collection to scan (see the value stack in idris_heap.h)
 #define RESERVE(x) do { \
-    if (vm->valstack_top+(x) > vm->stack_max) { stackOverflow(); } \
-    else { memset(vm->valstack_top, 0, (x)*sizeof(VAL)); } \
-  } while(0)
-#define RESERVENOALLOC(x) do { \
-    if (vm->valstack_top+(x) > vm->stack_max) { stackOverflow(); } \
+    if (vm->valstack_top+(x) > vm->stack_dirty) { grow_stack(vm, (x)); } \
   } while(0)
+#define RESERVENOALLOC(x) RESERVE(x)
 #define ADDTOP(x) vm->valstack_top += (x)
 #define TOPBASE(x) vm->valstack_top = vm->valstack_base + (x)
 #define BASETOP(x) vm->valstack_base = vm->valstack_top + (x)
 #define STOREOLD myoldbase = vm->valstack_base
 
-#define CALL(f) callres = f(vm, myoldbase); \
+#ifdef IDRIS_PROFILE
+#define PROF_CALL vm->prof_depth++;
+#define PROF_RETURN vm->prof_depth--;
+#else
+#define PROF_CALL
+#define PROF_RETURN
+#endif
+
+// A function returns NULL when it's done, or the next function to call if
+// it ends in a tail call which it couldn't make itself. CALL keeps calling
+// those with the same base until one returns NULL.
+#define CALL(f) PROF_CALL \
+  callres = f(vm, myoldbase); \
   while(callres!=NULL) { \
       callres = ((func)(callres))(vm, myoldbase); \
-  }
+  } \
+  PROF_RETURN
+
+// Compiled with -DIDRIS_MUSTTAIL, functions make their tail calls directly
+// where the C compiler can guarantee them (clang, and GCC 15 and later), and
+// the loop in CALL only ever runs once. Otherwise they return to the loop.
+#if defined(IDRIS_MUSTTAIL) && defined(__has_attribute)
+#if __has_attribute(musttail)
+#define IDRIS_DIRECT_TAILCALLS
+#endif
+#endif
+
+#ifdef IDRIS_DIRECT_TAILCALLS
+#define TAILCALL(f) __attribute__((musttail)) return f(vm, oldbase);
+#else
 #define TAILCALL(f) return (void*)(f);
+#endif
 
 // Creating new values (each value placed at the top of the stack)
 VAL MKFLOAT(VM* vm, double val);
 VAL MKSTR(VM* vm, const char* str);
 VAL MKSTRlen(VM* vm, const char* str, size_t size);
+// Make a string of at least LARGE_OBJECT_MIN bytes from a block from malloc,
+// of sizeof(LargeObject) + sizeof(String) + len + 1 bytes, with the
+// characters already in place. The block belongs to the VM afterwards.
+VAL MKSTRadopt(VM* vm, void* block, size_t len, int ascii);
 VAL MKPTR(VM* vm, void* ptr);
 VAL MKMPTR(VM* vm, void* ptr, size_t size);
 VAL MKB8(VM* vm, uint8_t b);
@@ -317,7 +481,8 @@ VAL MKB32(VM* vm, uint32_t b);
 VAL MKB64(VM* vm, uint64_t b);
 VAL MKCDATA(VM* vm, CHeapItem * item);
 
-// following versions don't take a lock when allocating
+// Originally versions which don't take a lock when allocating. Allocation
+// never locks now, so these are the same as the versions above.
 VAL MKFLOATc(VM* vm, double val);
 VAL MKSTROFFc(VM* vm, VAL basestr);
 VAL MKSTRc(VM* vm, char* str);
@@ -326,8 +491,12 @@ VAL MKPTRc(VM* vm, void* ptr);
 VAL MKMPTRc(VM* vm, void* ptr, size_t size);
 VAL MKCDATAc(VM* vm, CHeapItem * item);
 
+// Copies the view into a buffer if it isn't terminated.
 char* GETSTROFF(VAL stroff);
 size_t GETSTROFFLEN(VAL stroff);
+// Flattens the concatenation, if that hasn't been done already.
+char* GETSTRCONCAT(VAL strcat);
+size_t GETSTRCONCATLEN(VAL strcat);
 
 #define SETARG(x, i, a) (((Con*)(x))->args)[i] = ((VAL)(a))
 #define GETARG(x, i) (((Con*)(x))->args[i])
@@ -337,6 +506,8 @@ size_t GETSTROFFLEN(VAL stroff);
 #define SLIDE(vm, args) \
     memmove(&(LOC(0)), &(TOP(0)), sizeof(VAL)*args)
 
+// Only the thread running a VM may allocate in it, so no locking is
+// needed. The outerlock argument is no longer used.
 void* iallocate(VM *, size_t, int);
 
 void* allocate(size_t size, int outerlock);
@@ -345,12 +516,24 @@ void* allocate(size_t size, int outerlock);
 // When allocating from C, call 'idris_requireAlloc' with a size to
 // guarantee that no garbage collection will happen (and hence nothing
 // will move) until at least size bytes have been allocated.
-// idris_doneAlloc *must* be called when allocation from C is done (as it
-// may take a lock if other threads are running).
+// idris_doneAlloc *must* be called when allocation from C is done.
 
 void idris_requireAlloc(VM *, size_t size);
 void idris_doneAlloc(VM *);
 
+// Record an old object that has been mutated in the remembered set
+void idris_remember(VM *, VAL x);
+
+// Write barrier: must be called whenever a field of an existing CT_CON,
+// CT_ARRAY or CT_REF is overwritten, so that a pointer from the heap into
+// the nursery is seen by the next minor collection, and the replica made by
+// an incremental collection is brought up to date.
+static inline void idris_writeBarrier(VAL x) {
+    if ((x->hdr.u8 & (GC_OLD | GC_REMEMBERED)) == GC_OLD) {
+        idris_remember(get_vm(), x);
+    }
+}
+
 // public interface to allocation (note that this may move other pointers
 // if allocating beyond the limits given by idris_requireAlloc!)
 // 'realloc' just calls alloc and copies; 'free' does nothing
@@ -358,24 +541,29 @@ void* idris_alloc(size_t size);
 void* idris_realloc(void* old, size_t old_size, size_t size);
 void idris_free(void* ptr, size_t size);
 
-static inline void updateConF(Con * cl, uint32_t tag, uint16_t arity) {
-    SETTY(cl, CT_CON);
-    cl->tag = tag;
-    // hdr.u16 used to store arity
-    cl->hdr.u16 = arity;
-    assert(cl->hdr.sz == sizeof(*cl) + sizeof(VAL) * arity);
-    // cl->hdr.sz = sizeof(*cl) + sizeof(VAL) * arity;
-}
-
 static inline Con * allocConF(VM * vm, uint32_t tag, uint16_t arity, int outer) {
     Con * cl = iallocate(vm, sizeof(*cl) + sizeof(VAL) * arity, outer);
     SETTY(cl, CT_CON);
-    cl->tag = tag;
-    // hdr.u16 used to store arity
+    // hdr.sz used to store tag, hdr.u16 used to store arity
+    cl->hdr.sz = tag;
     cl->hdr.u16 = arity;
     return cl;
 }
 
+// Reuse a unique constructor cell which is dead, for one of the same arity.
+// Frozen and static cells may be in use by other threads, so a new one is
+// allocated in their place.
+static inline Con * updateConF(VM * vm, Con * cl, uint32_t tag, uint16_t arity) {
+    assert(GETTY((VAL)cl) == CT_CON && cl->hdr.u16 == arity);
+    if (cl->hdr.u8 & (GC_SHARED | GC_STATIC)) {
+        return allocConF(vm, tag, arity, 0);
+    }
+    idris_writeBarrier((VAL)cl);
+    // hdr.sz used to store tag
+    cl->hdr.sz = tag;
+    return cl;
+}
+
 static inline Array * allocArrayF(VM * vm, size_t len, int outer) {
     Array * cl = iallocate(vm, sizeof(*cl) + sizeof(VAL) * len, outer);
     SETTY(cl, CT_ARRAY);
@@ -383,19 +571,21 @@ static inline Array * allocArrayF(VM * vm, size_t len, int outer) {
 }
 
 
-#define allocCon(cl, vm, t, a, o) (cl) = (VAL)allocConF(vm, t, a, o)
+// Nullary constructors are never allocated, so code can rely on them all
+// being immediate
+#define allocCon(cl, vm, t, a, o) \
+    (cl) = ((a) == 0 ? NULL_CON(t) : (VAL)allocConF(vm, t, a, o))
 
-#define updateCon(cl, old, tag, arity) (cl) = (old); updateConF(cl, tag, arity)
+#define updateCon(cl, vm, old, tag, arity) \
+    (cl) = (VAL)updateConF(vm, (Con*)(old), tag, arity)
 
-#define NULL_CON(x) ((VAL)(nullary_cons + x))
+#define NULL_CON(x) MKNULLARY(x)
 
 #define allocArray(cl, vm, len, o) (cl) = (VAL)allocArrayF(vm, len, o)
 
 int idris_errno(void);
 char* idris_showerror(int err);
 
-extern Con nullary_cons[];
-void init_nullaries(void);
 
 void init_signals(void);
 
@@ -405,8 +595,17 @@ void* idris_stopThread(VM* vm);
 // Copy a structure to another vm's heap
 VAL copyTo(VM* newVM, VAL x);
 
+// Freeze a structure into a shared region, which other VMs are sent or
+// given instead of a copy. Structures holding arrays, buffers or C data, which
+// can change or belong to a VM, are returned as they are.
+VAL idris_freeze(VM* vm, VAL x);
+
 // Add a message to another VM's message queue
 int idris_sendMessage(VM* sender, int channel_id, VM* dest, VAL msg);
+
+// The following look at vm's own message queue, so must only be called by
+// the thread running vm.
+
 // Check whether there are any messages in the queue and return PID of
 // sender if so (null if not)
 VM* idris_checkMessages(VM* vm);
@@ -417,6 +616,9 @@ Msg* idris_checkInitMessages(VM* vm);
 VM* idris_checkMessagesFrom(VM* vm, int channel_id, VM* sender);
 // Check whether there are any messages in the queue, and wait if not
 VM* idris_checkMessagesTimeout(VM* vm, int timeout);
+// Return the first message from the sender on the channel (either may be
+// 0 to match anything) without removing it, or NULL if there isn't one
+Msg* idris_getMessageFrom(VM* vm, int channel_id, VM* sender);
 // block until there is a message in the queue
 Msg* idris_recvMessage(VM* vm);
 // block until there is a message in the queue
@@ -428,6 +630,8 @@ VAL idris_getMsg(Msg* msg);
 VM* idris_getSender(Msg* msg);
 int idris_getChannel(Msg* msg);
 void idris_freeMsg(Msg* msg);
+// Free every message still in the queue
+void idris_freeMessages(VM* vm);
 
 void idris_trace(VM* vm, const char* func, int line);
 void dumpVal(VAL r);
@@ -464,6 +668,14 @@ VAL idris_concat(VM* vm, VAL l, VAL r);
 VAL idris_strlt(VM* vm, VAL l, VAL r);
 VAL idris_streq(VM* vm, VAL l, VAL r);
 VAL idris_strlen(VM* vm, VAL l);
+// Call f on each run of bytes making up a string, in order, without
+// flattening it, and stop at the first call which returns non-zero. Returns
+// what that call returned, or 0. f mustn't allocate in the heap.
+int idris_strPieces(VAL str, int (*f)(const char*, size_t, void*), void* env);
+// The one copy of a string shared by every VM, which is never moved or
+// freed, so that comparing two interned strings takes constant time. Once
+// 16M of strings have been interned, new ones are returned as they are.
+VAL idris_intern(VM* vm, VAL str);
 // Read a line from a file
 VAL idris_readStr(VM* vm, FILE* h);
 // Read up to 'num' characters from a file
@@ -490,6 +702,42 @@ VAL idris_newArray(VM* vm, int size, VAL def);
 void idris_arraySet(VAL arr, int index, VAL newval);
 VAL idris_arrayGet(VAL arr, int index);
 
+// Support for unboxed arrays. Like IOArrays there's no bounds checking.
+static inline size_t primArrayElemSize(PrimArrayKind kind) {
+    switch (kind) {
+    case PA_BITS8: return sizeof(uint8_t);
+    case PA_BITS32: return sizeof(uint32_t);
+    case PA_INT: return sizeof(i_int);
+    default: return sizeof(double);
+    }
+}
+
+// A new array of the given kind, with every element zero
+VAL idris_newPrimArray(VM* vm, int kind, int size);
+int idris_primArrayLength(VAL arr);
+
+uint8_t idris_primArrayGetBits8(VAL arr, int index);
+uint32_t idris_primArrayGetBits32(VAL arr, int index);
+i_int idris_primArrayGetInt(VAL arr, int index);
+double idris_primArrayGetDouble(VAL arr, int index);
+
+void idris_primArraySetBits8(VAL arr, int index, uint8_t val);
+void idris_primArraySetBits32(VAL arr, int index, uint32_t val);
+void idris_primArraySetInt(VAL arr, int index, i_int val);
+void idris_primArraySetDouble(VAL arr, int index, double val);
+
+// Set len elements, starting at start, to val
+void idris_primArrayFillBits8(VAL arr, int start, int len, uint8_t val);
+void idris_primArrayFillBits32(VAL arr, int start, int len, uint32_t val);
+void idris_primArrayFillInt(VAL arr, int start, int len, i_int val);
+void idris_primArrayFillDouble(VAL arr, int start, int len, double val);
+
+// Copy len elements from position start in one array to position loc in
+// another of the same kind (or the same array: the ranges may overlap)
+void idris_primArrayCopy(VAL from, int start, int len, VAL to, int loc);
+// A new array holding a copy of len elements, starting at start
+VAL idris_primArraySlice(VM* vm, VAL arr, int start, int len);
+
 // system infox
 // used indices:
 //   0 returns backend
@@ -521,14 +769,34 @@ void stackOverflow(void);
 
 #include "idris_gmp.h"
 
+static inline size_t hdrSize(const Hdr* h) {
+    return h->ty == CT_CON ? sizeof(Con) + sizeof(VAL) * h->u16 : h->sz;
+}
+
 static inline size_t valSize(VAL v) {
-    return v->hdr.sz;
+    return hdrSize(&v->hdr);
 }
 
 static inline size_t aligned(size_t sz) {
     return (sz + sizeof(void*) - 1) & ~(sizeof(void*)-1);
 }
 
+// Read one of the current stats, for Idris code. Times are in nanoseconds.
+// Only STAT_COLLECTIONS and STAT_VMS are counted without IDRIS_ENABLE_STATS.
+#define STAT_ALLOCATED 0   // Bytes allocated
+#define STAT_ALLOCATIONS 1 // Number of allocations
+#define STAT_COPIED 2      // Bytes copied by the collector
+#define STAT_MAX_HEAP 3    // Largest heap size of any one VM
+#define STAT_COLLECTIONS 4
+#define STAT_MINOR 5       // Collections of the nursery only
+#define STAT_GC_TIME 6     // In this VM
+#define STAT_OTHERS_GC_TIME 7 // In the finished child VMs
+#define STAT_MAX_PAUSE 8
+#define STAT_ELAPSED 9     // Since this VM started
+#define STAT_VMS 10        // How many VMs are counted, including this one
+#define STAT_PAUSES 16     // STAT_PAUSES + i: pauses up to 2^i microseconds
+i_int idris_stat(VM* vm, int which);
+
 VM* get_vm(void);
 
 #endif
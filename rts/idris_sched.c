@@ -0,0 +1,429 @@
+#include "idris_sched.h"
+
+static size_t process_stack = PROCESS_STACK_SIZE;
+
+void idris_processStack(size_t size) {
+    if (size == 0) {
+        process_stack = PROCESS_STACK_SIZE;
+    } else {
+        process_stack = size > PROCESS_STACK_MIN ? size : PROCESS_STACK_MIN;
+    }
+}
+
+size_t idris_processStackSize(void) {
+    return process_stack;
+}
+
+#ifdef IDRIS_GREEN_THREADS
+
+#include <time.h>
+#include <unistd.h>
+#include <ucontext.h>
+
+// Process states
+#define PROC_RUNNING  0
+#define PROC_WAITING  1 // Parked
+#define PROC_RUNNABLE 2 // In a run queue
+#define PROC_DONE     3
+
+// Why a process has switched back to its worker
+#define SWITCH_YIELD 0
+#define SWITCH_PARK  1
+#define SWITCH_EXIT  2
+
+typedef struct Process Process;
+typedef struct Worker Worker;
+
+struct Process {
+    VM* vm;
+    func fn;
+    VAL arg;
+
+    ucontext_t context;
+    char* stack;
+
+    int state;   // One of PROC_*. Changed atomically.
+    int reason;  // One of SWITCH_*, set when switching back to the worker
+    int timeout; // In milliseconds when parking, or negative for none
+    Worker* worker; // Worker the process is running on
+
+    struct Process* next; // Next process in the run queue
+
+    // Set while the process is parked with a timeout, protected by idle_lock
+    int sleeping;
+    struct timespec wake_at;
+    struct Process* next_sleeper;
+};
+
+struct Worker {
+    pthread_t thread;
+    pthread_mutex_t lock; // Protects the run queue
+    Process* first;
+    Process* last;
+    ucontext_t context;   // Processes on this worker switch back to here
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t worker_key;
+static Worker* workers;
+static int nworkers;
+static int next_worker; // For spreading out processes spawned by the root VM
+static int queued;      // Number of processes in run queues
+
+// Idle workers wait on idle_cond. Processes parked with a timeout go in
+// sleepers. Both are protected by idle_lock.
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static int idle_workers;
+static Process* sleepers;
+
+static void enqueue(Worker* w, Process* p) {
+    p->next = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (w->last != NULL) {
+        w->last->next = p;
+    } else {
+        w->first = p;
+    }
+    w->last = p;
+    pthread_mutex_unlock(&w->lock);
+
+    // Workers count themselves idle before checking queued, so either they
+    // see this process or we see them.
+    __atomic_add_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&idle_workers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+static Process* dequeue(Worker* w) {
+    Process* p;
+
+    pthread_mutex_lock(&w->lock);
+    p = w->first;
+    if (p != NULL) {
+        w->first = p->next;
+        if (w->first == NULL) {
+            w->last = NULL;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    if (p != NULL) {
+        __atomic_sub_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+    }
+    return p;
+}
+
+static Process* steal(Worker* w) {
+    int self = w - workers;
+    int i;
+
+    for (i = 1; i < nworkers; ++i) {
+        Process* p = dequeue(workers + (self + i) % nworkers);
+        if (p != NULL) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Wake processes go on the waker's worker if it's in the pool, since the
+// waker is likely to be talking to them, or else back where they last ran.
+static Worker* wake_worker(Process* p) {
+    Worker* w = pthread_getspecific(worker_key);
+    return w != NULL ? w : p->worker;
+}
+
+// idle_lock must be held
+static void add_sleeper(Process* p) {
+    clock_gettime(CLOCK_REALTIME, &p->wake_at);
+    p->wake_at.tv_sec += p->timeout / 1000;
+    p->wake_at.tv_nsec += (long)(p->timeout % 1000) * 1000000;
+    if (p->wake_at.tv_nsec >= 1000000000) {
+        p->wake_at.tv_sec++;
+        p->wake_at.tv_nsec -= 1000000000;
+    }
+
+    p->sleeping = 1;
+    p->next_sleeper = sleepers;
+    sleepers = p;
+    // An idle worker may need to wait for less time now
+    pthread_cond_signal(&idle_cond);
+}
+
+// idle_lock must be held
+static void remove_sleeper(Process* p) {
+    Process** link;
+
+    if (!p->sleeping) {
+        return;
+    }
+    for (link = &sleepers; *link != p; link = &(*link)->next_sleeper)
+        ;
+    *link = p->next_sleeper;
+    p->sleeping = 0;
+}
+
+static int before(struct timespec* a, struct timespec* b) {
+    return a->tv_sec < b->tv_sec ||
+           (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// Wake any processes whose timeouts have passed. idle_lock must be held;
+// it's released while the processes are queued.
+static void wake_sleepers(Worker* w) {
+    struct timespec now;
+    Process* expired = NULL;
+    Process* p;
+    Process* next;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (p = sleepers; p != NULL; p = next) {
+        next = p->next_sleeper;
+        if (!before(&now, &p->wake_at)) {
+            int waiting = PROC_WAITING;
+            remove_sleeper(p);
+            // If this fails, a message has woken the process already
+            if (__atomic_compare_exchange_n(&p->state, &waiting, PROC_RUNNABLE,
+                                            0, __ATOMIC_SEQ_CST,
+                                            __ATOMIC_SEQ_CST)) {
+                p->next_sleeper = expired;
+                expired = p;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&idle_lock);
+    for (p = expired; p != NULL; p = next) {
+        next = p->next_sleeper;
+        enqueue(w, p);
+    }
+    pthread_mutex_lock(&idle_lock);
+}
+
+static void idle(Worker* w) {
+    pthread_mutex_lock(&idle_lock);
+    wake_sleepers(w);
+
+    __atomic_add_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&queued, __ATOMIC_SEQ_CST) == 0) {
+        if (sleepers != NULL) {
+            struct timespec next = sleepers->wake_at;
+            Process* p;
+            for (p = sleepers->next_sleeper; p != NULL; p = p->next_sleeper) {
+                if (before(&p->wake_at, &next)) {
+                    next = p->wake_at;
+                }
+            }
+            pthread_cond_timedwait(&idle_cond, &idle_lock, &next);
+        } else {
+            pthread_cond_wait(&idle_cond, &idle_lock);
+        }
+    }
+    __atomic_sub_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_unlock(&idle_lock);
+}
+
+static void park(Process* p) {
+    if (p->timeout >= 0) {
+        // The timeout mustn't see the process before it's parked
+        pthread_mutex_lock(&idle_lock);
+        add_sleeper(p);
+        __atomic_store_n(&p->state, PROC_WAITING, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&idle_lock);
+    } else {
+        __atomic_store_n(&p->state, PROC_WAITING, __ATOMIC_SEQ_CST);
+    }
+
+    // A message may have been sent after the process last looked, but
+    // before it was parked, in which case the sender won't have woken it.
+    if (__atomic_load_n(&p->vm->inbox_incoming, __ATOMIC_SEQ_CST) != NULL) {
+        idris_wake(p->vm);
+    }
+}
+
+static void run(Worker* w, Process* p) {
+    p->worker = w;
+    __atomic_store_n(&p->state, PROC_RUNNING, __ATOMIC_SEQ_CST);
+    init_threaddata(p->vm);
+
+    swapcontext(&w->context, &p->context);
+
+    switch (p->reason) {
+    case SWITCH_YIELD:
+        __atomic_store_n(&p->state, PROC_RUNNABLE, __ATOMIC_SEQ_CST);
+        enqueue(w, p);
+        break;
+    case SWITCH_PARK:
+        park(p);
+        break;
+    case SWITCH_EXIT:
+        // Other processes may still refer to the VM, and so to the Process,
+        // so (like the VM) only the memory it was running in is freed.
+        free(p->stack);
+        p->stack = NULL;
+        __atomic_store_n(&p->state, PROC_DONE, __ATOMIC_SEQ_CST);
+        break;
+    }
+}
+
+static void* worker_main(void* arg) {
+    Worker* w = arg;
+    pthread_setspecific(worker_key, w);
+
+    for (;;) {
+        Process* p;
+
+        if (__atomic_load_n(&sleepers, __ATOMIC_RELAXED) != NULL) {
+            pthread_mutex_lock(&idle_lock);
+            wake_sleepers(w);
+            pthread_mutex_unlock(&idle_lock);
+        }
+
+        p = dequeue(w);
+        if (p == NULL) {
+            p = steal(w);
+        }
+        if (p != NULL) {
+            run(w, p);
+        } else {
+            idle(w);
+        }
+    }
+    return NULL;
+}
+
+static void start_pool(int size) {
+    int i;
+
+    pthread_mutex_lock(&pool_lock);
+    if (workers == NULL) {
+        if (size <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+            size = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+            if (size <= 0) {
+                size = 1;
+            }
+        }
+
+        pthread_key_create(&worker_key, NULL);
+        workers = malloc(size * sizeof(Worker));
+        if (workers == NULL) {
+            fprintf(stderr, "RTS ERROR: Unable to allocate workers\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(workers, 0, size * sizeof(Worker));
+        nworkers = size;
+
+        for (i = 0; i < size; ++i) {
+            pthread_mutex_init(&workers[i].lock, NULL);
+            if (pthread_create(&workers[i].thread, NULL, worker_main,
+                               workers + i) != 0) {
+                fprintf(stderr, "RTS ERROR: Unable to start worker thread\n");
+                exit(EXIT_FAILURE);
+            }
+            pthread_detach(workers[i].thread);
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void switch_out(Process* p, int reason) {
+    p->reason = reason;
+    // We may come back on a different worker
+    swapcontext(&p->context, &p->worker->context);
+}
+
+static void process_start(void) {
+    // The worker sets the thread's VM before switching to a process
+    VM* vm = get_vm();
+    Process* p = vm->proc;
+
+    TOP(0) = p->arg;
+    BASETOP(0);
+    ADDTOP(1);
+    p->fn(vm, NULL);
+
+    terminate(vm);
+    idris_exit(vm);
+}
+
+int idris_spawn(VM* vm, func f, VAL arg) {
+    Process* p;
+    Worker* w;
+
+    start_pool(vm->max_threads);
+
+    p = malloc(sizeof(*p));
+    if (p == NULL) {
+        return 0;
+    }
+    memset(p, 0, sizeof(*p));
+    p->stack = malloc(process_stack);
+    if (p->stack == NULL) {
+        free(p);
+        return 0;
+    }
+
+    getcontext(&p->context);
+    p->context.uc_stack.ss_sp = p->stack;
+    p->context.uc_stack.ss_size = process_stack;
+    p->context.uc_link = NULL;
+    makecontext(&p->context, process_start, 0);
+
+    p->vm = vm;
+    p->fn = f;
+    p->arg = arg;
+    p->state = PROC_RUNNABLE;
+    vm->proc = p;
+
+    w = pthread_getspecific(worker_key);
+    if (w == NULL) {
+        w = workers + __atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED)
+                      % nworkers;
+    }
+    p->worker = w;
+    enqueue(w, p);
+    return 1;
+}
+
+void idris_park(VM* vm, int timeout) {
+    vm->proc->timeout = timeout;
+    switch_out(vm->proc, SWITCH_PARK);
+}
+
+void idris_wake(VM* vm) {
+    Process* p = vm->proc;
+    int waiting = PROC_WAITING;
+
+    if (p == NULL) {
+        return;
+    }
+    if (__atomic_compare_exchange_n(&p->state, &waiting, PROC_RUNNABLE,
+                                    0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        // Nothing else can touch the process now until it's queued
+        if (p->timeout >= 0) {
+            pthread_mutex_lock(&idle_lock);
+            remove_sleeper(p);
+            pthread_mutex_unlock(&idle_lock);
+        }
+        enqueue(wake_worker(p), p);
+    }
+}
+
+void idris_yield(VM* vm) {
+    switch_out(vm->proc, SWITCH_YIELD);
+}
+
+void idris_exit(VM* vm) {
+    switch_out(vm->proc, SWITCH_EXIT);
+    // Never gets here
+    assert(0);
+}
+
+#endif // IDRIS_GREEN_THREADS
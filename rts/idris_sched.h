@@ -0,0 +1,66 @@
+#ifndef _IDRIS_SCHED_H
+#define _IDRIS_SCHED_H
+
+#include "idris_rts.h"
+
+/* *** Scheduler ***
+ * Processes created by vmThread are green threads: each one is a VM with a
+ * small heap and a C stack of its own, and they're multiplexed onto a fixed
+ * pool of worker pthreads. Every worker has a run queue, and idle workers
+ * steal from the others. Scheduling is cooperative: a process only gives up
+ * its worker when it waits for a message, polls for one, or stops. So a
+ * process which computes for a long time without doing any of those keeps
+ * the processes queued behind it waiting, until an idle worker steals them.
+ * With every worker busy, they wait until it's done.
+ *
+ * Each process has a C stack of a fixed size, 8M unless +RTS -k says
+ * otherwise, since a stack can't be moved to grow it once the process has
+ * pointers into it. Only the part which is used gets touched.
+ *
+ * The root VM isn't a process: it keeps running on the thread which created
+ * it, and waits for messages on its condition variable.
+ */
+
+// ucontext isn't available everywhere we have pthreads. Elsewhere, each
+// process gets a pthread of its own.
+#if defined(HAS_PTHREAD) && !defined(_WIN32)
+#define IDRIS_GREEN_THREADS
+#endif
+
+// C stack for running a process, by default, and the least it can be set to
+#define PROCESS_STACK_SIZE (8 * 1024 * 1024)
+#define PROCESS_STACK_MIN 65536
+
+// Set the size of the C stack for processes created from now on, or go back
+// to the default if it's 0. Without green threads, this is the size of
+// each process's thread's stack.
+void idris_processStack(size_t size);
+size_t idris_processStackSize(void);
+
+#ifdef IDRIS_GREEN_THREADS
+
+// Heap a process starts with. It grows by its creator's growth factor.
+#define PROCESS_HEAP_SIZE 65536
+
+// Start running f(arg) in vm, which must be new, as a process. The pool of
+// workers is started on first use, with max_threads workers (or one per
+// processor, if max_threads is 0). Returns 0 on failure.
+int idris_spawn(VM* vm, func f, VAL arg);
+
+// Suspend the running process until idris_wake is called on its VM, or the
+// timeout (in milliseconds, if it's not negative) has passed. May also
+// return early, so callers need to check again for what they're waiting for.
+void idris_park(VM* vm, int timeout);
+
+// Make vm's process runnable if it's parked. Does nothing otherwise.
+void idris_wake(VM* vm);
+
+// Let other processes on this worker run.
+void idris_yield(VM* vm);
+
+// Finish the running process. vm must already have been terminated.
+void idris_exit(VM* vm);
+
+#endif // IDRIS_GREEN_THREADS
+
+#endif // _IDRIS_SCHED_H
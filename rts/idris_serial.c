@@ -0,0 +1,640 @@
+#include "idris_serial.h"
+#include "idris_buffer.h"
+#include "idris_gc.h"
+#include "idris_gmp.h"
+#include "idris_image.h"
+#include "idris_utf8.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SERIAL_MAGIC "IDS1"
+#define SERIAL_HEADER 12 // The magic, then the program id
+
+// Object kinds
+#define SK_CON 0
+#define SK_ARRAY 1
+#define SK_STRING 2
+#define SK_FLOAT 3
+#define SK_BITS32 4
+#define SK_BITS64 5
+#define SK_BIGINT 6
+#define SK_ROOT 255 // No more objects: the value follows
+
+// Reference kinds, in the low two bits
+#define SR_OBJECT 0
+#define SR_INT 1
+#define SR_NULLARY 2
+#define SR_OTHER 3
+
+/* *** Writing *** */
+
+typedef struct {
+    uint8_t* buf;
+    size_t used;
+    size_t room;
+    int failed;
+} Out;
+
+static void put_bytes(Out* out, const void* bytes, size_t len) {
+    if (out->used + len > out->room) {
+        size_t room = out->room * 2 > out->used + len ? out->room * 2
+                                                      : out->used + len;
+        uint8_t* buf = realloc(out->buf, room);
+        if (buf == NULL) {
+            out->failed = 1;
+            return;
+        }
+        out->buf = buf;
+        out->room = room;
+    }
+    memcpy(out->buf + out->used, bytes, len);
+    out->used += len;
+}
+
+static void put_byte(Out* out, uint8_t byte) {
+    put_bytes(out, &byte, 1);
+}
+
+static void put_varint(Out* out, uint64_t x) {
+    uint8_t bytes[10];
+    size_t len = 0;
+    while (x >= 0x80) {
+        bytes[len++] = (uint8_t)(x | 0x80);
+        x >>= 7;
+    }
+    bytes[len++] = (uint8_t)x;
+    put_bytes(out, bytes, len);
+}
+
+static void put_le(Out* out, uint64_t x, int len) {
+    uint8_t bytes[8];
+    int i;
+    for (i = 0; i < len; ++i) {
+        bytes[i] = (uint8_t)(x >> (8 * i));
+    }
+    put_bytes(out, bytes, len);
+}
+
+// Objects already written, or being written, by index
+typedef struct {
+    VAL* keys; // NULL marks an empty slot
+    uint64_t* indices;
+    size_t slots; // A power of 2
+    size_t count;
+} Seen;
+
+// The index of an object whose arguments are still being written
+#define PENDING UINT64_MAX
+
+static size_t seen_slot(const Seen* s, VAL x) {
+    uint64_t h = (uint64_t)(uintptr_t)x * 0x9e3779b97f4a7c15ULL;
+    size_t i = (size_t)(h >> 32) & (s->slots - 1);
+    while (s->keys[i] != NULL && s->keys[i] != x) {
+        i = (i + 1) & (s->slots - 1);
+    }
+    return i;
+}
+
+static uint64_t* seen_find(Seen* s, VAL x) {
+    if (s->slots == 0) {
+        return NULL;
+    }
+    size_t i = seen_slot(s, x);
+    return s->keys[i] == x ? &s->indices[i] : NULL;
+}
+
+static int seen_add(Seen* s, VAL x) {
+    size_t i;
+    if (2 * (s->count + 1) > s->slots) {
+        Seen old = *s;
+        s->slots = old.slots ? old.slots * 2 : 1024;
+        s->keys = calloc(s->slots, sizeof(VAL));
+        s->indices = malloc(s->slots * sizeof(uint64_t));
+        if (s->keys == NULL || s->indices == NULL) {
+            free(old.keys);
+            free(old.indices);
+            return 0;
+        }
+        for (i = 0; i < old.slots; ++i) {
+            if (old.keys[i] != NULL) {
+                size_t j = seen_slot(s, old.keys[i]);
+                s->keys[j] = old.keys[i];
+                s->indices[j] = old.indices[i];
+            }
+        }
+        free(old.keys);
+        free(old.indices);
+    }
+    i = seen_slot(s, x);
+    s->keys[i] = x;
+    s->indices[i] = PENDING;
+    s->count++;
+    return 1;
+}
+
+// Whether x is written as an object, rather than in a reference
+static int is_object(VAL x) {
+    return x != NULL && !ISIMM(x);
+}
+
+static size_t fields(VAL x, VAL** field) {
+    switch(GETTY(x)) {
+    case CT_CON:
+        *field = ((Con*)x)->args;
+        return CARITY(x);
+    case CT_ARRAY:
+        *field = ((Array*)x)->array;
+        return CELEM(x);
+    default:
+        return 0;
+    }
+}
+
+static void put_ref(Out* out, Seen* seen, VAL x) {
+    if (x == NULL) {
+        put_varint(out, SR_OTHER);
+    } else if (ISINT(x)) {
+        int64_t i = GETINT(x);
+        uint64_t zz = ((uint64_t)i << 1) ^ (uint64_t)(i >> 63);
+        if (zz < (UINT64_C(1) << 62)) {
+            put_varint(out, (zz << 2) | SR_INT);
+        } else {
+            put_varint(out, (1 << 2) | SR_OTHER);
+            put_varint(out, zz);
+        }
+    } else if (ISNULLARY(x)) {
+        put_varint(out, ((uint64_t)NULLARYTAG(x) << 2) | SR_NULLARY);
+    } else {
+        put_varint(out, (*seen_find(seen, x) << 2) | SR_OBJECT);
+    }
+}
+
+// Write an object whose fields have all been written
+static int put_object(Out* out, Seen* seen, VAL x) {
+    VAL* field;
+    size_t n = fields(x, &field);
+    size_t i;
+    switch(GETTY(x)) {
+    case CT_CON:
+        put_byte(out, SK_CON);
+        put_varint(out, CTAG(x));
+        put_varint(out, n);
+        break;
+    case CT_ARRAY:
+        put_byte(out, SK_ARRAY);
+        put_varint(out, n);
+        break;
+    case CT_STRING:
+    case CT_STROFFSET:
+    case CT_STRCONCAT: {
+        const char* chars = GETSTR(x);
+        size_t len = chars == NULL ? 0 : GETSTRLEN(x);
+        put_byte(out, SK_STRING);
+        put_varint(out, len);
+        put_bytes(out, chars, len);
+    } break;
+    case CT_FLOAT: {
+        uint64_t bits;
+        memcpy(&bits, &((Float*)x)->f, sizeof(bits));
+        put_byte(out, SK_FLOAT);
+        put_le(out, bits, 8);
+    } break;
+    case CT_BITS32:
+        put_byte(out, SK_BITS32);
+        put_le(out, ((Bits32*)x)->bits32, 4);
+        break;
+    case CT_BITS64:
+        put_byte(out, SK_BITS64);
+        put_le(out, ((Bits64*)x)->bits64, 8);
+        break;
+    case CT_BIGINT: {
+        // Limb by limb, since GMP would allocate in the heap to export it
+        mpz_t* big = getmpz((BigInt*)x);
+        size_t limbs = mpz_size(*big);
+        const mp_limb_t* limb = mpz_limbs_read(*big);
+        size_t len = limbs * sizeof(mp_limb_t);
+        while (len > 0 &&
+               (uint8_t)(limb[(len - 1) / sizeof(mp_limb_t)] >>
+                         (8 * ((len - 1) % sizeof(mp_limb_t)))) == 0) {
+            --len;
+        }
+        put_byte(out, SK_BIGINT);
+        put_varint(out, 2 * (uint64_t)len + (mpz_sgn(*big) < 0));
+        for (i = 0; i < len; ++i) {
+            put_byte(out, (uint8_t)(limb[i / sizeof(mp_limb_t)] >>
+                                    (8 * (i % sizeof(mp_limb_t)))));
+        }
+    } break;
+    default:
+        // Mutable, or belonging to this process
+        return 0;
+    }
+    for (i = 0; i < n; ++i) {
+        put_ref(out, seen, field[i]);
+    }
+    return 1;
+}
+
+typedef struct {
+    VAL x;
+    size_t next; // The next field to look at
+} Frame;
+
+VAL idris_serialize(VM* vm, VAL x) {
+    Out out = { NULL, 0, 0, 0 };
+    Seen seen = { NULL, NULL, 0, 0 };
+    Frame* stack = NULL;
+    size_t depth = 0;
+    size_t room = 0;
+    uint64_t count = 0;
+    int ok = 1;
+
+    put_bytes(&out, SERIAL_MAGIC, 4);
+    put_le(&out, idris_programId(), 8);
+
+    // Depth first, with a stack of our own, writing each object once all
+    // it refers to has been written
+    if (is_object(x)) {
+        ok = seen_add(&seen, x);
+        stack = malloc(sizeof(Frame) * 64);
+        room = 64;
+        ok = ok && stack != NULL;
+        if (ok) {
+            stack[depth++] = (Frame){ x, 0 };
+        }
+    }
+    while (ok && depth > 0) {
+        Frame* f = &stack[depth - 1];
+        VAL* field;
+        size_t n = fields(f->x, &field);
+        VAL next = NULL;
+        for (; f->next < n; ++f->next) {
+            VAL y = field[f->next];
+            if (!is_object(y)) {
+                continue;
+            }
+            uint64_t* index = seen_find(&seen, y);
+            if (index == NULL) {
+                next = y;
+                break;
+            }
+            if (*index == PENDING) {
+                ok = 0; // A cycle, through an array
+                break;
+            }
+        }
+        if (!ok) {
+            break;
+        }
+        if (next != NULL) {
+            if (depth == room) {
+                Frame* bigger = realloc(stack, sizeof(Frame) * room * 2);
+                if (bigger == NULL) {
+                    ok = 0;
+                    break;
+                }
+                stack = bigger;
+                room *= 2;
+            }
+            ok = seen_add(&seen, next);
+            stack[depth++] = (Frame){ next, 0 };
+            continue;
+        }
+        ok = put_object(&out, &seen, f->x);
+        *seen_find(&seen, f->x) = count++;
+        --depth;
+    }
+
+    put_byte(&out, SK_ROOT);
+    if (ok) {
+        put_ref(&out, &seen, x);
+    }
+    free(stack);
+    free(seen.keys);
+    free(seen.indices);
+
+    VAL buffer = NULL;
+    if (ok && !out.failed && out.used <= INT_MAX) {
+        // Nothing refers to x any more, so it doesn't matter if it moves
+        buffer = idris_newBuffer(vm, (int)out.used);
+        if (buffer != NULL) {
+            memcpy(idris_getBufferData(GETMPTR(buffer)), out.buf, out.used);
+        }
+    }
+    free(out.buf);
+    return buffer;
+}
+
+/* *** Reading *** */
+
+typedef struct {
+    const uint8_t* p;
+    const uint8_t* end;
+    // Set when building, to the next free byte of the heap, and the
+    // objects built so far
+    char* next;
+    VAL* objects;
+    int old; // Whether mutable objects need GC_OLD
+} In;
+
+static int get_varint(In* in, uint64_t* x) {
+    int shift;
+    *x = 0;
+    for (shift = 0; shift < 64 && in->p < in->end; shift += 7) {
+        uint8_t byte = *in->p++;
+        *x |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static uint64_t get_le(In* in, int len) {
+    uint64_t x = 0;
+    int i;
+    for (i = 0; i < len; ++i) {
+        x |= (uint64_t)in->p[i] << (8 * i);
+    }
+    in->p += len;
+    return x;
+}
+
+static VAL unzigzag(uint64_t zz) {
+    int64_t i = (int64_t)(zz >> 1) ^ -(int64_t)(zz & 1);
+    return MKINT((i_int)i);
+}
+
+// Read a reference to one of the first 'count' objects, or to something
+// which isn't an object
+static int get_ref(In* in, uint64_t count, VAL* x) {
+    uint64_t ref;
+    if (!get_varint(in, &ref)) {
+        return 0;
+    }
+    switch (ref & 3) {
+    case SR_OBJECT:
+        if ((ref >> 2) >= count) {
+            return 0;
+        }
+        *x = in->objects != NULL ? in->objects[ref >> 2] : NULL;
+        return 1;
+    case SR_INT:
+        *x = unzigzag(ref >> 2);
+        return 1;
+    case SR_NULLARY:
+        if ((ref >> 2) > UINT32_MAX) {
+            return 0;
+        }
+        *x = NULL_CON((ref >> 2));
+        return 1;
+    default:
+        if (ref == SR_OTHER) {
+            *x = NULL;
+            return 1;
+        }
+        if (ref == ((1 << 2) | SR_OTHER) && get_varint(in, &ref)) {
+            *x = unzigzag(ref);
+            return 1;
+        }
+        return 0;
+    }
+}
+
+// Room in the heap for an object, if building
+static void* place(In* in, ClosureType ty, size_t size) {
+    if (in->next == NULL) {
+        return NULL;
+    }
+    Hdr* h = (Hdr*)in->next;
+    in->next += aligned(size);
+    *h = (Hdr){ .ty = ty, .sz = size };
+    return h;
+}
+
+// Check, or build, the objects and the value after them. Returns the room
+// they need in the heap, or -1, and the number of objects in *count.
+static i_int read_objects(In* in, uint64_t* count, VAL* root) {
+    size_t size = 0;
+    uint64_t n, i, len;
+    *count = 0;
+
+    if (in->end - in->p < SERIAL_HEADER ||
+        memcmp(in->p, SERIAL_MAGIC, 4) != 0) {
+        return -1;
+    }
+    in->p += 4;
+    if (get_le(in, 8) != idris_programId()) {
+        return -1;
+    }
+
+    for (;;) {
+        if (in->p >= in->end) {
+            return -1;
+        }
+        uint8_t kind = *in->p++;
+        VAL x = NULL;
+        switch (kind) {
+        case SK_ROOT:
+            if (!get_ref(in, *count, root) || in->p != in->end) {
+                return -1;
+            }
+            return (i_int)size;
+        case SK_CON:
+        case SK_ARRAY: {
+            uint64_t tag = 0;
+            if ((kind == SK_CON && !get_varint(in, &tag)) ||
+                !get_varint(in, &n) ||
+                tag > UINT32_MAX || n > (uint64_t)(in->end - in->p) ||
+                (kind == SK_CON && (n == 0 || n > UINT16_MAX))) {
+                // Nullary constructors are always written as references
+                return -1;
+            }
+            VAL* field;
+            if (kind == SK_CON) {
+                Con* c = place(in, CT_CON, sizeof(Con) + n * sizeof(VAL));
+                if (c != NULL) {
+                    c->hdr.u16 = (uint16_t)n;
+                    c->hdr.sz = (uint32_t)tag;
+                }
+                field = c != NULL ? c->args : NULL;
+                x = (VAL)c;
+                size += aligned(sizeof(Con) + n * sizeof(VAL));
+            } else {
+                Array* a = place(in, CT_ARRAY, sizeof(Array) + n * sizeof(VAL));
+                field = a != NULL ? a->array : NULL;
+                x = (VAL)a;
+                size += aligned(sizeof(Array) + n * sizeof(VAL));
+            }
+            if (x != NULL && in->old) {
+                x->hdr.u8 = GC_OLD;
+            }
+            for (i = 0; i < n; ++i) {
+                VAL y;
+                if (!get_ref(in, *count, &y)) {
+                    return -1;
+                }
+                if (field != NULL) {
+                    field[i] = y;
+                }
+            }
+        } break;
+        case SK_STRING: {
+            if (!get_varint(in, &len) || len > (uint64_t)(in->end - in->p)) {
+                return -1;
+            }
+            String* s = place(in, CT_STRING, sizeof(String) + len + 1);
+            if (s != NULL) {
+                int ascii;
+                s->slen = len;
+                memcpy(s->str, in->p, len);
+                s->str[len] = '\0';
+                s->clen = idris_utf8_count(s->str, len, &ascii);
+                s->hdr.u16 = STR_COUNTED | (ascii ? STR_ASCII : 0);
+            }
+            in->p += len;
+            x = (VAL)s;
+            size += aligned(sizeof(String) + len + 1);
+        } break;
+        case SK_FLOAT:
+        case SK_BITS64:
+        case SK_BITS32: {
+            int bytes = kind == SK_BITS32 ? 4 : 8;
+            if (in->end - in->p < bytes) {
+                return -1;
+            }
+            uint64_t bits = get_le(in, bytes);
+            if (kind == SK_FLOAT) {
+                Float* f = place(in, CT_FLOAT, sizeof(Float));
+                if (f != NULL) {
+                    memcpy(&f->f, &bits, sizeof(bits));
+                }
+                x = (VAL)f;
+                size += aligned(sizeof(Float));
+            } else if (kind == SK_BITS64) {
+                Bits64* b = place(in, CT_BITS64, sizeof(Bits64));
+                if (b != NULL) {
+                    b->bits64 = bits;
+                }
+                x = (VAL)b;
+                size += aligned(sizeof(Bits64));
+            } else {
+                // In this machine's representation, which may not be the
+                // writer's. Unboxed, MKB32 doesn't allocate.
+#ifdef IDRIS_UNBOXED_BITS32
+                x = MKB32(NULL, (uint32_t)bits);
+#else
+                Bits32* b = place(in, CT_BITS32, sizeof(Bits32));
+                if (b != NULL) {
+                    b->bits32 = (uint32_t)bits;
+                }
+                x = (VAL)b;
+                size += aligned(sizeof(Bits32));
+#endif
+            }
+        } break;
+        case SK_BIGINT: {
+            if (!get_varint(in, &len) ||
+                (len >> 1) > (uint64_t)(in->end - in->p)) {
+                return -1;
+            }
+            int negative = len & 1;
+            len >>= 1;
+            size_t limbs = (len + sizeof(mp_limb_t) - 1) / sizeof(mp_limb_t);
+            size_t alloc = limbs ? limbs : 1;
+            // The limbs go in a RawData block after it, as if GMP had
+            // allocated them
+            BigInt* b = place(in, CT_BIGINT, sizeof(BigInt) + sizeof(mpz_t));
+            RawData* d = place(in, CT_RAWDATA,
+                               sizeof(RawData) + alloc * sizeof(mp_limb_t));
+            if (b != NULL) {
+                mp_limb_t* limb = (mp_limb_t*)d->raw;
+                memset(limb, 0, alloc * sizeof(mp_limb_t));
+                for (i = 0; i < len; ++i) {
+                    limb[i / sizeof(mp_limb_t)] |=
+                        (mp_limb_t)in->p[i] << (8 * (i % sizeof(mp_limb_t)));
+                }
+                while (limbs > 0 && limb[limbs - 1] == 0) {
+                    --limbs;
+                }
+                mpz_t* big = getmpz(b);
+                (*big)->_mp_alloc = alloc;
+                (*big)->_mp_size = negative ? -(int)limbs : (int)limbs;
+                (*big)->_mp_d = limb;
+            }
+            in->p += len;
+            x = (VAL)b;
+            size += aligned(sizeof(BigInt) + sizeof(mpz_t)) +
+                    aligned(sizeof(RawData) + alloc * sizeof(mp_limb_t));
+        } break;
+        default:
+            return -1;
+        }
+        if (in->objects != NULL) {
+            in->objects[*count] = x;
+        }
+        ++*count;
+    }
+}
+
+// The len bytes from loc of a buffer, or NULL if they're out of range
+static const uint8_t* buffer_range(void* buffer, int loc, int len) {
+    if (loc < 0 || len < 0 || loc > idris_getBufferSize(buffer) - len) {
+        return NULL;
+    }
+    return idris_getBufferData(buffer) + loc;
+}
+
+i_int idris_serialCheck(void* buffer, int loc, int len) {
+    const uint8_t* bytes = buffer_range(buffer, loc, len);
+    if (bytes == NULL) {
+        return -1;
+    }
+    In in = { bytes, bytes + len, NULL, NULL, 0 };
+    uint64_t count;
+    VAL root;
+    return read_objects(&in, &count, &root);
+}
+
+VAL idris_deserialize(VM* vm, VAL buffer, int loc, int len) {
+    const uint8_t* bytes = buffer_range(GETMPTR(buffer), loc, len);
+    if (bytes == NULL) {
+        return NULL;
+    }
+    In in = { bytes, bytes + len, NULL, NULL, 0 };
+    uint64_t count;
+    VAL root;
+    i_int size = read_objects(&in, &count, &root);
+    if (size < 0) {
+        return NULL;
+    }
+
+    // The value goes in the heap in one piece, so nothing can be collected
+    // part way through. Make room first; the buffer may move meanwhile.
+    if (vm->heap.next + size > vm->heap.end) {
+        RESERVENOALLOC(1);
+        TOP(0) = buffer;
+        ADDTOP(1);
+        idris_gc_for(vm, size);
+        buffer = TOP(-1);
+        ADDTOP(-1);
+        bytes = buffer_range(GETMPTR(buffer), loc, len);
+    }
+    in.objects = malloc((count ? count : 1) * sizeof(VAL));
+    if (in.objects == NULL) {
+        return NULL;
+    }
+
+    STATS_ALLOC(vm->stats, size)
+    in.p = bytes;
+    in.end = bytes + len;
+    in.next = vm->heap.next;
+    in.old = vm->nursery.size > 0;
+    read_objects(&in, &count, &root);
+    vm->heap.next = in.next;
+    free(in.objects);
+    return root;
+}
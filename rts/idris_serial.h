@@ -0,0 +1,50 @@
+#ifndef _IDRIS_SERIAL_H
+#define _IDRIS_SERIAL_H
+
+#include "idris_rts.h"
+
+/* *** Serialization ***
+ * A value can be written into a Data.Buffer, to be stored or sent to
+ * another process, and read back into any VM of the same program. Sharing
+ * is kept: an object reached along several paths is written once, and
+ * read back as one object.
+ *
+ * The encoding is a header, then the objects, each after everything it
+ * refers to, then a reference to the value itself. Numbers are LEB128
+ * varints. A reference is a varint whose low two bits say what it is:
+ *   0  an object written earlier, by its index
+ *   1  an Int, zigzag encoded
+ *   2  a nullary constructor, by its tag
+ *   3  NULL if the rest is 0, otherwise an Int too large for the above,
+ *      zigzag encoded in the next varint
+ * An object is a kind byte followed by:
+ *   constructor  tag, arity, then a reference for each argument
+ *   array        length, then a reference for each element
+ *   string       length in bytes, then the bytes
+ *   float        8 bytes, the bits of the double, little endian
+ *   bits32/64    4 or 8 bytes, little endian
+ *   bigint       the length of the magnitude in bytes, times 2, plus 1 if
+ *                negative, then the magnitude, little endian
+ * Substrings and concatenations are written as plain strings.
+ *
+ * Reading first checks the whole buffer and works out how much room the
+ * value needs, then builds it in one pass, straight into the heap, without
+ * collecting part way. Arrays are copied like the rest, as when they're
+ * sent to another thread. References, buffers, pointers and C data can't
+ * be written.
+ */
+
+// Serialize x into a new Data.Buffer, or return NULL if it holds anything
+// which can't be
+VAL idris_serialize(VM* vm, VAL x);
+
+// Check len bytes of a buffer from loc hold a serialized value of this
+// program. Returns the room it needs in the heap, or -1 if they don't.
+i_int idris_serialCheck(void* buffer, int loc, int len);
+
+// Read a value serialized into len bytes of a Data.Buffer from loc, or
+// return NULL if they don't hold one. The buffer is the heap object, since
+// making room for the value can move it.
+VAL idris_deserialize(VM* vm, VAL buffer, int loc, int len);
+
+#endif // _IDRIS_SERIAL_H
@@ -3,12 +3,56 @@
 #include <stdio.h>
 #include <locale.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+uint64_t idris_clock_ns(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&now);
+    // Split to avoid overflowing for counters running at several GHz
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000
+         + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000
+           / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
 #ifdef IDRIS_ENABLE_STATS
 
+#define NS_PER_SEC 1e9
+
+// Longest pause, in milliseconds, of the given fraction of them all. Pauses
+// are only counted to within a power of two.
+static double pause_percentile(const Stats * stats, double fraction) {
+    uint64_t total = 0, seen = 0;
+    int i;
+    for (i = 0; i < STATS_PAUSE_BUCKETS; ++i) {
+        total += stats->pauses[i];
+    }
+    for (i = 0; i < STATS_PAUSE_BUCKETS; ++i) {
+        seen += stats->pauses[i];
+        if (seen > 0 && seen >= fraction * total) {
+            break;
+        }
+    }
+    return i < STATS_PAUSE_BUCKETS ? (double)((uint64_t)1 << i) / 1000 : 0;
+}
+
 void print_stats(const Stats * stats) {
-    clock_t total   = clock() - stats->start_time;
-    clock_t mut     = total - stats->init_time - stats->gc_time - stats->exit_time;
-    double  mut_sec = (double)mut   / CLOCKS_PER_SEC;
+    uint64_t total   = idris_clock_ns() - stats->start_time;
+    uint64_t mut     = total - stats->init_time - stats->gc_time - stats->exit_time;
+    double   mut_sec = (double)mut / NS_PER_SEC;
 
     uint64_t avg_chunk = 0;
     if (stats->alloc_count > 0) {
@@ -31,17 +75,31 @@ void print_stats(const Stats * stats) {
     printf("\n");
     printf("%'20" PRIu64 " bytes allocated in the heap\n",  stats->allocations);
     printf("%'20" PRIu64 " bytes copied during GC\n",       stats->copied);
-    printf("%'20" PRIu32 " maximum heap size\n",            stats->max_heap_size);
+    printf("%'20" PRIu64 " maximum heap size\n",            stats->max_heap_size);
     printf("%'20" PRIu32 " chunks allocated in the heap\n", stats->alloc_count);
     printf("%'20" PRIu64 " average chunk size\n\n",         avg_chunk);
 
-    printf("GC called %d times\n\n", stats->collections);
+    printf("GC called %d times (%d minor)\n", stats->collections,
+           stats->minor_collections);
+    if (stats->increments > 0) {
+        printf("%d incremental steps\n", stats->increments);
+    }
+    printf("Pauses up to %.3fms (50%%), %.3fms (90%%), %.3fms (99%%), "
+           "longest %.3fms\n\n",
+           pause_percentile(stats, 0.5), pause_percentile(stats, 0.9),
+           pause_percentile(stats, 0.99),
+           (double)stats->max_gc_pause / 1e6);
 
-    printf("INIT  time: %8.3fs\n",   (double)stats->init_time / CLOCKS_PER_SEC);
+    printf("INIT  time: %8.3fs\n",   (double)stats->init_time / NS_PER_SEC);
     printf("MUT   time: %8.3fs\n",   mut_sec);
-    printf("GC    time: %8.3fs\n",   (double)stats->gc_time   / CLOCKS_PER_SEC);
-    printf("EXIT  time: %8.3fs\n",   (double)stats->exit_time / CLOCKS_PER_SEC);
-    printf("TOTAL time: %8.3fs\n\n", (double)total            / CLOCKS_PER_SEC);
+    printf("GC    time: %8.3fs\n",   (double)stats->gc_time   / NS_PER_SEC);
+    printf("EXIT  time: %8.3fs\n",   (double)stats->exit_time / NS_PER_SEC);
+    printf("TOTAL time: %8.3fs\n\n", (double)total            / NS_PER_SEC);
+    if (stats->vms > 1) {
+        // Allocation and collection counts above include these
+        printf("%" PRIu32 " other VMs finished, spending %.3fs in GC\n\n",
+               stats->vms - 1, (double)stats->others_gc_time / NS_PER_SEC);
+    }
 
     printf("%%GC   time: %.2f%%\n\n", gc_percent);
 
@@ -50,8 +108,49 @@ void print_stats(const Stats * stats) {
     printf("Productivity %.2f%%\n", productivity);
 }
 
+void write_stats_json(FILE * f, const Stats * stats) {
+    uint64_t total = idris_clock_ns() - stats->start_time;
+    int i;
+
+    fprintf(f, "{\"bytes_allocated\": %" PRIu64 ", ", stats->allocations);
+    fprintf(f, "\"allocations\": %" PRIu32 ", ", stats->alloc_count);
+    fprintf(f, "\"bytes_copied\": %" PRIu64 ", ", stats->copied);
+    fprintf(f, "\"max_heap_size\": %" PRIu64 ", ", stats->max_heap_size);
+    fprintf(f, "\"collections\": %" PRIu32 ", ", stats->collections);
+    fprintf(f, "\"minor_collections\": %" PRIu32 ", ",
+            stats->minor_collections);
+    fprintf(f, "\"increments\": %" PRIu32 ", ", stats->increments);
+    fprintf(f, "\"init_ns\": %" PRIu64 ", ", stats->init_time);
+    fprintf(f, "\"gc_ns\": %" PRIu64 ", ", stats->gc_time);
+    fprintf(f, "\"others_gc_ns\": %" PRIu64 ", ", stats->others_gc_time);
+    fprintf(f, "\"exit_ns\": %" PRIu64 ", ", stats->exit_time);
+    fprintf(f, "\"total_ns\": %" PRIu64 ", ", total);
+    fprintf(f, "\"max_pause_ns\": %" PRIu64 ", ", stats->max_gc_pause);
+    fprintf(f, "\"vms\": %" PRIu32 ", ", stats->vms);
+    fprintf(f, "\"pauses\": [");
+    for (i = 0; i < STATS_PAUSE_BUCKETS; ++i) {
+        fprintf(f, i > 0 ? ", %" PRIu32 : "%" PRIu32, stats->pauses[i]);
+    }
+    fprintf(f, "]}\n");
+}
+
 void aggregate_stats(Stats * stats1, const Stats * stats2) {
-    fprintf(stderr, "RTS error: aggregate_stats not implemented");
+    int i;
+    stats1->allocations       += stats2->allocations;
+    stats1->alloc_count       += stats2->alloc_count;
+    stats1->copied            += stats2->copied;
+    stats1->max_heap_size      = MAX(stats1->max_heap_size,
+                                     stats2->max_heap_size);
+    stats1->collections       += stats2->collections;
+    stats1->minor_collections += stats2->minor_collections;
+    stats1->increments        += stats2->increments;
+    for (i = 0; i < STATS_PAUSE_BUCKETS; ++i) {
+        stats1->pauses[i] += stats2->pauses[i];
+    }
+    stats1->max_gc_pause       = MAX(stats1->max_gc_pause,
+                                     stats2->max_gc_pause);
+    stats1->others_gc_time    += stats2->gc_time + stats2->others_gc_time;
+    stats1->vms               += stats2->vms;
 }
 
 #else
@@ -61,8 +160,14 @@ void print_stats(const Stats * stats) {
                     "By the way GC called %d times.\n", stats->collections);
 }
 
+void write_stats_json(FILE * f, const Stats * stats) {
+    fprintf(f, "{\"collections\": %" PRIu32 ", \"vms\": %" PRIu32 "}\n",
+            stats->collections, stats->vms);
+}
+
 void aggregate_stats(Stats * stats1, const Stats * stats2) {
     stats1->collections += stats2->collections;
+    stats1->vms         += stats2->vms;
 }
 
 #endif // IDRIS_ENABLE_STATS
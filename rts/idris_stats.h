@@ -1,32 +1,46 @@
 #ifndef _IDRIS_STATS_H
 #define _IDRIS_STATS_H
 
-#ifdef IDRIS_ENABLE_STATS
-#include <time.h>
-#endif
-
 #include <inttypes.h>
 #include <stdint.h>
+#include <stdio.h>
 
+#define STATS_PAUSE_BUCKETS 24
 
-// TODO: measure user time, exclusive/inclusive stats
+// Nanoseconds from a monotonic clock, for measuring intervals. Unlike
+// clock(), this is wall-clock time, and it means the same in every thread.
+uint64_t idris_clock_ns(void);
+
+// All times are in nanoseconds.
 typedef struct {
 #ifdef IDRIS_ENABLE_STATS
     uint64_t allocations;       // Size of allocated space in bytes for all execution time.
     uint32_t alloc_count;       // How many times alloc is called.
     uint64_t copied;            // Size of space copied during GC.
-    uint32_t max_heap_size;     // Maximum heap size achieved.
-
-    clock_t init_time;     // Time spent for vm initialization.
-    clock_t exit_time;     // Time spent for vm termination.
-    clock_t gc_time;       // Time spent for gc for all execution time.
-    clock_t max_gc_pause;  // Time spent for longest gc.
-    clock_t start_time;    // Time of rts entry point.
+    uint64_t max_heap_size;     // Maximum heap size achieved.
+    uint32_t minor_collections; // How many of the collections were nursery only.
+    uint32_t increments;        // Steps of incremental collections, besides their ends.
+    uint32_t pauses[STATS_PAUSE_BUCKETS]; // Pauses by length: bucket i counts
+                                          // those up to 2^i microseconds.
+
+    uint64_t init_time;    // Time spent for vm initialization.
+    uint64_t exit_time;    // Time spent for vm termination.
+    uint64_t gc_time;      // Time spent for gc for all execution time.
+    uint64_t max_gc_pause; // Time spent for longest gc.
+    uint64_t start_time;   // Time of rts entry point.
+    uint64_t others_gc_time; // Time the other VMs counted here spent in gc.
+                             // They ran alongside this one, so it isn't
+                             // part of this VM's time.
 #endif // IDRIS_ENABLE_STATS
     uint32_t collections;       // How many times gc called.
-} Stats; // without start time it's a monoid, can we remove start_time it somehow?
+    uint32_t vms;               // How many VMs these are the stats of.
+} Stats;
 
 void print_stats(const Stats * stats);
+// Write the stats as one JSON object, for tools. Times are in nanoseconds.
+void write_stats_json(FILE * f, const Stats * stats);
+// Add the stats of other VMs to stats1. Counts are summed, and maxima
+// taken; the times of stats1 itself are left alone.
 void aggregate_stats(Stats * stats1, const Stats * stats2);
 
 
@@ -38,31 +52,51 @@ void aggregate_stats(Stats * stats1, const Stats * stats2);
 
 #define STATS_INIT_STATS(stats)                 \
     memset(&stats, 0, sizeof(Stats));           \
-    stats.start_time  = clock();
+    stats.vms = 1;                              \
+    stats.start_time  = idris_clock_ns();
 
 #define STATS_ALLOC(stats, size)                \
     stats.allocations += size;                  \
     stats.alloc_count = stats.alloc_count + 1;
 
-#define STATS_ENTER_INIT(stats) clock_t _start_time = clock();
-#define STATS_LEAVE_INIT(stats) stats.init_time = clock() - _start_time;
+#define STATS_ENTER_INIT(stats) uint64_t _start_time = idris_clock_ns();
+#define STATS_LEAVE_INIT(stats) stats.init_time = idris_clock_ns() - _start_time;
 
-#define STATS_ENTER_EXIT(stats) clock_t _start_time = clock();
-#define STATS_LEAVE_EXIT(stats) stats.exit_time = clock() - _start_time;
+#define STATS_ENTER_EXIT(stats) uint64_t _start_time = idris_clock_ns();
+#define STATS_LEAVE_EXIT(stats) stats.exit_time = idris_clock_ns() - _start_time;
 
 #define STATS_ENTER_GC(stats, heap_size)                        \
-    clock_t _start_time = clock();                              \
+    uint64_t _start_time = idris_clock_ns();                    \
     stats.max_heap_size = MAX(stats.max_heap_size, heap_size);
+#define STATS_PAUSE(stats, pause)                               \
+    {                                                           \
+        uint64_t _us = (pause) / 1000;                          \
+        int _b = 0;                                             \
+        while (_b < STATS_PAUSE_BUCKETS - 1 && ((uint64_t)1 << _b) < _us) \
+            ++_b;                                               \
+        stats.pauses[_b]++;                                     \
+    }
 #define STATS_LEAVE_GC(stats, heap_size, heap_occuped)          \
-    clock_t _pause = clock() - _start_time;                     \
+    uint64_t _pause = idris_clock_ns() - _start_time;           \
     stats.gc_time += _pause;                                    \
     stats.max_gc_pause = MAX(_pause, stats.max_gc_pause);       \
+    STATS_PAUSE(stats, _pause)                                  \
     stats.max_heap_size = MAX(stats.max_heap_size, heap_size);  \
     stats.copied     += heap_occuped;                           \
     stats.collections = stats.collections + 1;
+#define STATS_MINOR_GC(stats)                                   \
+    stats.minor_collections = stats.minor_collections + 1;
+#define STATS_LEAVE_STEP(stats)                                 \
+    uint64_t _pause = idris_clock_ns() - _start_time;           \
+    stats.gc_time += _pause;                                    \
+    stats.max_gc_pause = MAX(_pause, stats.max_gc_pause);       \
+    STATS_PAUSE(stats, _pause)                                  \
+    stats.increments = stats.increments + 1;
 
 #else
-#define STATS_INIT_STATS(stats) memset(&stats, 0, sizeof(Stats));
+#define STATS_INIT_STATS(stats)                 \
+    memset(&stats, 0, sizeof(Stats));           \
+    stats.vms = 1;
 #define STATS_ENTER_INIT(stats)
 #define STATS_LEAVE_INIT(stats)
 #define STATS_ENTER_EXIT(stats)
@@ -71,6 +105,8 @@ void aggregate_stats(Stats * stats1, const Stats * stats2);
 #define STATS_ENTER_GC(stats, heap_size)
 #define STATS_LEAVE_GC(stats, heap_size, heap_occuped)  \
     stats.collections = stats.collections + 1;
+#define STATS_MINOR_GC(stats)
+#define STATS_LEAVE_STEP(stats)
 #endif // IDRIS_ENABLE_STATS
 
 #endif // _IDRIS_STATS_H
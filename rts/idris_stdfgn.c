@@ -2,6 +2,8 @@
 #include "idris_rts.h"
 #include "idris_gmp.h"
 #include "idris_gc.h"
+#include "idris_utf8.h"
+#include "idris_num.h"
 
 #include <fcntl.h>
 #include <errno.h>
@@ -14,12 +16,13 @@
 #include "windows/win_utils.h"
 #else
 #include <sys/select.h>
+#include <sys/uio.h>
 #endif
 
 extern char** environ;
 
 void putStr(char* str) {
-    printf("%s", str);
+    fputs(str, stdout);
 }
 
 void *fileOpen(char *name, char *mode) {
@@ -160,6 +163,88 @@ int idris_writeStr(void* h, char* str) {
     }
 }
 
+// Pieces at least this long skip the handle's buffer
+#define WRITE_DIRECT_MIN 8192
+// Pieces written by one writev
+#define WRITE_BATCH 16
+
+typedef struct {
+    FILE* f;
+#ifndef _WIN32
+    struct iovec batch[WRITE_BATCH];
+    int pending;
+#endif
+} StrWriter;
+
+#ifndef _WIN32
+// Write the batched pieces. The handle's buffer has been flushed already.
+static int writeBatch(StrWriter* w) {
+    int fd = fileno(w->f);
+    struct iovec* iov = w->batch;
+    int n = w->pending;
+    w->pending = 0;
+    while (n > 0) {
+        ssize_t done = writev(fd, iov, n);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        // Skip what was written, which may end part way into a piece
+        while (n > 0 && (size_t)done >= iov->iov_len) {
+            done -= iov->iov_len;
+            ++iov;
+            --n;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return 0;
+}
+#endif
+
+static int writePiece(const char* bytes, size_t len, void* env) {
+    StrWriter* w = (StrWriter*)env;
+#ifndef _WIN32
+    if (len >= WRITE_DIRECT_MIN) {
+        if (w->pending == 0 && fflush(w->f) != 0) {
+            return -1;
+        }
+        w->batch[w->pending].iov_base = (void*)bytes;
+        w->batch[w->pending].iov_len = len;
+        if (++w->pending == WRITE_BATCH) {
+            return writeBatch(w);
+        }
+        return 0;
+    }
+    if (w->pending > 0 && writeBatch(w) != 0) {
+        return -1;
+    }
+#endif
+    return fwrite(bytes, 1, len, w->f) == len ? 0 : -1;
+}
+
+int idris_writeString(void* h, VAL str) {
+    StrWriter w;
+    w.f = (FILE*)h;
+#ifndef _WIN32
+    w.pending = 0;
+    // Keep other threads' writes to the handle out from between the pieces
+    flockfile(w.f);
+#endif
+    int res = idris_strPieces(str, writePiece, &w);
+#ifndef _WIN32
+    if (res == 0 && w.pending > 0) {
+        res = writeBatch(&w);
+    }
+    funlockfile(w.f);
+#endif
+    return res;
+}
+
 int fpoll(void* h)
 {
 #ifdef _WIN32
@@ -261,34 +346,104 @@ void idris_forceGC(void* vm) {
     idris_gc((VM*)vm);
 }
 
+// The characters are kept after room for the headers of a large string, so
+// that a result long enough for the large object space is handed over
+// without copying. Shorter results are copied into the heap, once.
 typedef struct {
-    char* string;
-    int len;
+    char* block;
+    size_t len;
+    size_t capacity;
+    int ascii; // whether everything added so far is known to be ASCII
 } StrBuffer;
 
+#define STRBUF_HEADER (sizeof(LargeObject) + sizeof(String))
+#define STRBUF_MIN 64
+
+static char* strBufChars(StrBuffer* sb) {
+    return sb->block + STRBUF_HEADER;
+}
+
+// Make room for len more bytes, and the terminator, doubling as needed
+static char* strBufReserve(StrBuffer* sb, size_t len) {
+    if (sb->len + len + 1 > sb->capacity) {
+        size_t cap = sb->capacity < STRBUF_MIN ? STRBUF_MIN : sb->capacity;
+        while (cap < sb->len + len + 1) {
+            cap *= 2;
+        }
+        char* block = realloc(sb->block, STRBUF_HEADER + cap);
+        if (block == NULL) {
+            fprintf(stderr, "Out of memory in a string buffer\n");
+            exit(EXIT_FAILURE);
+        }
+        sb->block = block;
+        sb->capacity = cap;
+    }
+    return strBufChars(sb) + sb->len;
+}
+
+static void strBufAdd(StrBuffer* sb, const char* str, size_t len, int ascii) {
+    memcpy(strBufReserve(sb, len), str, len);
+    sb->len += len;
+    sb->ascii = sb->ascii && ascii;
+}
+
 void* idris_makeStringBuffer(int len) {
     StrBuffer* sb = malloc(sizeof(StrBuffer));
     if (sb != NULL) {
-        sb->string = malloc(len);
-        sb->string[0] = '\0';
+        sb->block = NULL;
         sb->len = 0;
+        sb->capacity = 0;
+        sb->ascii = 1;
+        strBufReserve(sb, len > 0 ? len : 0);
     }
     return sb;
 }
 
 void idris_addToString(void* buffer, char* str) {
+    strBufAdd((StrBuffer*)buffer, str, strlen(str), 0);
+}
+
+// Whether a string is known to be ASCII without counting it
+static int knownASCII(VAL str) {
+    if (GETTY(str) == CT_STROFFSET) {
+        str = (VAL)((StrOffset*)str)->base;
+    }
+    return (str->hdr.u16 & STR_ASCII) != 0;
+}
+
+void idris_appendString(void* buffer, VAL str) {
+    strBufAdd((StrBuffer*)buffer, GETSTR(str), GETSTRLEN(str), knownASCII(str));
+}
+
+void idris_appendChar(void* buffer, int c) {
     StrBuffer* sb = (StrBuffer*)buffer;
-    int len = strlen(str);
+    sb->len += idris_utf8_encode(c, strBufReserve(sb, 4));
+    sb->ascii = sb->ascii && c >= 0 && c < 0x80;
+}
 
-    memcpy(sb->string + sb->len, str, len+1);
-    sb->len += len;
+void idris_appendInt(void* buffer, i_int x) {
+    StrBuffer* sb = (StrBuffer*)buffer;
+    sb->len += idris_fmt_i64(strBufReserve(sb, IDRIS_INT_DIGITS), x);
+}
+
+void idris_appendDouble(void* buffer, double x) {
+    StrBuffer* sb = (StrBuffer*)buffer;
+    sb->len += idris_fmt_double(strBufReserve(sb, IDRIS_DOUBLE_DIGITS), x);
 }
 
 VAL idris_getString(VM* vm, void* buffer) {
     StrBuffer* sb = (StrBuffer*)buffer;
+    VAL str;
 
-    VAL str = MKSTR(vm, sb->string);
-    free(sb->string);
+    if (aligned(sizeof(String) + sb->len + 1) >= LARGE_OBJECT_MIN) {
+        // Trim to the exact size, which realloc can usually do in place
+        char* block = realloc(sb->block, STRBUF_HEADER + sb->len + 1);
+        str = MKSTRadopt(vm, block != NULL ? block : sb->block,
+                         sb->len, sb->ascii);
+    } else {
+        str = MKSTRlen(vm, strBufChars(sb), sb->len);
+        free(sb->block);
+    }
     free(sb);
     return str;
 }
@@ -35,13 +35,27 @@ int idris_dirError(void *dptr);
 
 // return 0 on success
 int idris_writeStr(void*h, char* str);
+// Write an Idris string, using its length rather than looking for a
+// terminator, so it may contain nulls. Concatenations are written a piece
+// at a time without being flattened. Short pieces go through the handle's
+// buffer, and large ones are written directly, several to a system call.
+// Returns 0 on success.
+int idris_writeString(void* h, VAL str);
 // construct a file error structure (see Prelude.File) from errno
 VAL idris_mkFileError(VM* vm);
 
-// Some machinery for building a large string without reallocating
-// Create a string with space for 'len' bytes
+// Some machinery for building a large string from pieces. The buffer
+// starts with space for 'len' bytes, and doubles whenever it runs out.
 void* idris_makeStringBuffer(int len);
 void idris_addToString(void* buffer, char* str);
+// Append an Idris string, without looking for its end
+void idris_appendString(void* buffer, VAL str);
+// Append a character, UTF8 encoded
+void idris_appendChar(void* buffer, int c);
+// Append a number, in decimal, or as prim__floatToStr formats it
+void idris_appendInt(void* buffer, i_int x);
+void idris_appendDouble(void* buffer, double x);
+// Make the string, and free the buffer
 VAL idris_getString(VM* vm, void* buffer);
 
 void* do_popen(const char* cmd, const char* mode);
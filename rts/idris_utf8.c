@@ -2,15 +2,229 @@
 #include <string.h>
 #include <stdlib.h>
 
+/* Vectorised kernels. Each one deals with as many whole blocks at the
+   start of its input as it can, and returns the number of bytes it dealt
+   with. The scalar code then carries on from there, so it handles the
+   tail, any null bytes, and anything else the kernel gives up on.
+
+   SSE2 is always available on x86-64, and AVX2 is used when the processor
+   has it. NEON is always available on AArch64. */
+
+// Does a character start at s[i]? A stray continuation byte after a block
+// belongs with the block's last character.
+#define UTF8_START(s, len, i) ((i) >= (len) || ((s)[i] & 0xc0) != 0x80)
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define UTF8_SSE2
+#include <immintrin.h>
+
+static int have_avx2(void) {
+    static int avx2 = -1;
+    if (avx2 < 0) {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2") != 0;
+    }
+    return avx2;
+}
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define UTF8_NEON
+#include <arm_neon.h>
+#endif
+
+#ifdef UTF8_SSE2
+// Continuation bytes, 0x80 to 0xbf, are the ones less than -64 as signed bytes.
+
+static size_t count_sse2(const char *s, size_t len, size_t *chars, int *high) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i cont = _mm_set1_epi8(-64);
+    size_t i;
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero))) break;
+        *high |= _mm_movemask_epi8(v);
+        *chars += 16 - __builtin_popcount(_mm_movemask_epi8(_mm_cmplt_epi8(v, cont)));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t count_avx2(const char *s, size_t len, size_t *chars, int *high) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i cont = _mm256_set1_epi8(-64);
+    size_t i;
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(s + i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero))) break;
+        *high |= _mm256_movemask_epi8(v);
+        // No signed byte compare for less than, so swap the arguments
+        *chars += 32 - __builtin_popcount((unsigned)_mm256_movemask_epi8(_mm256_cmpgt_epi8(cont, v)));
+    }
+    return i;
+}
+
+static size_t offset_sse2(const char *s, size_t len, size_t *skip) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i cont = _mm_set1_epi8(-64);
+    size_t i;
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero))) break;
+        size_t n = 16 - __builtin_popcount(_mm_movemask_epi8(_mm_cmplt_epi8(v, cont)));
+        if (n > *skip) break;
+        *skip -= n;
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t offset_avx2(const char *s, size_t len, size_t *skip) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i cont = _mm256_set1_epi8(-64);
+    size_t i;
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(s + i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero))) break;
+        size_t n = 32 - __builtin_popcount((unsigned)_mm256_movemask_epi8(_mm256_cmpgt_epi8(cont, v)));
+        if (n > *skip) break;
+        *skip -= n;
+    }
+    return i;
+}
+
+// Reverse blocks of ASCII, writing each one so that it ends at end
+static size_t rev_sse2(const char *s, size_t len, char *end) {
+    size_t i;
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        if (_mm_movemask_epi8(v) || !UTF8_START(s, len, i + 16)) break;
+        v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i*)(end - i - 16), v);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t rev_avx2(const char *s, size_t len, char *end) {
+    const __m256i rev = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+                                         7, 6, 5, 4, 3, 2, 1, 0,
+                                         15, 14, 13, 12, 11, 10, 9, 8,
+                                         7, 6, 5, 4, 3, 2, 1, 0);
+    size_t i;
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(s + i));
+        if (_mm256_movemask_epi8(v) || !UTF8_START(s, len, i + 32)) break;
+        v = _mm256_shuffle_epi8(v, rev);
+        v = _mm256_permute2x128_si256(v, v, 1);
+        _mm256_storeu_si256((__m256i*)(end - i - 32), v);
+    }
+    return i;
+}
+
+static size_t count_blocks(const char *s, size_t len, size_t *chars, int *high) {
+    return have_avx2() ? count_avx2(s, len, chars, high)
+                       : count_sse2(s, len, chars, high);
+}
+
+static size_t offset_blocks(const char *s, size_t len, size_t *skip) {
+    return have_avx2() ? offset_avx2(s, len, skip) : offset_sse2(s, len, skip);
+}
+
+static size_t rev_blocks(const char *s, size_t len, char *end) {
+    return have_avx2() ? rev_avx2(s, len, end) : rev_sse2(s, len, end);
+}
+
+#elif defined(UTF8_NEON)
+
+static size_t count_blocks(const char *s, size_t len, size_t *chars, int *high) {
+    const uint8x16_t one = vdupq_n_u8(1);
+    size_t i;
+    for (i = 0; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)(s + i));
+        if (vminvq_u8(v) == 0) break;
+        *high |= vmaxvq_u8(v) >= 0x80;
+        // Continuation bytes are 10xxxxxx
+        uint8x16_t c = vceqq_u8(vandq_u8(v, vdupq_n_u8(0xc0)), vdupq_n_u8(0x80));
+        *chars += 16 - vaddvq_u8(vandq_u8(c, one));
+    }
+    return i;
+}
+
+static size_t offset_blocks(const char *s, size_t len, size_t *skip) {
+    const uint8x16_t one = vdupq_n_u8(1);
+    size_t i;
+    for (i = 0; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)(s + i));
+        if (vminvq_u8(v) == 0) break;
+        uint8x16_t c = vceqq_u8(vandq_u8(v, vdupq_n_u8(0xc0)), vdupq_n_u8(0x80));
+        size_t n = 16 - vaddvq_u8(vandq_u8(c, one));
+        if (n > *skip) break;
+        *skip -= n;
+    }
+    return i;
+}
+
+static size_t rev_blocks(const char *s, size_t len, char *end) {
+    size_t i;
+    for (i = 0; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)(s + i));
+        if (vmaxvq_u8(v) >= 0x80 || !UTF8_START(s, len, i + 16)) break;
+        v = vrev64q_u8(v);
+        v = vextq_u8(v, v, 8);
+        vst1q_u8((uint8_t*)(end - i - 16), v);
+    }
+    return i;
+}
+
+#else
+
+static size_t count_blocks(const char *s, size_t len, size_t *chars, int *high) {
+    return 0;
+}
+
+static size_t offset_blocks(const char *s, size_t len, size_t *skip) {
+    return 0;
+}
+
+static size_t rev_blocks(const char *s, size_t len, char *end) {
+    return 0;
+}
+
+#endif
+
 int idris_utf8_strlen(char *s) {
-   int i = 0, j = 0;
-   while (s[i]) {
+   int ascii;
+   return idris_utf8_count(s, strlen(s), &ascii);
+}
+
+size_t idris_utf8_count(const char *s, size_t len, int *ascii) {
+   size_t j = 0;
+   int high = 0;
+   size_t i = count_blocks(s, len, &j, &high);
+   int plain = !high;
+   for (; i < len && s[i]; i++) {
      if ((s[i] & 0xc0) != 0x80) j++;
-     i++;
+     if (s[i] & 0x80) plain = 0;
    }
+   *ascii = plain && i == len;
    return j;
 }
 
+size_t idris_utf8_offset(const char *s, size_t len, size_t i) {
+    size_t pos = offset_blocks(s, len, &i);
+    // As idris_utf8_advance, from here on
+    while (i > 0 && pos < len && s[pos] != '\0') {
+        if ((s[pos] & 0xc0) != 0x80) {
+            i--;
+        }
+        pos++;
+    }
+    while (pos < len && (s[pos] & 0xc0) == 0x80) { pos++; }
+    return pos;
+}
+
 int idris_utf8_charlen(char* s) {
     int init = (int)s[0];
     if ((init & 0x80) == 0) {
@@ -114,15 +328,12 @@ int idris_utf8_findOffset(char* str, int i) {
 }
 
 
-char* idris_utf8_fromChar(int x) {
-    char* str;
+size_t idris_utf8_encode(int x, char* buf) {
     int bytes = 0, top = 0;
 
     if (x < 0x80) {
-        str = malloc(2);
-        str[0] = (char)x;
-        str[1] = '\0';
-        return str;
+        buf[0] = (char)x;
+        return 1;
     }
 
     if (x >= 0x80 && x <= 0x7ff) {
@@ -136,45 +347,40 @@ char* idris_utf8_fromChar(int x) {
         top = 0xf0;
     }
 
-    str = malloc(bytes + 1);
-    str[bytes] = '\0';
+    size_t len = bytes;
     while(bytes > 0) {
         int xbits = x & 0x3f; // Next 6 bits
         bytes--;
         if (bytes > 0) {
-            str[bytes] = (char)xbits + 0x80;
+            buf[bytes] = (char)xbits + 0x80;
         } else {
-            str[0] = (char)xbits + top;
+            buf[0] = (char)xbits + top;
         }
         x = x >> 6;
     }
-
-    return str;
+    return len;
 }
 
-void reverse_range(char *start, char *end)
-{
-    while(start < end)
-    {
-        char c = *start;
-        *start++ = *end;
-        *end-- = c;
-    }
-}
-
-char* reverse_char(char *start)
-{
-    char *end = start;
-    while((end[1] & 0xc0) == 0x80) { end++; }
-    reverse_range(start, end);
-    return(end + 1);
+char* idris_utf8_fromChar(int x) {
+    char* str = malloc(5);
+    str[idris_utf8_encode(x, str)] = '\0';
+    return str;
 }
 
 char* idris_utf8_rev(char* s, char* result) {
-    strcpy(result, s);
-    char* end = result;
-    while(*end) { end = reverse_char(end); }
-    reverse_range(result, end-1);
+    size_t len = strlen(s);
+    size_t i = 0;
+    result[len] = '\0';
+    while (i < len) {
+        i += rev_blocks(s + i, len - i, result + len - i);
+        // Characters at a time, for at least a block's worth
+        size_t stop = i + 32;
+        while (i < len && i < stop) {
+            size_t n = 1;
+            while (i + n < len && (s[i + n] & 0xc0) == 0x80) { n++; }
+            memcpy(result + len - i - n, s + i, n);
+            i += n;
+        }
+    }
     return result;
 }
-
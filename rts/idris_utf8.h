@@ -6,13 +6,22 @@
    correctness.) Nevertheless, they mean that we can treat Strings as
    UFT8. Patches welcome :). */
 
+#include <stddef.h>
+
 // Get length of a UTF8 encoded string in characters
 int idris_utf8_strlen(char *s);
+// Get length in characters of the first len bytes of a UTF8 encoded string,
+// stopping early at a null byte like idris_utf8_strlen. Sets *ascii if they
+// are all non-null ASCII characters, so characters and bytes coincide.
+size_t idris_utf8_count(const char *s, size_t len, int *ascii);
 // Get number of bytes the first character takes in a string
 int idris_utf8_charlen(char* s);
 // Return int representation of string at an index.
 // Assumes in bounds.
 unsigned idris_utf8_index(char* s, int j);
+// Write the UTF8 encoding of a char, which is at most 4 bytes, to buf.
+// Return the number of bytes written, which is 0 if it is past 0x10ffff.
+size_t idris_utf8_encode(int x, char* buf);
 // Convert a char as an integer to a char* as a byte sequence
 // Null terminated; caller responsible for freeing
 char* idris_utf8_fromChar(int x);
@@ -23,4 +32,7 @@ char* idris_utf8_rev(char* s, char* result);
 char* idris_utf8_advance(char* str, int i);
 // Return the offset of the ith UTF8 character in the string
 int idris_utf8_findOffset(char* str, int i);
+// Return the offset of the ith UTF8 character in the first len bytes of a
+// string, as idris_utf8_advance would, or len if there aren't that many.
+size_t idris_utf8_offset(const char *s, size_t len, size_t i);
 #endif
@@ -14,7 +14,6 @@ RTSOpts opts = {
 int main() {
     VM* vm = init_vm(opts.max_stack_size, opts.init_heap_size, 1);
     init_gmpalloc();
-    init_nullaries();
 
     _idris__123_runMain_95_0_125_(vm, NULL);
 
@@ -18,13 +18,22 @@ import IRTS.System
 
 import Util.System
 
+import Control.Concurrent.Async (mapConcurrently)
+import Control.Concurrent.QSem
+import Control.Exception (bracket_, finally)
 import Control.Monad
 import Data.Bits
 import Data.Char
-import Data.List (intercalate, nubBy)
+import Data.Function (on)
+import Data.List (foldl', groupBy, intercalate, isPrefixOf, nubBy, sort, sortOn)
+import qualified Data.Map.Strict as M
+import qualified Data.Set as S
+import Data.Word
 import Numeric
+import System.Directory
 import System.Exit
-import System.FilePath ((<.>), (</>))
+import System.FilePath (takeDirectory, takeExtension, takeFileName, (<.>),
+                        (</>))
 import System.IO
 import System.Process
 
@@ -62,20 +71,18 @@ codegenC' defs out exec incs objs libs flags exports iface dbg
          let bc = map toBC defs
          let wrappers = genWrappers bc
          let h = concatMap toDecl (map fst bc)
-         let cc = concatMap (uncurry toC) bc
+         let cc = concat (zipWith (\site (f, code) -> toC (show site) f code)
+                                  [0..] bc)
          let hi = concatMap ifaceC (concatMap getExp exports)
          d <- getIdrisCRTSDir
          mprog <- readFile (d </> "idris_main" <.> "c")
+         let mainc = programId (h ++ cc) ++ applyName ++
+                     profSites (map fst bc) ++ mprog
          let cout = headers incs ++ debug dbg ++ h ++ wrappers ++ cc ++
-                     (if (exec == Executable) then mprog else hi)
+                     (if (exec == Executable) then mainc else hi)
          case exec of
            Raw -> writeSource out cout
            _ -> do
-             (tmpn, tmph) <- tempfile ".c"
-             hSetEncoding tmph utf8
-             hPutStr tmph cout
-             hFlush tmph
-             hClose tmph
              comp <- getCC
              libFlags <- getLibFlags
              incFlags <- getIncFlags
@@ -83,31 +90,172 @@ codegenC' defs out exec incs objs libs flags exports iface dbg
              let stripFlag = if isDarwin then "-dead_strip" else "-Wl,-gc-sections"
              let stackFlags = if isWindows then ["-Wl,--stack,16777216"] else []
              let linkFlags = stripFlag : stackFlags
-             let args = gccDbg dbg ++
-                        gccFlags iface ++
-                        -- # Any flags defined here which alter the RTS API must also be added to config.mk
-                        [ "-std=c99", "-pipe"
-                        , "-fdata-sections", "-ffunction-sections"
-                        , "-D_POSIX_C_SOURCE=200809L", "-DHAS_PTHREAD", "-DIDRIS_ENABLE_STATS"
-                        , "-I."] ++ objs ++ envFlags ++
-                        (if (exec == Executable) then linkFlags else ["-c"]) ++
-                        [tmpn] ++
-                        (if not iface then libFlags else []) ++
-                        incFlags ++
-                        (if not iface then libs else []) ++
-                        flags ++
-                        ["-o", out]
---              putStrLn (show args)
-             exit <- rawSystem comp args
-             when (exit /= ExitSuccess) $
-                putStrLn ("FAILURE: " ++ show comp ++ " " ++ show args)
+             let ccFlags = gccDbg dbg ++
+                           gccFlags iface ++
+                           -- # Any flags defined here which alter the RTS API must also be added to config.mk
+                           [ "-std=c99", "-pipe"
+                           , "-fdata-sections", "-ffunction-sections"
+                           , "-D_POSIX_C_SOURCE=200809L", "-DHAS_PTHREAD", "-DIDRIS_ENABLE_STATS"
+                           , "-I."]
+             let link srcs = ccFlags ++ objs ++ envFlags ++
+                             (if (exec == Executable) then linkFlags else ["-c"]) ++
+                             srcs ++
+                             (if not iface then libFlags else []) ++
+                             incFlags ++
+                             (if not iface then libs else []) ++
+                             flags ++
+                             ["-o", out]
+             if exec == Executable && length cc > unitSize
+                then do
+                  -- Too big to compile quickly in one go, so compile the
+                  -- functions in pieces, in parallel, and link them with the
+                  -- rest in the usual way. The main file numbers the
+                  -- profiling sites, so that a new function doesn't change
+                  -- the code of every piece after it.
+                  let unitFlags = ccFlags ++ envFlags ++
+                                  filter (not . linkOnly)
+                                         (libFlags ++ incFlags ++ libs ++ flags)
+                  let hdrs = headers incs ++ debug dbg
+                  (dir, protos) <- writeDecls hdrs h
+                  flip finally (removeDirectoryRecursive dir) $ do
+                    let fns = [(f, unitC f code) | (f, code) <- bc]
+                    ok <- compileUnits comp unitFlags hdrs dir protos
+                                       (splitUnits fns)
+                    case ok of
+                      Nothing -> return ()
+                      Just unitObjs -> do
+                        mainn <- writeTemp ".c" (declsInclude ++ wrappers ++
+                                                 siteIds (map fst bc) ++ mainc)
+                        runCC comp (link (unitObjs ++ ["-I" ++ dir, mainn]))
+                        return ()
+                else do
+                  tmpn <- writeTemp ".c" cout
+                  runCC comp (link [tmpn])
+                  return ()
   where
     getExp (Export _ _ exp) = exp
+    linkOnly a = "-l" `isPrefixOf` a || "-L" `isPrefixOf` a
+
+-- | Run the C compiler, reporting whether it succeeded
+runCC :: String -> [String] -> IO Bool
+runCC comp args
+    = do -- putStrLn (show args)
+         exit <- rawSystem comp args
+         when (exit /= ExitSuccess) $
+            putStrLn ("FAILURE: " ++ show comp ++ " " ++ show args)
+         return (exit == ExitSuccess)
+
+writeTemp :: String -> String -> IO FilePath
+writeTemp ext code
+    = do (tmpn, tmph) <- tempfile ext
+         hSetEncoding tmph utf8
+         hPutStr tmph code
+         hFlush tmph
+         hClose tmph
+         return tmpn
+
+-- | Programs which generate more C than this are compiled in pieces
+unitSize :: Int
+unitSize = 256 * 1024
+
+-- | Cut the functions into pieces to compile separately: one for each
+-- module, with big modules cut again into pieces of about unitSize. An edit
+-- to one module leaves the pieces of the others as they were, so their
+-- objects can be reused from the cache.
+splitUnits :: [(Name, String)] -> [[(Name, String)]]
+splitUnits fns = concatMap (cut 0 []) (groupBy ((==) `on` (modOf . fst))
+                                               (sortOn (modOf . fst) fns))
+  where
+    modOf (NS _ ns) = ns
+    modOf _ = []
+
+    cut _ acc [] = [reverse acc | not (null acc)]
+    cut sz acc (f@(_, c) : fs)
+        | sz + length c > unitSize && not (null acc)
+            = reverse acc : cut 0 [] (f : fs)
+        | otherwise = cut (sz + length c) (f : acc) fs
+
+declsHeader :: FilePath
+declsHeader = "idris_decls.h"
+
+declsInclude :: String
+declsInclude = "#include \"" ++ declsHeader ++ "\"\n\n"
+
+-- | Write the header which every piece includes, with the prototypes of all
+-- the functions, into a new directory for the pieces. Also returns the
+-- prototype of each function by its C name.
+writeDecls :: String -> String -> IO (FilePath, M.Map String String)
+writeDecls hdrs decls
+    = do dir <- createTempDirectory "idris-c"
+         withFile (dir </> declsHeader) WriteMode $ \hdl ->
+             do hSetEncoding hdl utf8
+                hPutStr hdl (hdrs ++ decls ++ "void* _idris_get_wrapper(VAL con);\n")
+         return (dir, M.fromList [(takeWhile (/= '(') (drop 6 l), l) | l <- lines decls])
+
+-- | Compile each piece to an object, running up to getCCJobs compilers at
+-- once. With IDRIS_CC_CACHE set, objects are kept there, named by a hash of
+-- everything which went into them, and used again when nothing has changed.
+-- Returns the objects, or Nothing if any piece failed to compile.
+compileUnits :: String -> [String] -> String -> FilePath ->
+                M.Map String String -> [[(Name, String)]] -> IO (Maybe [FilePath])
+compileUnits comp cflags hdrs dir protos units
+    = do jobs <- getCCJobs
+         cache <- getCCCache
+         rtsKey <- rtsHeaders
+         -- A different compiler, or version of it, makes different objects
+         version <- catchIO (readProcess comp ["--version"] "")
+                            (\_ -> return "")
+         sem <- newQSem jobs
+         let prefix = unlines (comp : version : cflags) ++ rtsKey ++ hdrs
+         objs <- mapConcurrently (bracket_ (waitQSem sem) (signalQSem sem) .
+                                  compileUnit cache prefix) units
+         return (sequence objs)
+  where
+    compileUnit cache prefix fns
+        = do let code = concatMap snd fns
+             -- Only the prototypes the piece uses can affect its object
+             let used = S.fromList (filter ("_idris_" `isPrefixOf`) (idents code))
+             let key = prefix ++ concat (M.elems (M.filterWithKey
+                                                    (\f _ -> S.member f used)
+                                                    protos)) ++ code
+             let name = showHex (fnv1a key) ""
+             let src = dir </> name <.> "c"
+             let obj = maybe dir id cache </> name <.> "o"
+             cached <- doesFileExist obj
+             if cached
+                then return (Just obj)
+                else do
+                  writeSource src (declsInclude ++ code)
+                  let tmpo = dir </> name <.> "o"
+                  ok <- runCC comp (cflags ++ ["-I" ++ dir, "-c", src, "-o", tmpo])
+                  if not ok
+                     then return Nothing
+                     else do when (tmpo /= obj) $ store tmpo obj
+                             return (Just obj)
+
+    -- Other builds may be using the cache at the same time, so an object
+    -- only appears there once it's complete
+    store tmpo obj
+        = do createDirectoryIfMissing True (takeDirectory obj)
+             (part, h) <- openTempFile (takeDirectory obj)
+                                       (takeFileName obj <.> "part")
+             hClose h
+             copyFile tmpo part
+             renameFile part obj
+
+    idents = words . map (\c -> if isAlphaNum c || c == '_' then c else ' ')
+
+    -- The RTS headers go into every piece, so a new RTS means new objects
+    rtsHeaders = do rts <- getIdrisCRTSDir
+                    hs <- sort . filter ((== ".h") . takeExtension) <$>
+                            getDirectoryContents rts
+                    concat <$> mapM (readSourceStrict . (rts </>)) hs
 
 headers xs =
   concatMap
     (\h -> "#include \"" ++ h ++ "\"\n")
-    (xs ++ ["idris_rts.h", "idris_bitstring.h", "idris_stdfgn.h"])
+    (xs ++ ["idris_rts.h", "idris_bitstring.h", "idris_stdfgn.h", "idris_prof.h",
+           "idris_image.h"])
 
 debug TRACE = "#define IDRIS_TRACE\n\n"
 debug _ = ""
@@ -136,13 +284,58 @@ creg Tmp = "REG1"
 toDecl :: Name -> String
 toDecl f = "void* " ++ cname f ++ "(VM*, VAL*);\n"
 
-toC :: Name -> [BC] -> String
-toC f code
+-- | The site is the function's index in the table written by profSites, for
+-- counting the constructors it allocates when compiled with IDRIS_PROFILE
+toC :: String -> Name -> [BC] -> String
+toC site f code
     = -- "/* " ++ show code ++ "*/\n\n" ++
       "void* " ++ cname f ++ "(VM* vm, VAL* oldbase) {\n" ++
+                  indent 1 ++ "PROF_FUNCTION(" ++ site ++ ")\n" ++
                   indent 1 ++ "INITFRAME;\nloop:\n" ++
                   concatMap (bcc f 1) code ++ "}\n\n"
 
+-- | A function to compile separately, which finds its site in a constant
+-- defined by siteIds
+unitC :: Name -> [BC] -> String
+unitC f code = "extern const int " ++ siteName f ++ ";\n" ++
+               toC (siteName f) f code
+
+siteName :: Name -> String
+siteName f = cname f ++ "_site"
+
+siteIds :: [Name] -> String
+siteIds fs
+    = "#ifdef IDRIS_PROFILE\n" ++
+      concat (zipWith (\site f -> "const int " ++ siteName f ++ " = " ++
+                                  show site ++ ";\n") [0 :: Int ..] fs) ++
+      "#endif\n\n"
+
+-- | Names of the allocation sites for the heap profiler, one per function
+profSites :: [Name] -> String
+profSites fs
+    = "#ifdef IDRIS_PROFILE\n" ++
+      "#define IDRIS_PROF_SITES " ++ show (length fs) ++ "\n" ++
+      "static const char* idris_prof_sites[] = {\n" ++
+      concatMap (\f -> indent 1 ++ showCStr (showCG f) ++ ",\n") fs ++
+      "};\n#endif\n\n"
+
+-- | A hash (FNV-1a) of the generated code, which heap images record so that
+-- one program never loads an image saved by another
+programId :: String -> String
+programId code
+    = "#define IDRIS_PROGRAM_ID 0x" ++ showHex (fnv1a code) "ULL\n\n"
+
+-- | FNV-1a hash of a string
+fnv1a :: String -> Word64
+fnv1a = foldl' step 14695981039346656037
+  where
+    step h c = (h `xor` fromIntegral (ord c)) * 1099511628211
+
+-- | The function which applies a closure to an argument, which the RTS
+-- calls itself to run closures on the data parallel worker threads
+applyName :: String
+applyName = "#define IDRIS_APPLY " ++ cname (sMN 0 "APPLY") ++ "\n\n"
+
 showCStr :: String -> String
 showCStr s = '"' : foldr ((++) . showChar) "\"" s
   where
@@ -177,8 +370,30 @@ showCStr s = '"' : foldr ((++) . showChar) "\"" s
                  2 -> s
                  _ -> error $ "Can't happen: String of invalid length " ++ show s
 
+-- | The number of bytes in the UTF-8 encoding of a string, as written out by
+-- showCStr
+utf8Length :: String -> Int
+utf8Length = sum . map (bytes . ord)
+  where bytes c | c <= 0x7f   = 1
+                | c <= 0x7ff  = 2
+                | c <= 0xffff = 3
+                | otherwise   = 4
+
+-- | Whether a case alternative matches a nullary constructor. Every
+-- alternative starts by projecting the constructor's arguments.
+nullaryAlt :: [BC] -> Bool
+nullaryAlt (PROJECT _ _ 0 : _) = True
+nullaryAlt _ = False
+
 bcc :: Name -> Int -> BC -> String
 bcc f i (ASSIGN l r) = indent i ++ creg l ++ " = " ++ creg r ++ ";\n"
+-- String literals are allocated statically, once, rather than copied into
+-- the heap each time they're evaluated
+bcc f i (ASSIGNCONST l (Str s))
+    = indent i ++ "{ STATIC_STRING(lit, " ++ show (utf8Length s) ++ ", " ++
+      show (length s) ++ ", " ++ flags ++ ", " ++ showCStr s ++ "); " ++
+      creg l ++ " = (VAL)&lit; }\n"
+  where flags = if all isAscii s then "STR_ASCII" else "0"
 bcc f i (ASSIGNCONST l c)
     = indent i ++ creg l ++ " = " ++ mkConst c ++ ";\n"
   where
@@ -189,7 +404,6 @@ bcc f i (ASSIGNCONST l c)
                         else "MKBIGC(vm,\"" ++ show i ++ "\")"
     mkConst (Fl f) = "MKFLOAT(vm, " ++ (map toUpper $ show f) ++ ")"
     mkConst (Ch c) = "MKINT(" ++ show (fromEnum c) ++ ")"
-    mkConst (Str s) = "MKSTR(vm, " ++ showCStr s ++ ")"
     mkConst (B8  x) = "idris_b8const(vm, "  ++ show x ++ "U)"
     mkConst (B16 x) = "idris_b16const(vm, " ++ show x ++ "U)"
     mkConst (B32 x) = "idris_b32const(vm, " ++ show x ++ "UL)"
@@ -201,7 +415,7 @@ bcc f i (ASSIGNCONST l c)
     mkConst c = error $ "mkConst of (" ++ show c ++ ") not implemented"
 
 bcc f i (UPDATE l r) = indent i ++ creg l ++ " = " ++ creg r ++ ";\n"
-bcc f i (MKCON l loc tag []) | tag < 256
+bcc f i (MKCON l loc tag [])
     = indent i ++ creg l ++ " = NULL_CON(" ++ show tag ++ ");\n"
 bcc f i (MKCON l loc tag args)
     = indent i ++ alloc loc tag ++
@@ -212,9 +426,9 @@ bcc f i (MKCON l loc tag args)
                              "); " ++ setArgs (i + 1) xs
         alloc Nothing tag
             = "allocCon(" ++ creg Tmp ++ ", vm, " ++ show tag ++ ", " ++
-                    show (length args) ++ ", 0);\n"
+                    show (length args) ++ ", 0); PROF_CON(" ++ creg Tmp ++ ");\n"
         alloc (Just old) tag
-            = "updateCon(" ++ creg Tmp ++ ", " ++ creg old ++ ", " ++ show tag ++ ", " ++
+            = "updateCon(" ++ creg Tmp ++ ", vm, " ++ creg old ++ ", " ++ show tag ++ ", " ++
                     show (length args) ++ ");\n"
 
 bcc f i (PROJECT l loc a) = indent i ++ "PROJECT(vm, " ++ creg l ++ ", " ++ show loc ++
@@ -238,16 +452,22 @@ bcc f i (CASE True r code def)
     showCase i Nothing [(t, c)] = indent i ++ showCode i c
     showCase i (Just def) [] = indent i ++ showCode i def
     showCase i def ((t, c) : cs)
-        = indent i ++ "if (CTAG(" ++ creg r ++ ") == " ++ show t ++ ") " ++ showCode i c
+        = indent i ++ "if (" ++ isTag t c ++ ") " ++ showCode i c
            ++ indent i ++ "else\n" ++ showCase i def cs
 
+    -- Nullary constructors are immediate, so can be compared directly
+    isTag t c | nullaryAlt c = creg r ++ " == NULL_CON(" ++ show t ++ ")"
+              | otherwise = "CTAG(" ++ creg r ++ ") == " ++ show t
+
 bcc f i (CASE safe r code def)
     = indent i ++ "switch(" ++ ctag safe ++ "(" ++ creg r ++ ")) {\n" ++
       concatMap (showCase i) code ++
       showDef i def ++
       indent i ++ "}\n"
   where
-    ctag True = "CTAG"
+    -- If every constructor is nullary, the tag is in the value itself
+    ctag True | Nothing <- def, all (nullaryAlt . snd) code = "NULLARYTAG"
+              | otherwise = "CTAG"
     ctag False = "TAG"
 
     showCase i (t, bc) = indent i ++ "case " ++ show t ++ ":\n"
@@ -427,13 +647,6 @@ bitCoerce v op input output arg
 signedTy :: NativeTy -> String
 signedTy t = "int" ++ show (nativeTyWidth t) ++ "_t"
 
--- Need to ensure we have enough spare *before* GMP operations because they
--- use the idris allocator but outside our control, and if it GCs in the middle
--- then things get moved which leads to trouble...
--- I'm just guessing how much it'll need. This is a TMP HACK. Sorry.
-wrapGMP op
-   = "idris_requireAlloc(vm, 65536); " ++ op ++ "; idris_doneAlloc(vm)"
-
 doOp v (LPlus (ATInt ITNative)) [l, r] = v ++ "ADD(" ++ creg l ++ ", " ++ creg r ++ ")"
 doOp v (LMinus (ATInt ITNative)) [l, r] = v ++ "INTOP(-," ++ creg l ++ ", " ++ creg r ++ ")"
 doOp v (LTimes (ATInt ITNative)) [l, r] = v ++ "MULT(" ++ creg l ++ ", " ++ creg r ++ ")"
@@ -494,21 +707,21 @@ doOp v (LSGe ATFloat) [l, r] = v ++ "FLOATBOP(>=," ++ creg l ++ ", " ++ creg r +
 
 doOp v (LIntFloat ITBig) [x] = v ++ "idris_castBigFloat(vm, " ++ creg x ++ ")"
 doOp v (LFloatInt ITBig) [x] = v ++ "idris_castFloatBig(vm, " ++ creg x ++ ")"
-doOp v (LPlus (ATInt ITBig)) [l, r] = wrapGMP $ v ++ "idris_bigPlus(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
-doOp v (LMinus (ATInt ITBig)) [l, r] = wrapGMP $ v ++ "idris_bigMinus(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
-doOp v (LTimes (ATInt ITBig)) [l, r] = wrapGMP $ v ++ "idris_bigTimes(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
-doOp v (LSDiv (ATInt ITBig)) [l, r] = wrapGMP $ v ++ "idris_bigDivide(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
-doOp v (LSRem (ATInt ITBig)) [l, r] = wrapGMP $ v ++ "idris_bigMod(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
-doOp v (LAnd ITBig) [l, r] = wrapGMP $ v ++ "idris_bigAnd(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
-doOp v (LOr ITBig) [l, r] = wrapGMP $ v ++ "idris_bigOr(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
-doOp v (LSHL ITBig) [l, r] = wrapGMP $ v ++ "idris_bigShiftLeft(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
-doOp v (LLSHR ITBig) [l, r] = wrapGMP $ v ++ "idris_bigLShiftRight(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
-doOp v (LASHR ITBig) [l, r] = wrapGMP $ v ++ "idris_bigAShiftRight(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
-doOp v (LEq (ATInt ITBig)) [l, r] = wrapGMP $ v ++ "idris_bigEq(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
-doOp v (LSLt (ATInt ITBig)) [l, r] = wrapGMP $ v ++ "idris_bigLt(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
-doOp v (LSLe (ATInt ITBig)) [l, r] = wrapGMP $ v ++ "idris_bigLe(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
-doOp v (LSGt (ATInt ITBig)) [l, r] = wrapGMP $ v ++ "idris_bigGt(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
-doOp v (LSGe (ATInt ITBig)) [l, r] = wrapGMP $ v ++ "idris_bigGe(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
+doOp v (LPlus (ATInt ITBig)) [l, r] = v ++ "idris_bigPlus(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
+doOp v (LMinus (ATInt ITBig)) [l, r] = v ++ "idris_bigMinus(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
+doOp v (LTimes (ATInt ITBig)) [l, r] = v ++ "idris_bigTimes(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
+doOp v (LSDiv (ATInt ITBig)) [l, r] = v ++ "idris_bigDivide(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
+doOp v (LSRem (ATInt ITBig)) [l, r] = v ++ "idris_bigMod(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
+doOp v (LAnd ITBig) [l, r] = v ++ "idris_bigAnd(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
+doOp v (LOr ITBig) [l, r] = v ++ "idris_bigOr(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
+doOp v (LSHL ITBig) [l, r] = v ++ "idris_bigShiftLeft(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
+doOp v (LLSHR ITBig) [l, r] = v ++ "idris_bigLShiftRight(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
+doOp v (LASHR ITBig) [l, r] = v ++ "idris_bigAShiftRight(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
+doOp v (LEq (ATInt ITBig)) [l, r] = v ++ "idris_bigEq(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
+doOp v (LSLt (ATInt ITBig)) [l, r] = v ++ "idris_bigLt(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
+doOp v (LSLe (ATInt ITBig)) [l, r] = v ++ "idris_bigLe(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
+doOp v (LSGt (ATInt ITBig)) [l, r] = v ++ "idris_bigGt(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
+doOp v (LSGe (ATInt ITBig)) [l, r] = v ++ "idris_bigGe(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
 
 doOp v (LIntFloat ITNative) [x] = v ++ "idris_castIntFloat(" ++ creg x ++ ")"
 doOp v (LFloatInt ITNative) [x] = v ++ "idris_castFloatInt(" ++ creg x ++ ")"
@@ -610,9 +823,8 @@ doOp v LStrEq [l,r] = v ++ "idris_streq(vm, " ++ creg l ++ ", " ++ creg r ++ ")"
 
 doOp v LReadStr [_] = v ++ "idris_readStr(vm, stdin)"
 doOp v LWriteStr [_,s]
-             = v ++ "MKINT((i_int)(idris_writeStr(stdout"
-                 ++ ",GETSTR("
-                 ++ creg s ++ "))))"
+             = v ++ "MKINT((i_int)(idris_writeString(stdout, "
+                 ++ creg s ++ ")))"
 
 
 -- String functions which need to know we're UTF8
@@ -645,9 +857,8 @@ doOp v (LExternal rf) [_,len,x]
                                 "), GETPTR(" ++ creg x ++ "))"
 doOp v (LExternal wf) [_,x,s]
    | wf == sUN "prim__writeFile"
-       = v ++ "MKINT((i_int)(idris_writeStr(GETPTR(" ++ creg x
-                              ++ "),GETSTR("
-                              ++ creg s ++ "))))"
+       = v ++ "MKINT((i_int)(idris_writeString(GETPTR(" ++ creg x
+                              ++ "), " ++ creg s ++ ")))"
 doOp v (LExternal si) [] | si == sUN "prim__stdin" = v ++ "MKPTR(vm, stdin)"
 doOp v (LExternal so) [] | so == sUN "prim__stdout" = v ++ "MKPTR(vm, stdout)"
 doOp v (LExternal se) [] | se == sUN "prim__stderr" = v ++ "MKPTR(vm, stderr)"
@@ -838,7 +1049,7 @@ genWrapper (desc, tag) =  ret ++ " " ++ wrapperName tag ++ "(" ++
                           indent 1 ++ "}\n" ++
                           indent 1 ++ "INITFRAME;\n" ++
                           indent 1 ++ "RESERVE(" ++ show (len + 1) ++ ");\n" ++
-                          indent 1 ++ "allocCon(REG1, vm, " ++ show tag ++ ",0 , 0);\n" ++
+                          indent 1 ++ "REG1 = NULL_CON(" ++ show tag ++ ");\n" ++
                           indent 1 ++ "TOP(0) = REG1;\n" ++
                           applyArgs argList ++
                           if ret /= "void"
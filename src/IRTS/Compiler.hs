@@ -89,7 +89,7 @@ compile codegen f mtm = do
             Nothing -> return ()
             Just f -> runIO $ writeFile f (showCaseTrees defsUniq)
 
-        let (nexttag, tagged) = addTags 65536 (liftAll defsInlined)
+        let (nexttag, tagged) = addTags 65536 (liftAll defsUniq)
         let ctxtIn = addAlist tagged emptyContext
 
         logCodeGen 1 "Defunctionalising"
@@ -252,6 +252,9 @@ lift env (LOp f args) = do args' <- mapM (lift env) args
 lift env (LError str) = return $ LError str
 lift env LNothing = return LNothing
 
+-- | Reuse the cells of unique values which have just been matched, and
+-- aren't used again, for new constructors of the same arity (and so the
+-- same size), rather than allocating new ones.
 allocUnique :: LDefs -> (Name, LDecl) -> (Name, LDecl)
 allocUnique defs p@(n, LConstructor _ _ _) = p
 allocUnique defs (n, LFun opts fn args e)
@@ -267,14 +270,14 @@ allocUnique defs (n, LFun opts fn args e)
           = findUp (LCon Nothing i n as)
     findUp (LV n)
        | Just (LConstructor _ i 0) <- lookupCtxtExact n defs
-          = return $ LCon Nothing i n [] -- nullary cons are global, no need to update
+          = return $ LCon Nothing i n [] -- nullary cons are immediate, no need to update
     findUp (LApp t f as) = LApp t <$> findUp f <*> mapM findUp as
     findUp (LLazyApp n as) = LLazyApp n <$> mapM findUp as
-    findUp (LLazyExp e) = LLazyExp <$> findUp e
+    findUp (LLazyExp e) = LLazyExp <$> hidden (findUp e)
     findUp (LForce e) = LForce <$> findUp e
     -- use assumption that names are unique!
     findUp (LLet n val sc) = LLet n <$> findUp val <*> findUp sc
-    findUp (LLam ns sc) = LLam ns <$> findUp sc
+    findUp (LLam ns sc) = LLam ns <$> hidden (findUp sc)
     findUp (LProj e i) = LProj <$> findUp e <*> return i
     findUp (LCon (Just l) i n es) = LCon (Just l) i n <$> mapM findUp es
     findUp (LCon Nothing i n es)
@@ -298,15 +301,28 @@ allocUnique defs (n, LFun opts fn args e)
     findUpAlt (LConstCase i rhs) = LConstCase i <$> findUp rhs
     findUpAlt (LDefaultCase rhs) = LDefaultCase <$> findUp rhs
 
+    -- The cell can only be reused if nothing looks at it again once the
+    -- arguments have been projected out
     doUpAlt n (LConCase i t args rhs)
            = do avail <- get
-                put ((n, length args) : avail)
+                when (null (usedIn [n] rhs)) $
+                     put ((n, length args) : avail)
                 rhs' <- findUp rhs
                 put avail
                 return $ LConCase i t args rhs'
     doUpAlt n (LConstCase i rhs) = LConstCase i <$> findUp rhs
     doUpAlt n (LDefaultCase rhs) = LDefaultCase <$> findUp rhs
 
+    -- A lambda or a lazy expression may be evaluated any number of times,
+    -- or after the cell has been reused elsewhere, so it can't reuse
+    -- anything from outside
+    hidden :: State [(Name, Int)] a -> State [(Name, Int)] a
+    hidden act = do avail <- get
+                    put []
+                    x <- act
+                    put avail
+                    return x
+
     findVar _ [] i = return Nothing
     findVar acc ((n, l) : ns) i | l == i = do put (reverse acc ++ ns)
                                               return (Just n)
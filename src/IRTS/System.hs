@@ -16,6 +16,8 @@ module IRTS.System( getIdrisDataFileByName
                   , getIdrisJSRTSDir
                   , getIncFlags
                   , getEnvFlags
+                  , getCCJobs
+                  , getCCCache
                   , version
                   ) where
 
@@ -29,9 +31,11 @@ import BuildFlags_idris
 
 import Data.List.Split
 import Data.Maybe (fromMaybe)
+import GHC.Conc (getNumProcessors)
 import System.Environment
 import System.FilePath (addTrailingPathSeparator, dropTrailingPathSeparator,
                         (</>))
+import Text.Read (readMaybe)
 
 
 getIdrisDataDir :: IO String
@@ -71,6 +75,17 @@ getCC = fromMaybe cc <$> lookupEnv "IDRIS_CC"
 getEnvFlags :: IO [String]
 getEnvFlags = maybe [] (splitOn " ") <$> lookupEnv "IDRIS_CFLAGS"
 
+-- | How many C compilers to run at once on a program split into pieces
+getCCJobs :: IO Int
+getCCJobs = do envValue <- lookupEnv "IDRIS_CC_JOBS"
+               case envValue >>= readMaybe of
+                 Just n | n > 0 -> return n
+                 _ -> getNumProcessors
+
+-- | Where to keep the compiled pieces of programs, to reuse in later builds
+getCCCache :: IO (Maybe FilePath)
+getCCCache = lookupEnv "IDRIS_CC_CACHE"
+
 
 #if defined(freebsd_HOST_OS) || defined(dragonfly_HOST_OS)\
     || defined(openbsd_HOST_OS) || defined(netbsd_HOST_OS)
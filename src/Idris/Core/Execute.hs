@@ -459,6 +459,42 @@ execForeign env ctxt arity ty fn xs onfail
                       "The arguments to idris_addToString should be a StringBuffer and a String, but were " ++
                       show strBuf ++ " and " ++ show str ++
                       ". Are all cases covered?"
+    | Just (FFun "idris_appendString" [(_, strBuf), (_, str)] _) <- foreignFromTT arity ty fn xs
+       = case (strBuf, str) of
+              (EStringBuf ref, EApp _ (EConstant (Str add))) ->
+                  do execIO $ modifyIORef ref (++add)
+                     execApp env ctxt ioUnit (drop arity xs)
+              _ -> execFail . Msg $
+                      "The arguments to idris_appendString should be a StringBuffer and a String, but were " ++
+                      show strBuf ++ " and " ++ show str ++
+                      ". Are all cases covered?"
+    | Just (FFun "idris_appendChar" [(_, strBuf), (_, c)] _) <- foreignFromTT arity ty fn xs
+       = case (strBuf, c) of
+              (EStringBuf ref, EConstant (Ch add)) ->
+                  do execIO $ modifyIORef ref (++[add])
+                     execApp env ctxt ioUnit (drop arity xs)
+              _ -> execFail . Msg $
+                      "The arguments to idris_appendChar should be a StringBuffer and a Char, but were " ++
+                      show strBuf ++ " and " ++ show c ++
+                      ". Are all cases covered?"
+    | Just (FFun "idris_appendInt" [(_, strBuf), (_, i)] _) <- foreignFromTT arity ty fn xs
+       = case (strBuf, i) of
+              (EStringBuf ref, EConstant (I add)) ->
+                  do execIO $ modifyIORef ref (++show add)
+                     execApp env ctxt ioUnit (drop arity xs)
+              _ -> execFail . Msg $
+                      "The arguments to idris_appendInt should be a StringBuffer and an Int, but were " ++
+                      show strBuf ++ " and " ++ show i ++
+                      ". Are all cases covered?"
+    | Just (FFun "idris_appendDouble" [(_, strBuf), (_, d)] _) <- foreignFromTT arity ty fn xs
+       = case (strBuf, d) of
+              (EStringBuf ref, EConstant (Fl add)) ->
+                  do execIO $ modifyIORef ref (++show add)
+                     execApp env ctxt ioUnit (drop arity xs)
+              _ -> execFail . Msg $
+                      "The arguments to idris_appendDouble should be a StringBuffer and a Double, but were " ++
+                      show strBuf ++ " and " ++ show d ++
+                      ". Are all cases covered?"
     | Just (FFun "idris_getString" [_, (_, str)] _) <- foreignFromTT arity ty fn xs
        = case str of
               EStringBuf ref -> do str <- execIO $ readIORef ref
@@ -7,6 +7,7 @@ Maintainer  : The Idris Community.
 -}
 {-# LANGUAGE CPP, ForeignFunctionInterface #-}
 module Util.System( tempfile
+                  , createTempDirectory
                   , withTempdir
                   , rmFile
                   , catchIO
@@ -25,8 +26,10 @@ import Control.Monad (when)
 import qualified Data.Text as T
 import qualified Data.Text.IO as TIO
 import Foreign.C
-import System.Directory (createDirectoryIfMissing, getTemporaryDirectory,
-                         removeDirectoryRecursive, removeFile)
+import System.CPUTime (getCPUTime)
+import System.Directory (createDirectory, createDirectoryIfMissing,
+                         getTemporaryDirectory, removeDirectoryRecursive,
+                         removeFile)
 import System.FilePath (normalise, (</>))
 import System.Info
 import System.IO
@@ -59,6 +62,22 @@ tempfile :: String -> IO (FilePath, Handle)
 tempfile ext = do dir <- getTemporaryDirectory
                   openTempFile (normalise dir) $ "idris" ++ ext
 
+-- | Create a new directory in the system's temporary directory. Creating it
+-- is what claims the name, so it's never one which someone else is using.
+createTempDirectory :: String -> IO FilePath
+createTempDirectory prefix
+    = do dir <- getTemporaryDirectory
+         seed <- getCPUTime
+         claim (normalise dir) (seed `div` 1000000)
+  where
+    claim dir n
+      = do let path = dir </> prefix ++ show n
+           made <- catchIO (createDirectory path >> return True)
+                           (\ioError -> if isAlreadyExistsError ioError
+                                           then return False
+                                           else throw ioError)
+           if made then return path else claim dir (n + 1)
+
 -- | Read a source file, same as readFile but make sure the encoding is utf-8.
 readSource :: FilePath -> IO String
 readSource f = do h <- openFile f ReadMode
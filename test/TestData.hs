@@ -77,7 +77,8 @@ testFamiliesData = [
       ( 23, ANY     ),
       ( 24, ANY     ),
       ( 25, ANY     ),
-      ( 26, ANY     )]),
+      ( 26, ANY     ),
+      ( 27, C_CG    )]),
   ("bignum",          "Bignum",
     [ (  1, ANY  ),
       (  2, ANY  ),
@@ -86,9 +87,18 @@ testFamiliesData = [
     [ (  1, ANY  )]),
   ("buffer",          "Buffer",
     [ (  1, C_CG  ),
-      (  2, C_CG  )]),
+      (  2, C_CG  ),
+      (  3, C_CG  ),
+      (  4, C_CG  ),
+      (  5, C_CG  ),
+      (  6, C_CG  ),
+      (  7, C_CG  )]),
   ("contrib",         "Contrib",
-    [ (  1, C_CG  )]),
+    [ (  1, C_CG  ),
+      (  2, C_CG  ),
+      (  3, C_CG  ),
+      (  4, C_CG  ),
+      (  5, C_CG  )]),
   ("corecords",       "Corecords",
     [ (  1, ANY  ),
       (  2, ANY  )]),
@@ -142,9 +152,19 @@ testFamiliesData = [
     , ( 11, NODE_CG )
     , ( 12, NODE_CG )
     , ( 13, C_CG )
+    , ( 14, C_CG )
+    , ( 15, C_CG )
+    , ( 16, C_CG )
+    , ( 17, C_CG )
+    , ( 18, C_CG )
     ]),
   ("folding",         "Folding",
     [ (  1, ANY  )]),
+  ("gc",              "Garbage collection",
+    [ (  1, C_CG ),
+      (  2, C_CG ),
+      (  3, C_CG ),
+      (  4, C_CG )]),
   ("idrisdoc",        "Idris documentation",
     [ (  1, ANY  ),
       (  2, ANY  ),
@@ -194,7 +214,9 @@ testFamiliesData = [
   ("io",              "IO monad",
     [ (  1, C_CG ),
       (  2, ANY  ),
-      (  3, C_CG )]),
+      (  3, C_CG ),
+      (  4, C_CG ),
+      (  5, C_CG )]),
   ("layout",          "Layout",
     [ (  1, ANY  )]),
   ("literate",        "Literate programming",
@@ -221,7 +243,12 @@ testFamiliesData = [
       (  2, ANY  ),
       (  3, ANY  ),
       (  5, C_CG ),
-      (  6, C_CG )]),
+      (  6, C_CG ),
+      (  7, C_CG ),
+      (  8, C_CG )]),
+  ("prof",            "Profiling",
+    [ (  1, C_CG ),
+      (  2, C_CG )]),
   ("proof",           "Theorem proving",
     [ (  1, ANY  ),
       (  2, ANY  ),
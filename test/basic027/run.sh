@@ -0,0 +1,32 @@
+#!/usr/bin/env bash
+# Enough functions for more than 256K of generated C
+for m in 1 2 3 4; do
+  {
+    echo "module Mod$m"
+    echo
+    for i in $(seq 0 249); do
+      echo "export"
+      echo "f${m}_$i : Int -> Int"
+      echo "f${m}_$i x = if x > 1000 then x - $i else x * 3 + $i + $m"
+      echo
+    done
+    echo "export"
+    echo "sum$m : Int -> Int"
+    printf "sum$m x = 0"
+    for i in $(seq 0 249); do
+      printf " + f${m}_$i x"
+    done
+    echo
+  } > Mod$m.idr
+done
+
+export IDRIS_CC_CACHE=$PWD/cache
+${IDRIS:-idris} $@ basic027.idr -o basic027
+./basic027
+[ "$(ls cache | wc -l)" -gt 1 ] && echo "Compiled in pieces"
+ls cache > first
+# Nothing has changed, so every piece comes from the cache
+${IDRIS:-idris} $@ basic027.idr -o basic027
+./basic027
+ls cache | diff - first > /dev/null && echo "Reused the pieces"
+rm -rf basic027 *.ibc Mod?.idr cache first
@@ -0,0 +1,4 @@
+#!/usr/bin/env bash
+${IDRIS:-idris} $@ buffer003.idr -o buffer003
+./buffer003
+rm -f buffer003 *.ibc
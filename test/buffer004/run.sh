@@ -0,0 +1,4 @@
+#!/usr/bin/env bash
+${IDRIS:-idris} $@ buffer004.idr -o buffer004
+./buffer004
+rm -f buffer004 *.ibc
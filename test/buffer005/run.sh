@@ -0,0 +1,4 @@
+#!/usr/bin/env bash
+${IDRIS:-idris} $@ buffer005.idr -o buffer005
+./buffer005
+rm -f buffer005 test.map *.ibc
@@ -0,0 +1,4 @@
+#!/usr/bin/env bash
+${IDRIS:-idris} $@ buffer006.idr -o buffer006
+./buffer006
+rm -f buffer006 *.ibc
@@ -0,0 +1,4 @@
+#!/usr/bin/env bash
+${IDRIS:-idris} $@ buffer007.idr -o buffer007
+./buffer007
+rm -f buffer007 buffer007.dat *.ibc
@@ -0,0 +1,4 @@
+#!/usr/bin/env bash
+${IDRIS:-idris} $@ contrib002.idr -o contrib002 -p contrib
+./contrib002
+rm -f contrib002 *.ibc
@@ -0,0 +1,5 @@
+#!/usr/bin/env bash
+${IDRIS:-idris} $@ contrib003.idr -o contrib003 -p contrib
+./contrib003 +RTS -j4 -RTS
+./contrib003 +RTS -j1 -RTS | head -1
+rm -f contrib003 *.ibc
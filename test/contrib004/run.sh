@@ -0,0 +1,4 @@
+#!/usr/bin/env bash
+${IDRIS:-idris} $@ contrib004.idr -o contrib004 -p contrib
+./contrib004
+rm -f contrib004 *.ibc
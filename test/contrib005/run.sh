@@ -0,0 +1,4 @@
+#!/usr/bin/env bash
+${IDRIS:-idris} $@ contrib005.idr -o contrib005 -p contrib
+./contrib005
+rm -f contrib005 *.ibc
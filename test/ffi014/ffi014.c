@@ -0,0 +1,27 @@
+#include "testHdr.h"
+#include "idris_embed.h"
+
+int main() {
+    RTSOpts opts = IDRIS_DEFAULT_OPTS;
+    opts.init_heap_size = 1 << 20;
+    VMPool* pool = idris_newPool(&opts, 2);
+    int i;
+
+    // The same VM comes back each time, reset
+    VM* first = idris_takeVM(pool);
+    idris_giveVM(pool, first);
+    for (i = 0; i < 1000; ++i) {
+        VM* vm = idris_takeVM(pool);
+        if (vm != first || sumTo(vm, 1000) != 500500) {
+            printf("Wrong VM or result on call %d\n", i);
+        }
+        idris_giveVM(pool, vm);
+    }
+
+    VM* vm = idris_threadVM(pool);
+    printf("%s\n", greet(vm, "pool"));
+    printf("%d\n", idris_threadVM(pool) == vm);
+
+    idris_freePool(pool);
+    return 0;
+}
@@ -0,0 +1,5 @@
+#!/usr/bin/env bash
+${IDRIS:-idris} $@ ffi014.idr --interface -o ffi014.o
+${CC:=cc} ffi014.c ffi014.o `${IDRIS:-idris} $@ --include` `${IDRIS:-idris} $@ --link` -o ffi014
+./ffi014
+rm -f ffi014 *.ibc *.o *.h
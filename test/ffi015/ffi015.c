@@ -0,0 +1,63 @@
+#include "idris_embed.h"
+#include "idris_gc.h"
+#include "idris_rts.h"
+
+// Allocate until the nursery has been collected a few times
+static void churn(VM* vm) {
+    int i;
+    for (i = 0; i < 100000; ++i) {
+        MKFLOAT(vm, 1.0);
+    }
+}
+
+static void check(VAL arr, int index) {
+    VAL x = idris_arrayGet(arr, index);
+    if (GETTY(x) == CT_STRING) {
+        printf("%d: %s\n", index, GETSTR(x));
+    } else {
+        printf("%d: lost (type %d)\n", index, GETTY(x));
+    }
+}
+
+int main() {
+    RTSOpts opts = IDRIS_DEFAULT_OPTS;
+    opts.nursery_size = 256 * 1024;
+    VM* vm = idris_newVM(&opts);
+
+    // Big enough to be a large object, which full collections don't move
+    RESERVE(2);
+    TOP(0) = idris_newArray(vm, 50000, MKINT(0));
+    TOP(1) = NULL;
+    ADDTOP(2);
+    VAL* arr = vm->valstack_top - 2;
+    VAL* fresh = vm->valstack_top - 1;
+
+    // Old once a minor collection has promoted it, and then remembered when
+    // it's written to
+    churn(vm);
+    idris_arraySet(*arr, 0, MKSTR(vm, "before the full collection"));
+
+    // The full collection empties the remembered set, so the next write
+    // has to remember it again
+    idris_gc(vm);
+    idris_arraySet(*arr, 1, MKSTR(vm, "after the full collection"));
+    churn(vm);
+
+    check(*arr, 0);
+    check(*arr, 1);
+
+    // Made old by a full collection before any minor one has seen it
+    *fresh = idris_newArray(vm, 50000, MKINT(0));
+    idris_gc(vm);
+    idris_arraySet(*fresh, 0, MKSTR(vm, "after its first collection"));
+    churn(vm);
+    idris_gc(vm);
+    idris_arraySet(*fresh, 1, MKSTR(vm, "after another full collection"));
+    churn(vm);
+
+    check(*fresh, 0);
+    check(*fresh, 1);
+
+    idris_freeVM(vm);
+    return 0;
+}
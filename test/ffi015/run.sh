@@ -0,0 +1,4 @@
+#!/usr/bin/env bash
+${CC:=cc} ffi015.c `${IDRIS:-idris} $@ --include` `${IDRIS:-idris} $@ --link` -o ffi015
+./ffi015
+rm -f ffi015
@@ -0,0 +1,76 @@
+#include "idris_embed.h"
+#include "idris_gc.h"
+#include "idris_opts.h"
+#include "idris_rts.h"
+
+// Allocate until the nursery has been collected a few times
+static void churn(VM* vm) {
+    int i;
+    for (i = 0; i < 100000; ++i) {
+        MKFLOAT(vm, 1.0);
+    }
+}
+
+static void show(const char* what, VAL x) {
+    if (x != NULL && !ISINT(x) && GETTY(x) == CT_STRING) {
+        printf("%s: %s\n", what, GETSTR(x));
+    } else {
+        printf("%s: lost\n", what);
+    }
+}
+
+// Store young strings into old closures, and check they survive both
+// kinds of collection
+int main(int argc, char** argv) {
+    RTSOpts opts = IDRIS_DEFAULT_OPTS;
+    parse_shift_args(&opts, &argc, &argv);
+    VM* vm = idris_newVM(&opts);
+    if (vm->nursery.size == 0) {
+        printf("No nursery\n");
+        return 1;
+    }
+
+    RESERVE(3);
+    TOP(0) = idris_newArray(vm, 10, MKINT(0));
+    TOP(1) = NULL;
+    TOP(2) = idris_newArray(vm, 50000, MKINT(0));
+    ADDTOP(3);
+    VAL* small = vm->valstack_top - 3;
+    VAL* ref = vm->valstack_top - 2;
+    VAL* large = vm->valstack_top - 1;
+    *ref = idris_newRef(MKINT(0));
+
+    // Promoted by a minor collection
+    churn(vm);
+    idris_arraySet(*small, 0, MKSTR(vm, "small, minor"));
+    idris_writeRef(*ref, MKSTR(vm, "ref, minor"));
+    idris_arraySet(*large, 0, MKSTR(vm, "large, minor"));
+    churn(vm);
+    show("small", idris_arrayGet(*small, 0));
+    show("ref", idris_readRef(*ref));
+    show("large", idris_arrayGet(*large, 0));
+
+    // Young values across a full collection, then written again after it
+    idris_arraySet(*small, 1, MKSTR(vm, "small, full"));
+    idris_writeRef(*ref, MKSTR(vm, "ref, full"));
+    idris_arraySet(*large, 1, MKSTR(vm, "large, full"));
+    idris_gc(vm);
+    show("small", idris_arrayGet(*small, 1));
+    show("ref", idris_readRef(*ref));
+    show("large", idris_arrayGet(*large, 1));
+
+    idris_arraySet(*small, 2, MKSTR(vm, "small, after full"));
+    idris_writeRef(*ref, MKSTR(vm, "ref, after full"));
+    idris_arraySet(*large, 2, MKSTR(vm, "large, after full"));
+    churn(vm);
+    show("small", idris_arrayGet(*small, 2));
+    show("ref", idris_readRef(*ref));
+    show("large", idris_arrayGet(*large, 2));
+
+    // The earlier values are still there
+    show("small", idris_arrayGet(*small, 0));
+    show("large", idris_arrayGet(*large, 1));
+
+    idris_freeVM(vm);
+    return 0;
+}
@@ -0,0 +1,4 @@
+#!/usr/bin/env bash
+${CC:=cc} ffi016.c `${IDRIS:-idris} $@ --include` `${IDRIS:-idris} $@ --link` -o ffi016
+./ffi016 +RTS -A256K -RTS
+rm -f ffi016
@@ -0,0 +1,32 @@
+#include "idris_embed.h"
+#include "idris_opts.h"
+#include "idris_rts.h"
+
+// Use about 4K of C stack per level
+static int deep(int n) {
+    volatile char frame[4096];
+    frame[0] = (char)n;
+    return n == 0 ? 0 : deep(n - 1) + 1 + frame[0] * 0;
+}
+
+static void* child(VM* vm, VAL* oldbase) {
+    // 16M of C stack, twice the default
+    int depth = deep(4000);
+    idris_sendMessage(vm, 0, vm->creator, MKINT(depth));
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    RTSOpts opts = IDRIS_DEFAULT_OPTS;
+    parse_shift_args(&opts, &argc, &argv);
+    VM* vm = idris_newVM(&opts);
+    if (vmThread(vm, child, MKINT(0)) == NULL) {
+        printf("Can't start a process\n");
+        return 1;
+    }
+    Msg* msg = idris_recvMessage(vm);
+    printf("Recursed %d levels in a process\n", (int)GETINT(idris_getMsg(msg)));
+    idris_freeMsg(msg);
+    idris_freeVM(vm);
+    return 0;
+}
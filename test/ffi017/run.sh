@@ -0,0 +1,5 @@
+#!/usr/bin/env bash
+${CC:=cc} ffi017.c `${IDRIS:-idris} $@ --include` `${IDRIS:-idris} $@ --link` -o ffi017
+# The process needs more than the default stack
+./ffi017 +RTS -k32M -RTS
+rm -f ffi017
@@ -0,0 +1,53 @@
+#include "idris_embed.h"
+#include "idris_opts.h"
+#include "idris_rts.h"
+
+#include <string.h>
+
+static int interned(VAL x) {
+    return (x->hdr.u16 & STR_INTERNED) != 0;
+}
+
+// A different string of 1000 characters for each i
+static VAL make(VM* vm, int i) {
+    char buf[1001];
+    memset(buf, 'x', 1000);
+    buf[1000] = '\0';
+    snprintf(buf, sizeof(buf), "%d", i);
+    buf[strlen(buf)] = 'x';
+    return MKSTR(vm, buf);
+}
+
+// Intern strings until the table is full, then check that new strings are
+// given back as they are, and the ones already there are still found
+int main(int argc, char** argv) {
+    RTSOpts opts = IDRIS_DEFAULT_OPTS;
+    parse_shift_args(&opts, &argc, &argv);
+    VM* vm = idris_newVM(&opts);
+
+    VAL first = idris_intern(vm, make(vm, 0));
+    int n = 1;
+    while (interned(idris_intern(vm, make(vm, n)))) {
+        ++n;
+    }
+    // About 16M of 1K strings
+    printf("Full after between 15000 and 17000: %d\n", n > 15000 && n < 17000);
+
+    // On the stack, since it's in the heap and the next allocation may move it
+    RESERVE(1);
+    TOP(0) = make(vm, n + 1);
+    ADDTOP(1);
+    VAL* s = vm->valstack_top - 1;
+    VAL t = idris_intern(vm, *s);
+    printf("New string given back: %d\n", t == *s && !interned(t));
+    VAL u = make(vm, n + 1);
+    printf("Still equal to a copy: %d\n", GETINT(idris_streq(vm, *s, u)) != 0);
+
+    VAL again = idris_intern(vm, make(vm, 0));
+    printf("Old string found: %d\n", again == first);
+    VAL other = idris_intern(vm, make(vm, 1));
+    printf("Old strings differ: %d\n", GETINT(idris_streq(vm, again, other)) == 0);
+
+    idris_freeVM(vm);
+    return 0;
+}
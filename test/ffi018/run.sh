@@ -0,0 +1,4 @@
+#!/usr/bin/env bash
+${CC:=cc} ffi018.c `${IDRIS:-idris} $@ --include` `${IDRIS:-idris} $@ --link` -o ffi018
+./ffi018
+rm -f ffi018
@@ -0,0 +1,5 @@
+#!/usr/bin/env bash
+${IDRIS:-idris} $@ gc001.idr -o gc001
+# Big enough for full collections to be shared between the threads
+./gc001 +RTS -G4 -RTS
+rm -f gc001 *.ibc
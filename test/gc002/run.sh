@@ -0,0 +1,5 @@
+#!/usr/bin/env bash
+${IDRIS:-idris} $@ gc002.idr -o gc002
+./gc002 +RTS -I1 -Sstats.json -RTS
+grep -q '"increments": 0,' stats.json && echo "Not collected incrementally"
+rm -f gc002 *.ibc stats.json
@@ -0,0 +1,4 @@
+#!/usr/bin/env bash
+${IDRIS:-idris} $@ gc003.idr -o gc003
+./gc003 +RTS -c -RTS
+rm -f gc003 *.ibc
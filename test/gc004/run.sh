@@ -0,0 +1,5 @@
+#!/usr/bin/env bash
+${IDRIS:-idris} $@ gc004.idr -o gc004
+# A small heap, so that there are collections to count
+./gc004 +RTS -H1M -RTS
+rm -f gc004 *.ibc
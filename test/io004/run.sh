@@ -0,0 +1,8 @@
+#!/usr/bin/env bash
+${IDRIS:-idris} $@ io004.idr -o io004
+${IDRIS:-idris} $@ io004a.idr -o io004a
+rm -f *.img
+./io004 save
+./io004 load
+./io004a
+rm -f io004 io004a *.ibc *.img
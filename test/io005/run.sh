@@ -0,0 +1,4 @@
+#!/usr/bin/env bash
+${IDRIS:-idris} $@ io005.idr -o io005
+./io005 | awk '{ print length($0), substr($0, 1, 5) }'
+rm -f io005 io005.txt *.ibc
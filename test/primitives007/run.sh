@@ -0,0 +1,4 @@
+#!/usr/bin/env bash
+${IDRIS:-idris} $@ primitives007.idr -o primitives007
+./primitives007
+rm -f primitives007 *.ibc
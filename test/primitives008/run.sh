@@ -0,0 +1,4 @@
+#!/usr/bin/env bash
+${IDRIS:-idris} $@ primitives008.idr -o primitives008
+./primitives008
+rm -f primitives008 *.ibc
@@ -0,0 +1,10 @@
+#!/usr/bin/env bash
+${IDRIS:-idris} $@ prof001.idr -o prof001 --cg-opt -DIDRIS_PROFILE
+# A small heap, so that there are several censuses
+./prof001 +RTS -h -H1M -RTS
+head -1 prof001.hp
+# Every row has all the columns, after a known kind of collection
+awk -F'\t' 'NR > 1 && (NF != 8 || ($3 != "full" && $3 != "minor" && $3 != "exit") || ($4 != "live" && $4 != "alloc")) { bad++ } END { print "Bad rows:", bad + 0 }' prof001.hp
+tail -1 prof001.hp | cut -f3
+grep -q "	SITE	Main.build	" prof001.hp && echo "Allocations by Main.build"
+rm -f prof001 prof001.hp *.ibc
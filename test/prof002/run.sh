@@ -0,0 +1,7 @@
+#!/usr/bin/env bash
+${IDRIS:-idris} $@ prof002.idr -o prof002 --cg-opt -DIDRIS_PROFILE
+./prof002 +RTS -p100 -RTS
+# Each line is a stack, outermost function first, then a count of samples
+awk '$0 !~ /^[^;].* [0-9]+$/ { bad++ } END { print "Bad lines:", bad + 0 }' prof002.folded
+grep -q "Main\.churn [0-9]*$" prof002.folded && echo "Samples in Main.churn"
+rm -f prof002 prof002.folded *.ibc